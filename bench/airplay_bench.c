@@ -0,0 +1,1650 @@
+// Headless benchmark: replays a captured AirPlay session through the server
+// in-process over loopback and reports per-stage timings, thread CPU time,
+// allocations and I/O calls. Built with -DBUILD_BENCH=ON.
+#define _GNU_SOURCE
+#include "airplay_server.h"
+#include "audio_output.h"
+#include "buffered_audio.h"
+#include "config.h"
+#include "crypto_engine.h"
+#include "crypto_utils.h"
+#include "dacp_client.h"
+#include "session_arena.h"
+#include "stats.h"
+#include "logger.h"
+#include "bplist.h"
+#include "dsp_chain.h"
+#include "event_loop.h"
+#include "input_control.h"
+#include "zone.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <openssl/evp.h>
+#include <linux/input.h>
+
+// Capture file: magic, then records of u64 time_us, u8 stream, 3 reserved
+// bytes and u32 length (all big endian) followed by the payload
+#define CAPTURE_MAGIC "AP2CAP01"
+#define CAPTURE_MAGIC_SIZE 8
+#define CAPTURE_RECORD_HEADER 16
+#define CAPTURE_CONTROL 0
+#define CAPTURE_AUDIO 1
+#define MAX_RECORD_LENGTH 65536
+
+#define DEFAULT_SECONDS 10
+#define DEFAULT_DEVICE "null"
+#define SYNTH_SAMPLE_RATE 44100
+#define SYNTH_CHANNELS 2
+#define SYNTH_FRAMES 352
+#define SYNTH_COMPRESSION_PCM 1
+#define RESPONSE_TIMEOUT_MS 5000
+#define DRAIN_TIMEOUT_MS 10000
+#define MAX_THREAD_GROUPS 16
+#define CIPHER_BATCH 8
+
+typedef struct {
+    uint64_t time_us;
+    int stream;
+    uint32_t length;
+    uint8_t *data;
+} capture_record_t;
+
+typedef struct {
+    capture_record_t *records;
+    size_t count;
+    size_t capacity;
+} capture_t;
+
+typedef struct {
+    char name[32];
+    double cpu_ms;
+} thread_cpu_t;
+
+// Calls made by daemon code, counted through the linker's --wrap shims
+enum {
+    CALL_MALLOC = 0,
+    CALL_CALLOC,
+    CALL_REALLOC,
+    CALL_MEMALIGN,
+    CALL_FREE,
+    CALL_RECV,
+    CALL_SEND,
+    CALL_SENDMSG,
+    CALL_SELECT,
+    CALL_POLL,
+    CALL_READ,
+    CALL_WRITE,
+    CALL_COUNT
+};
+
+static const char *call_names[CALL_COUNT] = {
+    "malloc", "calloc", "realloc", "posix_memalign", "free",
+    "recv", "send", "sendmsg", "select", "poll", "read", "write"
+};
+
+static uint32_t calls[CALL_COUNT];
+static uint64_t allocated_bytes = 0;
+static __thread bool bench_thread = false;  // the replay side is not counted
+
+static ino_t input_fifo_ino = 0;        // FIFO that the ioctl shim presents as an event device
+
+static volatile bool server_running = false;
+static volatile bool monitor_running = false;
+static uint64_t first_output_ns = 0;
+static zone_t *replay_zone = NULL;      // the zone the session is replayed to
+
+#define COUNT_CALL(call) \
+    do { \
+        if (!bench_thread) { \
+            __atomic_fetch_add(&calls[call], 1, __ATOMIC_RELAXED); \
+        } \
+    } while (0)
+
+#define COUNT_BYTES(bytes) \
+    do { \
+        if (!bench_thread) { \
+            __atomic_fetch_add(&allocated_bytes, (uint64_t)(bytes), __ATOMIC_RELAXED); \
+        } \
+    } while (0)
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+int __real_posix_memalign(void **pointer, size_t alignment, size_t size);
+void __real_free(void *pointer);
+ssize_t __real_recv(int fd, void *buffer, size_t length, int flags);
+ssize_t __real_send(int fd, const void *buffer, size_t length, int flags);
+ssize_t __real_sendmsg(int fd, const struct msghdr *message, int flags);
+int __real_select(int nfds, fd_set *read_fds, fd_set *write_fds, fd_set *except_fds, struct timeval *timeout);
+int __real_poll(struct pollfd *fds, nfds_t count, int timeout);
+ssize_t __real_read(int fd, void *buffer, size_t length);
+ssize_t __real_write(int fd, const void *buffer, size_t length);
+int __real_ioctl(int fd, unsigned long request, ...);
+
+void *__wrap_malloc(size_t size) {
+    COUNT_CALL(CALL_MALLOC);
+    COUNT_BYTES(size);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    COUNT_CALL(CALL_CALLOC);
+    COUNT_BYTES(count * size);
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size) {
+    COUNT_CALL(CALL_REALLOC);
+    COUNT_BYTES(size);
+    return __real_realloc(pointer, size);
+}
+
+int __wrap_posix_memalign(void **pointer, size_t alignment, size_t size) {
+    COUNT_CALL(CALL_MEMALIGN);
+    COUNT_BYTES(size);
+    return __real_posix_memalign(pointer, alignment, size);
+}
+
+void __wrap_free(void *pointer) {
+    if (pointer) {
+        COUNT_CALL(CALL_FREE);
+    }
+    __real_free(pointer);
+}
+
+ssize_t __wrap_recv(int fd, void *buffer, size_t length, int flags) {
+    COUNT_CALL(CALL_RECV);
+    return __real_recv(fd, buffer, length, flags);
+}
+
+ssize_t __wrap_send(int fd, const void *buffer, size_t length, int flags) {
+    COUNT_CALL(CALL_SEND);
+    return __real_send(fd, buffer, length, flags);
+}
+
+ssize_t __wrap_sendmsg(int fd, const struct msghdr *message, int flags) {
+    COUNT_CALL(CALL_SENDMSG);
+    return __real_sendmsg(fd, message, flags);
+}
+
+int __wrap_select(int nfds, fd_set *read_fds, fd_set *write_fds, fd_set *except_fds, struct timeval *timeout) {
+    COUNT_CALL(CALL_SELECT);
+    return __real_select(nfds, read_fds, write_fds, except_fds, timeout);
+}
+
+int __wrap_poll(struct pollfd *fds, nfds_t count, int timeout) {
+    COUNT_CALL(CALL_POLL);
+    return __real_poll(fds, count, timeout);
+}
+
+ssize_t __wrap_read(int fd, void *buffer, size_t length) {
+    COUNT_CALL(CALL_READ);
+    return __real_read(fd, buffer, length);
+}
+
+ssize_t __wrap_write(int fd, const void *buffer, size_t length) {
+    COUNT_CALL(CALL_WRITE);
+    return __real_write(fd, buffer, length);
+}
+
+#define SET_BIT(bits, size, bit) \
+    do { \
+        if ((bit) / 8 < (size)) { \
+            (bits)[(bit) / (sizeof(long) * 8)] |= 1UL << ((bit) % (sizeof(long) * 8)); \
+        } \
+    } while (0)
+
+// Not counted. The input FIFO answers the evdev queries input_control makes
+// as a device with media keys and a dial.
+int __wrap_ioctl(int fd, unsigned long request, ...) {
+    va_list args;
+    va_start(args, request);
+    void *arg = va_arg(args, void *);
+    va_end(args);
+    
+    struct stat st;
+    if (input_fifo_ino == 0 || _IOC_TYPE(request) != 'E' || fstat(fd, &st) != 0 || st.st_ino != input_fifo_ino) {
+        return __real_ioctl(fd, request, arg);
+    }
+    
+    size_t size = _IOC_SIZE(request);
+    unsigned long *bits = arg;
+    memset(arg, 0, size);
+    if (_IOC_NR(request) == _IOC_NR(EVIOCGBIT(EV_KEY, 0))) {
+        static const uint16_t keys[] = {
+            KEY_VOLUMEUP, KEY_VOLUMEDOWN, KEY_MUTE, KEY_PLAYPAUSE, KEY_PLAYCD, KEY_PAUSECD,
+            KEY_STOPCD, KEY_NEXTSONG, KEY_PREVIOUSSONG
+        };
+        for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+            SET_BIT(bits, size, keys[i]);
+        }
+    } else if (_IOC_NR(request) == _IOC_NR(EVIOCGBIT(EV_REL, 0))) {
+        SET_BIT(bits, size, REL_DIAL);
+    } else if (_IOC_NR(request) == _IOC_NR(EVIOCGNAME(0)) && size > 0) {
+        snprintf(arg, size, "bench input");
+    }
+    return 0;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline_ns) {
+    uint64_t now = now_ns();
+    if (deadline_ns > now) {
+        struct timespec delay = {
+            (time_t)((deadline_ns - now) / 1000000000ULL),
+            (long)((deadline_ns - now) % 1000000000ULL)
+        };
+        nanosleep(&delay, NULL);
+    }
+}
+
+static void put_be32(uint8_t *data, uint32_t value) {
+    data[0] = (uint8_t)(value >> 24);
+    data[1] = (uint8_t)(value >> 16);
+    data[2] = (uint8_t)(value >> 8);
+    data[3] = (uint8_t)value;
+}
+
+static uint32_t get_be32(const uint8_t *data) {
+    return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+// Capture handling
+static int capture_add(capture_t *capture, uint64_t time_us, int stream, const uint8_t *data, size_t length) {
+    if (length > MAX_RECORD_LENGTH) {
+        return -1;
+    }
+    if (capture->count == capture->capacity) {
+        size_t capacity = capture->capacity ? capture->capacity * 2 : 256;
+        capture_record_t *records = realloc(capture->records, capacity * sizeof(capture_record_t));
+        if (!records) {
+            return -1;
+        }
+        capture->records = records;
+        capture->capacity = capacity;
+    }
+    
+    capture_record_t *record = &capture->records[capture->count];
+    record->data = malloc(length);
+    if (!record->data) {
+        return -1;
+    }
+    memcpy(record->data, data, length);
+    record->time_us = time_us;
+    record->stream = stream;
+    record->length = (uint32_t)length;
+    capture->count++;
+    return 0;
+}
+
+static void capture_free(capture_t *capture) {
+    for (size_t i = 0; i < capture->count; i++) {
+        free(capture->records[i].data);
+    }
+    free(capture->records);
+    memset(capture, 0, sizeof(*capture));
+}
+
+static int capture_save(const capture_t *capture, const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    
+    int result = fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_SIZE, file) == CAPTURE_MAGIC_SIZE ? 0 : -1;
+    for (size_t i = 0; i < capture->count && result == 0; i++) {
+        const capture_record_t *record = &capture->records[i];
+        uint8_t header[CAPTURE_RECORD_HEADER] = { 0 };
+        put_be32(header, (uint32_t)(record->time_us >> 32));
+        put_be32(header + 4, (uint32_t)record->time_us);
+        header[8] = (uint8_t)record->stream;
+        put_be32(header + 12, record->length);
+        if (fwrite(header, 1, sizeof(header), file) != sizeof(header) ||
+            fwrite(record->data, 1, record->length, file) != record->length) {
+            result = -1;
+        }
+    }
+    
+    if (fclose(file) != 0 || result != 0) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static int capture_load(capture_t *capture, const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    
+    char magic[CAPTURE_MAGIC_SIZE];
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+        memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != 0) {
+        fprintf(stderr, "%s is not a capture file\n", path);
+        fclose(file);
+        return -1;
+    }
+    
+    uint8_t *data = malloc(MAX_RECORD_LENGTH);
+    uint8_t header[CAPTURE_RECORD_HEADER];
+    int result = data ? 0 : -1;
+    while (result == 0 && fread(header, 1, sizeof(header), file) == sizeof(header)) {
+        uint64_t time_us = ((uint64_t)get_be32(header) << 32) | get_be32(header + 4);
+        uint32_t length = get_be32(header + 12);
+        if (length > MAX_RECORD_LENGTH || fread(data, 1, length, file) != length ||
+            capture_add(capture, time_us, header[8], data, length) != 0) {
+            fprintf(stderr, "Truncated or oversized record in %s\n", path);
+            result = -1;
+        }
+    }
+    
+    free(data);
+    fclose(file);
+    return result;
+}
+
+// Synthetic PCM session: SETUP with a type 103 stream, RECORD, a sine wave
+// in encrypted buffered packets, then TEARDOWN, once per track
+static int add_request(capture_t *capture, uint64_t time_us, const char *method, int cseq,
+                       const uint8_t *body, size_t body_length) {
+    uint8_t request[1024];
+    int length = snprintf((char *)request, sizeof(request),
+        "%s rtsp://127.0.0.1/bench RTSP/1.0\r\n"
+        "CSeq: %d\r\n"
+        "%s"
+        "Content-Length: %zu\r\n"
+        "\r\n",
+        method, cseq, body ? "Content-Type: application/x-apple-binary-plist\r\n" : "", body_length);
+    if (length < 0 || (size_t)length + body_length > sizeof(request)) {
+        return -1;
+    }
+    if (body_length > 0) {
+        memcpy(request + length, body, body_length);
+    }
+    return capture_add(capture, time_us, CAPTURE_CONTROL, request, length + body_length);
+}
+
+static int synthesize(capture_t *capture, int seconds, int tracks) {
+    uint8_t key[CHACHA20_POLY1305_KEY_SIZE];
+    for (size_t i = 0; i < sizeof(key); i++) {
+        key[i] = (uint8_t)(i * 7 + 1);
+    }
+    
+    // {"streams": [{"type": 103, "ct": 1, "sr": 44100, "spf": 352, "shk": key}]}
+    uint8_t plist[512];
+    size_t plist_length;
+    bplist_writer_t writer;
+    bplist_writer_init(&writer, plist, sizeof(plist));
+    int keys[5] = {
+        bplist_write_string(&writer, "type"),
+        bplist_write_string(&writer, "ct"),
+        bplist_write_string(&writer, "sr"),
+        bplist_write_string(&writer, "spf"),
+        bplist_write_string(&writer, "shk")
+    };
+    int values[5] = {
+        bplist_write_int(&writer, BUFFERED_AUDIO_STREAM_TYPE),
+        bplist_write_int(&writer, SYNTH_COMPRESSION_PCM),
+        bplist_write_int(&writer, SYNTH_SAMPLE_RATE),
+        bplist_write_int(&writer, SYNTH_FRAMES),
+        bplist_write_data(&writer, key, sizeof(key))
+    };
+    int stream = bplist_write_dict(&writer, keys, values, 5);
+    int streams_key = bplist_write_string(&writer, "streams");
+    int streams = bplist_write_array(&writer, &stream, 1);
+    int top = bplist_write_dict(&writer, &streams_key, &streams, 1);
+    if (top < 0 || bplist_writer_finish(&writer, top, &plist_length) != 0) {
+        return -1;
+    }
+    
+    aead_session_t *session = aead_session_create(key);
+    if (!session) {
+        return -1;
+    }
+    
+    // Length, RTP header, payload, tag, nonce
+    size_t payload_length = SYNTH_FRAMES * SYNTH_CHANNELS * sizeof(int16_t);
+    size_t packet_length = 2 + 12 + payload_length + CHACHA20_POLY1305_TAG_SIZE + 8;
+    uint8_t packet[2 + 12 + SYNTH_FRAMES * SYNTH_CHANNELS * 2 + CHACHA20_POLY1305_TAG_SIZE + 8];
+    uint32_t packets = (uint32_t)((uint64_t)seconds * SYNTH_SAMPLE_RATE / SYNTH_FRAMES);
+    uint32_t track_packets = packets / tracks > 0 ? packets / tracks : 1;
+    uint64_t time_us = 0;
+    int cseq = 1;
+    int result = 0;
+    
+    for (uint32_t i = 0; i < packets && result == 0; i++) {
+        // Each track is its own stream, set up where the previous one ended
+        if (i % track_packets == 0 && i / track_packets < (uint32_t)tracks) {
+            if ((i > 0 && add_request(capture, 2000 + time_us, "TEARDOWN", cseq++, NULL, 0) != 0) ||
+                add_request(capture, 2000 + time_us, "SETUP", cseq++, plist, plist_length) != 0 ||
+                add_request(capture, 2000 + time_us, "RECORD", cseq++, NULL, 0) != 0) {
+                result = -1;
+                break;
+            }
+        }
+        
+        uint32_t timestamp = i * SYNTH_FRAMES;
+        uint8_t *rtp = packet + 2;
+        uint8_t *payload = rtp + 12;
+        uint8_t *tag = payload + payload_length;
+        uint8_t *nonce = tag + CHACHA20_POLY1305_TAG_SIZE;
+        
+        packet[0] = (uint8_t)(packet_length >> 8);
+        packet[1] = (uint8_t)packet_length;
+        put_be32(rtp, 0x80600000 | (i & 0x00FFFFFF));
+        put_be32(rtp + 4, timestamp);
+        put_be32(rtp + 8, 0x42454E43);  // SSRC "BENC"
+        
+        // 440 Hz at half scale, big endian like the sender
+        for (uint32_t frame = 0; frame < SYNTH_FRAMES; frame++) {
+            double phase = 2.0 * M_PI * 440.0 * (timestamp + frame) / SYNTH_SAMPLE_RATE;
+            int16_t sample = (int16_t)(16384.0 * sin(phase));
+            for (int channel = 0; channel < SYNTH_CHANNELS; channel++) {
+                uint8_t *out = payload + (frame * SYNTH_CHANNELS + channel) * 2;
+                out[0] = (uint8_t)((uint16_t)sample >> 8);
+                out[1] = (uint8_t)sample;
+            }
+        }
+        
+        memset(nonce, 0, 8);
+        put_be32(nonce + 4, i);
+        if (aead_session_encrypt(session, nonce, rtp + 4, 8, payload, payload_length, tag) != 0 ||
+            capture_add(capture, 2000 + time_us, CAPTURE_AUDIO, packet, packet_length) != 0) {
+            result = -1;
+        }
+        time_us = (uint64_t)(i + 1) * SYNTH_FRAMES * 1000000ULL / SYNTH_SAMPLE_RATE;
+    }
+    aead_session_destroy(session);
+    
+    if (result == 0) {
+        result = add_request(capture, 2000 + time_us, "TEARDOWN", cseq, NULL, 0);
+    }
+    return result;
+}
+
+// Replay
+static int connect_loopback(uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_all(int fd, const uint8_t *data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = __real_send(fd, data, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return -1;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+// Reads one response, returns its total length
+static int read_response(int fd, uint8_t *buffer, size_t size) {
+    size_t received = 0;
+    uint64_t deadline = now_ns() + RESPONSE_TIMEOUT_MS * 1000000ULL;
+    
+    while (received < size) {
+        buffer[received] = '\0';
+        char *end = strstr((char *)buffer, "\r\n\r\n");
+        if (end) {
+            size_t header_length = end + 4 - (char *)buffer;
+            const char *field = strcasestr((char *)buffer, "Content-Length:");
+            size_t body_length = field && field < end ? strtoul(field + 15, NULL, 10) : 0;
+            if (received >= header_length + body_length) {
+                return (int)(header_length + body_length);
+            }
+        }
+        
+        uint64_t now = now_ns();
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (now >= deadline || __real_poll(&pfd, 1, (int)((deadline - now) / 1000000ULL) + 1) <= 0) {
+            return -1;
+        }
+        ssize_t count = __real_recv(fd, buffer + received, size - 1 - received, 0);
+        if (count <= 0) {
+            return -1;
+        }
+        received += count;
+    }
+    return -1;
+}
+
+static bool wait_for_drain(void) {
+    uint64_t deadline = now_ns() + DRAIN_TIMEOUT_MS * 1000000ULL;
+    while (now_ns() < deadline) {
+        buffered_audio_stats_t stats;
+        buffered_audio_get_stats(replay_zone->stream, &stats);
+        if (stats.packets_buffered == 0 && audio_output_get_buffered(replay_zone->output) == 0) {
+            return true;
+        }
+        usleep(1000);
+    }
+    return false;
+}
+
+// Sums utime and stime per thread name from /proc/self/task
+static int snapshot_thread_cpu(thread_cpu_t *groups, int max_groups) {
+    DIR *tasks = opendir("/proc/self/task");
+    if (!tasks) {
+        return 0;
+    }
+    
+    long ticks = sysconf(_SC_CLK_TCK);
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(tasks)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        
+        char path[64];
+        char line[512];
+        snprintf(path, sizeof(path), "/proc/self/task/%s/stat", entry->d_name);
+        FILE *file = fopen(path, "r");
+        if (!file) {
+            continue;
+        }
+        bool ok = fgets(line, sizeof(line), file) != NULL;
+        fclose(file);
+        
+        char *open = strchr(line, '(');
+        char *close_paren = strrchr(line, ')');
+        if (!ok || !open || !close_paren) {
+            continue;
+        }
+        
+        // Fields after the name start at state (3), utime and stime are 14 and 15
+        unsigned long utime = 0, stime = 0;
+        if (sscanf(close_paren + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                   &utime, &stime) != 2) {
+            continue;
+        }
+        
+        *close_paren = '\0';
+        const char *name = open + 1;
+        int group = 0;
+        while (group < count && strcmp(groups[group].name, name) != 0) {
+            group++;
+        }
+        if (group == count) {
+            if (count == max_groups) {
+                continue;
+            }
+            snprintf(groups[count].name, sizeof(groups[count].name), "%s", name);
+            groups[count].cpu_ms = 0;
+            count++;
+        }
+        groups[group].cpu_ms += (utime + stime) * 1000.0 / ticks;
+    }
+    
+    closedir(tasks);
+    return count;
+}
+
+static void* server_thread_func(void *arg) {
+    (void)arg;
+    pthread_setname_np(pthread_self(), "ap2-control");
+    
+    while (server_running) {
+        if (airplay_server_dispatch(10) < 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+// First sample handed to ALSA, the end of the end-to-end path
+static void* monitor_thread_func(void *arg) {
+    (void)arg;
+    bench_thread = true;
+    
+    while (monitor_running && first_output_ns == 0) {
+        if (stats_get_count(STATS_STAGE_ALSA_WRITE) > 0) {
+            first_output_ns = now_ns();
+        }
+        usleep(200);
+    }
+    return NULL;
+}
+
+typedef struct {
+    uint64_t wall_ns;
+    uint64_t first_audio_ns;
+    uint32_t audio_packets;
+    uint32_t skipped_packets;
+    uint64_t audio_us;
+    bool drained;
+    thread_cpu_t threads[MAX_THREAD_GROUPS];
+    int thread_count;
+} replay_result_t;
+
+static int replay(const capture_t *capture, uint16_t port, double speed, replay_result_t *result) {
+    uint8_t response[4096];
+    int control_fd = connect_loopback(port);
+    int data_fd = -1;
+    if (control_fd < 0) {
+        fprintf(stderr, "Cannot connect to the server on port %u\n", port);
+        return -1;
+    }
+    
+    memset(result, 0, sizeof(*result));
+    uint64_t start = now_ns();
+    bool pending_audio = false;
+    bool snapshot_taken = false;
+    int status = 0;
+    
+    for (size_t i = 0; i < capture->count && status == 0; i++) {
+        const capture_record_t *record = &capture->records[i];
+        if (speed > 0) {
+            sleep_until(start + (uint64_t)(record->time_us * 1000.0 / speed));
+        }
+        
+        if (record->stream == CAPTURE_AUDIO) {
+            if (data_fd < 0) {
+                result->skipped_packets++;
+                continue;
+            }
+            if (result->audio_packets == 0) {
+                result->first_audio_ns = now_ns();
+            }
+            if (send_all(data_fd, record->data, record->length) != 0) {
+                fprintf(stderr, "Audio connection closed by the server\n");
+                status = -1;
+            }
+            result->audio_packets++;
+            result->audio_us = record->time_us;
+            pending_audio = true;
+            continue;
+        }
+        
+        // A TEARDOWN after audio waits for playout to finish, a FLUSH goes
+        // straight through so track changes keep their handoff
+        if (pending_audio && record->length >= 8 && memcmp(record->data, "TEARDOWN", 8) == 0) {
+            result->drained = wait_for_drain();
+            result->thread_count = snapshot_thread_cpu(result->threads, MAX_THREAD_GROUPS);
+            pending_audio = false;
+            snapshot_taken = true;
+        }
+        
+        int length;
+        if (send_all(control_fd, record->data, record->length) != 0 ||
+            (length = read_response(control_fd, response, sizeof(response))) < 0) {
+            fprintf(stderr, "No response to control record %zu\n", i);
+            status = -1;
+            break;
+        }
+        
+        // Every SETUP reply carries the data port of a new buffered stream
+        const char *body = strstr((char *)response, "\r\n\r\n");
+        int64_t data_port;
+        if (body && bplist_get_int((const uint8_t *)body + 4, length - (body + 4 - (char *)response),
+                                   "dataPort", &data_port) == 0) {
+            if (data_fd >= 0) {
+                close(data_fd);
+            }
+            data_fd = connect_loopback((uint16_t)data_port);
+            if (data_fd < 0) {
+                fprintf(stderr, "Cannot connect to data port %lld\n", (long long)data_port);
+                status = -1;
+            }
+        }
+    }
+    
+    if (pending_audio || !snapshot_taken) {
+        result->drained = wait_for_drain();
+        result->thread_count = snapshot_thread_cpu(result->threads, MAX_THREAD_GROUPS);
+    }
+    result->wall_ns = now_ns() - start;
+    
+    if (data_fd >= 0) {
+        close(data_fd);
+    }
+    close(control_fd);
+    return status;
+}
+
+static void print_report(const replay_result_t *result, double speed) {
+    static const char *stage_names[STATS_STAGE_COUNT] = {
+        "receive", "decrypt", "decode", "dsp", "jitter_wait", "volume", "alsa_write", "gap",
+        "wake_idle", "wake_suspended", "wake_closed"
+    };
+    static const char *counter_names[STATS_COUNTER_COUNT] = {
+        "packets", "kilobytes", "underruns", "late_drops", "decrypt_errors", "decode_errors", "resends",
+        "sink_drops"
+    };
+    
+    printf("Replayed %.2f s of audio in %u packets at %s in %.3f s%s\n",
+           result->audio_us / 1e6, result->audio_packets,
+           speed > 0 ? "recorded pace" : "full speed", result->wall_ns / 1e9,
+           result->drained ? "" : " (playout did not drain)");
+    if (speed > 0 && speed != 1.0) {
+        printf("Clock scaled x%.2f\n", speed);
+    }
+    if (result->skipped_packets > 0) {
+        printf("Skipped %u audio packets sent before SETUP\n", result->skipped_packets);
+    }
+    if (first_output_ns > result->first_audio_ns && result->first_audio_ns > 0) {
+        printf("First audio out %.3f ms after the first packet was sent\n",
+               (first_output_ns - result->first_audio_ns) / 1e6);
+    }
+    
+    printf("\n%-12s %8s %10s %10s %10s %10s\n", "stage", "count", "mean_us", "p50_us", "p99_us", "p99.9_us");
+    for (int i = 0; i < STATS_STAGE_COUNT; i++) {
+        printf("%-12s %8u %10.1f %10.1f %10.1f %10.1f\n", stage_names[i], stats_get_count(i),
+               stats_get_mean(i) / 1e3, stats_get_percentile(i, 50.0) / 1e3,
+               stats_get_percentile(i, 99.0) / 1e3, stats_get_percentile(i, 99.9) / 1e3);
+    }
+    
+    printf("\n%-16s %10s\n", "thread", "cpu_ms");
+    for (int i = 0; i < result->thread_count; i++) {
+        printf("%-16s %10.1f\n", result->threads[i].name, result->threads[i].cpu_ms);
+    }
+    
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("\nProcess: user %.1f ms, system %.1f ms, %ld voluntary and %ld involuntary context switches\n",
+           usage.ru_utime.tv_sec * 1e3 + usage.ru_utime.tv_usec / 1e3,
+           usage.ru_stime.tv_sec * 1e3 + usage.ru_stime.tv_usec / 1e3,
+           usage.ru_nvcsw, usage.ru_nivcsw);
+    
+    printf("\nDaemon calls during replay:\n");
+    for (int i = 0; i < CALL_COUNT; i++) {
+        printf("  %-16s %10u\n", call_names[i], __atomic_load_n(&calls[i], __ATOMIC_RELAXED));
+    }
+    printf("  %-16s %10llu\n", "bytes allocated",
+           (unsigned long long)__atomic_load_n(&allocated_bytes, __ATOMIC_RELAXED));
+    
+    printf("\nCounters:");
+    for (int i = 0; i < STATS_COUNTER_COUNT; i++) {
+        printf(" %s %u", counter_names[i], stats_get_counter(i));
+    }
+    printf("\n");
+}
+
+static void remove_key_dir(const char *path) {
+    DIR *dir = opendir(path);
+    if (dir) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] != '.') {
+                char file[512];
+                snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+                unlink(file);
+            }
+        }
+        closedir(dir);
+    }
+    rmdir(path);
+}
+
+static double thread_cpu_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+// CPU cost of the DSP chain per second of stereo audio, one row per stage
+// count. Run it on the target, the host says little about a MIPS router.
+static int bench_dsp(int seconds) {
+    static int16_t packet[SYNTH_FRAMES * SYNTH_CHANNELS];
+    uint32_t packets = (uint32_t)((uint64_t)seconds * SYNTH_SAMPLE_RATE / SYNTH_FRAMES);
+    double bypass_ms = 0;
+    
+    dsp_chain_t *dsp = dsp_chain_create();
+    if (!dsp) {
+        return -1;
+    }
+    dsp_chain_set_format(dsp, SYNTH_SAMPLE_RATE, SYNTH_CHANNELS);
+    printf("DSP chain, %d s of %u Hz stereo in %d frame packets\n", seconds, SYNTH_SAMPLE_RATE, SYNTH_FRAMES);
+    printf("%-16s %14s %14s\n", "chain", "ms cpu / s", "ms / stage");
+    
+    for (int stages = 0; stages <= DSP_MAX_FILTERS + 1; stages++) {
+        // The last row is the full chain plus the limiter
+        dsp_config_t config;
+        dsp_chain_get_defaults(&config);
+        config.filter_count = stages <= DSP_MAX_FILTERS ? stages : DSP_MAX_FILTERS;
+        config.limiter = stages > DSP_MAX_FILTERS;
+        for (int i = 0; i < config.filter_count; i++) {
+            config.filters[i].type = DSP_FILTER_PEAKING;
+            config.filters[i].frequency = 60.0f * (1 << i);
+            config.filters[i].gain_db = i % 2 ? -3.0f : 3.0f;
+            config.filters[i].q = 1.0f;
+        }
+        dsp_chain_configure(dsp, &config);
+        
+        // One packet lets the crossfade from the previous row finish
+        double start_ms = 0;
+        for (uint32_t i = 0; i <= packets; i++) {
+            for (int frame = 0; frame < SYNTH_FRAMES; frame++) {
+                double phase = 2.0 * M_PI * 440.0 * ((uint64_t)i * SYNTH_FRAMES + frame) / SYNTH_SAMPLE_RATE;
+                packet[frame * 2] = packet[frame * 2 + 1] = (int16_t)(16384.0 * sin(phase));
+            }
+            if (i == 1) {
+                start_ms = thread_cpu_ms();
+            }
+            dsp_chain_process(dsp, packet, SYNTH_FRAMES);
+        }
+        double ms = (thread_cpu_ms() - start_ms) / seconds;
+        
+        char label[32];
+        snprintf(label, sizeof(label), config.limiter ? "biquads %d + limiter" : "biquads %d", config.filter_count);
+        if (stages == 0) {
+            bypass_ms = ms;
+            printf("%-16s %14.3f %14s\n", "bypass", ms, "-");
+        } else {
+            printf("%-16s %14.3f %14.3f\n", label, ms, (ms - bypass_ms) / stages);
+        }
+    }
+    
+    dsp_chain_destroy(dsp);
+    return 0;
+}
+
+// Audio decryption per second of realtime stereo packets: AES-128-CBC
+// restarted from the IV each packet, as crypto_engine_decrypt_audio does,
+// against ChaCha20-Poly1305 one-shot, with a session and in batches.
+static int bench_ciphers(int seconds) {
+    enum { CIPHER_AES_CBC = 0, CIPHER_ONE_SHOT, CIPHER_SESSION, CIPHER_BATCH_ROW, CIPHER_ROWS };
+    static const char *labels[CIPHER_ROWS] = {
+        "aes-128-cbc", "chacha20 one-shot", "chacha20 session", "chacha20 batch"
+    };
+    const size_t length = SYNTH_FRAMES * SYNTH_CHANNELS * sizeof(int16_t);
+    uint32_t packets = (uint32_t)((uint64_t)seconds * SYNTH_SAMPLE_RATE / SYNTH_FRAMES);
+    uint8_t key[CHACHA20_POLY1305_KEY_SIZE];
+    uint8_t iv[16];
+    int status = 0;
+    
+    uint8_t *cipher = malloc((size_t)packets * length);
+    uint8_t *work = malloc((size_t)CIPHER_BATCH * length);
+    uint8_t *nonces = malloc((size_t)packets * 8);
+    uint8_t *tags = malloc((size_t)packets * CHACHA20_POLY1305_TAG_SIZE);
+    aead_session_t *session = NULL;
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!cipher || !work || !nonces || !tags || !ctx || generate_random_bytes(key, sizeof(key)) != 0 ||
+        generate_random_bytes(iv, sizeof(iv)) != 0 || !(session = aead_session_create(key)) ||
+        EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, key, iv) != 1) {
+        fprintf(stderr, "Failed to set up the ciphers\n");
+        status = -1;
+    }
+    
+    // Same payload for every row, sealed once with explicit nonces
+    for (uint32_t i = 0; i < packets && status == 0; i++) {
+        uint8_t *packet = cipher + (size_t)i * length;
+        for (size_t b = 0; b < length; b++) {
+            packet[b] = (uint8_t)(i * 31 + b);
+        }
+        for (int b = 0; b < 8; b++) {
+            nonces[(size_t)i * 8 + b] = (uint8_t)(i >> (8 * b));
+        }
+        if (aead_session_encrypt(session, nonces + (size_t)i * 8, NULL, 0, packet, length,
+                                 tags + (size_t)i * CHACHA20_POLY1305_TAG_SIZE) != 0) {
+            status = -1;
+        }
+    }
+    if (status == 0) {
+        EVP_CIPHER_CTX_set_padding(ctx, 0);
+        printf("Audio decryption, %d s of %u Hz stereo in %zu byte packets\n", seconds, SYNTH_SAMPLE_RATE, length);
+        printf("%-20s %14s %14s\n", "cipher", "ms cpu / s", "MB / s");
+    }
+    
+    for (int row = 0; row < CIPHER_ROWS && status == 0; row++) {
+        uint32_t failures = 0;
+        double start_ms = thread_cpu_ms();
+        for (uint32_t i = 0; i < packets; i += CIPHER_BATCH) {
+            uint32_t count = packets - i < CIPHER_BATCH ? packets - i : CIPHER_BATCH;
+            memcpy(work, cipher + (size_t)i * length, (size_t)count * length);
+            
+            if (row == CIPHER_BATCH_ROW) {
+                aead_packet_t batch[CIPHER_BATCH];
+                for (uint32_t k = 0; k < count; k++) {
+                    batch[k].data = work + (size_t)k * length;
+                    batch[k].length = length;
+                    batch[k].aad = NULL;
+                    batch[k].aad_length = 0;
+                    batch[k].tag = tags + (size_t)(i + k) * CHACHA20_POLY1305_TAG_SIZE;
+                    batch[k].nonce = nonces + (size_t)(i + k) * 8;
+                }
+                failures += (uint32_t)(count - aead_session_decrypt_batch(session, batch, count));
+                continue;
+            }
+            
+            for (uint32_t k = 0; k < count; k++) {
+                uint8_t *data = work + (size_t)k * length;
+                const uint8_t *nonce = nonces + (size_t)(i + k) * 8;
+                const uint8_t *tag = tags + (size_t)(i + k) * CHACHA20_POLY1305_TAG_SIZE;
+                int out_length = 0;
+                int result = 0;
+                if (row == CIPHER_AES_CBC) {
+                    result = EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, iv) == 1 &&
+                             EVP_DecryptUpdate(ctx, data, &out_length, data, (int)length) == 1 ? 0 : -1;
+                } else if (row == CIPHER_ONE_SHOT) {
+                    uint8_t full_nonce[CHACHA20_POLY1305_NONCE_SIZE] = {0};
+                    memcpy(full_nonce + 4, nonce, 8);
+                    result = chacha20_poly1305_decrypt(key, full_nonce, NULL, 0, data, length, tag, data);
+                } else {
+                    result = aead_session_decrypt(session, nonce, NULL, 0, data, length, tag);
+                }
+                failures += result != 0;
+            }
+        }
+        double ms = thread_cpu_ms() - start_ms;
+        
+        if (failures > 0) {
+            fprintf(stderr, "%s: %u packets failed to decrypt\n", labels[row], failures);
+            status = -1;
+            break;
+        }
+        char label[32];
+        snprintf(label, sizeof(label), row == CIPHER_BATCH_ROW ? "%s %d" : "%s", labels[row], CIPHER_BATCH);
+        printf("%-20s %14.3f %14.1f\n", label, ms / seconds,
+               ms > 0 ? (double)packets * length / ms / 1e3 : 0.0);
+    }
+    
+    EVP_CIPHER_CTX_free(ctx);
+    aead_session_destroy(session);
+    free(tags);
+    free(nonces);
+    free(work);
+    free(cipher);
+    return status;
+}
+
+// What the daemon configures for a zone without a configuration file
+static void get_zone_config(const char *device, zone_config_t *zone) {
+    memset(zone, 0, sizeof(*zone));
+    airplay_server_get_defaults(&zone->airplay);
+    zone->airplay.port = 0;
+    zone->airplay.enable_discovery = false;
+    snprintf(zone->output, sizeof(zone->output), "alsa");
+    snprintf(zone->audio_device, sizeof(zone->audio_device), "%s", device);
+    zone->sample_rate = SYNTH_SAMPLE_RATE;
+    zone->channels = SYNTH_CHANNELS;
+    zone->bits_per_sample = 16;
+    zone->buffer_size = CONFIG_DEFAULT_BUFFER_SIZE;
+    zone->volume_rate = VOLUME_CONTROL_DEFAULT_RATE_HZ;
+    dsp_chain_get_defaults(&zone->dsp);
+}
+
+// Resident set size from /proc/self/statm, in kB
+static long resident_kb(void) {
+    long pages = 0;
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file) {
+        if (fscanf(file, "%*s %ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(file);
+    }
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Memory of idle zones beyond the first, as started by the daemon. A stream
+// adds its packet index and session arena, its audio pages come from the
+// pool all zones share and the arenas from one process-wide limit.
+static int bench_zones(int extra, const char *device) {
+    zone_t *zones[ZONE_MAX_ZONES];
+    int count = 0;
+    int status = 0;
+    
+    if (extra > ZONE_MAX_ZONES - 1) {
+        extra = ZONE_MAX_ZONES - 1;
+    }
+    
+    stats_init(NULL);
+    logger_init();
+    if (event_loop_init() != 0 || buffered_audio_init(BUFFERED_AUDIO_DEFAULT_POOL_SIZE) != 0 ||
+        session_arena_init(SESSION_ARENA_DEFAULT_LIMIT) != 0) {
+        fprintf(stderr, "Failed to initialize the shared modules\n");
+        status = -1;
+    }
+    
+    uint64_t base_bytes = 0;
+    long base_kb = 0;
+    for (int i = 0; i <= extra && status == 0; i++) {
+        zone_config_t config;
+        get_zone_config(device, &config);
+        snprintf(config.airplay.device_name, sizeof(config.airplay.device_name), "Bench zone %d", i + 1);
+        
+        // Counted like daemon code, the first zone is the baseline
+        uint64_t bytes_before = allocated_bytes;
+        long kb_before = resident_kb();
+        bench_thread = false;
+        zones[count] = zone_create(&config);
+        bool started = zones[count] && zone_start(zones[count]) == 0;
+        bench_thread = true;
+        if (zones[count]) {
+            count++;
+        }
+        if (!started) {
+            fprintf(stderr, "Failed to start zone %d\n", i + 1);
+            status = -1;
+            break;
+        }
+        
+        if (i == 0) {
+            printf("Zones on %s, first zone %llu bytes allocated, %ld kB resident\n", device,
+                   (unsigned long long)(allocated_bytes - bytes_before), resident_kb() - kb_before);
+            base_bytes = allocated_bytes;
+            base_kb = resident_kb();
+        }
+    }
+    
+    if (status == 0 && extra > 0) {
+        printf("%d more zones, %llu bytes allocated and %ld kB resident per zone\n", extra,
+               (unsigned long long)((allocated_bytes - base_bytes) / (uint64_t)extra),
+               (resident_kb() - base_kb) / extra);
+    }
+    
+    while (count > 0) {
+        zone_destroy(zones[--count]);
+    }
+    session_arena_cleanup();
+    buffered_audio_cleanup();
+    event_loop_cleanup();
+    logger_cleanup();
+    stats_cleanup();
+    return status;
+}
+
+// Stand-in for the sender's remote control on loopback: answers or ignores
+// /ctrl-int/1/ requests and records the last one
+enum { STANDIN_ANSWER = 0, STANDIN_SILENT };
+
+typedef struct {
+    pthread_mutex_t mutex;
+    int listen_fd;
+    volatile bool running;
+    volatile int mode;
+    volatile bool drop_idle;        // close the kept connection, as a sender does when idle
+    int connections;
+    char path[64];
+    char active_remote[32];
+} standin_t;
+
+typedef struct {
+    volatile bool done;
+    volatile int status;
+} remote_result_t;
+
+static void* standin_thread_func(void *arg) {
+    standin_t *standin = arg;
+    static const char answer[] = "HTTP/1.1 204 No Content\r\nContent-Length: 0\r\n\r\n";
+    char request[1024];
+    size_t received = 0;
+    int client_fd = -1;
+    
+    while (standin->running) {
+        if (standin->drop_idle) {
+            if (client_fd >= 0) {
+                close(client_fd);
+                client_fd = -1;
+            }
+            standin->drop_idle = false;
+        }
+        
+        struct pollfd pfds[2] = { { standin->listen_fd, POLLIN, 0 }, { client_fd, POLLIN, 0 } };
+        if (poll(pfds, client_fd >= 0 ? 2 : 1, 20) <= 0) {
+            continue;
+        }
+        if (pfds[0].revents & POLLIN) {
+            int fd = accept(standin->listen_fd, NULL, NULL);
+            if (fd >= 0) {
+                if (client_fd >= 0) {
+                    close(client_fd);
+                }
+                client_fd = fd;
+                received = 0;
+                pthread_mutex_lock(&standin->mutex);
+                standin->connections++;
+                pthread_mutex_unlock(&standin->mutex);
+            }
+            continue;
+        }
+        
+        ssize_t bytes = recv(client_fd, request + received, sizeof(request) - 1 - received, 0);
+        if (bytes <= 0) {
+            close(client_fd);
+            client_fd = -1;
+            continue;
+        }
+        received += (size_t)bytes;
+        request[received] = '\0';
+        if (!strstr(request, "\r\n\r\n")) {
+            continue;
+        }
+        
+        pthread_mutex_lock(&standin->mutex);
+        standin->path[0] = '\0';
+        standin->active_remote[0] = '\0';
+        sscanf(request, "GET %63s", standin->path);
+        const char *header = strstr(request, "\r\nActive-Remote: ");
+        if (header) {
+            sscanf(header + strlen("\r\nActive-Remote: "), "%31[^\r]", standin->active_remote);
+        }
+        pthread_mutex_unlock(&standin->mutex);
+        received = 0;
+        
+        if (standin->mode == STANDIN_ANSWER) {
+            send(client_fd, answer, sizeof(answer) - 1, MSG_NOSIGNAL);
+        }
+    }
+    
+    if (client_fd >= 0) {
+        close(client_fd);
+    }
+    return NULL;
+}
+
+static void remote_done(dacp_command_t command, int status, void *userdata) {
+    (void)command;
+    remote_result_t *result = userdata;
+    result->status = status;
+    __atomic_store_n(&result->done, true, __ATOMIC_RELEASE);
+}
+
+static bool wait_remote(remote_result_t *result) {
+    uint64_t deadline_ns = now_ns() + (uint64_t)RESPONSE_TIMEOUT_MS * 1000000ULL;
+    while (!__atomic_load_n(&result->done, __ATOMIC_ACQUIRE) && now_ns() < deadline_ns) {
+        usleep(10000);
+    }
+    return result->done;
+}
+
+static bool remote_row(const char *check, int status, uint64_t start_ns, bool passed) {
+    printf("%-28s %8d %10.1f  %s\n", check, status, (now_ns() - start_ns) / 1e6, passed ? "ok" : "FAILED");
+    return passed;
+}
+
+// Listens on a free loopback port and starts answering, -1 on failure
+static int standin_start(standin_t *standin, pthread_t *thread, uint16_t *port) {
+    memset(standin, 0, sizeof(*standin));
+    pthread_mutex_init(&standin->mutex, NULL);
+    
+    struct sockaddr_in addr;
+    socklen_t addr_length = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    standin->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (standin->listen_fd < 0 || bind(standin->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(standin->listen_fd, 4) != 0 ||
+        getsockname(standin->listen_fd, (struct sockaddr *)&addr, &addr_length) != 0) {
+        fprintf(stderr, "Failed to set up the stand-in remote control\n");
+        if (standin->listen_fd >= 0) {
+            close(standin->listen_fd);
+        }
+        pthread_mutex_destroy(&standin->mutex);
+        return -1;
+    }
+    
+    *port = ntohs(addr.sin_port);
+    standin->running = true;
+    pthread_create(thread, NULL, standin_thread_func, standin);
+    return 0;
+}
+
+static void standin_stop(standin_t *standin, pthread_t thread) {
+    standin->running = false;
+    pthread_join(thread, NULL);
+    close(standin->listen_fd);
+    pthread_mutex_destroy(&standin->mutex);
+}
+
+// DACP client against the stand-in: the Active-Remote header, the kept
+// connection, one reconnect when the sender closed it while idle, the bound
+// on a silent sender and a queue that returns without waiting for it
+static int bench_remote(void) {
+    static const char remote_id[] = "3141592653";
+    standin_t standin;
+    pthread_t standin_thread;
+    uint16_t port;
+    
+    dacp_client_t *client = dacp_client_create();
+    if (!client || standin_start(&standin, &standin_thread, &port) != 0) {
+        dacp_client_destroy(client);
+        return -1;
+    }
+    
+    // Without mDNS the lookup fails but the headers are kept
+    dacp_client_set_remote(client, "0123456789ABCDEF", remote_id);
+    dacp_client_set_endpoint(client, "127.0.0.1", port);
+    
+    printf("Remote control against a stand-in on port %u, %d ms timeout\n", port, DACP_CLIENT_TIMEOUT_MS);
+    printf("%-28s %8s %10s  %s\n", "check", "status", "ms", "result");
+    bool passed = true;
+    
+    uint64_t start_ns = now_ns();
+    int status = dacp_client_send(client, DACP_COMMAND_PLAY);
+    pthread_mutex_lock(&standin.mutex);
+    bool sent = strcmp(standin.path, "/ctrl-int/1/play") == 0 && strcmp(standin.active_remote, remote_id) == 0;
+    pthread_mutex_unlock(&standin.mutex);
+    passed &= remote_row("active-remote header", status, start_ns, status == 204 && sent);
+    
+    start_ns = now_ns();
+    status = dacp_client_send(client, DACP_COMMAND_PAUSE);
+    pthread_mutex_lock(&standin.mutex);
+    int connections = standin.connections;
+    pthread_mutex_unlock(&standin.mutex);
+    passed &= remote_row("kept connection", status, start_ns, status == 204 && connections == 1);
+    
+    standin.drop_idle = true;
+    while (standin.drop_idle) {
+        usleep(10000);
+    }
+    start_ns = now_ns();
+    status = dacp_client_send(client, DACP_COMMAND_NEXT);
+    pthread_mutex_lock(&standin.mutex);
+    connections = standin.connections;
+    pthread_mutex_unlock(&standin.mutex);
+    passed &= remote_row("reconnect after idle close", status, start_ns, status == 204 && connections == 2);
+    
+    // The kept connection times out, then the fresh one does and ends it
+    standin.mode = STANDIN_SILENT;
+    start_ns = now_ns();
+    status = dacp_client_send(client, DACP_COMMAND_PREVIOUS);
+    passed &= remote_row("silent sender", status, start_ns,
+                         status < 0 && now_ns() - start_ns < (uint64_t)(2 * DACP_CLIENT_TIMEOUT_MS + 500) * 1000000ULL);
+    
+    remote_result_t result = { false, 0 };
+    start_ns = now_ns();
+    int queued = dacp_client_queue(client, DACP_COMMAND_VOLUME_UP, remote_done, &result);
+    passed &= remote_row("queue while silent", queued, start_ns,
+                         queued == 0 && now_ns() - start_ns < 10000000ULL);
+    passed &= remote_row("  completes with", result.status, start_ns, wait_remote(&result) && result.status < 0);
+    
+    standin.mode = STANDIN_ANSWER;
+    memset(&result, 0, sizeof(result));
+    start_ns = now_ns();
+    queued = dacp_client_queue(client, DACP_COMMAND_VOLUME_DOWN, remote_done, &result);
+    bool completed = queued == 0 && wait_remote(&result);
+    pthread_mutex_lock(&standin.mutex);
+    sent = strcmp(standin.path, "/ctrl-int/1/volumedown") == 0;
+    pthread_mutex_unlock(&standin.mutex);
+    passed &= remote_row("queue after recovery", result.status, start_ns, completed && result.status == 204 && sent);
+    
+    dacp_client_destroy(client);
+    standin_stop(&standin, standin_thread);
+    return passed ? 0 : -1;
+}
+
+static void write_event(int fd, uint64_t ms, uint16_t type, uint16_t code, int32_t value) {
+    struct input_event event;
+    memset(&event, 0, sizeof(event));
+    event.input_event_sec = ms / 1000;
+    event.input_event_usec = (ms % 1000) * 1000;
+    event.type = type;
+    event.code = code;
+    event.value = value;
+    if (write(fd, &event, sizeof(event)) != (ssize_t)sizeof(event)) {
+        fprintf(stderr, "Cannot write input event: %s\n", strerror(errno));
+    }
+}
+
+static bool input_row(const char *check, const char *value, uint64_t start_ns, bool passed) {
+    printf("%-28s %12s %10.1f  %s\n", check, value, (now_ns() - start_ns) / 1e6, passed ? "ok" : "FAILED");
+    return passed;
+}
+
+static bool volume_is(zone_t *zone, float expected, char *value, size_t size) {
+    float level = volume_control_get_volume(zone->volume);
+    snprintf(value, size, "%.2f", level);
+    return fabsf(level - expected) < 0.001f;
+}
+
+// Buttons and an encoder fed through a FIFO that input_control opens as its
+// event device, on the event loop like the daemon's: key presses, held-key
+// repeat, debounce, encoder acceleration and bounce, local play without a
+// sender and a track change that does not wait for a silent sender
+static int bench_input(const char *device) {
+    char dir[] = "/tmp/airplay2-bench.XXXXXX";
+    char path[64];
+    char value[16];
+    standin_t standin;
+    pthread_t standin_thread;
+    uint16_t port = 0;
+    zone_t *zone = NULL;
+    int writer = -1;
+    bool passed = true;
+    
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "Cannot create FIFO directory: %s\n", strerror(errno));
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/event0", dir);
+    
+    // The writer holds the FIFO open, so the reader never sees end of file
+    struct stat st;
+    zone_config_t config;
+    get_zone_config(device, &config);
+    stats_init(NULL);
+    logger_init();
+    bool ready = mkfifo(path, 0600) == 0 && (writer = open(path, O_RDWR | O_CLOEXEC)) >= 0 &&
+                 fstat(writer, &st) == 0 && event_loop_init() == 0 &&
+                 buffered_audio_init(BUFFERED_AUDIO_DEFAULT_POOL_SIZE) == 0 &&
+                 session_arena_init(SESSION_ARENA_DEFAULT_LIMIT) == 0 && (zone = zone_create(&config)) != NULL &&
+                 standin_start(&standin, &standin_thread, &port) == 0;
+    if (ready) {
+        input_fifo_ino = st.st_ino;
+        input_control_config_t input_config;
+        input_control_get_defaults(&input_config);
+        input_config.device = path;
+        ready = input_control_init(&input_config, zone->playback, zone->volume) == 0 &&
+                input_control_get_device_count() == 1;
+    }
+    if (!ready) {
+        fprintf(stderr, "Failed to set up the input check\n");
+        passed = false;
+    } else {
+        printf("Input through %s, %d ms debounce\n", path, INPUT_CONTROL_DEFAULT_DEBOUNCE_MS);
+        printf("%-28s %12s %10s  %s\n", "check", "value", "ms", "result");
+    }
+    
+    uint64_t start_ns = now_ns();
+    if (ready) {
+        volume_control_set_volume(zone->volume, 0.5f);
+        write_event(writer, 1000, EV_KEY, KEY_VOLUMEUP, 1);
+        write_event(writer, 1080, EV_KEY, KEY_VOLUMEUP, 0);
+        event_loop_dispatch(100);
+        passed &= input_row("volume key", value, start_ns, volume_is(zone, 0.55f, value, sizeof(value)));
+        
+        start_ns = now_ns();
+        write_event(writer, 2000, EV_KEY, KEY_VOLUMEUP, 1);
+        write_event(writer, 2250, EV_KEY, KEY_VOLUMEUP, 2);
+        write_event(writer, 2283, EV_KEY, KEY_VOLUMEUP, 2);
+        write_event(writer, 2300, EV_KEY, KEY_VOLUMEUP, 0);
+        event_loop_dispatch(100);
+        passed &= input_row("held key repeats", value, start_ns, volume_is(zone, 0.70f, value, sizeof(value)));
+        
+        start_ns = now_ns();
+        write_event(writer, 3000, EV_KEY, KEY_MUTE, 1);
+        write_event(writer, 3005, EV_KEY, KEY_MUTE, 0);
+        write_event(writer, 3012, EV_KEY, KEY_MUTE, 1);
+        write_event(writer, 3040, EV_KEY, KEY_MUTE, 0);
+        event_loop_dispatch(100);
+        bool muted = volume_control_is_muted(zone->volume);
+        passed &= input_row("bounced press counts once", muted ? "muted" : "unmuted", start_ns, muted);
+        
+        start_ns = now_ns();
+        volume_control_set_volume(zone->volume, 0.2f);
+        write_event(writer, 4000, EV_REL, REL_DIAL, 1);
+        write_event(writer, 4010, EV_REL, REL_DIAL, 1);
+        event_loop_dispatch(100);
+        passed &= input_row("fast detents accelerate", value, start_ns, volume_is(zone, 0.45f, value, sizeof(value)));
+        
+        start_ns = now_ns();
+        write_event(writer, 4015, EV_REL, REL_DIAL, -1);
+        event_loop_dispatch(100);
+        passed &= input_row("quick reversal is bounce", value, start_ns, volume_is(zone, 0.45f, value, sizeof(value)));
+        
+        start_ns = now_ns();
+        write_event(writer, 5000, EV_KEY, KEY_PLAYCD, 1);
+        event_loop_dispatch(100);
+        bool playing = playback_control_get_state(zone->playback) == PLAYBACK_PLAYING;
+        passed &= input_row("play without a sender", playing ? "playing" : "not playing", start_ns, playing);
+        
+        // The event loop must come back long before the sender times out
+        dacp_client_set_endpoint(zone->remote, "127.0.0.1", port);
+        standin.mode = STANDIN_SILENT;
+        start_ns = now_ns();
+        write_event(writer, 6000, EV_KEY, KEY_NEXTSONG, 1);
+        event_loop_dispatch(100);
+        uint64_t dispatch_ns = now_ns() - start_ns;
+        passed &= input_row("next, silent sender", "dispatched", start_ns, dispatch_ns < 50000000ULL);
+        
+        bool sent = false;
+        uint64_t deadline_ns = now_ns() + (uint64_t)DACP_CLIENT_TIMEOUT_MS * 1000000ULL;
+        while (!sent && now_ns() < deadline_ns) {
+            pthread_mutex_lock(&standin.mutex);
+            sent = strcmp(standin.path, "/ctrl-int/1/nextitem") == 0;
+            pthread_mutex_unlock(&standin.mutex);
+            usleep(5000);
+        }
+        passed &= input_row("  reaches the sender", sent ? "nextitem" : "nothing", start_ns, sent);
+    }
+    
+    input_control_cleanup();
+    zone_destroy(zone);
+    if (port != 0) {
+        standin_stop(&standin, standin_thread);
+    }
+    input_fifo_ino = 0;
+    if (writer >= 0) {
+        close(writer);
+    }
+    unlink(path);
+    rmdir(dir);
+    session_arena_cleanup();
+    buffered_audio_cleanup();
+    event_loop_cleanup();
+    logger_cleanup();
+    stats_cleanup();
+    return passed ? 0 : -1;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-g capture] [-s seconds] [-T tracks] [-x speed] [-D device] [-E] [-A] [-R] [-K] [-Z zones] [-v]\n"
+                    "          [capture]\n", name);
+    fprintf(stderr, "  -g: write a synthetic PCM session to capture and exit\n");
+    fprintf(stderr, "  -s: length of the synthetic session (default %d)\n", DEFAULT_SECONDS);
+    fprintf(stderr, "  -T: split the synthetic session into tracks, one stream each (default 1)\n");
+    fprintf(stderr, "  -x: replay clock scale, 0 sends as fast as the server accepts (default 0)\n");
+    fprintf(stderr, "  -D: ALSA device for playout (default %s)\n", DEFAULT_DEVICE);
+    fprintf(stderr, "  -E: measure the DSP chain cost per stage instead of replaying\n");
+    fprintf(stderr, "  -A: compare ChaCha20-Poly1305 and AES-CBC audio decryption instead of replaying\n");
+    fprintf(stderr, "  -R: check the DACP client against a stand-in remote control instead of replaying\n");
+    fprintf(stderr, "  -K: check buttons and encoder input through a FIFO instead of replaying\n");
+    fprintf(stderr, "  -Z: measure the memory of this many zones beyond the first instead of replaying\n");
+    fprintf(stderr, "  -v: copy daemon log messages to stderr\n");
+    fprintf(stderr, "Without a capture argument a synthetic session is replayed.\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *generate_path = NULL;
+    const char *device = DEFAULT_DEVICE;
+    int seconds = DEFAULT_SECONDS;
+    int tracks = 1;
+    double speed = 0;
+    bool verbose = false;
+    bool dsp_only = false;
+    bool ciphers_only = false;
+    bool remote_only = false;
+    bool input_only = false;
+    int extra_zones = -1;
+    int opt;
+    
+    bench_thread = true;
+    
+    while ((opt = getopt(argc, argv, "g:s:T:x:D:EARKZ:vh")) != -1) {
+        switch (opt) {
+            case 'g':
+                generate_path = optarg;
+                break;
+            case 's':
+                seconds = atoi(optarg);
+                break;
+            case 'T':
+                tracks = atoi(optarg) > 0 ? atoi(optarg) : 1;
+                break;
+            case 'x':
+                speed = atof(optarg);
+                break;
+            case 'D':
+                device = optarg;
+                break;
+            case 'E':
+                dsp_only = true;
+                break;
+            case 'A':
+                ciphers_only = true;
+                break;
+            case 'R':
+                remote_only = true;
+                break;
+            case 'K':
+                input_only = true;
+                break;
+            case 'Z':
+                extra_zones = atoi(optarg) > 0 ? atoi(optarg) : 1;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    
+    if (dsp_only) {
+        return bench_dsp(seconds > 0 ? seconds : DEFAULT_SECONDS) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (ciphers_only) {
+        return bench_ciphers(seconds > 0 ? seconds : DEFAULT_SECONDS) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (remote_only) {
+        openlog("airplay2-bench", LOG_PID | (verbose ? LOG_PERROR : 0), LOG_USER);
+        setlogmask(LOG_UPTO(verbose ? LOG_DEBUG : LOG_WARNING));
+        logger_init();
+        int checked = bench_remote();
+        logger_cleanup();
+        closelog();
+        return checked == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (input_only) {
+        openlog("airplay2-bench", LOG_PID | (verbose ? LOG_PERROR : 0), LOG_USER);
+        setlogmask(LOG_UPTO(verbose ? LOG_DEBUG : LOG_WARNING));
+        int checked = bench_input(device);
+        closelog();
+        return checked == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (extra_zones > 0) {
+        openlog("airplay2-bench", LOG_PID | (verbose ? LOG_PERROR : 0), LOG_USER);
+        setlogmask(LOG_UPTO(verbose ? LOG_DEBUG : LOG_WARNING));
+        int zoned = bench_zones(extra_zones, device);
+        closelog();
+        return zoned == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    
+    capture_t capture;
+    memset(&capture, 0, sizeof(capture));
+    int loaded = optind < argc ? capture_load(&capture, argv[optind]) : synthesize(&capture, seconds, tracks);
+    if (loaded != 0) {
+        capture_free(&capture);
+        return EXIT_FAILURE;
+    }
+    if (generate_path) {
+        int saved = capture_save(&capture, generate_path);
+        capture_free(&capture);
+        return saved == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    
+    openlog("airplay2-bench", LOG_PID | (verbose ? LOG_PERROR : 0), LOG_USER);
+    setlogmask(LOG_UPTO(verbose ? LOG_DEBUG : LOG_WARNING));
+    
+    char key_dir[] = "/tmp/airplay2-bench.XXXXXX";
+    if (!mkdtemp(key_dir)) {
+        fprintf(stderr, "Cannot create key directory: %s\n", strerror(errno));
+        capture_free(&capture);
+        return EXIT_FAILURE;
+    }
+    
+    // Same module order as the daemon, with one zone bound to a free port
+    stats_init(NULL);
+    logger_init();
+    
+    zone_config_t zone_config;
+    get_zone_config(device, &zone_config);
+    int status = EXIT_FAILURE;
+    
+    if (event_loop_init() != 0 || crypto_engine_init(key_dir) != 0 ||
+        buffered_audio_init(BUFFERED_AUDIO_DEFAULT_POOL_SIZE) != 0 ||
+        session_arena_init(SESSION_ARENA_DEFAULT_LIMIT) != 0 ||
+        !(replay_zone = zone_create(&zone_config))) {
+        fprintf(stderr, "Failed to initialize the server modules\n");
+        goto cleanup;
+    }
+    
+    if (zone_start(replay_zone) != 0) {
+        fprintf(stderr, "Failed to start the server\n");
+        goto cleanup;
+    }
+    
+    pthread_t server_thread, monitor_thread;
+    server_running = true;
+    monitor_running = true;
+    memset(calls, 0, sizeof(calls));
+    allocated_bytes = 0;
+    pthread_create(&server_thread, NULL, server_thread_func, NULL);
+    pthread_create(&monitor_thread, NULL, monitor_thread_func, NULL);
+    
+    replay_result_t result;
+    int replayed = replay(&capture, replay_zone->config.airplay.port, speed, &result);
+    
+    monitor_running = false;
+    server_running = false;
+    pthread_join(monitor_thread, NULL);
+    pthread_join(server_thread, NULL);
+    
+    print_report(&result, speed);
+    status = replayed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+cleanup:
+    zone_destroy(replay_zone);
+    session_arena_cleanup();
+    buffered_audio_cleanup();
+    crypto_engine_cleanup();
+    event_loop_cleanup();
+    logger_cleanup();
+    stats_cleanup();
+    remove_key_dir(key_dir);
+    capture_free(&capture);
+    closelog();
+    return status;
+}
@@ -1,19 +1,28 @@
 #include "airplay_server.h"
 #include "crypto_utils.h"
+#include "crypto_engine.h"
+#include "secure_channel.h"
+#include "buffered_audio.h"
+#include "bplist.h"
+#include "audio_pipeline.h"
+#include "session_arena.h"
+#include "volume_control.h"
+#include "playback_control.h"
+#include "dacp_client.h"
+#include "event_loop.h"
+#include "mdns.h"
 #include "network_utils.h"
+#include "stats.h"
+#include "logger.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <syslog.h>
-#include <avahi-client/client.h>
-#include <avahi-client/lookup.h>
-#include <avahi-common/error.h>
-#include <avahi-common/malloc.h>
-#include <avahi-common/thread-watch.h>
 #include <errno.h>
 #include <openssl/sha.h>
 #include <openssl/hmac.h>
@@ -21,13 +30,22 @@
 #include <openssl/aes.h>
 
 #define AIRPLAY_PORT 7000
-#define MAX_CLIENTS 4
+#define MAX_CLIENTS AIRPLAY_SERVER_MAX_CLIENTS
 #define BUFFER_SIZE 4096
+#define STATS_RESPONSE_SIZE 2048
+
+// Crypto sessions are numbered across servers, each owns MAX_CLIENTS of them
+#if AIRPLAY_SERVER_MAX_INSTANCES * AIRPLAY_SERVER_MAX_CLIENTS > CRYPTO_ENGINE_MAX_SESSIONS
+#error "Not enough crypto sessions for every server's clients"
+#endif
 
 struct airplay_server {
     int socket_fd;
     struct sockaddr_in server_addr;
     airplay_config_t config;
+    airplay_receiver_t receiver;
+    int instance;
+    int session_base;               // crypto session of clients[0]
     
     // Callbacks
     audio_data_callback_t audio_callback;
@@ -44,37 +62,81 @@ struct airplay_server {
         struct sockaddr_in addr;
         bool connected;
         char session_id[64];
+        char cseq[16];
+        bool rtsp;
+        bool remote;                // sent a DACP-ID, owns the remote control
+        secure_channel_t channel;
+        audio_format_t format;
+        bool has_format;
+        session_arena_t *arena;     // per-stream state, SETUP to TEARDOWN
     } clients[MAX_CLIENTS];
     
-    // Avahi for mDNS
-    AvahiClient *avahi_client;
-    AvahiEntryGroup *entry_group;
+    // mDNS announcement, -1 when not announced
+    int service;
     
     // Running state
     bool running;
 };
 
-static void avahi_client_callback(AvahiClient *c, AvahiClientState state, void *userdata);
-static void avahi_entry_group_callback(AvahiEntryGroup *g, AvahiEntryGroupState state, void *userdata);
-static void* server_thread(void *arg);
-static int handle_client_request(airplay_server_t *server, int client_fd);
+// Servers by instance, all served from the main thread
+static airplay_server_t *instances[AIRPLAY_SERVER_MAX_INSTANCES];
+
+static void accept_callback(int fd, uint32_t events, void *userdata);
+static void client_callback(int fd, uint32_t events, void *userdata);
+static int handle_client_request(airplay_server_t *server, int slot);
+static int dispatch_request(airplay_server_t *server, int slot, const char *request, size_t length);
 static int parse_airplay_request(const char *request, char *method, char *path, char *headers);
-static int handle_rtsp_request(airplay_server_t *server, int client_fd, const char *request);
-static int handle_http_request(airplay_server_t *server, int client_fd, const char *request);
+static int handle_rtsp_request(airplay_server_t *server, int slot, const char *request, size_t length);
+static int handle_http_request(airplay_server_t *server, int slot, const char *request, size_t length);
+static int get_header_value(const char *request, const char *name, char *value, size_t value_size);
+static int send_response(airplay_server_t *server, int slot, const char *status,
+                         const char *content_type, const uint8_t *body, size_t body_length);
+static int send_response_headers(airplay_server_t *server, int slot, const char *status, const char *headers,
+                                 const char *content_type, const uint8_t *body, size_t body_length);
+static void end_stream(airplay_server_t *server, int slot);
+static void pairing_job_callback(int session, crypto_job_type_t type, int status,
+                                 const uint8_t *response, size_t response_length, void *userdata);
+
+void airplay_server_get_defaults(airplay_config_t *config) {
+    if (!config) {
+        return;
+    }
+    
+    memset(config, 0, sizeof(*config));
+    strncpy(config->device_name, "OpenWRT AirPlay", sizeof(config->device_name) - 1);
+    strncpy(config->model_name, "OpenWRT", sizeof(config->model_name) - 1);
+    strncpy(config->device_id, "OpenWRT-AirPlay-001", sizeof(config->device_id) - 1);
+    config->port = AIRPLAY_PORT;
+    config->enable_multiroom = false;
+    config->enable_discovery = true;
+}
 
-airplay_server_t* airplay_server_create(void) {
+airplay_server_t* airplay_server_create(const airplay_receiver_t *receiver) {
+    if (!receiver) {
+        return NULL;
+    }
+    
+    int instance = 0;
+    while (instance < AIRPLAY_SERVER_MAX_INSTANCES && instances[instance]) {
+        instance++;
+    }
+    if (instance == AIRPLAY_SERVER_MAX_INSTANCES) {
+        syslog(LOG_ERR, "No more than %d AirPlay servers", AIRPLAY_SERVER_MAX_INSTANCES);
+        return NULL;
+    }
+    
     airplay_server_t *server = calloc(1, sizeof(airplay_server_t));
     if (!server) {
         return NULL;
     }
     
-    // Set default configuration
-    strncpy(server->config.device_name, "OpenWRT AirPlay", sizeof(server->config.device_name) - 1);
-    strncpy(server->config.model_name, "OpenWRT", sizeof(server->config.model_name) - 1);
-    strncpy(server->config.device_id, "OpenWRT-AirPlay-001", sizeof(server->config.device_id) - 1);
-    server->config.port = AIRPLAY_PORT;
-    server->config.enable_multiroom = false;
-    
+    airplay_server_get_defaults(&server->config);
+    server->receiver = *receiver;
+    server->instance = instance;
+    server->session_base = instance * MAX_CLIENTS;
+    server->socket_fd = -1;
+    server->service = -1;
+    instances[instance] = server;
     return server;
 }
 
@@ -104,26 +166,41 @@ int airplay_server_start(airplay_server_t *server) {
              sizeof(server->server_addr)) < 0) {
         syslog(LOG_ERR, "Failed to bind socket to port %d", server->config.port);
         close(server->socket_fd);
+        server->socket_fd = -1;
         return -1;
     }
     
-    // Listen for connections
-    if (listen(server->socket_fd, MAX_CLIENTS) < 0) {
+    // Listen for connections, accepted on the event loop
+    if (listen(server->socket_fd, MAX_CLIENTS) < 0 ||
+        event_loop_add(server->socket_fd, accept_callback, server) != 0) {
         syslog(LOG_ERR, "Failed to listen on socket");
         close(server->socket_fd);
+        server->socket_fd = -1;
         return -1;
     }
     
-    // Initialize Avahi client for mDNS
-    int error;
-    server->avahi_client = avahi_client_new(avahi_threaded_poll_get(), 
-                                           AVAHI_CLIENT_NO_FAIL, 
-                                           avahi_client_callback, 
-                                           server, &error);
-    if (!server->avahi_client) {
-        syslog(LOG_ERR, "Failed to create Avahi client: %s", avahi_strerror(error));
-        close(server->socket_fd);
-        return -1;
+    if (server->config.port == 0) {
+        socklen_t addr_len = sizeof(server->server_addr);
+        getsockname(server->socket_fd, (struct sockaddr*)&server->server_addr, &addr_len);
+        server->config.port = ntohs(server->server_addr.sin_port);
+    }
+    
+    // Pairing identity must match what is advertised, the keys are shared
+    // so the first server's identity is the one every zone pairs as
+    if (server->instance == 0) {
+        crypto_engine_set_accessory_id(server->config.device_id);
+    }
+    
+    // Announced through the shared Avahi client, again whenever it reconnects
+    if (server->config.enable_discovery) {
+        server->service = mdns_add_service(server->config.device_name, "_airplay._tcp", server->config.port);
+        if (server->service < 0) {
+            syslog(LOG_ERR, "Failed to announce AirPlay service");
+            event_loop_remove(server->socket_fd);
+            close(server->socket_fd);
+            server->socket_fd = -1;
+            return -1;
+        }
     }
     
     server->running = true;
@@ -142,26 +219,24 @@ int airplay_server_stop(airplay_server_t *server) {
     // Close client connections
     for (int i = 0; i < MAX_CLIENTS; i++) {
         if (server->clients[i].connected) {
+            end_stream(server, i);
+            event_loop_remove(server->clients[i].fd);
             close(server->clients[i].fd);
             server->clients[i].connected = false;
+            secure_channel_cleanup(&server->clients[i].channel);
         }
     }
     
     // Close server socket
     if (server->socket_fd >= 0) {
+        event_loop_remove(server->socket_fd);
         close(server->socket_fd);
         server->socket_fd = -1;
     }
     
-    // Cleanup Avahi
-    if (server->entry_group) {
-        avahi_entry_group_free(server->entry_group);
-        server->entry_group = NULL;
-    }
-    
-    if (server->avahi_client) {
-        avahi_client_free(server->avahi_client);
-        server->avahi_client = NULL;
+    if (server->service >= 0) {
+        mdns_remove_service(server->service);
+        server->service = -1;
     }
     
     syslog(LOG_INFO, "AirPlay server stopped");
@@ -171,34 +246,108 @@ int airplay_server_stop(airplay_server_t *server) {
 void airplay_server_destroy(airplay_server_t *server) {
     if (server) {
         airplay_server_stop(server);
+        instances[server->instance] = NULL;
         free(server);
     }
 }
 
-int airplay_server_process(airplay_server_t *server) {
-    if (!server || !server->running) {
-        return -1;
+// Drops a client and everything it set up
+static void disconnect_client(airplay_server_t *server, int slot) {
+    logger_log(LOG_INFO, "Client disconnected");
+    end_stream(server, slot);
+    if (server->clients[slot].remote && server->receiver.remote) {
+        dacp_client_clear(server->receiver.remote);
+    }
+    event_loop_remove(server->clients[slot].fd);
+    close(server->clients[slot].fd);
+    server->clients[slot].connected = false;
+    secure_channel_cleanup(&server->clients[slot].channel);
+    crypto_engine_session_reset(server->session_base + slot);
+}
+
+static void accept_callback(int fd, uint32_t events, void *userdata) {
+    airplay_server_t *server = userdata;
+    struct sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+    (void)events;
+    
+    int client_fd = accept(fd, (struct sockaddr*)&client_addr, &client_len);
+    if (client_fd < 0) {
+        return;
     }
     
+    // Find free client slot
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (server->clients[i].connected) {
+            continue;
+        }
+        if (secure_channel_init(&server->clients[i].channel) != 0) {
+            syslog(LOG_ERR, "Failed to allocate client receive buffer");
+            break;
+        }
+        if (event_loop_add(client_fd, client_callback, server) != 0) {
+            secure_channel_cleanup(&server->clients[i].channel);
+            break;
+        }
+        server->clients[i].fd = client_fd;
+        server->clients[i].addr = client_addr;
+        server->clients[i].connected = true;
+        memset(server->clients[i].session_id, 0, sizeof(server->clients[i].session_id));
+        server->clients[i].has_format = false;
+        server->clients[i].arena = NULL;
+        server->clients[i].remote = false;
+        crypto_engine_session_reset(server->session_base + i);
+        
+        logger_log(LOG_INFO, "New client connected from %s:%d",
+                   inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+        return;
+    }
+    
+    // If no free slot, close connection
+    close(client_fd);
+    logger_log(LOG_WARNING, "No free client slots, connection rejected");
+}
+
+static void client_callback(int fd, uint32_t events, void *userdata) {
+    airplay_server_t *server = userdata;
+    (void)events;
+    
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (server->clients[i].connected && server->clients[i].fd == fd) {
+            if (handle_client_request(server, i) < 0) {
+                disconnect_client(server, i);
+            }
+            return;
+        }
+    }
+}
+
+int airplay_server_dispatch(int timeout_ms) {
     fd_set read_fds;
     struct timeval timeout;
-    int max_fd = server->socket_fd;
+    int max_fd = -1;
     
     FD_ZERO(&read_fds);
-    FD_SET(server->socket_fd, &read_fds);
     
-    // Add client sockets
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (server->clients[i].connected) {
-            FD_SET(server->clients[i].fd, &read_fds);
-            if (server->clients[i].fd > max_fd) {
-                max_fd = server->clients[i].fd;
-            }
+    // Listening sockets and clients of every server, with buttons and
+    // other handlers, are on the shared event loop
+    int loop_fd = event_loop_get_fd();
+    if (loop_fd >= 0) {
+        FD_SET(loop_fd, &read_fds);
+        max_fd = loop_fd;
+    }
+    
+    // Finished key exchange jobs, the engine may still be loading its keys
+    int crypto_fd = crypto_engine_get_notify_fd();
+    if (crypto_fd >= 0) {
+        FD_SET(crypto_fd, &read_fds);
+        if (crypto_fd > max_fd) {
+            max_fd = crypto_fd;
         }
     }
     
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 10000; // 10ms
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
     
     int result = select(max_fd + 1, &read_fds, NULL, NULL, &timeout);
     if (result < 0) {
@@ -213,171 +362,528 @@ int airplay_server_process(airplay_server_t *server) {
         return 0; // Timeout
     }
     
-    // Check for new connections
-    if (FD_ISSET(server->socket_fd, &read_fds)) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        
-        int client_fd = accept(server->socket_fd, (struct sockaddr*)&client_addr, &client_len);
-        if (client_fd >= 0) {
-            // Find free client slot
-            for (int i = 0; i < MAX_CLIENTS; i++) {
-                if (!server->clients[i].connected) {
-                    server->clients[i].fd = client_fd;
-                    server->clients[i].addr = client_addr;
-                    server->clients[i].connected = true;
-                    memset(server->clients[i].session_id, 0, sizeof(server->clients[i].session_id));
-                    
-                    syslog(LOG_INFO, "New client connected from %s:%d", 
-                           inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-                    break;
-                }
-            }
-            
-            // If no free slot, close connection
-            if (client_fd >= 0) {
-                bool found_slot = false;
-                for (int i = 0; i < MAX_CLIENTS; i++) {
-                    if (server->clients[i].fd == client_fd) {
-                        found_slot = true;
-                        break;
-                    }
-                }
-                if (!found_slot) {
-                    close(client_fd);
-                    syslog(LOG_WARNING, "No free client slots, connection rejected");
-                }
-            }
-        }
+    if (crypto_fd >= 0 && FD_ISSET(crypto_fd, &read_fds)) {
+        crypto_engine_process_completions();
     }
     
-    // Handle client requests
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (server->clients[i].connected && FD_ISSET(server->clients[i].fd, &read_fds)) {
-            if (handle_client_request(server, server->clients[i].fd) < 0) {
-                // Client disconnected or error
-                syslog(LOG_INFO, "Client disconnected");
-                close(server->clients[i].fd);
-                server->clients[i].connected = false;
-            }
-        }
+    if (loop_fd >= 0 && FD_ISSET(loop_fd, &read_fds)) {
+        event_loop_dispatch(0);
     }
     
     return 0;
 }
 
-static int handle_client_request(airplay_server_t *server, int client_fd) {
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read = recv(client_fd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
+// Length of the first complete message in data, 0 if more bytes are needed.
+// needed is the whole message length once its headers are in, else 0.
+static size_t complete_message_length(char *data, size_t available, size_t *needed) {
+    size_t header_length = 0;
+    *needed = 0;
+    for (size_t i = 0; i + 4 <= available; i++) {
+        if (memcmp(data + i, "\r\n\r\n", 4) == 0) {
+            header_length = i + 4;
+            break;
+        }
+    }
+    if (header_length == 0) {
+        return 0;
+    }
+    
+    // The byte after the headers may be undecrypted input, so put it back
+    char value[16];
+    size_t body_length = 0;
+    char saved = data[header_length];
+    data[header_length] = '\0';
+    if (get_header_value(data, "Content-Length", value, sizeof(value)) == 0) {
+        body_length = strtoul(value, NULL, 10);
+    }
+    data[header_length] = saved;
+    
+    *needed = body_length > SECURE_CHANNEL_MAX_MESSAGE ? SIZE_MAX : header_length + body_length;
+    if (body_length > available - header_length) {
+        return 0;
+    }
+    return header_length + body_length;
+}
+
+static int handle_client_request(airplay_server_t *server, int slot) {
+    secure_channel_t *channel = &server->clients[slot].channel;
+    ssize_t bytes_read = secure_channel_receive(channel, server->clients[slot].fd);
     
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
     if (bytes_read <= 0) {
         return -1; // Client disconnected or error
     }
     
-    buffer[bytes_read] = '\0';
+    // Requests are parsed where they were received, pipelined ones included
+    char *data;
+    size_t available;
+    while ((available = secure_channel_peek(channel, &data)) > 0) {
+        size_t needed;
+        size_t length = complete_message_length(data, available, &needed);
+        if (length == 0) {
+            // Artwork and large SETUP bodies outgrow the idle buffer
+            if (needed > 0 && secure_channel_expect(channel, needed) != 0) {
+                logger_log(LOG_WARNING, "Request body too large, closing the connection");
+                return -1;
+            }
+            break;
+        }
+        
+        char saved = data[length];
+        data[length] = '\0';
+        int result = dispatch_request(server, slot, data, length);
+        data[length] = saved;
+        
+        secure_channel_consume(channel, length);
+        if (result < 0) {
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+static int dispatch_request(airplay_server_t *server, int slot, const char *request, size_t length) {
+    // Remember how to address the response
+    const char *line_end = strstr(request, "\r\n");
+    const char *rtsp = strstr(request, "RTSP/1.0");
+    server->clients[slot].rtsp = rtsp && (!line_end || rtsp < line_end);
+    if (get_header_value(request, "CSeq", server->clients[slot].cseq,
+                         sizeof(server->clients[slot].cseq)) != 0) {
+        server->clients[slot].cseq[0] = '\0';
+    }
     
     // Parse request type and route accordingly
-    if (strncmp(buffer, "OPTIONS", 7) == 0 || 
-        strncmp(buffer, "POST", 4) == 0 ||
-        strncmp(buffer, "GET", 3) == 0) {
-        return handle_http_request(server, client_fd, buffer);
-    } else if (strncmp(buffer, "ANNOUNCE", 8) == 0 ||
-               strncmp(buffer, "SETUP", 5) == 0 ||
-               strncmp(buffer, "RECORD", 6) == 0 ||
-               strncmp(buffer, "PAUSE", 5) == 0 ||
-               strncmp(buffer, "FLUSH", 5) == 0 ||
-               strncmp(buffer, "TEARDOWN", 8) == 0) {
-        return handle_rtsp_request(server, client_fd, buffer);
+    if (strncmp(request, "OPTIONS", 7) == 0 || 
+        strncmp(request, "POST", 4) == 0 ||
+        strncmp(request, "GET", 3) == 0) {
+        return handle_http_request(server, slot, request, length);
+    } else if (strncmp(request, "ANNOUNCE", 8) == 0 ||
+               strncmp(request, "SETUP", 5) == 0 ||
+               strncmp(request, "RECORD", 6) == 0 ||
+               strncmp(request, "PAUSE", 5) == 0 ||
+               strncmp(request, "FLUSH", 5) == 0 ||
+               strncmp(request, "TEARDOWN", 8) == 0 ||
+               strncmp(request, "SET_PARAMETER", 13) == 0) {
+        // The sender's remote control, looked up once per sender
+        char dacp_id[32];
+        char active_remote[32];
+        if (get_header_value(request, "DACP-ID", dacp_id, sizeof(dacp_id)) == 0 &&
+            get_header_value(request, "Active-Remote", active_remote, sizeof(active_remote)) == 0) {
+            if (server->receiver.remote) {
+                dacp_client_set_remote(server->receiver.remote, dacp_id, active_remote);
+                server->clients[slot].remote = true;
+            }
+        }
+        return handle_rtsp_request(server, slot, request, length);
     }
     
     return 0;
 }
 
-static int handle_http_request(airplay_server_t *server, int client_fd, const char *request) {
+static int get_header_value(const char *request, const char *name, char *value, size_t value_size) {
+    size_t name_length = strlen(name);
+    const char *line = strstr(request, "\r\n");
+    
+    while (line && strncmp(line, "\r\n\r\n", 4) != 0) {
+        line += 2;
+        if (strncasecmp(line, name, name_length) == 0 && line[name_length] == ':') {
+            const char *start = line + name_length + 1;
+            while (*start == ' ') {
+                start++;
+            }
+            size_t length = strcspn(start, "\r\n");
+            if (length >= value_size) {
+                return -1;
+            }
+            memcpy(value, start, length);
+            value[length] = '\0';
+            return 0;
+        }
+        line = strstr(line, "\r\n");
+    }
+    
+    return -1;
+}
+
+static int send_response(airplay_server_t *server, int slot, const char *status,
+                         const char *content_type, const uint8_t *body, size_t body_length) {
+    return send_response_headers(server, slot, status, NULL, content_type, body, body_length);
+}
+
+// Extra header lines end in CRLF, a NULL content type leaves that header out
+static int send_response_headers(airplay_server_t *server, int slot, const char *status, const char *headers,
+                                 const char *content_type, const uint8_t *body, size_t body_length) {
+    // Header and body are framed together once the channel is encrypted
+    char message[BUFFER_SIZE];
+    const char *cseq = server->clients[slot].cseq;
+    
+    int length = snprintf(message, sizeof(message),
+        "%s %s\r\n"
+        "%s%s%s"
+        "Server: AirPlay/220.68\r\n"
+        "%s"
+        "%s%s%s"
+        "Content-Length: %zu\r\n"
+        "\r\n",
+        server->clients[slot].rtsp ? "RTSP/1.0" : "HTTP/1.1", status,
+        cseq[0] ? "CSeq: " : "", cseq, cseq[0] ? "\r\n" : "",
+        headers ? headers : "",
+        content_type ? "Content-Type: " : "", content_type ? content_type : "", content_type ? "\r\n" : "",
+        body_length);
+    
+    if (length < 0 || (size_t)length + body_length > sizeof(message)) {
+        return -1;
+    }
+    if (body_length > 0) {
+        memcpy(message + length, body, body_length);
+    }
+    
+    return secure_channel_send(&server->clients[slot].channel, server->clients[slot].fd,
+                               (uint8_t *)message, length + body_length);
+}
+
+static void pairing_job_callback(int session, crypto_job_type_t type, int status,
+                                 const uint8_t *response, size_t response_length, void *userdata) {
+    airplay_server_t *server = (airplay_server_t*)userdata;
+    int slot = session - server->session_base;
+    
+    if (slot < 0 || slot >= MAX_CLIENTS || !server->clients[slot].connected) {
+        return;
+    }
+    
+    // Pairing failures are reported to the client inside the TLV response
+    if (response_length == 0) {
+        send_response(server, slot, "500 Internal Server Error", "application/octet-stream", NULL, 0);
+        return;
+    }
+    
+    if (send_response(server, slot, "200 OK", "application/octet-stream", response, response_length) != 0) {
+        return;
+    }
+    
+    // Everything after a successful pair-verify, or a transient pair-setup
+    // that ended at M4 with keys from the SRP secret, is framed and encrypted
+    secure_channel_t *channel = &server->clients[slot].channel;
+    if ((type == CRYPTO_JOB_PAIR_VERIFY || type == CRYPTO_JOB_PAIR_SETUP) &&
+        !secure_channel_is_encrypted(channel) && crypto_engine_session_is_verified(session)) {
+        uint8_t read_key[CHACHA20_POLY1305_KEY_SIZE];
+        uint8_t write_key[CHACHA20_POLY1305_KEY_SIZE];
+        
+        if (crypto_engine_session_get_control_keys(session, read_key, write_key) != 0 ||
+            secure_channel_enable_encryption(channel, write_key, read_key) != 0) {
+            syslog(LOG_ERR, "Failed to enable control channel encryption");
+        }
+        memset(read_key, 0, sizeof(read_key));
+        memset(write_key, 0, sizeof(write_key));
+    }
+}
+
+static int handle_http_request(airplay_server_t *server, int slot, const char *request, size_t length) {
+    // Key exchange runs on the crypto workers, the response is sent on completion
+    bool pair_setup = strncmp(request, "POST /pair-setup ", 17) == 0;
+    bool pair_verify = strncmp(request, "POST /pair-verify ", 18) == 0;
+    if (pair_setup || pair_verify) {
+        char value[16];
+        
+        // Keys are still loading in the background, the sender retries
+        if (!crypto_engine_is_ready()) {
+            return send_response(server, slot, "503 Service Unavailable", "application/octet-stream", NULL, 0);
+        }
+        const char *body = strstr(request, "\r\n\r\n");
+        size_t body_length = 0;
+        
+        if (body && get_header_value(request, "Content-Length", value, sizeof(value)) == 0) {
+            body += 4;
+            body_length = strtoul(value, NULL, 10);
+        }
+        if (!body || body_length == 0 || body + body_length > request + length ||
+            crypto_engine_submit(server->session_base + slot,
+                                 pair_setup ? CRYPTO_JOB_PAIR_SETUP : CRYPTO_JOB_PAIR_VERIFY,
+                                 (const uint8_t *)body, body_length,
+                                 pairing_job_callback, server) != 0) {
+            return send_response(server, slot, "400 Bad Request", "application/octet-stream", NULL, 0);
+        }
+        return 0;
+    }
+    
+    // Pipeline counters, the same data is mapped at STATS_DEFAULT_PATH
+    if (strncmp(request, "GET /stats ", 11) == 0) {
+        char body[STATS_RESPONSE_SIZE];
+        int body_length = stats_format_json(body, sizeof(body));
+        if (body_length < 0) {
+            return send_response(server, slot, "500 Internal Server Error", "application/json", NULL, 0);
+        }
+        return send_response(server, slot, "200 OK", "application/json", (const uint8_t *)body, body_length);
+    }
+    
     // Simple HTTP response for AirPlay discovery
-    const char *response = 
+    char response[] = 
         "HTTP/1.1 200 OK\r\n"
         "Content-Type: text/x-apple-plist+xml\r\n"
         "Content-Length: 0\r\n"
         "\r\n";
     
-    send(client_fd, response, strlen(response), 0);
-    return 0;
+    return secure_channel_send(&server->clients[slot].channel, server->clients[slot].fd,
+                               (uint8_t *)response, strlen(response));
 }
 
-static int handle_rtsp_request(airplay_server_t *server, int client_fd, const char *request) {
-    // Handle RTSP requests for audio streaming
-    char response[1024];
+// Starts decrypting the AirPlay 1 session key from the ANNOUNCE SDP
+static void submit_audio_key(int session, const char *request) {
+    const char *key_line = strstr(request, "a=rsaaeskey:");
+    const char *iv_line = strstr(request, "a=aesiv:");
+    char encoded[1024];
+    uint8_t job_data[CRYPTO_ENGINE_MAX_MESSAGE];
+    size_t iv_length = 16;
+    size_t key_length = sizeof(job_data) - 16;
     
-    if (strncmp(request, "ANNOUNCE", 8) == 0) {
-        snprintf(response, sizeof(response),
-            "RTSP/1.0 200 OK\r\n"
-            "CSeq: 1\r\n"
-            "Server: AirPlay/220.68\r\n"
-            "\r\n");
-    } else if (strncmp(request, "SETUP", 5) == 0) {
-        snprintf(response, sizeof(response),
-            "RTSP/1.0 200 OK\r\n"
-            "CSeq: 2\r\n"
-            "Server: AirPlay/220.68\r\n"
-            "Transport: RTP/AVP/UDP;unicast;interleaved=0-1\r\n"
-            "\r\n");
-    } else if (strncmp(request, "RECORD", 6) == 0) {
-        snprintf(response, sizeof(response),
-            "RTSP/1.0 200 OK\r\n"
-            "CSeq: 3\r\n"
-            "Server: AirPlay/220.68\r\n"
-            "\r\n");
-    } else {
-        snprintf(response, sizeof(response),
-            "RTSP/1.0 200 OK\r\n"
-            "CSeq: 1\r\n"
-            "Server: AirPlay/220.68\r\n"
-            "\r\n");
+    if (!key_line || !iv_line) {
+        return;
     }
     
-    send(client_fd, response, strlen(response), 0);
-    return 0;
+    // SDP base64 omits the padding base64_decode expects
+    size_t length = strcspn(iv_line + 8, "\r\n");
+    if (length + 4 >= sizeof(encoded)) {
+        return;
+    }
+    memcpy(encoded, iv_line + 8, length);
+    while (length % 4 != 0) {
+        encoded[length++] = '=';
+    }
+    encoded[length] = '\0';
+    if (base64_decode(encoded, job_data, &iv_length) != 0 || iv_length != 16) {
+        return;
+    }
+    
+    length = strcspn(key_line + 12, "\r\n");
+    if (length + 4 >= sizeof(encoded)) {
+        return;
+    }
+    memcpy(encoded, key_line + 12, length);
+    while (length % 4 != 0) {
+        encoded[length++] = '=';
+    }
+    encoded[length] = '\0';
+    if (base64_decode(encoded, job_data + 16, &key_length) != 0) {
+        return;
+    }
+    
+    if (crypto_engine_submit(session, CRYPTO_JOB_RSA_AES_KEY, job_data, 16 + key_length, NULL, NULL) != 0) {
+        syslog(LOG_WARNING, "Failed to queue session key decryption");
+    }
 }
 
-// Avahi callbacks
-static void avahi_client_callback(AvahiClient *c, AvahiClientState state, void *userdata) {
-    airplay_server_t *server = (airplay_server_t*)userdata;
+// Frees the client's session arena, stopping the pipeline first if it uses it
+static void end_stream(airplay_server_t *server, int slot) {
+    session_arena_t *arena = server->clients[slot].arena;
+    if (!arena) {
+        return;
+    }
     
-    switch (state) {
-        case AVAHI_CLIENT_S_RUNNING:
-            if (!server->entry_group) {
-                server->entry_group = avahi_entry_group_new(c, avahi_entry_group_callback, server);
-                if (server->entry_group) {
-                    avahi_entry_group_add_service(server->entry_group, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, 0,
-                                                 server->config.device_name, "_airplay._tcp", NULL, NULL,
-                                                 server->config.port, NULL);
-                    avahi_entry_group_commit(server->entry_group);
-                }
-            }
-            break;
-        case AVAHI_CLIENT_FAILURE:
-            syslog(LOG_ERR, "Avahi client failure");
-            break;
-        default:
-            break;
+    if (audio_pipeline_detach(server->receiver.pipeline, arena)) {
+        buffered_audio_stop_stream(server->receiver.stream);
     }
+    session_arena_destroy(arena);
+    server->clients[slot].arena = NULL;
 }
 
-static void avahi_entry_group_callback(AvahiEntryGroup *g, AvahiEntryGroupState state, void *userdata) {
-    switch (state) {
-        case AVAHI_ENTRY_GROUP_ESTABLISHED:
-            syslog(LOG_INFO, "AirPlay service registered with mDNS");
-            break;
-        case AVAHI_ENTRY_GROUP_COLLISION:
-            syslog(LOG_WARNING, "AirPlay service name collision");
-            break;
-        case AVAHI_ENTRY_GROUP_FAILURE:
-            syslog(LOG_ERR, "Failed to register AirPlay service");
-            break;
-        default:
+// Answers an AirPlay 2 SETUP for a buffered audio stream, returns 1 if handled
+static int setup_buffered_stream(airplay_server_t *server, int slot, const char *request, size_t length) {
+    const char *body = strstr(request, "\r\n\r\n");
+    if (!body) {
+        return 0;
+    }
+    body += 4;
+    
+    const uint8_t *plist = (const uint8_t *)body;
+    size_t plist_length = length - (body - request);
+    const uint8_t *key;
+    size_t key_length;
+    int64_t type;
+    if (bplist_get_int(plist, plist_length, "type", &type) != 0 || type != BUFFERED_AUDIO_STREAM_TYPE) {
+        return 0;
+    }
+    
+    // Codec parameters from the stream entry, the ANNOUNCE SDP otherwise
+    audio_format_t format;
+    int64_t compression, sample_rate = 0, frames_per_packet = 0;
+    bplist_get_int(plist, plist_length, "sr", &sample_rate);
+    bplist_get_int(plist, plist_length, "spf", &frames_per_packet);
+    if (bplist_get_int(plist, plist_length, "ct", &compression) != 0 ||
+        audio_format_from_compression_type(compression, (uint32_t)sample_rate,
+                                           (uint32_t)frames_per_packet, &format) != 0) {
+        if (server->clients[slot].has_format) {
+            format = server->clients[slot].format;
+        } else {
+            format.codec = AUDIO_CODEC_AAC;
+            format.sample_rate = 44100;
+            format.channels = 2;
+            format.frames_per_packet = 1024;
+        }
+    }
+    
+    // A new session is refused outright rather than risking OOM later
+    end_stream(server, slot);
+    server->clients[slot].arena = session_arena_create(session_arena_size_for_format(&format));
+    if (!server->clients[slot].arena) {
+        send_response(server, slot, "503 Service Unavailable", "application/x-apple-binary-plist", NULL, 0);
+        return 1;
+    }
+    
+    uint16_t port;
+    if (bplist_get_data(plist, plist_length, "shk", &key, &key_length) != 0 ||
+        key_length != CHACHA20_POLY1305_KEY_SIZE ||
+        buffered_audio_start_stream(server->receiver.stream, key, &port) != 0) {
+        end_stream(server, slot);
+        send_response(server, slot, "500 Internal Server Error", "application/x-apple-binary-plist", NULL, 0);
+        return 1;
+    }
+    
+    // {"streams": [{"type": 103, "dataPort": port, "audioBufferSize": pool}]}
+    buffered_audio_stats_t stats;
+    buffered_audio_get_stats(server->receiver.stream, &stats);
+    
+    uint8_t reply[256];
+    size_t reply_length;
+    bplist_writer_t writer;
+    bplist_writer_init(&writer, reply, sizeof(reply));
+    int keys[3] = {
+        bplist_write_string(&writer, "type"),
+        bplist_write_string(&writer, "dataPort"),
+        bplist_write_string(&writer, "audioBufferSize")
+    };
+    int values[3] = {
+        bplist_write_int(&writer, BUFFERED_AUDIO_STREAM_TYPE),
+        bplist_write_int(&writer, port),
+        bplist_write_int(&writer, (int64_t)stats.pool_size)
+    };
+    int stream = bplist_write_dict(&writer, keys, values, 3);
+    int streams_key = bplist_write_string(&writer, "streams");
+    int streams = bplist_write_array(&writer, &stream, 1);
+    int top = bplist_write_dict(&writer, &streams_key, &streams, 1);
+    
+    if (top < 0 || bplist_writer_finish(&writer, top, &reply_length) != 0) {
+        buffered_audio_stop_stream(server->receiver.stream);
+        end_stream(server, slot);
+        send_response(server, slot, "500 Internal Server Error", "application/x-apple-binary-plist", NULL, 0);
+        return 1;
+    }
+    
+    if (audio_pipeline_start(server->receiver.pipeline, &format, server->clients[slot].arena) != 0) {
+        syslog(LOG_WARNING, "Cannot play %s stream", audio_codec_name(format.codec));
+    }
+    
+    send_response(server, slot, "200 OK", "application/x-apple-binary-plist", reply, reply_length);
+    return 1;
+}
+
+// Track metadata arrives as an mlit container of DMAP items, each a
+// 4-byte tag and a 4-byte big-endian length followed by the value
+static void set_dmap_info(playback_control_t *playback, const uint8_t *data, size_t length) {
+    playback_info_t info;
+    playback_control_get_info(playback, &info);
+    info.title[0] = info.artist[0] = info.album[0] = '\0';
+    
+    size_t offset = 0;
+    while (offset + 8 <= length) {
+        const uint8_t *item = data + offset;
+        size_t item_length = ((size_t)item[4] << 24) | ((size_t)item[5] << 16) |
+                             ((size_t)item[6] << 8) | item[7];
+        if (memcmp(item, "mlit", 4) == 0) {
+            offset += 8;
+            continue;
+        }
+        if (item_length > length - offset - 8) {
             break;
+        }
+        
+        char *field = NULL;
+        if (memcmp(item, "minm", 4) == 0) {
+            field = info.title;
+        } else if (memcmp(item, "asar", 4) == 0) {
+            field = info.artist;
+        } else if (memcmp(item, "asal", 4) == 0) {
+            field = info.album;
+        }
+        if (field) {
+            size_t copy = item_length < sizeof(info.title) - 1 ? item_length : sizeof(info.title) - 1;
+            memcpy(field, item + 8, copy);
+            field[copy] = '\0';
+        }
+        offset += 8 + item_length;
     }
+    
+    playback_control_set_info(playback, &info);
+}
+
+static int handle_rtsp_request(airplay_server_t *server, int slot, const char *request, size_t length) {
+    // Handle RTSP requests for audio streaming
+    const char *headers = NULL;
+    
+    if (strncmp(request, "SETUP", 5) == 0 && setup_buffered_stream(server, slot, request, length)) {
+        return 0;
+    }
+    
+    if (strncmp(request, "ANNOUNCE", 8) == 0) {
+        submit_audio_key(server->session_base + slot, request);
+        server->clients[slot].has_format =
+            audio_format_from_sdp(request, &server->clients[slot].format) == 0;
+    } else if (strncmp(request, "SETUP", 5) == 0) {
+        headers = "Transport: RTP/AVP/UDP;unicast;interleaved=0-1\r\n";
+    } else if (strncmp(request, "RECORD", 6) == 0) {
+        // The device is opened here rather than at SETUP
+        if (audio_pipeline_play(server->receiver.pipeline) != 0) {
+            syslog(LOG_WARNING, "Cannot open the audio output");
+        }
+        playback_control_set_state(server->receiver.playback, PLAYBACK_PLAYING);
+    } else {
+        // Drops everything queued, the sender resends from the new position
+        if (strncmp(request, "FLUSH", 5) == 0) {
+            // RTP-Info names the first packet to keep, anything already
+            // buffered from that point on belongs to the next track
+            char rtp_info[128];
+            const char *rtptime = NULL;
+            if (get_header_value(request, "RTP-Info", rtp_info, sizeof(rtp_info)) == 0) {
+                rtptime = strstr(rtp_info, "rtptime=");
+            }
+            if (rtptime) {
+                buffered_audio_seek(server->receiver.stream, (uint32_t)strtoul(rtptime + 8, NULL, 10));
+            } else {
+                buffered_audio_flush(server->receiver.stream);
+            }
+            audio_pipeline_flush(server->receiver.pipeline);
+        } else if (strncmp(request, "TEARDOWN", 8) == 0) {
+            audio_pipeline_stop(server->receiver.pipeline);
+            buffered_audio_stop_stream(server->receiver.stream);
+            end_stream(server, slot);
+            playback_control_set_state(server->receiver.playback, PLAYBACK_STOPPED);
+        } else if (strncmp(request, "SET_PARAMETER", 13) == 0) {
+            // Only the newest level is kept, the reply does not wait for the
+            // output, so a slider drag cannot queue up behind the mixer
+            char content_type[32] = "";
+            const char *body = strstr(request, "\r\n\r\n");
+            const char *volume = NULL;
+            if (body && get_header_value(request, "Content-Type", content_type, sizeof(content_type)) == 0 &&
+                strcmp(content_type, "text/parameters") == 0) {
+                volume = strstr(body, "volume:");
+            } else if (body && strcmp(content_type, "application/x-dmap-tagged") == 0) {
+                set_dmap_info(server->receiver.playback, (const uint8_t *)body + 4,
+                              length - (size_t)(body + 4 - request));
+            }
+            if (volume) {
+                float db = strtof(volume + 7, NULL);
+                volume_control_set_airplay_volume(server->receiver.volume, db);
+                if (server->volume_callback) {
+                    server->volume_callback(db);
+                }
+            }
+        }
+    }
+    
+    // Senders match replies by CSeq, so every answer echoes the request's
+    return send_response_headers(server, slot, "200 OK", headers, NULL, NULL, 0);
 }
 
 // Configuration functions
@@ -390,6 +896,21 @@ int airplay_server_set_config(airplay_server_t *server, const airplay_config_t *
     return 0;
 }
 
+// Sessions stay connected, only the mDNS announcement is replaced
+int airplay_server_set_name(airplay_server_t *server, const char *name) {
+    if (!server || !name || !name[0]) {
+        return -1;
+    }
+    
+    snprintf(server->config.device_name, sizeof(server->config.device_name), "%s", name);
+    if (server->service >= 0) {
+        mdns_rename_service(server->service, server->config.device_name);
+    }
+    
+    syslog(LOG_INFO, "AirPlay service renamed to %s", server->config.device_name);
+    return 0;
+}
+
 int airplay_server_get_config(airplay_server_t *server, airplay_config_t *config) {
     if (!server || !config) {
         return -1;
@@ -2,23 +2,43 @@
 #define AIRPLAY_SERVER_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdbool.h>
+#include "audio_decoder.h"
+#include "audio_pipeline.h"
+#include "volume_control.h"
+#include "playback_control.h"
+#include "dacp_client.h"
+
+#define AIRPLAY_SERVER_MAX_CLIENTS 4
+#define AIRPLAY_SERVER_MAX_INSTANCES 4
 
 typedef struct airplay_server airplay_server_t;
 
+// The zone a server plays to, the server owns none of it. remote may be NULL.
+typedef struct {
+    audio_pipeline_t *pipeline;
+    buffered_stream_t *stream;
+    volume_control_t *volume;
+    playback_control_t *playback;
+    dacp_client_t *remote;
+} airplay_receiver_t;
+
 // AirPlay server configuration
 typedef struct {
     char device_name[64];
     char model_name[32];
     char device_id[64];
-    uint16_t port;
+    uint16_t port;                  // 0 binds any free port, read back with get_config
     bool enable_multiroom;
     char multiroom_group[32];
+    bool enable_discovery;          // mDNS registration through Avahi
 } airplay_config_t;
 
-// Audio data callback
+// Audio data callback, data is still encoded in the given codec
 typedef void (*audio_data_callback_t)(const uint8_t *data, size_t length, 
-                                     uint32_t sample_rate, uint8_t channels);
+                                     uint32_t sample_rate, uint8_t channels,
+                                     audio_codec_t codec);
 
 // Volume change callback
 typedef void (*volume_callback_t)(float volume);
@@ -31,15 +51,20 @@ typedef void (*next_callback_t)(void);
 typedef void (*previous_callback_t)(void);
 
 // AirPlay server functions
-airplay_server_t* airplay_server_create(void);
+void airplay_server_get_defaults(airplay_config_t *config);
+airplay_server_t* airplay_server_create(const airplay_receiver_t *receiver);
 int airplay_server_start(airplay_server_t *server);
 int airplay_server_stop(airplay_server_t *server);
 void airplay_server_destroy(airplay_server_t *server);
-int airplay_server_process(airplay_server_t *server);
+
+// Serves every started server and the event loop from the calling thread,
+// waiting up to timeout_ms for something to do
+int airplay_server_dispatch(int timeout_ms);
 
 // Configuration functions
 int airplay_server_set_config(airplay_server_t *server, const airplay_config_t *config);
 int airplay_server_get_config(airplay_server_t *server, airplay_config_t *config);
+int airplay_server_set_name(airplay_server_t *server, const char *name);   // while running
 
 // Callback registration
 int airplay_server_set_audio_callback(airplay_server_t *server, audio_data_callback_t callback);
@@ -0,0 +1,327 @@
+#include "alsa_probe.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <alsa/asoundlib.h>
+
+#define CACHE_HEADER "airplay2-lite alsa cache 1"
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+static const unsigned int probe_rates[] = { 44100, 48000, 88200, 96000, 176400, 192000 };
+#define PROBE_RATE_COUNT (sizeof(probe_rates) / sizeof(probe_rates[0]))
+
+static const struct {
+    uint8_t bits;
+    snd_pcm_format_t format;
+} probe_formats[] = {
+    { 8, SND_PCM_FORMAT_S8 },
+    { 16, SND_PCM_FORMAT_S16_LE },
+    { 24, SND_PCM_FORMAT_S24_LE },
+    { 32, SND_PCM_FORMAT_S32_LE }
+};
+#define PROBE_FORMAT_COUNT (sizeof(probe_formats) / sizeof(probe_formats[0]))
+
+static pthread_mutex_t probe_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char cache_path[256];
+static alsa_probe_device_t devices[ALSA_PROBE_MAX_DEVICES];
+static int device_count = 0;
+static uint32_t probed_signature = 0;
+static bool is_probed = false;
+
+// Hash of the card ids and names, cheap to compute without opening any PCM
+static uint32_t card_signature(void) {
+    uint32_t hash = FNV_OFFSET;
+    int card = -1;
+    
+    while (snd_card_next(&card) == 0 && card >= 0) {
+        char name[16];
+        snd_ctl_t *ctl;
+        snprintf(name, sizeof(name), "hw:%d", card);
+        if (snd_ctl_open(&ctl, name, 0) != 0) {
+            continue;
+        }
+        
+        snd_ctl_card_info_t *info;
+        snd_ctl_card_info_alloca(&info);
+        if (snd_ctl_card_info(ctl, info) == 0) {
+            char line[160];
+            int length = snprintf(line, sizeof(line), "%d:%s:%s;", card,
+                                  snd_ctl_card_info_get_id(info), snd_ctl_card_info_get_name(info));
+            for (int i = 0; i < length && i < (int)sizeof(line); i++) {
+                hash = (hash ^ (uint8_t)line[i]) * FNV_PRIME;
+            }
+        }
+        snd_ctl_close(ctl);
+    }
+    
+    return hash;
+}
+
+static int probe_pcm(const char *name, const char *card_id, alsa_probe_device_t *device) {
+    snd_pcm_t *pcm;
+    if (snd_pcm_open(&pcm, name, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK) != 0) {
+        return -1;
+    }
+    
+    snd_pcm_hw_params_t *params;
+    snd_pcm_hw_params_alloca(&params);
+    if (snd_pcm_hw_params_any(pcm, params) < 0) {
+        snd_pcm_close(pcm);
+        return -1;
+    }
+    
+    memset(device, 0, sizeof(*device));
+    snprintf(device->name, sizeof(device->name), "%s", name);
+    snprintf(device->card_id, sizeof(device->card_id), "%s", card_id);
+    
+    for (size_t i = 0; i < PROBE_RATE_COUNT; i++) {
+        if (snd_pcm_hw_params_test_rate(pcm, params, probe_rates[i], 0) == 0) {
+            device->rates |= 1u << i;
+        }
+    }
+    for (size_t i = 0; i < PROBE_FORMAT_COUNT; i++) {
+        if (snd_pcm_hw_params_test_format(pcm, params, probe_formats[i].format) == 0) {
+            device->formats |= 1u << i;
+        }
+    }
+    
+    snd_pcm_hw_params_get_channels_min(params, &device->channels_min);
+    snd_pcm_hw_params_get_channels_max(params, &device->channels_max);
+    
+    snd_pcm_uframes_t frames;
+    int dir = 0;
+    if (snd_pcm_hw_params_get_period_size_min(params, &frames, &dir) == 0) {
+        device->period_min = frames;
+    }
+    if (snd_pcm_hw_params_get_period_size_max(params, &frames, &dir) == 0) {
+        device->period_max = frames;
+    }
+    
+    snd_pcm_close(pcm);
+    return 0;
+}
+
+// Opens every playback device of every card, returns false if one was busy
+static bool probe_devices_locked(void) {
+    bool complete = true;
+    int card = -1;
+    
+    device_count = 0;
+    while (snd_card_next(&card) == 0 && card >= 0 && device_count < ALSA_PROBE_MAX_DEVICES) {
+        char name[16];
+        snd_ctl_t *ctl;
+        snprintf(name, sizeof(name), "hw:%d", card);
+        if (snd_ctl_open(&ctl, name, 0) != 0) {
+            continue;
+        }
+        
+        char card_id[32] = "";
+        snd_ctl_card_info_t *info;
+        snd_ctl_card_info_alloca(&info);
+        if (snd_ctl_card_info(ctl, info) == 0) {
+            snprintf(card_id, sizeof(card_id), "%s", snd_ctl_card_info_get_id(info));
+        }
+        
+        int pcm_device = -1;
+        while (snd_ctl_pcm_next_device(ctl, &pcm_device) == 0 && pcm_device >= 0 &&
+               device_count < ALSA_PROBE_MAX_DEVICES) {
+            snprintf(name, sizeof(name), "hw:%d,%d", card, pcm_device);
+            if (probe_pcm(name, card_id, &devices[device_count]) == 0) {
+                device_count++;
+            } else {
+                // Capture-only devices fail too, only a busy one makes the probe partial
+                snd_pcm_t *pcm;
+                int err = snd_pcm_open(&pcm, name, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK);
+                if (err == -EBUSY) {
+                    complete = false;
+                } else if (err == 0) {
+                    snd_pcm_close(pcm);
+                }
+            }
+        }
+        snd_ctl_close(ctl);
+    }
+    
+    for (int i = 0; i < device_count; i++) {
+        syslog(LOG_INFO, "ALSA %s (%s): rates 0x%x, formats 0x%x, %u-%u channels, period %lu-%lu frames",
+               devices[i].name, devices[i].card_id, devices[i].rates, devices[i].formats,
+               devices[i].channels_min, devices[i].channels_max,
+               devices[i].period_min, devices[i].period_max);
+    }
+    return complete;
+}
+
+static bool load_cache_locked(uint32_t signature) {
+    if (cache_path[0] == '\0') {
+        return false;
+    }
+    
+    FILE *file = fopen(cache_path, "r");
+    if (!file) {
+        return false;
+    }
+    
+    char line[256];
+    unsigned int cached_signature;
+    bool valid = fgets(line, sizeof(line), file) != NULL &&
+                 strncmp(line, CACHE_HEADER " ", strlen(CACHE_HEADER) + 1) == 0 &&
+                 sscanf(line + strlen(CACHE_HEADER) + 1, "%x", &cached_signature) == 1 &&
+                 cached_signature == signature;
+    
+    device_count = 0;
+    while (valid && device_count < ALSA_PROBE_MAX_DEVICES && fgets(line, sizeof(line), file)) {
+        alsa_probe_device_t *device = &devices[device_count];
+        memset(device, 0, sizeof(*device));
+        if (sscanf(line, "%15s %31s %x %x %u %u %lu %lu", device->name, device->card_id,
+                   &device->rates, &device->formats, &device->channels_min, &device->channels_max,
+                   &device->period_min, &device->period_max) != 8) {
+            valid = false;
+            break;
+        }
+        device_count++;
+    }
+    
+    fclose(file);
+    if (!valid) {
+        device_count = 0;
+    }
+    return valid;
+}
+
+static void save_cache_locked(uint32_t signature) {
+    if (cache_path[0] == '\0') {
+        return;
+    }
+    
+    char temp_path[sizeof(cache_path) + 8];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", cache_path);
+    FILE *file = fopen(temp_path, "w");
+    if (!file) {
+        syslog(LOG_WARNING, "Cannot write ALSA probe cache %s", temp_path);
+        return;
+    }
+    
+    fprintf(file, "%s %08x\n", CACHE_HEADER, signature);
+    for (int i = 0; i < device_count; i++) {
+        fprintf(file, "%s %s %x %x %u %u %lu %lu\n", devices[i].name,
+                devices[i].card_id[0] ? devices[i].card_id : "-",
+                devices[i].rates, devices[i].formats, devices[i].channels_min,
+                devices[i].channels_max, devices[i].period_min, devices[i].period_max);
+    }
+    
+    // Rename keeps a power cut from leaving half a cache behind
+    if (fclose(file) != 0 || rename(temp_path, cache_path) != 0) {
+        syslog(LOG_WARNING, "Cannot write ALSA probe cache %s", cache_path);
+        remove(temp_path);
+    }
+}
+
+// Cards are compared on every call, the PCMs are only opened when they changed
+static void ensure_probed_locked(bool refresh) {
+    uint32_t signature = card_signature();
+    if (!refresh && is_probed && signature == probed_signature) {
+        return;
+    }
+    
+    if (!refresh && load_cache_locked(signature)) {
+        syslog(LOG_INFO, "ALSA devices loaded from %s (%d devices)", cache_path, device_count);
+    } else if (probe_devices_locked()) {
+        save_cache_locked(signature);
+    } else {
+        syslog(LOG_INFO, "ALSA device busy, probe results not cached");
+    }
+    
+    probed_signature = signature;
+    is_probed = true;
+}
+
+int alsa_probe_init(const char *path) {
+    pthread_mutex_lock(&probe_mutex);
+    snprintf(cache_path, sizeof(cache_path), "%s", path ? path : "");
+    is_probed = false;
+    device_count = 0;
+    pthread_mutex_unlock(&probe_mutex);
+    return 0;
+}
+
+void alsa_probe_cleanup(void) {
+    pthread_mutex_lock(&probe_mutex);
+    is_probed = false;
+    device_count = 0;
+    pthread_mutex_unlock(&probe_mutex);
+}
+
+static int format_index(uint8_t bits) {
+    for (size_t i = 0; i < PROBE_FORMAT_COUNT; i++) {
+        if (probe_formats[i].bits == bits) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+static int rate_index(uint32_t rate) {
+    for (size_t i = 0; i < PROBE_RATE_COUNT; i++) {
+        if (probe_rates[i] == rate) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+int alsa_probe_select(const audio_config_t *config, size_t buffer_frames, bool refresh,
+                      char *device, size_t size) {
+    if (!config || !device || size == 0) {
+        return -1;
+    }
+    
+    int format = format_index(config->bits_per_sample);
+    int rate = rate_index(config->sample_rate);
+    
+    pthread_mutex_lock(&probe_mutex);
+    ensure_probed_locked(refresh);
+    
+    // Direct hw: needs the exact format and room for two periods in the buffer
+    int match = -1;
+    for (int i = 0; i < device_count && match < 0; i++) {
+        const alsa_probe_device_t *candidate = &devices[i];
+        if (format >= 0 && rate >= 0 &&
+            (candidate->formats & (1u << format)) && (candidate->rates & (1u << rate)) &&
+            config->channels >= candidate->channels_min && config->channels <= candidate->channels_max &&
+            (buffer_frames == 0 || candidate->period_min <= buffer_frames / 2)) {
+            match = i;
+        }
+    }
+    
+    if (match >= 0) {
+        snprintf(device, size, "%s", devices[match].name);
+    } else if (device_count > 0) {
+        snprintf(device, size, "plug%s", devices[0].name);
+    } else {
+        snprintf(device, size, "default");
+    }
+    
+    pthread_mutex_unlock(&probe_mutex);
+    
+    syslog(LOG_INFO, "ALSA output %s for %uHz, %u channels, %u bits%s", device,
+           config->sample_rate, config->channels, config->bits_per_sample,
+           match >= 0 ? "" : " (converted)");
+    return 0;
+}
+
+int alsa_probe_get_devices(alsa_probe_device_t *out, int max) {
+    if (!out || max <= 0) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&probe_mutex);
+    ensure_probed_locked(false);
+    int count = device_count < max ? device_count : max;
+    memcpy(out, devices, count * sizeof(alsa_probe_device_t));
+    pthread_mutex_unlock(&probe_mutex);
+    return count;
+}
@@ -0,0 +1,36 @@
+#ifndef ALSA_PROBE_H
+#define ALSA_PROBE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "audio_output.h"
+
+#define ALSA_PROBE_DEFAULT_CACHE "/etc/airplay2-lite/alsa.cache"
+#define ALSA_PROBE_MAX_DEVICES 8
+
+// Capabilities of one hw: playback device
+typedef struct {
+    char name[16];                  // "hw:card,device"
+    char card_id[32];
+    uint32_t rates;                 // bit per entry of the probed rate table
+    uint32_t formats;               // bit per sample width: 8, 16, 24, 32
+    unsigned int channels_min;
+    unsigned int channels_max;
+    unsigned long period_min;       // frames
+    unsigned long period_max;
+} alsa_probe_device_t;
+
+// Lifecycle, the cache is reused while the same sound cards are present
+int alsa_probe_init(const char *cache_path);
+void alsa_probe_cleanup(void);
+
+// Picks a direct hw: device that plays the format as is, the plughw: of the
+// first card when none does, "default" without cards. refresh reprobes.
+int alsa_probe_select(const audio_config_t *config, size_t buffer_frames, bool refresh,
+                      char *device, size_t size);
+
+// Probed devices, probing first if nothing is known yet
+int alsa_probe_get_devices(alsa_probe_device_t *devices, int max);
+
+#endif // ALSA_PROBE_H
@@ -0,0 +1,393 @@
+#include "audio_decoder.h"
+#include "stats.h"
+#include "session_arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+
+#ifdef WITH_FDK_AAC
+#include <aacdecoder_lib.h>
+#endif
+
+// SETUP "ct" values
+#define COMPRESSION_PCM 1
+#define COMPRESSION_ALAC 2
+#define COMPRESSION_AAC 4
+#define COMPRESSION_AAC_ELD 8
+
+struct audio_decoder {
+    const audio_decoder_ops_t *ops;
+    void *state;
+    audio_format_t format;
+    audio_decoder_stats_t stats;
+    bool in_arena;
+};
+
+static const char *codec_names[AUDIO_CODEC_COUNT] = {
+    "PCM", "ALAC", "AAC", "AAC-ELD"
+};
+
+// PCM: 16 bit big endian samples as sent by the source
+static int pcm_open(void *state, const audio_format_t *format) {
+    *(uint8_t *)state = format->channels;
+    return 0;
+}
+
+static int pcm_decode(void *state, const uint8_t *packet, size_t length,
+                      int16_t *pcm, size_t max_frames) {
+    size_t channels = *(uint8_t *)state;
+    size_t frames = length / (2 * channels);
+    if (frames > max_frames) {
+        frames = max_frames;
+    }
+    
+    for (size_t i = 0; i < frames * channels; i++) {
+        pcm[i] = (int16_t)((packet[2 * i] << 8) | packet[2 * i + 1]);
+    }
+    return (int)frames;
+}
+
+static void pcm_reset(void *state) {
+    (void)state;
+}
+
+static void pcm_close(void *state) {
+    (void)state;
+}
+
+static const audio_decoder_ops_t pcm_decoder = {
+    "pcm", AUDIO_CODEC_PCM, sizeof(uint8_t), pcm_open, pcm_decode, pcm_reset, pcm_close
+};
+
+#ifdef WITH_FDK_AAC
+typedef struct {
+    HANDLE_AACDECODER handle;
+    uint8_t channels;
+} aac_state_t;
+
+static int sample_rate_index(uint32_t sample_rate) {
+    static const uint32_t rates[] = {
+        96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350
+    };
+    for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+        if (rates[i] == sample_rate) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+static void put_bits(uint8_t *data, size_t *position, uint32_t value, int bits) {
+    for (int i = bits - 1; i >= 0; i--) {
+        if (value & (1u << i)) {
+            data[*position / 8] |= (uint8_t)(0x80 >> (*position % 8));
+        }
+        (*position)++;
+    }
+}
+
+// AudioSpecificConfig for raw access units, streams carry no ADTS headers
+static size_t build_audio_specific_config(const audio_format_t *format, uint8_t *config) {
+    size_t position = 0;
+    int rate_index = sample_rate_index(format->sample_rate);
+    if (rate_index < 0) {
+        return 0;
+    }
+    
+    memset(config, 0, 8);
+    if (format->codec == AUDIO_CODEC_AAC_ELD) {
+        put_bits(config, &position, 31, 5);     // escape
+        put_bits(config, &position, 39 - 32, 6);
+        put_bits(config, &position, rate_index, 4);
+        put_bits(config, &position, format->channels, 4);
+        put_bits(config, &position, format->frames_per_packet == 480 ? 1 : 0, 1);
+        put_bits(config, &position, 0, 3);      // no resilience tools
+        put_bits(config, &position, 0, 1);      // no LD-SBR
+        put_bits(config, &position, 0, 4);      // ELDEXT_TERM
+        put_bits(config, &position, 0, 2);      // epConfig
+    } else {
+        put_bits(config, &position, 2, 5);      // AAC-LC
+        put_bits(config, &position, rate_index, 4);
+        put_bits(config, &position, format->channels, 4);
+        put_bits(config, &position, format->frames_per_packet == 960 ? 1 : 0, 1);
+        put_bits(config, &position, 0, 2);
+    }
+    
+    return (position + 7) / 8;
+}
+
+static int aac_open(void *state, const audio_format_t *format) {
+    aac_state_t *aac = (aac_state_t *)state;
+    uint8_t config[8];
+    size_t config_length = build_audio_specific_config(format, config);
+    if (config_length == 0) {
+        syslog(LOG_ERR, "Unsupported AAC sample rate %u", format->sample_rate);
+        return -1;
+    }
+    
+    aac->channels = format->channels;
+    aac->handle = aacDecoder_Open(TT_MP4_RAW, 1);
+    if (!aac->handle) {
+        return -1;
+    }
+    
+    UCHAR *configs[] = { config };
+    UINT lengths[] = { (UINT)config_length };
+    if (aacDecoder_ConfigRaw(aac->handle, configs, lengths) != AAC_DEC_OK) {
+        syslog(LOG_ERR, "AAC decoder rejected stream configuration");
+        aacDecoder_Close(aac->handle);
+        aac->handle = NULL;
+        return -1;
+    }
+    
+    aacDecoder_SetParam(aac->handle, AAC_PCM_MIN_OUTPUT_CHANNELS, format->channels);
+    aacDecoder_SetParam(aac->handle, AAC_PCM_MAX_OUTPUT_CHANNELS, format->channels);
+    return 0;
+}
+
+static int aac_decode(void *state, const uint8_t *packet, size_t length,
+                      int16_t *pcm, size_t max_frames) {
+    aac_state_t *aac = (aac_state_t *)state;
+    UCHAR *input = (UCHAR *)packet;
+    UINT size = (UINT)length;
+    UINT valid = (UINT)length;
+    
+    if (aacDecoder_Fill(aac->handle, &input, &size, &valid) != AAC_DEC_OK) {
+        return -1;
+    }
+    if (aacDecoder_DecodeFrame(aac->handle, pcm, (INT)(max_frames * aac->channels), 0) != AAC_DEC_OK) {
+        return -1;
+    }
+    
+    CStreamInfo *info = aacDecoder_GetStreamInfo(aac->handle);
+    return info ? info->frameSize : -1;
+}
+
+static void aac_reset(void *state) {
+    aac_state_t *aac = (aac_state_t *)state;
+    aacDecoder_SetParam(aac->handle, AAC_TPDEC_CLEAR_BUFFER, 1);
+}
+
+static void aac_close(void *state) {
+    aac_state_t *aac = (aac_state_t *)state;
+    aacDecoder_Close(aac->handle);
+}
+
+static const audio_decoder_ops_t aac_decoder = {
+    "fdk-aac", AUDIO_CODEC_AAC, sizeof(aac_state_t), aac_open, aac_decode, aac_reset, aac_close
+};
+
+static const audio_decoder_ops_t aac_eld_decoder = {
+    "fdk-aac", AUDIO_CODEC_AAC_ELD, sizeof(aac_state_t), aac_open, aac_decode, aac_reset, aac_close
+};
+#endif
+
+// Backends built into this binary
+static const audio_decoder_ops_t *decoders[] = {
+    &pcm_decoder,
+#ifdef WITH_FDK_AAC
+    &aac_decoder,
+    &aac_eld_decoder,
+#endif
+};
+
+static const audio_decoder_ops_t* find_decoder(audio_codec_t codec) {
+    for (size_t i = 0; i < sizeof(decoders) / sizeof(decoders[0]); i++) {
+        if (decoders[i]->codec == codec) {
+            return decoders[i];
+        }
+    }
+    return NULL;
+}
+
+const char* audio_codec_name(audio_codec_t codec) {
+    if ((unsigned int)codec >= AUDIO_CODEC_COUNT) {
+        return "unknown";
+    }
+    return codec_names[codec];
+}
+
+int audio_format_from_sdp(const char *sdp, audio_format_t *format) {
+    if (!sdp || !format) {
+        return -1;
+    }
+    
+    const char *rtpmap = strstr(sdp, "a=rtpmap:");
+    const char *fmtp = strstr(sdp, "a=fmtp:");
+    if (!rtpmap) {
+        return -1;
+    }
+    
+    rtpmap = strchr(rtpmap, ' ');
+    if (!rtpmap) {
+        return -1;
+    }
+    rtpmap++;
+    
+    memset(format, 0, sizeof(*format));
+    format->sample_rate = 44100;
+    format->channels = 2;
+    
+    if (strncasecmp(rtpmap, "AppleLossless", 13) == 0) {
+        // fmtp: frames compat depth pb mb kb channels maxrun maxframe bitrate rate
+        unsigned int frames = 352, channels = 2, rate = 44100;
+        format->codec = AUDIO_CODEC_ALAC;
+        if (fmtp && (fmtp = strchr(fmtp, ' ')) != NULL) {
+            sscanf(fmtp, " %u %*u %*u %*u %*u %*u %u %*u %*u %*u %u", &frames, &channels, &rate);
+        }
+        format->frames_per_packet = frames;
+        format->channels = (uint8_t)channels;
+        format->sample_rate = rate;
+    } else if (strncasecmp(rtpmap, "mpeg4-generic/", 14) == 0) {
+        unsigned int rate = 44100, channels = 2;
+        sscanf(rtpmap + 14, "%u/%u", &rate, &channels);
+        format->sample_rate = rate;
+        format->channels = (uint8_t)channels;
+        format->codec = fmtp && strstr(fmtp, "mode=AAC-eld") ? AUDIO_CODEC_AAC_ELD : AUDIO_CODEC_AAC;
+        format->frames_per_packet = format->codec == AUDIO_CODEC_AAC_ELD ? 480 : 1024;
+        
+        const char *duration = fmtp ? strstr(fmtp, "constantDuration=") : NULL;
+        if (duration) {
+            format->frames_per_packet = strtoul(duration + 17, NULL, 10);
+        }
+    } else if (strncasecmp(rtpmap, "L16/", 4) == 0) {
+        unsigned int rate = 44100, channels = 2;
+        sscanf(rtpmap + 4, "%u/%u", &rate, &channels);
+        format->codec = AUDIO_CODEC_PCM;
+        format->sample_rate = rate;
+        format->channels = (uint8_t)channels;
+        format->frames_per_packet = 352;
+    } else {
+        return -1;
+    }
+    
+    if (format->channels == 0 || format->channels > 2 || format->sample_rate == 0 ||
+        format->frames_per_packet == 0 || format->frames_per_packet > AUDIO_DECODER_MAX_FRAMES) {
+        return -1;
+    }
+    return 0;
+}
+
+int audio_format_from_compression_type(int64_t type, uint32_t sample_rate,
+                                       uint32_t frames_per_packet, audio_format_t *format) {
+    if (!format) {
+        return -1;
+    }
+    
+    memset(format, 0, sizeof(*format));
+    switch (type) {
+        case COMPRESSION_PCM:
+            format->codec = AUDIO_CODEC_PCM;
+            format->frames_per_packet = 352;
+            break;
+        case COMPRESSION_ALAC:
+            format->codec = AUDIO_CODEC_ALAC;
+            format->frames_per_packet = 352;
+            break;
+        case COMPRESSION_AAC:
+            format->codec = AUDIO_CODEC_AAC;
+            format->frames_per_packet = 1024;
+            break;
+        case COMPRESSION_AAC_ELD:
+            format->codec = AUDIO_CODEC_AAC_ELD;
+            format->frames_per_packet = 480;
+            break;
+        default:
+            return -1;
+    }
+    
+    format->sample_rate = sample_rate ? sample_rate : 44100;
+    format->channels = 2;
+    if (frames_per_packet > 0 && frames_per_packet <= AUDIO_DECODER_MAX_FRAMES) {
+        format->frames_per_packet = frames_per_packet;
+    }
+    return 0;
+}
+
+bool audio_decoder_is_supported(audio_codec_t codec) {
+    return find_decoder(codec) != NULL;
+}
+
+audio_decoder_t* audio_decoder_create(const audio_format_t *format, session_arena_t *arena) {
+    if (!format) {
+        return NULL;
+    }
+    
+    const audio_decoder_ops_t *ops = find_decoder(format->codec);
+    if (!ops) {
+        syslog(LOG_WARNING, "No %s decoder in this build", audio_codec_name(format->codec));
+        return NULL;
+    }
+    
+    // Backend state follows the decoder in the same block
+    size_t header = (sizeof(audio_decoder_t) + 7) & ~(size_t)7;
+    audio_decoder_t *decoder = arena ? session_arena_alloc(arena, header + ops->state_size)
+                                     : calloc(1, header + ops->state_size);
+    if (!decoder) {
+        return NULL;
+    }
+    
+    decoder->in_arena = arena != NULL;
+    decoder->ops = ops;
+    decoder->format = *format;
+    decoder->state = (uint8_t *)decoder + header;
+    if (ops->open(decoder->state, format) != 0) {
+        syslog(LOG_ERR, "Failed to open %s decoder", audio_codec_name(format->codec));
+        if (!decoder->in_arena) {
+            free(decoder);
+        }
+        return NULL;
+    }
+    
+    syslog(LOG_INFO, "Decoding %s %uHz/%u with %s", audio_codec_name(format->codec),
+           format->sample_rate, format->channels, ops->name);
+    return decoder;
+}
+
+void audio_decoder_destroy(audio_decoder_t *decoder) {
+    if (decoder) {
+        decoder->ops->close(decoder->state);
+        if (!decoder->in_arena) {
+            free(decoder);
+        }
+    }
+}
+
+int audio_decoder_decode(audio_decoder_t *decoder, const uint8_t *packet, size_t length,
+                         int16_t *pcm, size_t max_frames) {
+    if (!decoder || !packet || !pcm) {
+        return -1;
+    }
+    
+    uint64_t start_ns = stats_now();
+    int frames = decoder->ops->decode(decoder->state, packet, length, pcm, max_frames);
+    uint64_t elapsed_ns = stats_now() - start_ns;
+    stats_record_value(STATS_STAGE_DECODE, elapsed_ns);
+    
+    decoder->stats.packets++;
+    decoder->stats.decode_us += elapsed_ns / 1000;
+    if (frames < 0) {
+        decoder->stats.errors++;
+        stats_increment(STATS_COUNTER_DECODE_ERRORS);
+        return -1;
+    }
+    decoder->stats.frames += frames;
+    return frames;
+}
+
+void audio_decoder_reset(audio_decoder_t *decoder) {
+    if (decoder) {
+        decoder->ops->reset(decoder->state);
+    }
+}
+
+int audio_decoder_get_stats(const audio_decoder_t *decoder, audio_decoder_stats_t *stats) {
+    if (!decoder || !stats) {
+        return -1;
+    }
+    
+    *stats = decoder->stats;
+    return 0;
+}
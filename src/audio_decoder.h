@@ -0,0 +1,65 @@
+#ifndef AUDIO_DECODER_H
+#define AUDIO_DECODER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define AUDIO_DECODER_MAX_FRAMES 4096
+
+// Stream codecs, as announced in SDP or the SETUP "ct" field
+typedef enum {
+    AUDIO_CODEC_PCM = 0,
+    AUDIO_CODEC_ALAC,
+    AUDIO_CODEC_AAC,
+    AUDIO_CODEC_AAC_ELD,
+    AUDIO_CODEC_COUNT
+} audio_codec_t;
+
+typedef struct {
+    audio_codec_t codec;
+    uint32_t sample_rate;
+    uint8_t channels;
+    uint32_t frames_per_packet;
+} audio_format_t;
+
+// Backend interface, state_size bytes of zeroed state are kept between
+// packets of a stream and allocated by the caller
+typedef struct {
+    const char *name;
+    audio_codec_t codec;
+    size_t state_size;
+    int (*open)(void *state, const audio_format_t *format);
+    int (*decode)(void *state, const uint8_t *packet, size_t length,
+                  int16_t *pcm, size_t max_frames);
+    void (*reset)(void *state);
+    void (*close)(void *state);
+} audio_decoder_ops_t;
+
+typedef struct audio_decoder audio_decoder_t;
+struct session_arena;
+
+typedef struct {
+    uint64_t packets;
+    uint64_t frames;
+    uint64_t errors;
+    uint64_t decode_us;
+} audio_decoder_stats_t;
+
+// Format selection
+int audio_format_from_sdp(const char *sdp, audio_format_t *format);
+int audio_format_from_compression_type(int64_t type, uint32_t sample_rate,
+                                       uint32_t frames_per_packet, audio_format_t *format);
+const char* audio_codec_name(audio_codec_t codec);
+
+// Decoder functions, output is interleaved signed 16 bit PCM
+bool audio_decoder_is_supported(audio_codec_t codec);
+// With an arena the decoder lives in session memory, otherwise on the heap
+audio_decoder_t* audio_decoder_create(const audio_format_t *format, struct session_arena *arena);
+void audio_decoder_destroy(audio_decoder_t *decoder);
+int audio_decoder_decode(audio_decoder_t *decoder, const uint8_t *packet, size_t length,
+                         int16_t *pcm, size_t max_frames);
+void audio_decoder_reset(audio_decoder_t *decoder);
+int audio_decoder_get_stats(const audio_decoder_t *decoder, audio_decoder_stats_t *stats);
+
+#endif // AUDIO_DECODER_H
@@ -1,4 +1,11 @@
 #include "audio_output.h"
+#include "stats.h"
+#include "logger.h"
+#include "thread_policy.h"
+#include "output_sink.h"
+#include "alsa_probe.h"
+#include "power_gate.h"
+#include "volume_map.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,96 +18,85 @@
 #define DEFAULT_CHANNELS 2
 #define DEFAULT_BITS_PER_SAMPLE 16
 #define DEFAULT_BUFFER_SIZE 4096
+#define PLAYOUT_RING_SIZE (64 * 1024)
+#define PLAYOUT_RING_SLACK (16 * 1024)
+#define PLAYOUT_LOW_WATER (PLAYOUT_RING_SIZE / 2)
+#define PLAYOUT_CHUNK_FRAMES 1024
+#define PLAYOUT_IDLE_US 5000
+#define SINK_LEAD_NS 20000000ULL
+#define SINK_RESYNC_NS 100000000ULL
+#define SILENCE_FRAMES 256
+#define FADE_FRAMES 256
 
-static snd_pcm_t *pcm_handle = NULL;
-static audio_config_t current_config;
-static bool is_running = false;
-static pthread_mutex_t audio_mutex = PTHREAD_MUTEX_INITIALIZER;
-static uint8_t *audio_buffer = NULL;
-static size_t buffer_size = DEFAULT_BUFFER_SIZE;
-static size_t buffer_write_pos = 0;
-static size_t buffer_read_pos = 0;
-
-int audio_output_init(void) {
-    pthread_mutex_lock(&audio_mutex);
+struct audio_output {
+    const audio_backend_ops_t *backend;
+    void *sink;                     // backend state while the device is open
+    audio_config_t current_config;
+    bool is_running;
+    pthread_mutex_t mutex;
+    size_t buffer_size;             // backend buffer, applied at the next open
     
-    // Set default configuration
-    current_config.sample_rate = DEFAULT_SAMPLE_RATE;
-    current_config.channels = DEFAULT_CHANNELS;
-    current_config.bits_per_sample = DEFAULT_BITS_PER_SAMPLE;
-    current_config.device_name = "default";
-    current_config.use_hw_volume = false;
-    
-    // Allocate audio buffer
-    audio_buffer = malloc(buffer_size);
-    if (!audio_buffer) {
-        syslog(LOG_ERR, "Failed to allocate audio buffer");
-        pthread_mutex_unlock(&audio_mutex);
-        return -1;
-    }
+    // Playout ring, the slack past the end keeps reserved regions contiguous
+    uint8_t *playout_ring;
+    size_t playout_write;
+    size_t playout_read;
+    audio_source_callback_t playout_source;
+    void *playout_userdata;
+    pthread_t playout_thread;
+    bool playout_running;
+    bool playout_joinable;
+    uint64_t sink_due_ns;           // when unpaced backends are due for more audio
     
-    memset(audio_buffer, 0, buffer_size);
-    buffer_write_pos = 0;
-    buffer_read_pos = 0;
+    // Between tracks the device stays open and is fed silence, so the DAC does
+    // not restart. It is closed once nothing has played for the linger time.
+    size_t audio_end;               // ring position after the last real audio
+    bool had_audio;
+    bool lingering;
+    uint64_t linger_deadline_ns;
+    uint64_t dry_since_ns;
+    uint32_t fade_in_left;          // frames of new audio still to fade in
+    uint32_t flush_generation;      // commits of regions reserved before a flush are dropped
     
-    pthread_mutex_unlock(&audio_mutex);
+    // Silence moves the output from active to idle to suspended, the first
+    // audible period wakes it and records how long that took
+    power_gate_config_t gate_config;
+    power_state_t power_state;
+    power_state_t wake_from;
+    uint64_t last_sound_ns;
+    uint64_t wake_start_ns;
     
-    syslog(LOG_INFO, "Audio output initialized");
-    return 0;
-}
+    // Volume: the mixer stays open once found, software gain ramps per frame
+    snd_mixer_t *mixer_handle;
+    snd_mixer_elem_t *mixer_elem;
+    bool mixer_failed;
+    float volume_position;
+    uint32_t soft_gain;
+    uint32_t gain_target;
+    uint32_t gain_step;
+    uint32_t gain_ramp_ms;
+    size_t gain_pos;                // ring position up to which gain is applied
+};
 
-int audio_output_cleanup(void) {
-    pthread_mutex_lock(&audio_mutex);
-    
-    if (is_running) {
-        audio_output_stop();
-    }
-    
-    if (pcm_handle) {
-        snd_pcm_close(pcm_handle);
-        pcm_handle = NULL;
+// ALSA backend, snd_pcm_writei blocks and so paces the playout thread
+static int alsa_open(void **sink, const audio_config_t *config, size_t buffer_bytes) {
+    snd_pcm_t *pcm_handle = NULL;
+    const char *device = config->device_name ? config->device_name : AUDIO_OUTPUT_DEVICE_AUTO;
+    size_t buffer_frames = buffer_bytes / (config->channels * config->bits_per_sample / 8);
+    bool probed = strcmp(device, AUDIO_OUTPUT_DEVICE_AUTO) == 0;
+    char selected[32];
+    if (probed) {
+        alsa_probe_select(config, buffer_frames, false, selected, sizeof(selected));
+        device = selected;
     }
     
-    if (audio_buffer) {
-        free(audio_buffer);
-        audio_buffer = NULL;
+    // Open PCM device, a cached choice that fails is probed again
+    int err = snd_pcm_open(&pcm_handle, device, SND_PCM_STREAM_PLAYBACK, 0);
+    if (err < 0 && probed) {
+        alsa_probe_select(config, buffer_frames, true, selected, sizeof(selected));
+        err = snd_pcm_open(&pcm_handle, device, SND_PCM_STREAM_PLAYBACK, 0);
     }
-    
-    pthread_mutex_unlock(&audio_mutex);
-    
-    syslog(LOG_INFO, "Audio output cleaned up");
-    return 0;
-}
-
-int audio_output_configure(const audio_config_t *config) {
-    if (!config) {
-        return -1;
-    }
-    
-    pthread_mutex_lock(&audio_mutex);
-    
-    current_config = *config;
-    
-    pthread_mutex_unlock(&audio_mutex);
-    
-    syslog(LOG_INFO, "Audio output configured: %dHz, %d channels, %d bits",
-           config->sample_rate, config->channels, config->bits_per_sample);
-    return 0;
-}
-
-int audio_output_start(void) {
-    pthread_mutex_lock(&audio_mutex);
-    
-    if (is_running) {
-        pthread_mutex_unlock(&audio_mutex);
-        return 0;
-    }
-    
-    // Open PCM device
-    int err = snd_pcm_open(&pcm_handle, current_config.device_name, SND_PCM_STREAM_PLAYBACK, 0);
     if (err < 0) {
         syslog(LOG_ERR, "Cannot open PCM device: %s", snd_strerror(err));
-        pthread_mutex_unlock(&audio_mutex);
         return -1;
     }
     
@@ -112,8 +108,6 @@ int audio_output_start(void) {
     if (err < 0) {
         syslog(LOG_ERR, "Cannot initialize PCM parameters: %s", snd_strerror(err));
         snd_pcm_close(pcm_handle);
-        pcm_handle = NULL;
-        pthread_mutex_unlock(&audio_mutex);
         return -1;
     }
     
@@ -122,14 +116,12 @@ int audio_output_start(void) {
     if (err < 0) {
         syslog(LOG_ERR, "Cannot set PCM access type: %s", snd_strerror(err));
         snd_pcm_close(pcm_handle);
-        pcm_handle = NULL;
-        pthread_mutex_unlock(&audio_mutex);
         return -1;
     }
     
     // Set sample format
     snd_pcm_format_t format;
-    switch (current_config.bits_per_sample) {
+    switch (config->bits_per_sample) {
         case 8:
             format = SND_PCM_FORMAT_S8;
             break;
@@ -151,40 +143,32 @@ int audio_output_start(void) {
     if (err < 0) {
         syslog(LOG_ERR, "Cannot set PCM format: %s", snd_strerror(err));
         snd_pcm_close(pcm_handle);
-        pcm_handle = NULL;
-        pthread_mutex_unlock(&audio_mutex);
         return -1;
     }
     
     // Set sample rate
-    unsigned int rate = current_config.sample_rate;
+    unsigned int rate = config->sample_rate;
     err = snd_pcm_hw_params_set_rate_near(pcm_handle, hw_params, &rate, 0);
     if (err < 0) {
         syslog(LOG_ERR, "Cannot set PCM sample rate: %s", snd_strerror(err));
         snd_pcm_close(pcm_handle);
-        pcm_handle = NULL;
-        pthread_mutex_unlock(&audio_mutex);
         return -1;
     }
     
     // Set channels
-    err = snd_pcm_hw_params_set_channels(pcm_handle, hw_params, current_config.channels);
+    err = snd_pcm_hw_params_set_channels(pcm_handle, hw_params, config->channels);
     if (err < 0) {
         syslog(LOG_ERR, "Cannot set PCM channels: %s", snd_strerror(err));
         snd_pcm_close(pcm_handle);
-        pcm_handle = NULL;
-        pthread_mutex_unlock(&audio_mutex);
         return -1;
     }
     
     // Set buffer size
-    snd_pcm_uframes_t frames = buffer_size / (current_config.channels * current_config.bits_per_sample / 8);
+    snd_pcm_uframes_t frames = buffer_frames;
     err = snd_pcm_hw_params_set_buffer_size_near(pcm_handle, hw_params, &frames);
     if (err < 0) {
         syslog(LOG_ERR, "Cannot set PCM buffer size: %s", snd_strerror(err));
         snd_pcm_close(pcm_handle);
-        pcm_handle = NULL;
-        pthread_mutex_unlock(&audio_mutex);
         return -1;
     }
     
@@ -193,8 +177,6 @@ int audio_output_start(void) {
     if (err < 0) {
         syslog(LOG_ERR, "Cannot set PCM parameters: %s", snd_strerror(err));
         snd_pcm_close(pcm_handle);
-        pcm_handle = NULL;
-        pthread_mutex_unlock(&audio_mutex);
         return -1;
     }
     
@@ -203,194 +185,840 @@ int audio_output_start(void) {
     if (err < 0) {
         syslog(LOG_ERR, "Cannot prepare PCM: %s", snd_strerror(err));
         snd_pcm_close(pcm_handle);
-        pcm_handle = NULL;
-        pthread_mutex_unlock(&audio_mutex);
         return -1;
     }
     
-    is_running = true;
+    *sink = pcm_handle;
+    return 0;
+}
+
+static long alsa_write(void *sink, const uint8_t *data, size_t frames) {
+    snd_pcm_t *pcm_handle = sink;
+    snd_pcm_sframes_t frames_written = snd_pcm_writei(pcm_handle, data, frames);
+    if (frames_written == -EPIPE) {
+        logger_log(LOG_WARNING, "PCM underrun occurred");
+        stats_increment(STATS_COUNTER_UNDERRUNS);
+        snd_pcm_prepare(pcm_handle);
+        return 0;
+    }
+    if (frames_written < 0) {
+        if (snd_pcm_recover(pcm_handle, frames_written, 1) < 0) {
+            logger_log(LOG_ERR, "PCM write error: %s", snd_strerror(frames_written));
+            return -1;
+        }
+        return 0;
+    }
+    return frames_written;
+}
+
+static void alsa_drop(void *sink) {
+    snd_pcm_drop(sink);
+    snd_pcm_prepare(sink);
+}
+
+static void alsa_drain(void *sink) {
+    snd_pcm_drain(sink);
+}
+
+static void alsa_close(void *sink) {
+    snd_pcm_close(sink);
+}
+
+// Hardware without pause support is stopped instead and prepared on resume
+static int alsa_pause(void *sink, bool enable) {
+    if (snd_pcm_pause(sink, enable) == 0) {
+        return 0;
+    }
+    if (enable) {
+        snd_pcm_drop(sink);
+    } else {
+        snd_pcm_prepare(sink);
+    }
+    return 0;
+}
+
+static const audio_backend_ops_t alsa_backend = {
+    "alsa", true, alsa_open, alsa_write, alsa_drop, alsa_drain, alsa_close, alsa_pause, NULL
+};
+
+static const audio_backend_ops_t *backends[] = {
+    &alsa_backend,
+    &pipe_sink_backend,
+    &shm_sink_backend,
+    NULL
+};
+
+static const audio_backend_ops_t* find_backend(const char *name) {
+    if (!name) {
+        name = "alsa";
+    }
+    for (int i = 0; backends[i]; i++) {
+        if (strcmp(backends[i]->name, name) == 0) {
+            return backends[i];
+        }
+    }
+    return NULL;
+}
+
+// There is one Master control, so only one output drives it at a time
+static pthread_mutex_t mixer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static audio_output_t *mixer_owner = NULL;
+
+// Detaches the mixer from the volume map and gives up ownership
+static void mixer_close_locked(audio_output_t *output) {
+    if (!output->mixer_handle) {
+        return;
+    }
+    
+    pthread_mutex_lock(&mixer_mutex);
+    if (mixer_owner == output) {
+        volume_map_set_mixer(0, 0, NULL, NULL);
+        mixer_owner = NULL;
+    }
+    pthread_mutex_unlock(&mixer_mutex);
     
-    pthread_mutex_unlock(&audio_mutex);
+    snd_mixer_close(output->mixer_handle);
+    output->mixer_handle = NULL;
+    output->mixer_elem = NULL;
+}
+
+audio_output_t* audio_output_create(void) {
+    audio_output_t *output = calloc(1, sizeof(audio_output_t));
+    if (!output) {
+        syslog(LOG_ERR, "Failed to allocate audio output");
+        return NULL;
+    }
     
-    syslog(LOG_INFO, "Audio output started");
+    pthread_mutex_init(&output->mutex, NULL);
+    output->buffer_size = DEFAULT_BUFFER_SIZE;
+    output->power_state = POWER_STATE_CLOSED;
+    output->wake_from = POWER_STATE_CLOSED;
+    output->volume_position = 1.0f;
+    output->soft_gain = VOLUME_MAP_GAIN_UNITY;
+    output->gain_target = VOLUME_MAP_GAIN_UNITY;
+    
+    // Set default configuration
+    output->current_config.sample_rate = DEFAULT_SAMPLE_RATE;
+    output->current_config.channels = DEFAULT_CHANNELS;
+    output->current_config.bits_per_sample = DEFAULT_BITS_PER_SAMPLE;
+    output->current_config.backend = "alsa";
+    output->current_config.device_name = AUDIO_OUTPUT_DEVICE_AUTO;
+    output->current_config.use_hw_volume = false;
+    
+    output->playout_ring = malloc(PLAYOUT_RING_SIZE + PLAYOUT_RING_SLACK);
+    if (!output->playout_ring) {
+        syslog(LOG_ERR, "Failed to allocate playout ring");
+        pthread_mutex_destroy(&output->mutex);
+        free(output);
+        return NULL;
+    }
+    stats_set_gauge(STATS_GAUGE_RING_SIZE, PLAYOUT_RING_SIZE);
+    
+    syslog(LOG_INFO, "Audio output initialized");
+    return output;
+}
+
+void audio_output_destroy(audio_output_t *output) {
+    if (!output) {
+        return;
+    }
+    
+    // Stop takes the mutex itself and joins the playout thread
+    audio_output_stop(output);
+    
+    if (output->backend) {
+        output->backend->close(output->sink);
+    }
+    const audio_backend_ops_t *ops = find_backend(output->current_config.backend);
+    if (ops && ops->release) {
+        ops->release(&output->current_config);
+    }
+    
+    pthread_mutex_lock(&output->mutex);
+    mixer_close_locked(output);
+    pthread_mutex_unlock(&output->mutex);
+    
+    free(output->playout_ring);
+    pthread_mutex_destroy(&output->mutex);
+    free(output);
+    
+    syslog(LOG_INFO, "Audio output cleaned up");
+}
+
+int audio_output_configure(audio_output_t *output, const audio_config_t *config) {
+    if (!config) {
+        return -1;
+    }
+    
+    if (!find_backend(config->backend)) {
+        syslog(LOG_ERR, "Unknown audio output backend: %s", config->backend);
+        return -1;
+    }
+    
+    pthread_mutex_lock(&output->mutex);
+    
+    output->current_config = *config;
+    if (!output->current_config.backend) {
+        output->current_config.backend = "alsa";
+    }
+    
+    pthread_mutex_unlock(&output->mutex);
+    
+    syslog(LOG_INFO, "Audio output configured: %s %s, %dHz, %d channels, %d bits",
+           output->current_config.backend, config->device_name ? config->device_name : AUDIO_OUTPUT_DEVICE_AUTO,
+           config->sample_rate, config->channels, config->bits_per_sample);
     return 0;
 }
 
-int audio_output_stop(void) {
-    pthread_mutex_lock(&audio_mutex);
+int audio_output_get_config(audio_output_t *output, audio_config_t *config) {
+    if (!config) {
+        return -1;
+    }
     
-    if (!is_running) {
-        pthread_mutex_unlock(&audio_mutex);
+    pthread_mutex_lock(&output->mutex);
+    *config = output->current_config;
+    pthread_mutex_unlock(&output->mutex);
+    return 0;
+}
+
+static size_t frame_bytes_locked(audio_output_t *output) {
+    return output->current_config.channels * output->current_config.bits_per_sample / 8;
+}
+
+// Fold whatever ran into the slack back to the start of the ring
+static void advance_write_locked(audio_output_t *output, size_t length) {
+    size_t offset = output->playout_write % PLAYOUT_RING_SIZE;
+    if (offset + length > PLAYOUT_RING_SIZE) {
+        memcpy(output->playout_ring, output->playout_ring + PLAYOUT_RING_SIZE, offset + length - PLAYOUT_RING_SIZE);
+    }
+    output->playout_write += length;
+    stats_set_gauge(STATS_GAUGE_RING_FILL, (uint32_t)(output->playout_write - output->playout_read));
+}
+
+static void fill_silence_locked(audio_output_t *output, size_t frame_bytes) {
+    size_t length = SILENCE_FRAMES * frame_bytes;
+    if (length <= PLAYOUT_RING_SLACK && length <= PLAYOUT_RING_SIZE - (output->playout_write - output->playout_read)) {
+        memset(output->playout_ring + output->playout_write % PLAYOUT_RING_SIZE, 0, length);
+        advance_write_locked(output, length);
+    }
+}
+
+// Linear gain ramp over 16 bit frames at ring position start, step first of total
+static void fade_locked(audio_output_t *output, size_t start, size_t frames, uint32_t first, uint32_t total,
+                        bool fade_in) {
+    size_t channels = output->current_config.channels;
+    for (size_t frame = 0; frame < frames; frame++) {
+        uint32_t step = first + (uint32_t)frame;
+        int32_t gain = fade_in ? (int32_t)(step + 1) : (int32_t)(total - step);
+        for (size_t channel = 0; channel < channels; channel++) {
+            size_t position = (start + (frame * channels + channel) * sizeof(int16_t)) % PLAYOUT_RING_SIZE;
+            int16_t *sample = (int16_t *)(output->playout_ring + position);
+            *sample = (int16_t)(*sample * gain / (int32_t)total);
+        }
+    }
+}
+
+// Software volume on 16 bit audio about to be written, up to ring position end.
+// Changes ramp over FADE_FRAMES so a new level never clicks.
+static void apply_gain_locked(audio_output_t *output, size_t end) {
+    if (output->gain_pos < output->playout_read) {
+        output->gain_pos = output->playout_read;
+    }
+    if (output->current_config.bits_per_sample != 16 ||
+        (output->soft_gain == VOLUME_MAP_GAIN_UNITY && output->gain_target == VOLUME_MAP_GAIN_UNITY)) {
+        output->gain_pos = end;
+        return;
+    }
+    
+    size_t channels = output->current_config.channels;
+    uint32_t gain = output->soft_gain;
+    uint32_t target = output->gain_target;
+    uint32_t step = output->gain_step;
+    for (; output->gain_pos < end; output->gain_pos += channels * sizeof(int16_t)) {
+        if (gain < target) {
+            gain = target - gain > step ? gain + step : target;
+        } else if (gain > target) {
+            gain = gain - target > step ? gain - step : target;
+        }
+        for (size_t channel = 0; channel < channels; channel++) {
+            size_t position = (output->gain_pos + channel * sizeof(int16_t)) % PLAYOUT_RING_SIZE;
+            int16_t *sample = (int16_t *)(output->playout_ring + position);
+            *sample = (int16_t)(((int32_t)*sample * (int64_t)gain) >> 16);
+        }
+    }
+    output->soft_gain = gain;
+}
+
+static void set_power_state_locked(audio_output_t *output, power_state_t state) {
+    power_gate_set_state(output->power_state, state);
+    output->power_state = state;
+}
+
+// Ring audio above the gate threshold, audio of other widths counts by position
+static bool is_sound_locked(audio_output_t *output, size_t offset, size_t length) {
+    if (output->current_config.bits_per_sample == 16) {
+        uint16_t peak = power_gate_peak((const int16_t *)(output->playout_ring + offset), length / sizeof(int16_t));
+        return peak > output->gate_config.threshold;
+    }
+    return (ssize_t)(output->audio_end - output->playout_read) > 0;
+}
+
+static void wake_locked(audio_output_t *output, uint64_t now) {
+    if (output->power_state == POWER_STATE_SUSPENDED && output->backend->pause) {
+        output->backend->pause(output->sink, false);
+    }
+    if (output->wake_start_ns == 0) {
+        output->wake_start_ns = now;
+        output->wake_from = output->power_state;
+    }
+    set_power_state_locked(output, POWER_STATE_ACTIVE);
+}
+
+static void gate_silence_locked(audio_output_t *output, uint64_t now) {
+    uint64_t silent_ms = (now - output->last_sound_ns) / 1000000ULL;
+    if (output->power_state == POWER_STATE_ACTIVE && silent_ms >= output->gate_config.idle_ms) {
+        set_power_state_locked(output, POWER_STATE_IDLE);
+    } else if (output->power_state == POWER_STATE_IDLE && output->gate_config.suspend_ms > 0 &&
+               silent_ms >= (uint64_t)output->gate_config.idle_ms + output->gate_config.suspend_ms) {
+        // Only silence is queued in the device, nothing audible is lost
+        if (output->backend->pause) {
+            output->backend->pause(output->sink, true);
+        }
+        output->wake_start_ns = 0;
+        set_power_state_locked(output, POWER_STATE_SUSPENDED);
+    }
+}
+
+// Writes ring contents to ALSA, the blocking write paces the source
+static void* playout_thread_func(void *arg) {
+    audio_output_t *output = arg;
+    
+    thread_policy_apply(THREAD_ROLE_PLAYOUT);
+    
+    while (output->playout_running) {
+        pthread_mutex_lock(&output->mutex);
+        audio_source_callback_t source = output->playout_source;
+        void *userdata = output->playout_userdata;
+        size_t buffered = output->playout_write - output->playout_read;
+        pthread_mutex_unlock(&output->mutex);
+        
+        while (source && buffered < PLAYOUT_LOW_WATER) {
+            if (source(userdata) <= 0) {
+                break;
+            }
+            pthread_mutex_lock(&output->mutex);
+            buffered = output->playout_write - output->playout_read;
+            pthread_mutex_unlock(&output->mutex);
+        }
+        
+        pthread_mutex_lock(&output->mutex);
+        size_t frame_bytes = frame_bytes_locked(output);
+        size_t offset = output->playout_read % PLAYOUT_RING_SIZE;
+        size_t length = output->playout_write - output->playout_read;
+        if (length > PLAYOUT_RING_SIZE - offset) {
+            length = PLAYOUT_RING_SIZE - offset;
+        }
+        if (length > PLAYOUT_CHUNK_FRAMES * frame_bytes) {
+            length = PLAYOUT_CHUNK_FRAMES * frame_bytes;
+        }
+        
+        if (!output->backend) {
+            pthread_mutex_unlock(&output->mutex);
+            usleep(PLAYOUT_IDLE_US);
+            continue;
+        }
+        
+        if (length < frame_bytes) {
+            uint64_t now = stats_now();
+            if (output->lingering && now >= output->linger_deadline_ns) {
+                // Nobody resumed in time, the next start joins this thread
+                output->backend->drain(output->sink);
+                output->backend->close(output->sink);
+                output->backend = NULL;
+                output->lingering = false;
+                output->is_running = false;
+                output->playout_running = false;
+                set_power_state_locked(output, POWER_STATE_CLOSED);
+                pthread_mutex_unlock(&output->mutex);
+                syslog(LOG_INFO, "Audio output closed, no stream for %d ms", AUDIO_OUTPUT_LINGER_MS);
+                break;
+            }
+            if (output->had_audio && output->power_state != POWER_STATE_SUSPENDED) {
+                if (output->dry_since_ns == 0) {
+                    output->dry_since_ns = now;
+                }
+                fill_silence_locked(output, frame_bytes);
+                pthread_mutex_unlock(&output->mutex);
+                continue;
+            }
+            pthread_mutex_unlock(&output->mutex);
+            usleep(PLAYOUT_IDLE_US);
+            continue;
+        }
+        
+        // The peak of each period decides between sound and silence
+        uint64_t start_ns = stats_now();
+        apply_gain_locked(output, output->playout_read + length);
+        bool sound = is_sound_locked(output, offset, length);
+        if (sound) {
+            if (output->power_state != POWER_STATE_ACTIVE) {
+                wake_locked(output, start_ns);
+            }
+            output->last_sound_ns = start_ns;
+        } else {
+            gate_silence_locked(output, start_ns);
+        }
+        
+        // Sinks that never block are paced by the clock, a little ahead of
+        // it, and so is silence discarded while the device is suspended
+        bool gated = output->power_state == POWER_STATE_SUSPENDED;
+        if (!output->backend->paced || gated) {
+            if (start_ns + SINK_LEAD_NS < output->sink_due_ns) {
+                uint64_t wait_ns = output->sink_due_ns - start_ns - SINK_LEAD_NS;
+                pthread_mutex_unlock(&output->mutex);
+                usleep(wait_ns / 1000);
+                continue;
+            }
+            if (start_ns > output->sink_due_ns + SINK_RESYNC_NS) {
+                output->sink_due_ns = start_ns;
+            }
+        }
+        
+        long frames_written = (long)(length / frame_bytes);
+        if (!gated) {
+            frames_written = output->backend->write(output->sink, output->playout_ring + offset, length / frame_bytes);
+            stats_record(STATS_STAGE_ALSA_WRITE, start_ns);
+        }
+        if (sound && output->wake_start_ns != 0 && frames_written > 0) {
+            static const stats_stage_t wake_stages[POWER_STATE_COUNT] = {
+                STATS_STAGE_WAKE_IDLE, STATS_STAGE_WAKE_IDLE,
+                STATS_STAGE_WAKE_SUSPENDED, STATS_STAGE_WAKE_CLOSED
+            };
+            stats_record(wake_stages[output->wake_from], output->wake_start_ns);
+            output->wake_start_ns = 0;
+        }
+        if (frames_written > 0) {
+            output->playout_read += frames_written * frame_bytes;
+            output->sink_due_ns += (uint64_t)frames_written * 1000000000ULL / output->current_config.sample_rate;
+        }
+        stats_set_gauge(STATS_GAUGE_RING_FILL, (uint32_t)(output->playout_write - output->playout_read));
+        pthread_mutex_unlock(&output->mutex);
+        
+        if (frames_written < 0) {
+            usleep(PLAYOUT_IDLE_US);
+        }
+    }
+    
+    return NULL;
+}
+
+int audio_output_start(audio_output_t *output) {
+    // Reaps a playout thread that closed the output after lingering
+    if (!audio_output_is_running(output)) {
+        audio_output_stop(output);
+    }
+    
+    pthread_mutex_lock(&output->mutex);
+    
+    if (output->is_running) {
+        pthread_mutex_unlock(&output->mutex);
         return 0;
     }
     
-    if (pcm_handle) {
-        snd_pcm_drain(pcm_handle);
-        snd_pcm_close(pcm_handle);
-        pcm_handle = NULL;
+    // Time to first sound from a closed device includes the open
+    uint64_t open_ns = stats_now();
+    power_gate_get_config(&output->gate_config);
+    const audio_backend_ops_t *ops = find_backend(output->current_config.backend);
+    if (!ops || ops->open(&output->sink, &output->current_config, output->buffer_size) != 0) {
+        pthread_mutex_unlock(&output->mutex);
+        return -1;
+    }
+    output->backend = ops;
+    output->sink_due_ns = 0;
+    output->audio_end = output->playout_write;
+    output->had_audio = false;
+    output->lingering = false;
+    output->dry_since_ns = 0;
+    output->fade_in_left = 0;
+    output->wake_start_ns = open_ns;
+    output->wake_from = POWER_STATE_CLOSED;
+    output->last_sound_ns = open_ns;
+    set_power_state_locked(output, POWER_STATE_IDLE);
+    
+    output->is_running = true;
+    
+    output->playout_running = true;
+    output->playout_joinable = true;
+    if (pthread_create(&output->playout_thread, thread_policy_attr(), playout_thread_func, output) != 0) {
+        syslog(LOG_ERR, "Failed to create playout thread");
+        output->playout_running = false;
+        output->playout_joinable = false;
+        output->is_running = false;
+        output->backend->close(output->sink);
+        output->backend = NULL;
+        set_power_state_locked(output, POWER_STATE_CLOSED);
+        pthread_mutex_unlock(&output->mutex);
+        return -1;
+    }
+    
+    pthread_mutex_unlock(&output->mutex);
+    
+    syslog(LOG_INFO, "Audio output started (%s)", output->backend->name);
+    return 0;
+}
+
+int audio_output_stop(audio_output_t *output) {
+    pthread_mutex_lock(&output->mutex);
+    bool join = output->playout_joinable;
+    output->playout_joinable = false;
+    output->playout_running = false;
+    pthread_mutex_unlock(&output->mutex);
+    
+    if (join) {
+        pthread_join(output->playout_thread, NULL);
+    }
+    
+    pthread_mutex_lock(&output->mutex);
+    
+    if (!output->is_running) {
+        pthread_mutex_unlock(&output->mutex);
+        return 0;
     }
     
-    is_running = false;
+    if (output->backend) {
+        output->backend->drain(output->sink);
+        output->backend->close(output->sink);
+        output->backend = NULL;
+    }
     
-    pthread_mutex_unlock(&audio_mutex);
+    output->is_running = false;
+    output->lingering = false;
+    set_power_state_locked(output, POWER_STATE_CLOSED);
+    
+    pthread_mutex_unlock(&output->mutex);
     
     syslog(LOG_INFO, "Audio output stopped");
     return 0;
 }
 
-int audio_output_write(const uint8_t *data, size_t length) {
+int audio_output_write(audio_output_t *output, const uint8_t *data, size_t length) {
     if (!data || length == 0) {
         return -1;
     }
     
-    pthread_mutex_lock(&audio_mutex);
+    pthread_mutex_lock(&output->mutex);
     
-    if (!is_running || !pcm_handle) {
-        pthread_mutex_unlock(&audio_mutex);
+    if (!output->is_running || !output->backend) {
+        pthread_mutex_unlock(&output->mutex);
         return -1;
     }
     
-    // Write to ALSA
-    snd_pcm_sframes_t frames_written = snd_pcm_writei(pcm_handle, data, 
-                                                      length / (current_config.channels * current_config.bits_per_sample / 8));
+    uint64_t start_ns = stats_now();
+    long frames_written = output->backend->write(output->sink, data, length / frame_bytes_locked(output));
+    stats_record(STATS_STAGE_ALSA_WRITE, start_ns);
     
     if (frames_written < 0) {
-        // Handle underrun
-        if (frames_written == -EPIPE) {
-            syslog(LOG_WARNING, "PCM underrun occurred");
-            snd_pcm_prepare(pcm_handle);
-        } else {
-            syslog(LOG_ERR, "PCM write error: %s", snd_strerror(frames_written));
-            pthread_mutex_unlock(&audio_mutex);
-            return -1;
-        }
+        pthread_mutex_unlock(&output->mutex);
+        return -1;
     }
     
-    pthread_mutex_unlock(&audio_mutex);
+    pthread_mutex_unlock(&output->mutex);
     return 0;
 }
 
-int audio_output_set_volume(float volume) {
+// Reported in dB * 100 so the volume map never touches the mixer itself
+static long mixer_quantize(long db100, long *raw, void *userdata) {
+    snd_mixer_elem_t *elem = userdata;
+    long played = db100;
+    if (snd_mixer_selem_ask_playback_dB_vol(elem, db100, 1, raw) < 0 ||
+        snd_mixer_selem_ask_playback_vol_dB(elem, *raw, &played) < 0) {
+        return db100;
+    }
+    return played;
+}
+
+// Opens the Master control once and hands its dB steps to the volume map.
+// An output that finds the control owned by another zone uses software gain.
+static snd_mixer_elem_t* mixer_open_locked(audio_output_t *output) {
+    if (output->mixer_elem || output->mixer_failed) {
+        return output->mixer_elem;
+    }
+    
+    output->mixer_failed = true;
+    pthread_mutex_lock(&mixer_mutex);
+    if (mixer_owner) {
+        pthread_mutex_unlock(&mixer_mutex);
+        syslog(LOG_INFO, "Master control is used by another output, using software volume");
+        return NULL;
+    }
+    
+    snd_mixer_selem_id_t *sid;
+    if (snd_mixer_open(&output->mixer_handle, 0) < 0) {
+        output->mixer_handle = NULL;
+        pthread_mutex_unlock(&mixer_mutex);
+        return NULL;
+    }
+    if (snd_mixer_attach(output->mixer_handle, "default") < 0 ||
+        snd_mixer_selem_register(output->mixer_handle, NULL, NULL) < 0 ||
+        snd_mixer_load(output->mixer_handle) < 0) {
+        snd_mixer_close(output->mixer_handle);
+        output->mixer_handle = NULL;
+        pthread_mutex_unlock(&mixer_mutex);
+        return NULL;
+    }
+    
+    snd_mixer_selem_id_alloca(&sid);
+    snd_mixer_selem_id_set_index(sid, 0);
+    snd_mixer_selem_id_set_name(sid, "Master");
+    snd_mixer_elem_t *elem = snd_mixer_find_selem(output->mixer_handle, sid);
+    
+    long min_db100, max_db100;
+    if (!elem || snd_mixer_selem_get_playback_dB_range(elem, &min_db100, &max_db100) < 0 ||
+        volume_map_set_mixer(min_db100, max_db100, mixer_quantize, elem) < 0) {
+        pthread_mutex_unlock(&mixer_mutex);
+        syslog(LOG_WARNING, "No Master control with a dB scale, using software volume");
+        snd_mixer_close(output->mixer_handle);
+        output->mixer_handle = NULL;
+        return NULL;
+    }
+    
+    mixer_owner = output;
+    pthread_mutex_unlock(&mixer_mutex);
+    output->mixer_elem = elem;
+    output->mixer_failed = false;
+    return output->mixer_elem;
+}
+
+int audio_output_set_volume(audio_output_t *output, float volume) {
     if (volume < 0.0f || volume > 1.0f) {
         return -1;
     }
     
-    pthread_mutex_lock(&audio_mutex);
+    uint64_t start_ns = stats_now();
+    pthread_mutex_lock(&output->mutex);
     
-    if (current_config.use_hw_volume && pcm_handle) {
-        // Try to use hardware volume control
-        snd_mixer_t *mixer;
-        snd_mixer_elem_t *elem;
-        snd_mixer_selem_id_t *sid;
-        
-        if (snd_mixer_open(&mixer, 0) == 0) {
-            if (snd_mixer_attach(mixer, "default") == 0) {
-                if (snd_mixer_selem_register(mixer, NULL, NULL) == 0) {
-                    if (snd_mixer_load(mixer) == 0) {
-                        snd_mixer_selem_id_alloca(&sid);
-                        snd_mixer_selem_id_set_index(sid, 0);
-                        snd_mixer_selem_id_set_name(sid, "Master");
-                        
-                        elem = snd_mixer_find_selem(mixer, sid);
-                        if (elem) {
-                            long min, max;
-                            snd_mixer_selem_get_playback_volume_range(elem, &min, &max);
-                            long vol = min + (long)((max - min) * volume);
-                            snd_mixer_selem_set_playback_volume_all(elem, vol);
-                        }
-                    }
-                }
-            }
-            snd_mixer_close(mixer);
-        }
+    if (output->current_config.use_hw_volume) {
+        mixer_open_locked(output);
     }
     
-    pthread_mutex_unlock(&audio_mutex);
+    // Everything was worked out when the tables were built
+    volume_map_entry_t entry;
+    if (volume_map_lookup(volume, &entry) < 0) {
+        pthread_mutex_unlock(&output->mutex);
+        return -1;
+    }
+    // Only the output that attached the mixer splits attenuation with it
+    uint32_t gain = entry.full_gain;
+    if (entry.use_mixer && output->mixer_elem) {
+        snd_mixer_selem_set_playback_volume_all(output->mixer_elem, entry.mixer_raw);
+        gain = entry.gain;
+    }
+    // Software gain glides to the new level, over the time until the next
+    // change is due when updates are rate limited
+    uint32_t ramp_frames = (uint32_t)((uint64_t)output->current_config.sample_rate * output->gain_ramp_ms / 1000);
+    if (ramp_frames < FADE_FRAMES) {
+        ramp_frames = FADE_FRAMES;
+    }
+    uint32_t current = output->soft_gain;
+    output->gain_target = gain;
+    output->gain_step = (current > gain ? current - gain : gain - current) / ramp_frames + 1;
+    output->volume_position = volume;
+    
+    pthread_mutex_unlock(&output->mutex);
+    stats_record(STATS_STAGE_VOLUME, start_ns);
     return 0;
 }
 
-float audio_output_get_volume(void) {
-    pthread_mutex_lock(&audio_mutex);
-    
-    float volume = 0.5f; // Default volume
+// The mixer is left at full scale when detached, so software gain has the
+// whole range. Either way the next volume change moves the attenuation.
+int audio_output_set_hw_volume(audio_output_t *output, bool enable) {
+    pthread_mutex_lock(&output->mutex);
     
-    if (current_config.use_hw_volume && pcm_handle) {
-        snd_mixer_t *mixer;
-        snd_mixer_elem_t *elem;
-        snd_mixer_selem_id_t *sid;
-        
-        if (snd_mixer_open(&mixer, 0) == 0) {
-            if (snd_mixer_attach(mixer, "default") == 0) {
-                if (snd_mixer_selem_register(mixer, NULL, NULL) == 0) {
-                    if (snd_mixer_load(mixer) == 0) {
-                        snd_mixer_selem_id_alloca(&sid);
-                        snd_mixer_selem_id_set_index(sid, 0);
-                        snd_mixer_selem_id_set_name(sid, "Master");
-                        
-                        elem = snd_mixer_find_selem(mixer, sid);
-                        if (elem) {
-                            long min, max, vol;
-                            snd_mixer_selem_get_playback_volume_range(elem, &min, &max);
-                            snd_mixer_selem_get_playback_volume(elem, SND_MIXER_SCHN_FRONT_LEFT, &vol);
-                            volume = (float)(vol - min) / (float)(max - min);
-                        }
-                    }
-                }
-            }
-            snd_mixer_close(mixer);
+    output->current_config.use_hw_volume = enable;
+    output->mixer_failed = false;
+    if (!enable && output->mixer_handle) {
+        long min, max;
+        if (output->mixer_elem && snd_mixer_selem_get_playback_volume_range(output->mixer_elem, &min, &max) == 0) {
+            snd_mixer_selem_set_playback_volume_all(output->mixer_elem, max);
         }
+        mixer_close_locked(output);
     }
     
-    pthread_mutex_unlock(&audio_mutex);
+    pthread_mutex_unlock(&output->mutex);
+    return 0;
+}
+
+float audio_output_get_volume(audio_output_t *output) {
+    pthread_mutex_lock(&output->mutex);
+    float volume = output->volume_position;
+    pthread_mutex_unlock(&output->mutex);
     return volume;
 }
 
-bool audio_output_is_running(void) {
-    pthread_mutex_lock(&audio_mutex);
-    bool running = is_running;
-    pthread_mutex_unlock(&audio_mutex);
+int audio_output_set_volume_ramp(audio_output_t *output, uint32_t ms) {
+    pthread_mutex_lock(&output->mutex);
+    output->gain_ramp_ms = ms;
+    pthread_mutex_unlock(&output->mutex);
+    return 0;
+}
+
+bool audio_output_is_running(audio_output_t *output) {
+    pthread_mutex_lock(&output->mutex);
+    bool running = output->is_running;
+    pthread_mutex_unlock(&output->mutex);
     return running;
 }
 
-int audio_output_set_buffer_size(size_t size) {
+int audio_output_set_buffer_size(audio_output_t *output, size_t size) {
     if (size < 1024 || size > 65536) {
         return -1;
     }
     
-    pthread_mutex_lock(&audio_mutex);
+    pthread_mutex_lock(&output->mutex);
+    output->buffer_size = size;
+    pthread_mutex_unlock(&output->mutex);
+    return 0;
+}
+
+size_t audio_output_get_buffer_size(audio_output_t *output) {
+    pthread_mutex_lock(&output->mutex);
+    size_t size = output->buffer_size;
+    pthread_mutex_unlock(&output->mutex);
+    return size;
+}
+
+size_t audio_output_get_available_space(audio_output_t *output) {
+    pthread_mutex_lock(&output->mutex);
+    size_t available = PLAYOUT_RING_SIZE - (output->playout_write - output->playout_read);
+    pthread_mutex_unlock(&output->mutex);
+    return available;
+}
+
+int audio_output_set_source(audio_output_t *output, audio_source_callback_t source, void *userdata) {
+    pthread_mutex_lock(&output->mutex);
+    output->playout_source = source;
+    output->playout_userdata = userdata;
+    if (source) {
+        output->lingering = false;
+    }
+    pthread_mutex_unlock(&output->mutex);
+    return 0;
+}
+
+int audio_output_resume(audio_output_t *output, const audio_config_t *config,
+                        audio_source_callback_t source, void *userdata) {
+    if (!config) {
+        return -1;
+    }
     
-    if (audio_buffer) {
-        free(audio_buffer);
+    pthread_mutex_lock(&output->mutex);
+    bool same = output->is_running && output->backend &&
+                config->sample_rate == output->current_config.sample_rate &&
+                config->channels == output->current_config.channels &&
+                config->bits_per_sample == output->current_config.bits_per_sample;
+    if (same) {
+        output->playout_source = source;
+        output->playout_userdata = userdata;
+        output->lingering = false;
     }
+    pthread_mutex_unlock(&output->mutex);
     
-    buffer_size = size;
-    audio_buffer = malloc(buffer_size);
-    if (!audio_buffer) {
-        buffer_size = DEFAULT_BUFFER_SIZE;
-        audio_buffer = malloc(buffer_size);
-        if (!audio_buffer) {
-            pthread_mutex_unlock(&audio_mutex);
-            return -1;
-        }
+    return same ? 0 : -1;
+}
+
+int audio_output_linger(audio_output_t *output) {
+    pthread_mutex_lock(&output->mutex);
+    output->playout_source = NULL;
+    output->playout_userdata = NULL;
+    if (output->is_running) {
+        output->lingering = true;
+        output->linger_deadline_ns = stats_now() + AUDIO_OUTPUT_LINGER_MS * 1000000ULL;
+    }
+    pthread_mutex_unlock(&output->mutex);
+    return 0;
+}
+
+uint8_t* audio_output_reserve(audio_output_t *output, size_t length, uint32_t *generation) {
+    pthread_mutex_lock(&output->mutex);
+    
+    uint8_t *region = NULL;
+    if (output->playout_ring && length <= PLAYOUT_RING_SLACK &&
+        length <= PLAYOUT_RING_SIZE - (output->playout_write - output->playout_read)) {
+        region = output->playout_ring + output->playout_write % PLAYOUT_RING_SIZE;
+        *generation = output->flush_generation;
+    }
+    
+    pthread_mutex_unlock(&output->mutex);
+    return region;
+}
+
+int audio_output_commit(audio_output_t *output, size_t length, uint32_t generation) {
+    pthread_mutex_lock(&output->mutex);
+    
+    // Audio decoded from before a flush must not land behind its fade-out
+    if (generation != output->flush_generation) {
+        pthread_mutex_unlock(&output->mutex);
+        return -1;
     }
+    if (!output->playout_ring || length > PLAYOUT_RING_SLACK ||
+        length > PLAYOUT_RING_SIZE - (output->playout_write - output->playout_read)) {
+        pthread_mutex_unlock(&output->mutex);
+        return -1;
+    }
+    
+    size_t start = output->playout_write;
+    advance_write_locked(output, length);
     
-    buffer_write_pos = 0;
-    buffer_read_pos = 0;
+    // Audio after a flush ramps up from the faded-out tail
+    size_t frame_bytes = frame_bytes_locked(output);
+    if (output->fade_in_left > 0 && output->current_config.bits_per_sample == 16) {
+        size_t frames = length / frame_bytes < output->fade_in_left ? length / frame_bytes : output->fade_in_left;
+        fade_locked(output, start, frames, FADE_FRAMES - output->fade_in_left, FADE_FRAMES, true);
+        output->fade_in_left -= (uint32_t)frames;
+    }
+    output->audio_end = output->playout_write;
+    output->had_audio = true;
+    if (output->dry_since_ns != 0) {
+        stats_record(STATS_STAGE_GAP, output->dry_since_ns);
+        output->dry_since_ns = 0;
+    }
     
-    pthread_mutex_unlock(&audio_mutex);
+    pthread_mutex_unlock(&output->mutex);
     return 0;
 }
 
-size_t audio_output_get_buffer_size(void) {
-    pthread_mutex_lock(&audio_mutex);
-    size_t size = buffer_size;
-    pthread_mutex_unlock(&audio_mutex);
-    return size;
+size_t audio_output_get_buffered(audio_output_t *output) {
+    pthread_mutex_lock(&output->mutex);
+    // Silence played after the end of the stream moves read past audio_end
+    ssize_t buffered = (ssize_t)(output->audio_end - output->playout_read);
+    pthread_mutex_unlock(&output->mutex);
+    return buffered > 0 ? (size_t)buffered : 0;
 }
 
-size_t audio_output_get_available_space(void) {
-    pthread_mutex_lock(&audio_mutex);
-    size_t available = buffer_size - ((buffer_write_pos - buffer_read_pos) % buffer_size);
-    pthread_mutex_unlock(&audio_mutex);
-    return available;
+void audio_output_flush(audio_output_t *output) {
+    pthread_mutex_lock(&output->mutex);
+    
+    // The device keeps running: the next few ms of old audio fade out, the
+    // rest is dropped and whatever comes next fades in
+    size_t frame_bytes = frame_bytes_locked(output);
+    size_t frames = (output->playout_write - output->playout_read) / frame_bytes;
+    if (frames > FADE_FRAMES) {
+        frames = FADE_FRAMES;
+    }
+    if (output->current_config.bits_per_sample != 16) {
+        frames = 0;
+    } else {
+        if (frames > 0) {
+            fade_locked(output, output->playout_read, frames, 0, (uint32_t)frames, false);
+        }
+        output->fade_in_left = output->had_audio ? FADE_FRAMES : 0;
+    }
+    output->playout_write = output->playout_read + frames * frame_bytes;
+    output->audio_end = output->playout_write;
+    output->flush_generation++;
+    if (output->gain_pos > output->playout_write) {
+        output->gain_pos = output->playout_write;
+    }
+    
+    pthread_mutex_unlock(&output->mutex);
 }
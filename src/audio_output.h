@@ -2,31 +2,81 @@
 #define AUDIO_OUTPUT_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdbool.h>
 
+// Time an idle output stays open for the next track before it is closed
+#define AUDIO_OUTPUT_LINGER_MS 3000
+
+// Device name that lets the backend choose, ALSA probes for a direct hw: path
+#define AUDIO_OUTPUT_DEVICE_AUTO "auto"
+
 // Audio output configuration
 typedef struct {
     uint32_t sample_rate;
     uint8_t channels;
     uint8_t bits_per_sample;
-    const char *device_name;
+    const char *backend;            // "alsa", "pipe" or "shm", NULL for alsa
+    const char *device_name;        // PCM name, pipe path ("-" for stdout), shm name or auto
     bool use_hw_volume;
 } audio_config_t;
 
+// Output backend, only the playout thread writes to it. open hands back the
+// state of the opened device, which every other call takes. write returns
+// the frames consumed, including any the backend dropped, or -1 on error.
+typedef struct {
+    const char *name;
+    bool paced;                     // write blocks until the device takes the audio
+    int (*open)(void **sink, const audio_config_t *config, size_t buffer_bytes);
+    long (*write)(void *sink, const uint8_t *data, size_t frames);
+    void (*drop)(void *sink);
+    void (*drain)(void *sink);
+    void (*close)(void *sink);      // frees the state
+    int (*pause)(void *sink, bool enable);  // stops the device clock while silent, NULL if unsupported
+    void (*release)(const audio_config_t *config);  // what outlives close, at destroy, NULL if nothing
+} audio_backend_ops_t;
+
+// Playout source, called from the playout thread whenever the ring runs
+// low. Returns the frames it added, 0 when it has nothing buffered.
+typedef int (*audio_source_callback_t)(void *userdata);
+
+// One device with its playout ring and thread, each zone has its own.
+// The mixer used for hardware volume is shared: the first output to open it
+// owns it until it closes it, the others use software gain meanwhile.
+typedef struct audio_output audio_output_t;
+
 // Audio output functions
-int audio_output_init(void);
-int audio_output_cleanup(void);
-int audio_output_configure(const audio_config_t *config);
-int audio_output_start(void);
-int audio_output_stop(void);
-int audio_output_write(const uint8_t *data, size_t length);
-int audio_output_set_volume(float volume);
-float audio_output_get_volume(void);
-bool audio_output_is_running(void);
-
-// Buffer management
-int audio_output_set_buffer_size(size_t size);
-size_t audio_output_get_buffer_size(void);
-size_t audio_output_get_available_space(void);
+audio_output_t* audio_output_create(void);
+void audio_output_destroy(audio_output_t *output);
+int audio_output_configure(audio_output_t *output, const audio_config_t *config);
+int audio_output_get_config(audio_output_t *output, audio_config_t *config);
+int audio_output_start(audio_output_t *output);
+int audio_output_stop(audio_output_t *output);
+int audio_output_write(audio_output_t *output, const uint8_t *data, size_t length);
+int audio_output_set_volume(audio_output_t *output, float volume);
+float audio_output_get_volume(audio_output_t *output);
+int audio_output_set_volume_ramp(audio_output_t *output, uint32_t ms);
+int audio_output_set_hw_volume(audio_output_t *output, bool enable);
+bool audio_output_is_running(audio_output_t *output);
+
+// Buffer management, a new size is used when the device next opens
+int audio_output_set_buffer_size(audio_output_t *output, size_t size);
+size_t audio_output_get_buffer_size(audio_output_t *output);
+size_t audio_output_get_available_space(audio_output_t *output);
+
+// Playout ring: sources decode straight into reserved ring space
+int audio_output_set_source(audio_output_t *output, audio_source_callback_t source, void *userdata);
+
+// Gapless handover: resume switches to source on the open device if the
+// format is unchanged, linger detaches the source and keeps the device fed
+// with silence for AUDIO_OUTPUT_LINGER_MS
+int audio_output_resume(audio_output_t *output, const audio_config_t *config,
+                        audio_source_callback_t source, void *userdata);
+int audio_output_linger(audio_output_t *output);
+// A commit fails if the output was flushed since its reserve
+uint8_t* audio_output_reserve(audio_output_t *output, size_t length, uint32_t *generation);
+int audio_output_commit(audio_output_t *output, size_t length, uint32_t generation);
+size_t audio_output_get_buffered(audio_output_t *output);   // real audio, not silence fill
+void audio_output_flush(audio_output_t *output);            // fades out instead of stopping the device
 
 #endif // AUDIO_OUTPUT_H
@@ -0,0 +1,222 @@
+#include "audio_pipeline.h"
+#include "audio_output.h"
+#include "buffered_audio.h"
+#include "dsp_chain.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#define PIPELINE_MAX_PACKET 8192
+
+struct audio_pipeline {
+    audio_output_t *output;
+    dsp_chain_t *dsp;
+    buffered_stream_t *stream;
+    pthread_mutex_t mutex;
+    audio_decoder_t *decoder;
+    audio_format_t current_format;
+    size_t frame_bytes;
+    session_arena_t *current_arena;
+    uint8_t *packet;
+    audio_config_t output_config;   // stream format for the output
+    bool play_requested;            // RECORD seen, the output should run
+};
+
+audio_pipeline_t* audio_pipeline_create(audio_output_t *output, dsp_chain_t *dsp, buffered_stream_t *stream) {
+    if (!output || !dsp || !stream) {
+        return NULL;
+    }
+    
+    audio_pipeline_t *pipeline = calloc(1, sizeof(audio_pipeline_t));
+    if (!pipeline) {
+        return NULL;
+    }
+    pipeline->output = output;
+    pipeline->dsp = dsp;
+    pipeline->stream = stream;
+    pthread_mutex_init(&pipeline->mutex, NULL);
+    return pipeline;
+}
+
+void audio_pipeline_destroy(audio_pipeline_t *pipeline) {
+    if (!pipeline) {
+        return;
+    }
+    
+    audio_pipeline_stop(pipeline);
+    pthread_mutex_destroy(&pipeline->mutex);
+    free(pipeline);
+}
+
+// Playout source: one packet from the buffered stream per call
+static int pull_packet(void *userdata) {
+    audio_pipeline_t *pipeline = userdata;
+    
+    pthread_mutex_lock(&pipeline->mutex);
+    if (!pipeline->decoder) {
+        pthread_mutex_unlock(&pipeline->mutex);
+        return 0;
+    }
+    
+    // Check for room before taking a packet off the stream
+    size_t max_frames = pipeline->current_format.frames_per_packet * 2;
+    if (max_frames > AUDIO_DECODER_MAX_FRAMES) {
+        max_frames = AUDIO_DECODER_MAX_FRAMES;
+    }
+    uint32_t generation;
+    uint8_t *region = audio_output_reserve(pipeline->output, max_frames * pipeline->frame_bytes, &generation);
+    if (!region) {
+        pthread_mutex_unlock(&pipeline->mutex);
+        return 0;
+    }
+    
+    uint32_t timestamp;
+    int length = buffered_audio_read(pipeline->stream, pipeline->packet, PIPELINE_MAX_PACKET, &timestamp);
+    if (length <= 0) {
+        pthread_mutex_unlock(&pipeline->mutex);
+        return 0;
+    }
+    
+    int frames = audio_decoder_decode(pipeline->decoder, pipeline->packet, length, (int16_t *)region, max_frames);
+    if (frames > 0) {
+        dsp_chain_process(pipeline->dsp, (int16_t *)region, frames);
+        audio_output_commit(pipeline->output, frames * pipeline->frame_bytes, generation);
+    }
+    
+    pthread_mutex_unlock(&pipeline->mutex);
+    
+    // A bad packet is skipped, not treated as the end of the stream
+    return frames < 0 ? 1 : frames;
+}
+
+// A SETUP that is never followed by RECORD leaves the device closed
+static int open_output(audio_pipeline_t *pipeline) {
+    pthread_mutex_lock(&pipeline->mutex);
+    audio_config_t config = pipeline->output_config;
+    audio_codec_t codec = pipeline->current_format.codec;
+    pthread_mutex_unlock(&pipeline->mutex);
+    
+    // An open device in the same format carries straight on into this stream
+    if (audio_output_resume(pipeline->output, &config, pull_packet, pipeline) == 0) {
+        syslog(LOG_INFO, "Audio output kept open for %s stream", audio_codec_name(codec));
+        return 0;
+    }
+    
+    audio_output_stop(pipeline->output);
+    audio_output_configure(pipeline->output, &config);
+    audio_output_set_source(pipeline->output, pull_packet, pipeline);
+    if (audio_output_start(pipeline->output) != 0) {
+        audio_pipeline_stop(pipeline);
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Drops the current stream. Start keeps a RECORD that came before its
+// SETUP, stop forgets it.
+static void release_stream(audio_pipeline_t *pipeline, bool keep_play) {
+    audio_output_set_source(pipeline->output, NULL, NULL);
+    
+    pthread_mutex_lock(&pipeline->mutex);
+    audio_decoder_t *old_decoder = pipeline->decoder;
+    pipeline->decoder = NULL;
+    pipeline->play_requested = keep_play && pipeline->play_requested;
+    pipeline->packet = NULL;
+    pipeline->current_arena = NULL;
+    pthread_mutex_unlock(&pipeline->mutex);
+    
+    // The device stays open a little longer in case another track follows
+    if (old_decoder) {
+        audio_output_linger(pipeline->output);
+        audio_decoder_destroy(old_decoder);
+    }
+}
+
+int audio_pipeline_start(audio_pipeline_t *pipeline, const audio_format_t *format, session_arena_t *arena) {
+    if (!format || !arena) {
+        return -1;
+    }
+    
+    release_stream(pipeline, true);
+    
+    uint8_t *new_packet = session_arena_alloc(arena, PIPELINE_MAX_PACKET);
+    audio_decoder_t *new_decoder = new_packet ? audio_decoder_create(format, arena) : NULL;
+    if (!new_decoder) {
+        return -1;
+    }
+    
+    // Decoders produce 16 bit samples at the stream rate
+    audio_config_t config;
+    audio_output_get_config(pipeline->output, &config);
+    config.sample_rate = format->sample_rate;
+    config.channels = format->channels;
+    config.bits_per_sample = 16;
+    
+    dsp_chain_set_format(pipeline->dsp, format->sample_rate, format->channels);
+    
+    pthread_mutex_lock(&pipeline->mutex);
+    pipeline->decoder = new_decoder;
+    pipeline->packet = new_packet;
+    pipeline->current_arena = arena;
+    pipeline->current_format = *format;
+    pipeline->frame_bytes = format->channels * sizeof(int16_t);
+    pipeline->output_config = config;
+    bool play = pipeline->play_requested;
+    pthread_mutex_unlock(&pipeline->mutex);
+    
+    // Senders that send RECORD before the stream SETUP are already playing
+    return play ? open_output(pipeline) : 0;
+}
+
+int audio_pipeline_play(audio_pipeline_t *pipeline) {
+    pthread_mutex_lock(&pipeline->mutex);
+    pipeline->play_requested = true;
+    bool prepared = pipeline->decoder != NULL;
+    pthread_mutex_unlock(&pipeline->mutex);
+    
+    return prepared ? open_output(pipeline) : 0;
+}
+
+int audio_pipeline_stop(audio_pipeline_t *pipeline) {
+    release_stream(pipeline, false);
+    return 0;
+}
+
+// Stops the pipeline if it runs on arena, so the arena can be freed
+bool audio_pipeline_detach(audio_pipeline_t *pipeline, const session_arena_t *arena) {
+    pthread_mutex_lock(&pipeline->mutex);
+    bool attached = arena && pipeline->current_arena == arena;
+    pthread_mutex_unlock(&pipeline->mutex);
+    
+    if (attached) {
+        audio_pipeline_stop(pipeline);
+    }
+    return attached;
+}
+
+bool audio_pipeline_is_running(audio_pipeline_t *pipeline) {
+    pthread_mutex_lock(&pipeline->mutex);
+    bool running = pipeline->decoder != NULL;
+    pthread_mutex_unlock(&pipeline->mutex);
+    return running;
+}
+
+void audio_pipeline_flush(audio_pipeline_t *pipeline) {
+    pthread_mutex_lock(&pipeline->mutex);
+    if (pipeline->decoder) {
+        audio_decoder_reset(pipeline->decoder);
+    }
+    // Under the mutex, so pull_packet cannot commit pre-flush audio after it
+    audio_output_flush(pipeline->output);
+    pthread_mutex_unlock(&pipeline->mutex);
+}
+
+int audio_pipeline_get_decoder_stats(audio_pipeline_t *pipeline, audio_decoder_stats_t *stats) {
+    pthread_mutex_lock(&pipeline->mutex);
+    int result = audio_decoder_get_stats(pipeline->decoder, stats);
+    pthread_mutex_unlock(&pipeline->mutex);
+    return result;
+}
@@ -0,0 +1,28 @@
+#ifndef AUDIO_PIPELINE_H
+#define AUDIO_PIPELINE_H
+
+#include <stdbool.h>
+#include "audio_decoder.h"
+#include "audio_output.h"
+#include "buffered_audio.h"
+#include "dsp_chain.h"
+#include "session_arena.h"
+
+// Buffered stream -> decoder -> DSP -> playout ring of one zone. The pipeline
+// does not own the stages it is created with.
+typedef struct audio_pipeline audio_pipeline_t;
+
+audio_pipeline_t* audio_pipeline_create(audio_output_t *output, dsp_chain_t *dsp, buffered_stream_t *stream);
+void audio_pipeline_destroy(audio_pipeline_t *pipeline);
+
+// Per-stream state comes from arena. Start prepares the decoder at SETUP,
+// the output device opens on play at RECORD.
+int audio_pipeline_start(audio_pipeline_t *pipeline, const audio_format_t *format, session_arena_t *arena);
+int audio_pipeline_play(audio_pipeline_t *pipeline);
+int audio_pipeline_stop(audio_pipeline_t *pipeline);
+bool audio_pipeline_detach(audio_pipeline_t *pipeline, const session_arena_t *arena);
+bool audio_pipeline_is_running(audio_pipeline_t *pipeline);
+void audio_pipeline_flush(audio_pipeline_t *pipeline);
+int audio_pipeline_get_decoder_stats(audio_pipeline_t *pipeline, audio_decoder_stats_t *stats);
+
+#endif // AUDIO_PIPELINE_H
@@ -0,0 +1,383 @@
+#include "bplist.h"
+#include <string.h>
+
+#define BPLIST_HEADER "bplist00"
+#define BPLIST_HEADER_SIZE 8
+#define BPLIST_TRAILER_SIZE 32
+#define BPLIST_MAX_DEPTH 8
+#define BPLIST_MAX_VISITS 4096  // objects and keys looked at per lookup
+
+// Object type markers (high nibble)
+#define BPLIST_INT 0x1
+#define BPLIST_DATA 0x4
+#define BPLIST_ASCII 0x5
+#define BPLIST_UTF16 0x6
+#define BPLIST_ARRAY 0xA
+#define BPLIST_DICT 0xD
+
+typedef struct {
+    const uint8_t *data;
+    size_t length;
+    uint8_t offset_size;
+    uint8_t ref_size;
+    uint64_t object_count;
+    uint64_t top;
+    uint64_t table_offset;
+} bplist_t;
+
+typedef struct {
+    uint8_t type;
+    uint64_t count;
+    size_t content;
+} bplist_object_t;
+
+static uint64_t read_be(const uint8_t *data, size_t size) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; i++) {
+        value = (value << 8) | data[i];
+    }
+    return value;
+}
+
+static int open_plist(const uint8_t *data, size_t length, bplist_t *plist) {
+    if (!data || length < BPLIST_HEADER_SIZE + BPLIST_TRAILER_SIZE ||
+        memcmp(data, BPLIST_HEADER, BPLIST_HEADER_SIZE) != 0) {
+        return -1;
+    }
+    
+    const uint8_t *trailer = data + length - BPLIST_TRAILER_SIZE;
+    plist->data = data;
+    plist->length = length;
+    plist->offset_size = trailer[6];
+    plist->ref_size = trailer[7];
+    plist->object_count = read_be(trailer + 8, 8);
+    plist->top = read_be(trailer + 16, 8);
+    plist->table_offset = read_be(trailer + 24, 8);
+    
+    size_t table_space = length - BPLIST_TRAILER_SIZE;
+    if (plist->offset_size < 1 || plist->offset_size > 8 ||
+        plist->ref_size < 1 || plist->ref_size > 8 ||
+        plist->top >= plist->object_count ||
+        plist->table_offset < BPLIST_HEADER_SIZE || plist->table_offset > table_space ||
+        plist->object_count > (table_space - plist->table_offset) / plist->offset_size) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Locates an object and checks that its contents lie before the offset table
+static int read_object(const bplist_t *plist, uint64_t ref, bplist_object_t *object) {
+    if (ref >= plist->object_count) {
+        return -1;
+    }
+    
+    uint64_t offset = read_be(plist->data + plist->table_offset + ref * plist->offset_size,
+                              plist->offset_size);
+    if (offset < BPLIST_HEADER_SIZE || offset >= plist->table_offset) {
+        return -1;
+    }
+    
+    uint8_t marker = plist->data[offset];
+    size_t position = offset + 1;
+    object->type = marker >> 4;
+    object->count = marker & 0x0F;
+    
+    if (object->type == BPLIST_INT) {
+        object->count = (uint64_t)1 << object->count;
+    } else if (object->count == 0x0F) {
+        // Long lengths follow as an integer object
+        if (position >= plist->table_offset || (plist->data[position] >> 4) != BPLIST_INT) {
+            return -1;
+        }
+        size_t size = (size_t)1 << (plist->data[position] & 0x0F);
+        if (size > 8 || position + 1 + size > plist->table_offset) {
+            return -1;
+        }
+        object->count = read_be(plist->data + position + 1, size);
+        position += 1 + size;
+    }
+    object->content = position;
+    
+    uint64_t available = plist->table_offset - position;
+    uint64_t unit;
+    switch (object->type) {
+        case BPLIST_INT:
+        case BPLIST_DATA:
+        case BPLIST_ASCII:
+            unit = 1;
+            break;
+        case BPLIST_UTF16:
+            unit = 2;
+            break;
+        case BPLIST_ARRAY:
+            unit = plist->ref_size;
+            break;
+        case BPLIST_DICT:
+            unit = 2 * (uint64_t)plist->ref_size;
+            break;
+        default:
+            unit = 0;
+            break;
+    }
+    if (unit > 0 && object->count > available / unit) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+static uint64_t read_ref(const bplist_t *plist, const bplist_object_t *object, uint64_t index) {
+    return read_be(plist->data + object->content + index * plist->ref_size, plist->ref_size);
+}
+
+static bool key_matches(const bplist_t *plist, uint64_t ref, const char *key) {
+    bplist_object_t object;
+    size_t key_length = strlen(key);
+    
+    return read_object(plist, ref, &object) == 0 && object.type == BPLIST_ASCII &&
+           object.count == key_length &&
+           memcmp(plist->data + object.content, key, key_length) == 0;
+}
+
+// Depth-first search, keys of a dictionary are checked before its children.
+// Containers may share children or refer back to themselves, so every
+// object and key looked at costs one visit from budget, and running out
+// ends the whole lookup.
+static int find_value(const bplist_t *plist, uint64_t ref, const char *key, int depth,
+                      uint32_t *budget, bplist_object_t *value) {
+    bplist_object_t object;
+    
+    if (*budget == 0 || depth > BPLIST_MAX_DEPTH || read_object(plist, ref, &object) != 0) {
+        return -1;
+    }
+    (*budget)--;
+    
+    if (object.type == BPLIST_DICT) {
+        for (uint64_t i = 0; i < object.count; i++) {
+            if (*budget == 0) {
+                return -1;
+            }
+            (*budget)--;
+            if (key_matches(plist, read_ref(plist, &object, i), key)) {
+                return read_object(plist, read_ref(plist, &object, object.count + i), value);
+            }
+        }
+        for (uint64_t i = 0; i < object.count && *budget > 0; i++) {
+            if (find_value(plist, read_ref(plist, &object, object.count + i), key, depth + 1, budget, value) == 0) {
+                return 0;
+            }
+        }
+    } else if (object.type == BPLIST_ARRAY) {
+        for (uint64_t i = 0; i < object.count && *budget > 0; i++) {
+            if (find_value(plist, read_ref(plist, &object, i), key, depth + 1, budget, value) == 0) {
+                return 0;
+            }
+        }
+    }
+    
+    return -1;
+}
+
+static int lookup(const bplist_t *plist, const char *key, bplist_object_t *value) {
+    uint32_t budget = BPLIST_MAX_VISITS;
+    return find_value(plist, plist->top, key, 0, &budget, value);
+}
+
+bool bplist_is_valid(const uint8_t *data, size_t length) {
+    bplist_t plist;
+    bplist_object_t object;
+    
+    return open_plist(data, length, &plist) == 0 && read_object(&plist, plist.top, &object) == 0;
+}
+
+int bplist_get_int(const uint8_t *data, size_t length, const char *key, int64_t *value) {
+    bplist_t plist;
+    bplist_object_t object;
+    
+    if (!key || !value || open_plist(data, length, &plist) != 0 ||
+        lookup(&plist, key, &object) != 0 ||
+        object.type != BPLIST_INT || object.count > 8) {
+        return -1;
+    }
+    
+    *value = (int64_t)read_be(data + object.content, object.count);
+    return 0;
+}
+
+int bplist_get_data(const uint8_t *data, size_t length, const char *key,
+                    const uint8_t **value, size_t *value_length) {
+    bplist_t plist;
+    bplist_object_t object;
+    
+    if (!key || !value || !value_length || open_plist(data, length, &plist) != 0 ||
+        lookup(&plist, key, &object) != 0 || object.type != BPLIST_DATA) {
+        return -1;
+    }
+    
+    *value = data + object.content;
+    *value_length = object.count;
+    return 0;
+}
+
+// Writer
+static int append(bplist_writer_t *writer, const void *bytes, size_t length) {
+    if (writer->length > writer->size || length > writer->size - writer->length) {
+        return -1;
+    }
+    
+    memcpy(writer->data + writer->length, bytes, length);
+    writer->length += length;
+    return 0;
+}
+
+static int append_be(bplist_writer_t *writer, uint64_t value, size_t size) {
+    uint8_t bytes[8];
+    for (size_t i = 0; i < size; i++) {
+        bytes[i] = (uint8_t)(value >> (8 * (size - 1 - i)));
+    }
+    return append(writer, bytes, size);
+}
+
+static int append_marker(bplist_writer_t *writer, uint8_t type, size_t count) {
+    uint8_t marker = (uint8_t)(type << 4);
+    
+    if (count < 0x0F) {
+        marker |= (uint8_t)count;
+        return append(writer, &marker, 1);
+    }
+    
+    marker |= 0x0F;
+    uint8_t length_marker = (BPLIST_INT << 4) | 0x03;
+    if (append(writer, &marker, 1) != 0 || append(writer, &length_marker, 1) != 0) {
+        return -1;
+    }
+    return append_be(writer, count, 8);
+}
+
+static int begin_object(bplist_writer_t *writer) {
+    if (writer->count >= BPLIST_MAX_OBJECTS) {
+        return -1;
+    }
+    
+    writer->offsets[writer->count] = writer->length;
+    return 0;
+}
+
+static bool valid_refs(const bplist_writer_t *writer, const int *refs, int count) {
+    for (int i = 0; i < count; i++) {
+        if (refs[i] < 0 || refs[i] >= writer->count) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void bplist_writer_init(bplist_writer_t *writer, uint8_t *buffer, size_t size) {
+    writer->data = buffer;
+    writer->size = size;
+    writer->length = 0;
+    writer->count = 0;
+    
+    // A buffer too small for the header fails every later write
+    if (append(writer, BPLIST_HEADER, BPLIST_HEADER_SIZE) != 0) {
+        writer->length = BPLIST_HEADER_SIZE;
+    }
+}
+
+int bplist_write_int(bplist_writer_t *writer, int64_t value) {
+    uint8_t exponent;
+    
+    if (value < 0 || value > 0xFFFFFFFFLL) {
+        exponent = 3;
+    } else if (value > 0xFFFF) {
+        exponent = 2;
+    } else if (value > 0xFF) {
+        exponent = 1;
+    } else {
+        exponent = 0;
+    }
+    
+    uint8_t marker = (BPLIST_INT << 4) | exponent;
+    if (begin_object(writer) != 0 || append(writer, &marker, 1) != 0 ||
+        append_be(writer, (uint64_t)value, (size_t)1 << exponent) != 0) {
+        return -1;
+    }
+    return writer->count++;
+}
+
+int bplist_write_string(bplist_writer_t *writer, const char *value) {
+    size_t length = strlen(value);
+    
+    if (begin_object(writer) != 0 || append_marker(writer, BPLIST_ASCII, length) != 0 ||
+        append(writer, value, length) != 0) {
+        return -1;
+    }
+    return writer->count++;
+}
+
+int bplist_write_data(bplist_writer_t *writer, const uint8_t *value, size_t length) {
+    if (begin_object(writer) != 0 || append_marker(writer, BPLIST_DATA, length) != 0 ||
+        append(writer, value, length) != 0) {
+        return -1;
+    }
+    return writer->count++;
+}
+
+int bplist_write_array(bplist_writer_t *writer, const int *items, int count) {
+    if (count < 0 || !valid_refs(writer, items, count) ||
+        begin_object(writer) != 0 || append_marker(writer, BPLIST_ARRAY, count) != 0) {
+        return -1;
+    }
+    
+    for (int i = 0; i < count; i++) {
+        uint8_t ref = (uint8_t)items[i];
+        if (append(writer, &ref, 1) != 0) {
+            return -1;
+        }
+    }
+    return writer->count++;
+}
+
+int bplist_write_dict(bplist_writer_t *writer, const int *keys, const int *values, int count) {
+    if (count < 0 || !valid_refs(writer, keys, count) || !valid_refs(writer, values, count) ||
+        begin_object(writer) != 0 || append_marker(writer, BPLIST_DICT, count) != 0) {
+        return -1;
+    }
+    
+    for (int i = 0; i < 2 * count; i++) {
+        uint8_t ref = (uint8_t)(i < count ? keys[i] : values[i - count]);
+        if (append(writer, &ref, 1) != 0) {
+            return -1;
+        }
+    }
+    return writer->count++;
+}
+
+int bplist_writer_finish(bplist_writer_t *writer, int top, size_t *length) {
+    if (top < 0 || top >= writer->count || !length) {
+        return -1;
+    }
+    
+    size_t table_offset = writer->length;
+    uint8_t offset_size = table_offset <= 0xFF ? 1 : table_offset <= 0xFFFF ? 2 : 4;
+    for (int i = 0; i < writer->count; i++) {
+        if (append_be(writer, writer->offsets[i], offset_size) != 0) {
+            return -1;
+        }
+    }
+    
+    // Object references are a single byte, BPLIST_MAX_OBJECTS keeps them in range
+    uint8_t sizes[8] = {0};
+    sizes[6] = offset_size;
+    sizes[7] = 1;
+    if (append(writer, sizes, sizeof(sizes)) != 0 ||
+        append_be(writer, (uint64_t)writer->count, 8) != 0 ||
+        append_be(writer, (uint64_t)top, 8) != 0 ||
+        append_be(writer, table_offset, 8) != 0) {
+        return -1;
+    }
+    
+    *length = writer->length;
+    return 0;
+}
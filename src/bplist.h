@@ -0,0 +1,34 @@
+#ifndef BPLIST_H
+#define BPLIST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define BPLIST_MAX_OBJECTS 64
+
+// Lookup of the first value stored under key anywhere in the plist
+int bplist_get_int(const uint8_t *data, size_t length, const char *key, int64_t *value);
+int bplist_get_data(const uint8_t *data, size_t length, const char *key,
+                    const uint8_t **value, size_t *value_length);
+bool bplist_is_valid(const uint8_t *data, size_t length);
+
+// Writer for small replies. Children are written before their containers,
+// each call returns the object reference or -1 once the buffer is full.
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t length;
+    size_t offsets[BPLIST_MAX_OBJECTS];
+    int count;
+} bplist_writer_t;
+
+void bplist_writer_init(bplist_writer_t *writer, uint8_t *buffer, size_t size);
+int bplist_write_int(bplist_writer_t *writer, int64_t value);
+int bplist_write_string(bplist_writer_t *writer, const char *value);
+int bplist_write_data(bplist_writer_t *writer, const uint8_t *value, size_t length);
+int bplist_write_array(bplist_writer_t *writer, const int *items, int count);
+int bplist_write_dict(bplist_writer_t *writer, const int *keys, const int *values, int count);
+int bplist_writer_finish(bplist_writer_t *writer, int top, size_t *length);
+
+#endif // BPLIST_H
@@ -0,0 +1,665 @@
+#include "buffered_audio.h"
+#include "crypto_utils.h"
+#include "stats.h"
+#include "logger.h"
+#include "thread_policy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+// Each packet: 2 byte length (including itself), 12 byte RTP header,
+// ChaCha20-Poly1305 payload, 16 byte tag, 8 byte nonce
+#define PACKET_LENGTH_SIZE 2
+#define RTP_HEADER_SIZE 12
+#define PACKET_NONCE_SIZE 8
+#define PACKET_OVERHEAD (PACKET_LENGTH_SIZE + RTP_HEADER_SIZE + CHACHA20_POLY1305_TAG_SIZE + PACKET_NONCE_SIZE)
+#define AVERAGE_PACKET_SIZE 256
+#define SOCKET_RECEIVE_BUFFER (256 * 1024)
+#define POLL_INTERVAL_MS 100
+#define NO_PAGE -1
+
+typedef struct {
+    uint8_t *data;
+    size_t used;
+    uint32_t pending;   // indexed packets not yet read
+    int next;
+} page_t;
+
+typedef struct {
+    uint32_t timestamp;
+    uint32_t sequence;
+    int page;
+    uint16_t offset;
+    uint16_t length;
+    uint32_t arrival_us;    // wraps, only differences are used
+} packet_entry_t;
+
+// The page pool is shared by every stream, one lock covers it and them
+static pthread_mutex_t buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER;
+static size_t pool_size = 0;
+
+// Pages move between the free stack, a stream's sealed FIFO and its write page
+static page_t *pages = NULL;
+static int max_pages = 0;
+static int pages_allocated = 0;
+static int free_head = NO_PAGE;
+static int active_streams = 0;
+
+struct buffered_stream {
+    int sealed_head;
+    int sealed_tail;
+    int write_page;
+    size_t parse_offset;
+    
+    // Packets in arrival order, read and write only ever increase
+    packet_entry_t *packet_index;
+    size_t index_capacity;
+    size_t index_read;
+    size_t index_write;
+    
+    aead_session_t *stream_session;
+    int listen_fd;
+    int data_fd;
+    pthread_t receiver_thread;
+    bool receiver_running;
+    bool stream_active;
+    uint64_t bytes_received;
+    uint64_t packets_dropped;
+};
+
+int buffered_audio_init(size_t size) {
+    pthread_mutex_lock(&buffer_mutex);
+    
+    if (size < BUFFERED_AUDIO_MIN_POOL_SIZE) {
+        size = BUFFERED_AUDIO_MIN_POOL_SIZE;
+    }
+    
+    // Only page bookkeeping is allocated up front, audio pages on demand
+    max_pages = size / BUFFERED_AUDIO_PAGE_SIZE;
+    pages = calloc(max_pages, sizeof(page_t));
+    if (!pages) {
+        syslog(LOG_ERR, "Failed to allocate buffered audio pages");
+        pthread_mutex_unlock(&buffer_mutex);
+        return -1;
+    }
+    
+    pool_size = (size_t)max_pages * BUFFERED_AUDIO_PAGE_SIZE;
+    pages_allocated = 0;
+    free_head = NO_PAGE;
+    active_streams = 0;
+    
+    pthread_mutex_unlock(&buffer_mutex);
+    
+    syslog(LOG_INFO, "Buffered audio initialized (%zu KiB pool)", pool_size / 1024);
+    return 0;
+}
+
+// Every stream has been destroyed by now
+int buffered_audio_cleanup(void) {
+    pthread_mutex_lock(&buffer_mutex);
+    for (int i = 0; i < pages_allocated; i++) {
+        free(pages[i].data);
+    }
+    free(pages);
+    pages = NULL;
+    max_pages = 0;
+    pages_allocated = 0;
+    free_head = NO_PAGE;
+    pthread_mutex_unlock(&buffer_mutex);
+    
+    syslog(LOG_INFO, "Buffered audio cleaned up");
+    return 0;
+}
+
+buffered_stream_t* buffered_audio_create_stream(void) {
+    buffered_stream_t *stream = calloc(1, sizeof(buffered_stream_t));
+    if (!stream) {
+        syslog(LOG_ERR, "Failed to allocate buffered audio stream");
+        return NULL;
+    }
+    
+    stream->sealed_head = NO_PAGE;
+    stream->sealed_tail = NO_PAGE;
+    stream->write_page = NO_PAGE;
+    stream->listen_fd = -1;
+    stream->data_fd = -1;
+    return stream;
+}
+
+void buffered_audio_destroy_stream(buffered_stream_t *stream) {
+    if (!stream) {
+        return;
+    }
+    
+    buffered_audio_stop_stream(stream);
+    free(stream);
+}
+
+static uint32_t read_be32(const uint8_t *data) {
+    return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+static void push_free_page_locked(int page) {
+    pages[page].next = free_head;
+    free_head = page;
+    pthread_cond_broadcast(&space_cond);
+}
+
+// Waits for a page when the pool is at its cap, this is what throttles the sender
+static int take_page_locked(buffered_stream_t *stream) {
+    while (stream->receiver_running) {
+        int page = NO_PAGE;
+        if (free_head != NO_PAGE) {
+            page = free_head;
+            free_head = pages[page].next;
+        } else if (pages_allocated < max_pages) {
+            uint8_t *data = malloc(BUFFERED_AUDIO_PAGE_SIZE);
+            if (data) {
+                page = pages_allocated++;
+                pages[page].data = data;
+            }
+        }
+        
+        if (page != NO_PAGE) {
+            pages[page].used = 0;
+            pages[page].pending = 0;
+            pages[page].next = NO_PAGE;
+            return page;
+        }
+        pthread_cond_wait(&space_cond, &buffer_mutex);
+    }
+    
+    return NO_PAGE;
+}
+
+static void seal_page_locked(buffered_stream_t *stream, int page) {
+    if (pages[page].pending == 0) {
+        push_free_page_locked(page);
+        return;
+    }
+    
+    pages[page].next = NO_PAGE;
+    if (stream->sealed_tail != NO_PAGE) {
+        pages[stream->sealed_tail].next = page;
+    } else {
+        stream->sealed_head = page;
+    }
+    stream->sealed_tail = page;
+}
+
+// Pages are read in the order they were sealed
+static void release_read_pages_locked(buffered_stream_t *stream) {
+    while (stream->sealed_head != NO_PAGE && pages[stream->sealed_head].pending == 0) {
+        int page = stream->sealed_head;
+        stream->sealed_head = pages[page].next;
+        if (stream->sealed_head == NO_PAGE) {
+            stream->sealed_tail = NO_PAGE;
+        }
+        push_free_page_locked(page);
+    }
+}
+
+static void consume_entry_locked(buffered_stream_t *stream) {
+    packet_entry_t *entry = &stream->packet_index[stream->index_read % stream->index_capacity];
+    stream->index_read++;
+    
+    if (pages[entry->page].pending > 0) {
+        pages[entry->page].pending--;
+    }
+    release_read_pages_locked(stream);
+    pthread_cond_broadcast(&space_cond);
+}
+
+// Indexes every complete packet in the write page
+static int index_packets_locked(buffered_stream_t *stream) {
+    page_t *page = &pages[stream->write_page];
+    uint32_t arrival_us = (uint32_t)(stats_now() / 1000);
+    
+    while (page->used - stream->parse_offset >= PACKET_LENGTH_SIZE) {
+        const uint8_t *packet = page->data + stream->parse_offset;
+        size_t length = ((size_t)packet[0] << 8) | packet[1];
+        
+        if (length < PACKET_OVERHEAD || length > BUFFERED_AUDIO_PAGE_SIZE) {
+            logger_log(LOG_WARNING, "Invalid buffered audio packet length %zu", length);
+            return -1;
+        }
+        if (page->used - stream->parse_offset < length) {
+            break;
+        }
+        
+        while (stream->index_write - stream->index_read == stream->index_capacity &&
+               stream->receiver_running) {
+            pthread_cond_wait(&space_cond, &buffer_mutex);
+        }
+        if (!stream->receiver_running) {
+            return -1;
+        }
+        
+        packet_entry_t *entry = &stream->packet_index[stream->index_write % stream->index_capacity];
+        const uint8_t *rtp = packet + PACKET_LENGTH_SIZE;
+        entry->sequence = read_be32(rtp) & 0x00FFFFFF;
+        entry->timestamp = read_be32(rtp + 4);
+        entry->page = stream->write_page;
+        entry->offset = (uint16_t)stream->parse_offset;
+        entry->length = (uint16_t)length;
+        entry->arrival_us = arrival_us;
+        stream->index_write++;
+        page->pending++;
+        stream->parse_offset += length;
+    }
+    
+    return 0;
+}
+
+// Moves the incomplete trailing packet into a fresh page
+static int advance_page_locked(buffered_stream_t *stream) {
+    int old_page = stream->write_page;
+    int new_page = take_page_locked(stream);
+    if (new_page == NO_PAGE) {
+        return -1;
+    }
+    
+    size_t partial = pages[old_page].used - stream->parse_offset;
+    memcpy(pages[new_page].data, pages[old_page].data + stream->parse_offset, partial);
+    pages[new_page].used = partial;
+    pages[old_page].used = stream->parse_offset;
+    
+    stream->write_page = new_page;
+    stream->parse_offset = 0;
+    seal_page_locked(stream, old_page);
+    return 0;
+}
+
+static void close_data_connection(buffered_stream_t *stream) {
+    if (stream->data_fd >= 0) {
+        close(stream->data_fd);
+        stream->data_fd = -1;
+    }
+    
+    // A new connection starts on a packet boundary
+    pthread_mutex_lock(&buffer_mutex);
+    if (stream->write_page != NO_PAGE) {
+        pages[stream->write_page].used = stream->parse_offset;
+    }
+    pthread_mutex_unlock(&buffer_mutex);
+}
+
+static int accept_data_connection(buffered_stream_t *stream) {
+    struct pollfd pfd = { .fd = stream->listen_fd, .events = POLLIN };
+    if (poll(&pfd, 1, POLL_INTERVAL_MS) <= 0) {
+        return -1;
+    }
+    
+    stream->data_fd = accept(stream->listen_fd, NULL, NULL);
+    if (stream->data_fd < 0) {
+        return -1;
+    }
+    
+    int size = SOCKET_RECEIVE_BUFFER;
+    setsockopt(stream->data_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    logger_log(LOG_INFO, "Buffered audio connection accepted");
+    return 0;
+}
+
+static void* receiver_thread_func(void *arg) {
+    buffered_stream_t *stream = arg;
+    
+    thread_policy_apply(THREAD_ROLE_RECEIVE);
+    
+    while (stream->receiver_running) {
+        if (stream->data_fd < 0) {
+            accept_data_connection(stream);
+            continue;
+        }
+        
+        pthread_mutex_lock(&buffer_mutex);
+        if (stream->write_page == NO_PAGE) {
+            stream->write_page = take_page_locked(stream);
+            stream->parse_offset = 0;
+        }
+        int page = stream->write_page;
+        pthread_mutex_unlock(&buffer_mutex);
+        if (page == NO_PAGE) {
+            break;
+        }
+        
+        struct pollfd pfd = { .fd = stream->data_fd, .events = POLLIN };
+        if (poll(&pfd, 1, POLL_INTERVAL_MS) <= 0) {
+            continue;
+        }
+        
+        // Only this thread writes past pages[page].used, no lock needed for recv
+        ssize_t received = recv(stream->data_fd, pages[page].data + pages[page].used,
+                                BUFFERED_AUDIO_PAGE_SIZE - pages[page].used, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            logger_log(LOG_INFO, "Buffered audio connection closed");
+            close_data_connection(stream);
+            continue;
+        }
+        
+        uint64_t start_ns = stats_now();
+        pthread_mutex_lock(&buffer_mutex);
+        pages[page].used += received;
+        stream->bytes_received += received;
+        uint64_t total_received = stream->bytes_received;
+        size_t indexed = stream->index_write;
+        int result = index_packets_locked(stream);
+        if (result == 0 && pages[page].used == BUFFERED_AUDIO_PAGE_SIZE) {
+            result = advance_page_locked(stream);
+        }
+        indexed = stream->index_write - indexed;
+        int pool_pages = pages_allocated;
+        pthread_mutex_unlock(&buffer_mutex);
+        
+        stats_record(STATS_STAGE_RECEIVE, start_ns);
+        stats_add(STATS_COUNTER_PACKETS, (uint32_t)indexed);
+        stats_add(STATS_COUNTER_KILOBYTES, (uint32_t)(total_received / 1024 - (total_received - received) / 1024));
+        stats_set_gauge(STATS_GAUGE_POOL_PAGES, (uint32_t)pool_pages);
+        
+        if (result != 0 && stream->receiver_running) {
+            close_data_connection(stream);
+        }
+    }
+    
+    return NULL;
+}
+
+int buffered_audio_start_stream(buffered_stream_t *stream, const uint8_t *key, uint16_t *port) {
+    if (!key || !port) {
+        return -1;
+    }
+    
+    if (stream->stream_active) {
+        buffered_audio_stop_stream(stream);
+    }
+    
+    pthread_mutex_lock(&buffer_mutex);
+    if (!pages) {
+        pthread_mutex_unlock(&buffer_mutex);
+        return -1;
+    }
+    
+    // Each stream can fill the whole pool, its index is sized for that
+    stream->index_capacity = pool_size / AVERAGE_PACKET_SIZE;
+    stream->packet_index = calloc(stream->index_capacity, sizeof(packet_entry_t));
+    stream->stream_session = aead_session_create(key);
+    if (!stream->packet_index || !stream->stream_session) {
+        syslog(LOG_ERR, "Failed to allocate buffered audio index");
+        goto fail;
+    }
+    
+    stream->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (stream->listen_fd < 0) {
+        syslog(LOG_ERR, "Failed to create buffered audio socket");
+        goto fail;
+    }
+    
+    struct sockaddr_in addr;
+    socklen_t addr_length = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = 0;
+    if (bind(stream->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(stream->listen_fd, 1) < 0 ||
+        getsockname(stream->listen_fd, (struct sockaddr*)&addr, &addr_length) < 0) {
+        syslog(LOG_ERR, "Failed to listen for buffered audio: %s", strerror(errno));
+        goto fail;
+    }
+    
+    stream->index_read = 0;
+    stream->index_write = 0;
+    stream->bytes_received = 0;
+    stream->packets_dropped = 0;
+    stream->receiver_running = true;
+    if (pthread_create(&stream->receiver_thread, thread_policy_attr(), receiver_thread_func, stream) != 0) {
+        syslog(LOG_ERR, "Failed to create buffered audio thread");
+        stream->receiver_running = false;
+        goto fail;
+    }
+    
+    stream->stream_active = true;
+    active_streams++;
+    *port = ntohs(addr.sin_port);
+    pthread_mutex_unlock(&buffer_mutex);
+    
+    syslog(LOG_INFO, "Buffered audio stream listening on port %u", *port);
+    return 0;
+
+fail:
+    if (stream->listen_fd >= 0) {
+        close(stream->listen_fd);
+        stream->listen_fd = -1;
+    }
+    aead_session_destroy(stream->stream_session);
+    stream->stream_session = NULL;
+    free(stream->packet_index);
+    stream->packet_index = NULL;
+    pthread_mutex_unlock(&buffer_mutex);
+    return -1;
+}
+
+int buffered_audio_stop_stream(buffered_stream_t *stream) {
+    pthread_mutex_lock(&buffer_mutex);
+    if (!stream->stream_active) {
+        pthread_mutex_unlock(&buffer_mutex);
+        return 0;
+    }
+    stream->receiver_running = false;
+    pthread_cond_broadcast(&space_cond);
+    pthread_mutex_unlock(&buffer_mutex);
+    
+    pthread_join(stream->receiver_thread, NULL);
+    if (stream->data_fd >= 0) {
+        close(stream->data_fd);
+        stream->data_fd = -1;
+    }
+    if (stream->listen_fd >= 0) {
+        close(stream->listen_fd);
+        stream->listen_fd = -1;
+    }
+    
+    // The stream's pages go back to the pool, which gives the memory back
+    // once no stream is playing
+    pthread_mutex_lock(&buffer_mutex);
+    if (stream->sealed_head != NO_PAGE) {
+        pages[stream->sealed_tail].next = free_head;
+        free_head = stream->sealed_head;
+    }
+    if (stream->write_page != NO_PAGE) {
+        push_free_page_locked(stream->write_page);
+    }
+    if (--active_streams == 0) {
+        for (int i = 0; i < pages_allocated; i++) {
+            free(pages[i].data);
+            pages[i].data = NULL;
+        }
+        pages_allocated = 0;
+        free_head = NO_PAGE;
+    }
+    pthread_cond_broadcast(&space_cond);
+    stream->sealed_head = NO_PAGE;
+    stream->sealed_tail = NO_PAGE;
+    stream->write_page = NO_PAGE;
+    stream->parse_offset = 0;
+    stream->index_read = 0;
+    stream->index_write = 0;
+    free(stream->packet_index);
+    stream->packet_index = NULL;
+    aead_session_destroy(stream->stream_session);
+    stream->stream_session = NULL;
+    stream->stream_active = false;
+    pthread_mutex_unlock(&buffer_mutex);
+    
+    syslog(LOG_INFO, "Buffered audio stream stopped");
+    return 0;
+}
+
+bool buffered_audio_is_active(buffered_stream_t *stream) {
+    pthread_mutex_lock(&buffer_mutex);
+    bool active = stream->stream_active;
+    pthread_mutex_unlock(&buffer_mutex);
+    return active;
+}
+
+// Gives back the sealed pages from the head up to and including last
+static void splice_sealed_pages_locked(buffered_stream_t *stream, int last) {
+    int head = stream->sealed_head;
+    stream->sealed_head = pages[last].next;
+    if (stream->sealed_head == NO_PAGE) {
+        stream->sealed_tail = NO_PAGE;
+    }
+    pages[last].next = free_head;
+    free_head = head;
+    pthread_cond_broadcast(&space_cond);
+}
+
+static void drop_all_locked(buffered_stream_t *stream) {
+    // Whole sealed list goes back in one splice
+    stream->index_read = stream->index_write;
+    if (stream->sealed_head != NO_PAGE) {
+        splice_sealed_pages_locked(stream, stream->sealed_tail);
+    }
+    if (stream->write_page != NO_PAGE) {
+        pages[stream->write_page].pending = 0;
+    }
+    pthread_cond_broadcast(&space_cond);
+}
+
+int buffered_audio_flush(buffered_stream_t *stream) {
+    pthread_mutex_lock(&buffer_mutex);
+    drop_all_locked(stream);
+    pthread_mutex_unlock(&buffer_mutex);
+    return 0;
+}
+
+int buffered_audio_seek(buffered_stream_t *stream, uint32_t timestamp) {
+    pthread_mutex_lock(&buffer_mutex);
+    
+    // First packet at or after timestamp, allowing for wraparound
+    size_t low = stream->index_read;
+    size_t high = stream->index_write;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if ((int32_t)(stream->packet_index[middle % stream->index_capacity].timestamp - timestamp) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    
+    stats_add(STATS_COUNTER_LATE_DROPS, (uint32_t)(low - stream->index_read));
+    if (low == stream->index_write) {
+        drop_all_locked(stream);
+        pthread_mutex_unlock(&buffer_mutex);
+        return 0;
+    }
+    
+    // A page's packets sit together in the index, so every page before the
+    // target's is fully skipped and the one holding the packet just before
+    // the target's first ends the run of sealed pages to give back
+    int target = stream->packet_index[low % stream->index_capacity].page;
+    size_t first = low;
+    while (first > stream->index_read &&
+           stream->packet_index[(first - 1) % stream->index_capacity].page == target) {
+        first--;
+    }
+    if (first > stream->index_read) {
+        splice_sealed_pages_locked(stream, stream->packet_index[(first - 1) % stream->index_capacity].page);
+        stream->index_read = first;
+    }
+    
+    // Only the target page's leading packets are left to consume
+    while (stream->index_read < low) {
+        consume_entry_locked(stream);
+    }
+    
+    pthread_mutex_unlock(&buffer_mutex);
+    return 0;
+}
+
+int buffered_audio_read(buffered_stream_t *stream, uint8_t *payload, size_t size, uint32_t *timestamp) {
+    if (!payload) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&buffer_mutex);
+    if (stream->index_read == stream->index_write || !stream->stream_session) {
+        pthread_mutex_unlock(&buffer_mutex);
+        return 0;
+    }
+    
+    packet_entry_t *entry = &stream->packet_index[stream->index_read % stream->index_capacity];
+    const uint8_t *packet = pages[entry->page].data + entry->offset;
+    const uint8_t *rtp = packet + PACKET_LENGTH_SIZE;
+    size_t length = entry->length - PACKET_OVERHEAD;
+    const uint8_t *tag = rtp + RTP_HEADER_SIZE + length;
+    const uint8_t *nonce = tag + CHACHA20_POLY1305_TAG_SIZE;
+    uint32_t packet_timestamp = entry->timestamp;
+    uint64_t start_ns = stats_now();
+    int result = -1;
+    
+    stats_record_value(STATS_STAGE_JITTER_WAIT,
+                       (uint64_t)((uint32_t)(start_ns / 1000) - entry->arrival_us) * 1000);
+    
+    // The page stays intact, decryption happens in the caller's buffer
+    if (length <= size) {
+        memcpy(payload, rtp + RTP_HEADER_SIZE, length);
+        if (aead_session_decrypt(stream->stream_session, nonce, rtp + 4, 8, payload, length, tag) == 0) {
+            result = (int)length;
+        }
+    }
+    stats_record(STATS_STAGE_DECRYPT, start_ns);
+    if (result < 0) {
+        stream->packets_dropped++;
+        stats_increment(STATS_COUNTER_DECRYPT_ERRORS);
+    }
+    consume_entry_locked(stream);
+    
+    pthread_mutex_unlock(&buffer_mutex);
+    
+    if (result >= 0 && timestamp) {
+        *timestamp = packet_timestamp;
+    }
+    return result;
+}
+
+int buffered_audio_get_stats(buffered_stream_t *stream, buffered_audio_stats_t *stats) {
+    if (!stats) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&buffer_mutex);
+    memset(stats, 0, sizeof(*stats));
+    stats->pool_size = pool_size;
+    stats->pages_allocated = pages_allocated;
+    stats->packets_buffered = stream->index_write - stream->index_read;
+    stats->bytes_received = stream->bytes_received;
+    stats->packets_dropped = stream->packets_dropped;
+    
+    int free_pages = 0;
+    for (int page = free_head; page != NO_PAGE; page = pages[page].next) {
+        free_pages++;
+    }
+    stats->pages_in_use = pages_allocated - free_pages;
+    
+    if (stream->index_read != stream->index_write) {
+        const packet_entry_t *index = stream->packet_index;
+        stats->first_timestamp = index[stream->index_read % stream->index_capacity].timestamp;
+        stats->last_timestamp = index[(stream->index_write - 1) % stream->index_capacity].timestamp;
+    }
+    pthread_mutex_unlock(&buffer_mutex);
+    
+    return 0;
+}
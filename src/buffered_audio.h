@@ -0,0 +1,50 @@
+#ifndef BUFFERED_AUDIO_H
+#define BUFFERED_AUDIO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define BUFFERED_AUDIO_PAGE_SIZE 16384
+#define BUFFERED_AUDIO_DEFAULT_POOL_SIZE (8 * 1024 * 1024)
+#define BUFFERED_AUDIO_MIN_POOL_SIZE (4 * BUFFERED_AUDIO_PAGE_SIZE)
+
+// AirPlay 2 stream type for buffered (TCP) audio
+#define BUFFERED_AUDIO_STREAM_TYPE 103
+
+typedef struct {
+    size_t pool_size;
+    uint32_t pages_allocated;
+    uint32_t pages_in_use;
+    uint32_t packets_buffered;
+    uint32_t first_timestamp;
+    uint32_t last_timestamp;
+    uint64_t bytes_received;
+    uint64_t packets_dropped;
+} buffered_audio_stats_t;
+
+// One receiver per zone, all of them draw pages from the shared pool
+typedef struct buffered_stream buffered_stream_t;
+
+// Pool lifecycle, pool_size caps the memory held by received audio across
+// every stream. Streams are destroyed before the pool is cleaned up.
+int buffered_audio_init(size_t pool_size);
+int buffered_audio_cleanup(void);
+
+buffered_stream_t* buffered_audio_create_stream(void);
+void buffered_audio_destroy_stream(buffered_stream_t *stream);
+
+// Stream control, the data port is returned to the sender in the SETUP reply
+int buffered_audio_start_stream(buffered_stream_t *stream, const uint8_t *key, uint16_t *port);
+int buffered_audio_stop_stream(buffered_stream_t *stream);
+bool buffered_audio_is_active(buffered_stream_t *stream);
+int buffered_audio_flush(buffered_stream_t *stream);
+int buffered_audio_seek(buffered_stream_t *stream, uint32_t timestamp);
+
+// Playout side: returns the payload length, 0 when nothing is buffered
+int buffered_audio_read(buffered_stream_t *stream, uint8_t *payload, size_t size, uint32_t *timestamp);
+
+// Pool figures are for all streams, the rest for this one
+int buffered_audio_get_stats(buffered_stream_t *stream, buffered_audio_stats_t *stats);
+
+#endif // BUFFERED_AUDIO_H
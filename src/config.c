@@ -0,0 +1,499 @@
+#include "config.h"
+#include "volume_control.h"
+#include "input_control.h"
+#include "control_api.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#ifdef WITH_UCI
+#include <uci.h>
+#endif
+
+// Multiroom takes its settings from the AirPlay ones, the room is named
+// after the device. Zones fill their gaps from the main section, those
+// without a device of their own are dropped.
+static void finish(config_t *config) {
+    config->multiroom.enabled = config->airplay.enable_multiroom;
+    snprintf(config->multiroom.room_name, sizeof(config->multiroom.room_name), "%.*s",
+             MAX_ROOM_NAME_LEN - 1, config->airplay.device_name);
+    snprintf(config->multiroom.group_id, sizeof(config->multiroom.group_id), "%s",
+             config->airplay.multiroom_group);
+    
+    int kept = 0;
+    for (int i = 0; i < config->zone_count; i++) {
+        config_zone_t *zone = &config->zones[i];
+        if (!zone->audio_device[0] || strcmp(zone->audio_device, "auto") == 0) {
+            syslog(LOG_WARNING, "Zone %d has no audio_device, ignored", i + 2);
+            continue;
+        }
+        if (!zone->device_name[0]) {
+            snprintf(zone->device_name, sizeof(zone->device_name), "%.56s %d",
+                     config->airplay.device_name, kept + 2);
+        }
+        if (!zone->device_id[0]) {
+            snprintf(zone->device_id, sizeof(zone->device_id), "%.56s-%d",
+                     config->airplay.device_id, kept + 2);
+        }
+        if (!zone->output[0]) {
+            snprintf(zone->output, sizeof(zone->output), "%s", config->output);
+        }
+        config->zones[kept++] = *zone;
+    }
+    config->zone_count = kept;
+}
+
+void config_get_defaults(config_t *config) {
+    if (!config) {
+        return;
+    }
+    
+    memset(config, 0, sizeof(*config));
+    airplay_server_get_defaults(&config->airplay);
+    snprintf(config->airplay.multiroom_group, sizeof(config->airplay.multiroom_group), "default-group");
+    config->multiroom.port = CONFIG_DEFAULT_MULTIROOM_PORT;
+    snprintf(config->output, sizeof(config->output), "alsa");
+    snprintf(config->audio_device, sizeof(config->audio_device), "auto");
+    config->sample_rate = 44100;
+    config->channels = 2;
+    config->bits_per_sample = 16;
+    config->buffer_size = CONFIG_DEFAULT_BUFFER_SIZE;
+    config->use_hw_volume = false;
+    volume_map_get_defaults(&config->volume);
+    config->volume_rate = VOLUME_CONTROL_DEFAULT_RATE_HZ;
+    thread_policy_get_defaults(&config->policy);
+    power_gate_get_defaults(&config->gate);
+    dsp_chain_get_defaults(&config->dsp);
+    snprintf(config->input, sizeof(config->input), INPUT_CONTROL_AUTO);
+    config->input_debounce_ms = INPUT_CONTROL_DEFAULT_DEBOUNCE_MS;
+    config->input_accelerate = true;
+    snprintf(config->control_socket, sizeof(config->control_socket), "%s", CONTROL_API_DEFAULT_SOCKET);
+    config->control_port = 0;
+    config->other_hash = 0;
+    finish(config);
+}
+
+static bool parse_bool(const char *value) {
+    return strcmp(value, "1") == 0 || strcmp(value, "yes") == 0 || strcmp(value, "on") == 0 ||
+           strcmp(value, "true") == 0 || strcmp(value, "enabled") == 0;
+}
+
+// FNV-1a, only compared against the previous load
+static uint32_t hash_update(uint32_t hash, const char *text) {
+    for (const unsigned char *p = (const unsigned char *)text; *p; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return (hash ^ 0xff) * 16777619u;
+}
+
+static void set_string(char *field, size_t size, const char *value) {
+    snprintf(field, size, "%s", value);
+}
+
+// Out of range or malformed values are logged and leave the default
+static bool parse_number(const char *name, const char *value, long min, long max, long *number) {
+    char *end;
+    long parsed = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || parsed < min || parsed > max) {
+        syslog(LOG_WARNING, "Option %s '%s' is not a number from %ld to %ld, ignored", name, value, min, max);
+        return false;
+    }
+    *number = parsed;
+    return true;
+}
+
+static bool parse_decibels(const char *name, const char *value, float min, float max, float *decibels) {
+    char *end;
+    float parsed = strtof(value, &end);
+    if (end == value || *end != '\0' || parsed < min || parsed > max) {
+        syslog(LOG_WARNING, "Option %s '%s' is not a level from %.0f to %.0f dB, ignored", name, value, min, max);
+        return false;
+    }
+    *decibels = parsed;
+    return true;
+}
+
+static void add_other(config_t *config, const char *name, const char *value) {
+    config->other_hash = hash_update(hash_update(config->other_hash, name), value);
+}
+
+// Zones need a restart, so all of their options go into other_hash too
+static void set_zone_option(config_t *config, config_zone_t *zone, const char *name, const char *value) {
+    long number;
+    
+    add_other(config, name, value);
+    if (strcmp(name, "device_name") == 0) {
+        set_string(zone->device_name, sizeof(zone->device_name), value);
+    } else if (strcmp(name, "device_id") == 0) {
+        set_string(zone->device_id, sizeof(zone->device_id), value);
+    } else if (strcmp(name, "port") == 0) {
+        if (parse_number(name, value, 0, 65535, &number)) {
+            zone->port = (uint16_t)number;
+        }
+    } else if (strcmp(name, "output") == 0) {
+        set_string(zone->output, sizeof(zone->output), value);
+    } else if (strcmp(name, "audio_device") == 0) {
+        set_string(zone->audio_device, sizeof(zone->audio_device), value);
+    }
+}
+
+// The next free zone, NULL once CONFIG_MAX_ZONES are configured
+static config_zone_t* add_zone(config_t *config) {
+    if (config->zone_count == CONFIG_MAX_ZONES - 1) {
+        syslog(LOG_WARNING, "More than %d zones, the rest are ignored", CONFIG_MAX_ZONES);
+        return NULL;
+    }
+    
+    config_zone_t *zone = &config->zones[config->zone_count++];
+    memset(zone, 0, sizeof(*zone));
+    add_other(config, CONFIG_ZONE_TYPE, "");
+    return zone;
+}
+
+// Options the command line used to carry, an empty CPU, GPIO or limiter
+// leaves it unset
+static void set_startup_option(config_t *config, const char *name, const char *value) {
+    long number;
+    
+    if (strcmp(name, "rt_scheduler") == 0) {
+        if (thread_policy_parse_scheduler(value, &config->policy.playout_scheduler) != 0) {
+            syslog(LOG_WARNING, "Option rt_scheduler '%s' is not fifo, rr or other, ignored", value);
+        }
+    } else if (strcmp(name, "rt_priority") == 0) {
+        if (parse_number(name, value, 1, 99, &number)) {
+            config->policy.playout_priority = (int)number;
+        }
+    } else if (strcmp(name, "receive_nice") == 0) {
+        if (parse_number(name, value, -20, 19, &number)) {
+            config->policy.receive_nice = (int)number;
+        }
+    } else if (strcmp(name, "lock_memory") == 0) {
+        config->policy.lock_memory = parse_bool(value);
+    } else if (strcmp(name, "audio_cpu") == 0) {
+        if (value[0] && parse_number(name, value, 0, 1023, &number)) {
+            config->policy.cpu[THREAD_ROLE_PLAYOUT] = (int)number;
+        }
+    } else if (strcmp(name, "network_cpu") == 0) {
+        if (value[0] && parse_number(name, value, 0, 1023, &number)) {
+            config->policy.cpu[THREAD_ROLE_RECEIVE] = (int)number;
+        }
+    } else if (strcmp(name, "control_cpu") == 0) {
+        if (value[0] && parse_number(name, value, 0, 1023, &number)) {
+            config->policy.cpu[THREAD_ROLE_CONTROL] = (int)number;
+            config->policy.cpu[THREAD_ROLE_BACKGROUND] = (int)number;
+        }
+    } else if (strcmp(name, "idle_timeout") == 0) {
+        if (parse_number(name, value, 0, 3600000, &number)) {
+            config->gate.idle_ms = (uint32_t)number;
+        }
+    } else if (strcmp(name, "suspend_timeout") == 0) {
+        if (parse_number(name, value, 0, 86400000, &number)) {
+            config->gate.suspend_ms = (uint32_t)number;
+        }
+    } else if (strcmp(name, "amp_gpio") == 0) {
+        if (value[0] && parse_number(name, value, 0, 4095, &number)) {
+            config->gate.amp_gpio = (int)number;
+        }
+    } else if (strcmp(name, "amp_active_low") == 0) {
+        config->gate.amp_active_low = parse_bool(value);
+    } else if (strcmp(name, "preamp") == 0) {
+        parse_decibels(name, value, -60.0f, 24.0f, &config->dsp.preamp_db);
+    } else if (strcmp(name, "limiter") == 0) {
+        if (value[0] && parse_decibels(name, value, -60.0f, 0.0f, &config->dsp.limiter_db)) {
+            config->dsp.limiter = true;
+        }
+    } else if (strcmp(name, "eq") == 0) {
+        if (config->dsp.filter_count == DSP_MAX_FILTERS ||
+            dsp_chain_parse_filter(value, &config->dsp.filters[config->dsp.filter_count]) != 0) {
+            syslog(LOG_WARNING, "Invalid or too many filters: %s, ignored", value);
+        } else {
+            config->dsp.filter_count++;
+        }
+    } else if (strcmp(name, "input") == 0) {
+        set_string(config->input, sizeof(config->input), value[0] ? value : INPUT_CONTROL_AUTO);
+    } else if (strcmp(name, "input_debounce") == 0) {
+        if (parse_number(name, value, 0, 1000, &number)) {
+            config->input_debounce_ms = (uint32_t)number;
+        }
+    } else if (strcmp(name, "input_accel") == 0) {
+        config->input_accelerate = parse_bool(value);
+    } else if (strcmp(name, "control_socket") == 0) {
+        set_string(config->control_socket, sizeof(config->control_socket),
+                   strcmp(value, "none") == 0 ? "" : value);
+    } else if (strcmp(name, "control_port") == 0) {
+        if (parse_number(name, value, 0, 65535, &number)) {
+            config->control_port = (uint16_t)number;
+        }
+    }
+}
+
+static void set_option(config_t *config, const char *name, const char *value) {
+    airplay_config_t *airplay = &config->airplay;
+    long number;
+    
+    if (strcmp(name, "device_name") == 0) {
+        if (value[0]) {
+            set_string(airplay->device_name, sizeof(airplay->device_name), value);
+        }
+    } else if (strcmp(name, "model_name") == 0) {
+        set_string(airplay->model_name, sizeof(airplay->model_name), value);
+    } else if (strcmp(name, "device_id") == 0) {
+        set_string(airplay->device_id, sizeof(airplay->device_id), value);
+    } else if (strcmp(name, "port") == 0) {
+        if (parse_number(name, value, 0, 65535, &number)) {
+            airplay->port = (uint16_t)number;
+        }
+    } else if (strcmp(name, "enable_multiroom") == 0) {
+        airplay->enable_multiroom = parse_bool(value);
+    } else if (strcmp(name, "multiroom_group") == 0) {
+        set_string(airplay->multiroom_group, sizeof(airplay->multiroom_group), value);
+    } else if (strcmp(name, "output") == 0) {
+        set_string(config->output, sizeof(config->output), value);
+    } else if (strcmp(name, "audio_device") == 0) {
+        set_string(config->audio_device, sizeof(config->audio_device), value[0] ? value : "auto");
+    } else if (strcmp(name, "sample_rate") == 0) {
+        if (parse_number(name, value, 8000, 192000, &number)) {
+            config->sample_rate = (uint32_t)number;
+        }
+    } else if (strcmp(name, "channels") == 0) {
+        if (parse_number(name, value, 1, 8, &number)) {
+            config->channels = (uint8_t)number;
+        }
+    } else if (strcmp(name, "bits_per_sample") == 0) {
+        if (parse_number(name, value, 16, 32, &number) && number % 8 == 0) {
+            config->bits_per_sample = (uint8_t)number;
+        }
+    } else if (strcmp(name, "buffer_size") == 0) {
+        if (parse_number(name, value, 1024, 65536, &number)) {
+            config->buffer_size = (size_t)number;
+        }
+    } else if (strcmp(name, "use_hw_volume") == 0) {
+        config->use_hw_volume = parse_bool(value);
+    } else if (strcmp(name, "volume_curve") == 0) {
+        if (volume_map_parse_curve(value, &config->volume.curve) != 0) {
+            syslog(LOG_WARNING, "Option volume_curve '%s' is not db or cubic, ignored", value);
+        }
+    } else if (strcmp(name, "volume_range") == 0) {
+        if (parse_number(name, value, 1, 144, &number)) {
+            config->volume.range_db = (float)number;
+        }
+    } else if (strcmp(name, "volume_rate") == 0) {
+        if (parse_number(name, value, 0, 1000, &number)) {
+            config->volume_rate = (uint32_t)number;
+        }
+    } else {
+        set_startup_option(config, name, value);
+        add_other(config, name, value);
+    }
+}
+
+#ifdef WITH_UCI
+// libuci takes an absolute path as well as a package name
+static int load_file(const char *path, config_t *config) {
+    struct uci_context *context = uci_alloc_context();
+    if (!context) {
+        return -1;
+    }
+    
+    struct uci_package *package = NULL;
+    if (uci_load(context, path, &package) != UCI_OK) {
+        uci_free_context(context);
+        return -1;
+    }
+    
+    struct uci_section *section = uci_lookup_section(context, package, CONFIG_SECTION);
+    if (section) {
+        struct uci_element *element;
+        uci_foreach_element(&section->options, element) {
+            struct uci_option *option = uci_to_option(element);
+            if (option->type == UCI_TYPE_STRING) {
+                set_option(config, element->name, option->v.string);
+            } else {
+                // Lists such as eq are only read at startup
+                struct uci_element *item;
+                uci_foreach_element(&option->v.list, item) {
+                    set_startup_option(config, element->name, item->name);
+                    add_other(config, element->name, item->name);
+                }
+            }
+        }
+    }
+    
+    struct uci_element *section_element;
+    uci_foreach_element(&package->sections, section_element) {
+        struct uci_section *zone_section = uci_to_section(section_element);
+        if (strcmp(zone_section->type, CONFIG_ZONE_TYPE) != 0) {
+            continue;
+        }
+        config_zone_t *zone = add_zone(config);
+        if (!zone) {
+            break;
+        }
+        struct uci_element *element;
+        uci_foreach_element(&zone_section->options, element) {
+            struct uci_option *option = uci_to_option(element);
+            if (option->type == UCI_TYPE_STRING) {
+                set_zone_option(config, zone, element->name, option->v.string);
+            }
+        }
+    }
+    
+    uci_unload(context, package);
+    uci_free_context(context);
+    return 0;
+}
+#else
+#define CONFIG_LINE_SIZE 512
+#define CONFIG_MAX_TOKENS 3
+
+// Splits a UCI line into up to three words. Words may be quoted with ' or ",
+// a backslash escapes the next character outside single quotes, # starts a
+// comment. Words are unquoted in place.
+static int split_line(char *line, char *tokens[CONFIG_MAX_TOKENS]) {
+    int count = 0;
+    char *in = line;
+    
+    while (count < CONFIG_MAX_TOKENS) {
+        while (*in == ' ' || *in == '\t' || *in == '\r' || *in == '\n') {
+            in++;
+        }
+        if (*in == '\0' || *in == '#') {
+            break;
+        }
+        
+        char *out = in;
+        tokens[count++] = out;
+        char quote = 0;
+        while (*in) {
+            if (quote) {
+                if (*in == quote) {
+                    quote = 0;
+                    in++;
+                } else if (*in == '\\' && quote == '"' && in[1]) {
+                    *out++ = in[1];
+                    in += 2;
+                } else {
+                    *out++ = *in++;
+                }
+            } else if (*in == '\'' || *in == '"') {
+                quote = *in++;
+            } else if (*in == '\\' && in[1]) {
+                *out++ = in[1];
+                in += 2;
+            } else if (*in == ' ' || *in == '\t' || *in == '\r' || *in == '\n' || *in == '#') {
+                break;
+            } else {
+                *out++ = *in++;
+            }
+        }
+        if (quote) {
+            return -1;
+        }
+        
+        // The terminator may overwrite the separator just read past
+        char next = *in;
+        *out = '\0';
+        if (next != '\0' && next != '#') {
+            in++;
+        } else if (next == '#') {
+            *in = '\0';
+        }
+    }
+    
+    return count;
+}
+
+// Without libuci the file is read directly, which covers everything the
+// package and LuCI write
+static int load_file(const char *path, config_t *config) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    
+    char line[CONFIG_LINE_SIZE];
+    int line_number = 0;
+    bool in_section = false;
+    config_zone_t *zone = NULL;
+    while (fgets(line, sizeof(line), file)) {
+        char *tokens[CONFIG_MAX_TOKENS];
+        line_number++;
+        int count = split_line(line, tokens);
+        if (count < 0) {
+            syslog(LOG_WARNING, "%s:%d: unterminated quote", path, line_number);
+            continue;
+        }
+        if (count == 0) {
+            continue;
+        }
+        
+        if (strcmp(tokens[0], "config") == 0) {
+            in_section = count == 3 && strcmp(tokens[2], CONFIG_SECTION) == 0;
+            zone = count >= 2 && strcmp(tokens[1], CONFIG_ZONE_TYPE) == 0 ? add_zone(config) : NULL;
+        } else if (zone && count == 3 && strcmp(tokens[0], "option") == 0) {
+            set_zone_option(config, zone, tokens[1], tokens[2]);
+        } else if (!in_section || count != 3) {
+            continue;
+        } else if (strcmp(tokens[0], "option") == 0) {
+            set_option(config, tokens[1], tokens[2]);
+        } else if (strcmp(tokens[0], "list") == 0) {
+            // Lists such as eq are only read at startup
+            set_startup_option(config, tokens[1], tokens[2]);
+            add_other(config, tokens[1], tokens[2]);
+        }
+    }
+    
+    fclose(file);
+    return 0;
+}
+#endif
+
+int config_load(const char *path, config_t *config) {
+    if (!path || !config) {
+        return -1;
+    }
+    
+    config_get_defaults(config);
+    if (load_file(path, config) != 0) {
+        return -1;
+    }
+    
+    finish(config);
+    return 0;
+}
+
+uint32_t config_diff(const config_t *old_config, const config_t *new_config) {
+    if (!old_config || !new_config) {
+        return 0;
+    }
+    
+    const airplay_config_t *a = &old_config->airplay;
+    const airplay_config_t *b = &new_config->airplay;
+    uint32_t changed = 0;
+    
+    if (strcmp(a->device_name, b->device_name) != 0) {
+        changed |= CONFIG_CHANGED_NAME;
+    }
+    if (old_config->use_hw_volume != new_config->use_hw_volume ||
+        old_config->volume.curve != new_config->volume.curve ||
+        old_config->volume.range_db != new_config->volume.range_db ||
+        old_config->volume_rate != new_config->volume_rate) {
+        changed |= CONFIG_CHANGED_VOLUME;
+    }
+    if (old_config->buffer_size != new_config->buffer_size) {
+        changed |= CONFIG_CHANGED_BUFFER;
+    }
+    if (strcmp(a->model_name, b->model_name) != 0 || strcmp(a->device_id, b->device_id) != 0 ||
+        a->port != b->port || a->enable_multiroom != b->enable_multiroom ||
+        strcmp(a->multiroom_group, b->multiroom_group) != 0 ||
+        strcmp(old_config->output, new_config->output) != 0 ||
+        strcmp(old_config->audio_device, new_config->audio_device) != 0 ||
+        old_config->sample_rate != new_config->sample_rate ||
+        old_config->channels != new_config->channels ||
+        old_config->bits_per_sample != new_config->bits_per_sample ||
+        old_config->other_hash != new_config->other_hash) {
+        changed |= CONFIG_CHANGED_RESTART;
+    }
+    
+    return changed;
+}
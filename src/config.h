@@ -0,0 +1,78 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "airplay_server.h"
+#include "volume_map.h"
+#include "multiroom.h"
+#include "thread_policy.h"
+#include "power_gate.h"
+#include "dsp_chain.h"
+
+#define CONFIG_DEFAULT_PATH "/etc/config/airplay2-lite"
+#define CONFIG_SECTION "main"
+#define CONFIG_ZONE_TYPE "zone"
+#define CONFIG_MAX_ZONES 4              // the CONFIG_SECTION zone included
+#define CONFIG_DEFAULT_BUFFER_SIZE 4096
+#define CONFIG_DEFAULT_MULTIROOM_PORT 7001
+
+// What a reload has to redo, as returned by config_diff
+#define CONFIG_CHANGED_NAME     0x01    // mDNS announcement under the new name
+#define CONFIG_CHANGED_VOLUME   0x02    // volume tables, mixer and update rate
+#define CONFIG_CHANGED_BUFFER   0x04    // output buffer, when the device next opens
+#define CONFIG_CHANGED_RESTART  0x08    // options only read at startup
+
+// A further receiver from a CONFIG_ZONE_TYPE section, everything it does not
+// set is taken from the CONFIG_SECTION one. Zones are only read at startup.
+typedef struct {
+    char device_name[64];           // default: the main name and the zone number
+    char device_id[64];             // default: the main id and "-<zone number>"
+    uint16_t port;                  // 0 binds any free port
+    char output[16];                // default: the main backend
+    char audio_device[64];          // required, each zone needs its own device
+} config_zone_t;
+
+// Settings from the CONFIG_SECTION section, checked against their valid
+// ranges. Options only read at startup, and those without a field, are
+// folded into other_hash, so a reload still notices that they changed.
+typedef struct {
+    airplay_config_t airplay;
+    multiroom_config_t multiroom;
+    char output[16];                // audio_config_t backend
+    char audio_device[64];          // audio_config_t device_name
+    uint32_t sample_rate;
+    uint8_t channels;
+    uint8_t bits_per_sample;
+    size_t buffer_size;
+    bool use_hw_volume;
+    volume_map_config_t volume;
+    uint32_t volume_rate;
+    
+    // Startup only
+    thread_policy_config_t policy;
+    power_gate_config_t gate;
+    dsp_config_t dsp;               // preamp, limiter and the eq list
+    char input[64];                 // input_control_config_t device
+    uint32_t input_debounce_ms;
+    bool input_accelerate;
+    char control_socket[108];       // empty for none
+    uint16_t control_port;
+    
+    config_zone_t zones[CONFIG_MAX_ZONES - 1];
+    int zone_count;
+    uint32_t other_hash;
+} config_t;
+
+void config_get_defaults(config_t *config);
+
+// Reads the CONFIG_SECTION and CONFIG_ZONE_TYPE sections of a UCI file,
+// through libuci when built WITH_UCI. Options it does not set, and values out of range, keep their
+// defaults. Returns -1 if the file cannot be read.
+int config_load(const char *path, config_t *config);
+
+// CONFIG_CHANGED_* flags for going from old to new
+uint32_t config_diff(const config_t *old_config, const config_t *new_config);
+
+#endif // CONFIG_H
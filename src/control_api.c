@@ -0,0 +1,588 @@
+#define _GNU_SOURCE
+#include "control_api.h"
+#include "event_loop.h"
+#include "playback_control.h"
+#include "volume_control.h"
+#include "multiroom.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define CONTROL_API_LINE_SIZE 96
+#define CONTROL_API_BACKLOG 16
+#define CONTROL_API_BATCH 32
+#define CONTROL_API_READ_SIZE 512
+
+typedef enum {
+    CLIENT_READING = 0,         // request line and headers still arriving
+    CLIENT_SUBSCRIBED           // event stream open, only written to
+} client_state_t;
+
+// Fixed size whatever the request, the request line is all that is kept
+typedef struct {
+    int fd;
+    client_state_t state;
+    uint8_t header_match;       // progress through the blank line ending the headers
+    uint16_t line_length;
+    bool line_done;
+    char line[CONTROL_API_LINE_SIZE];
+} api_client_t;
+
+// All of this belongs to the main thread. Other threads only set pending
+// and poke the eventfd, so a change never waits on a subscriber socket.
+static int api_epoll = -1;
+static int unix_fd = -1;
+static int tcp_fd = -1;
+static int notify_fd = -1;
+static char socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static api_client_t *clients[CONTROL_API_MAX_CLIENTS];
+static int subscriber_count = 0;
+static bool pending = false;
+
+// The zone served, the primary one
+static playback_control_t *playback = NULL;
+static volume_control_t *volume = NULL;
+
+// Snapshot and event, built once per change for every subscriber
+static char snapshot[CONTROL_API_SNAPSHOT_SIZE];
+static char event[CONTROL_API_SNAPSHOT_SIZE + 32];
+
+static const char *state_names[] = { "stopped", "playing", "paused", "buffering" };
+
+void control_api_get_defaults(control_api_config_t *config) {
+    if (!config) {
+        return;
+    }
+    
+    config->socket_path = CONTROL_API_DEFAULT_SOCKET;
+    config->port = 0;
+}
+
+static void mark_changed(void) {
+    if (notify_fd >= 0 && !__atomic_exchange_n(&pending, true, __ATOMIC_ACQ_REL)) {
+        uint64_t one = 1;
+        ssize_t written = write(notify_fd, &one, sizeof(one));
+        (void)written;
+    }
+}
+
+static void on_state(playback_state_t state, void *userdata) {
+    (void)state;
+    (void)userdata;
+    mark_changed();
+}
+
+static void on_info(const playback_info_t *info, void *userdata) {
+    (void)info;
+    (void)userdata;
+    mark_changed();
+}
+
+static void on_volume(float level, bool muted, void *userdata) {
+    (void)level;
+    (void)muted;
+    (void)userdata;
+    mark_changed();
+}
+
+static void on_room(const char *room_name) {
+    (void)room_name;
+    mark_changed();
+}
+
+static size_t append_json_string(char *buffer, size_t size, size_t used, const char *text) {
+    if (used < size) {
+        buffer[used] = '"';
+    }
+    used++;
+    for (const unsigned char *p = (const unsigned char *)text; *p; p++) {
+        char escaped[8];
+        int length;
+        if (*p == '"' || *p == '\\') {
+            length = snprintf(escaped, sizeof(escaped), "\\%c", *p);
+        } else if (*p < 0x20) {
+            length = snprintf(escaped, sizeof(escaped), "\\u%04x", *p);
+        } else {
+            escaped[0] = (char)*p;
+            length = 1;
+        }
+        for (int i = 0; i < length; i++, used++) {
+            if (used < size) {
+                buffer[used] = escaped[i];
+            }
+        }
+    }
+    if (used < size) {
+        buffer[used] = '"';
+    }
+    return used + 1;
+}
+
+int control_api_format_state(char *buffer, size_t size) {
+    playback_info_t info;
+    multiroom_config_t room_config;
+    char rooms[MAX_ROOMS][MAX_ROOM_NAME_LEN];
+    if (!playback || !volume) {
+        return -1;
+    }
+    playback_state_t state = playback_control_get_state(playback);
+    playback_control_get_info(playback, &info);
+    memset(&room_config, 0, sizeof(room_config));
+    multiroom_get_config(&room_config);
+    int room_count = multiroom_get_room_list(rooms);
+    
+    size_t used = (size_t)snprintf(buffer, size, "{\"state\":\"%s\",\"volume\":%.3f,\"muted\":%s,\"title\":",
+                                   state <= PLAYBACK_BUFFERING ? state_names[state] : "unknown",
+                                   volume_control_get_volume(volume), volume_control_is_muted(volume) ? "true" : "false");
+    used = append_json_string(buffer, size, used, info.title);
+    used += (size_t)snprintf(buffer + (used < size ? used : size), used < size ? size - used : 0, ",\"artist\":");
+    used = append_json_string(buffer, size, used, info.artist);
+    used += (size_t)snprintf(buffer + (used < size ? used : size), used < size ? size - used : 0, ",\"album\":");
+    used = append_json_string(buffer, size, used, info.album);
+    used += (size_t)snprintf(buffer + (used < size ? used : size), used < size ? size - used : 0,
+                             ",\"duration_ms\":%u,\"position_ms\":%u,"
+                             "\"multiroom\":{\"enabled\":%s,\"running\":%s,\"sync_delay_ms\":%u,\"group\":",
+                             info.duration_ms, info.position_ms,
+                             multiroom_is_enabled() ? "true" : "false",
+                             multiroom_is_running() ? "true" : "false", multiroom_get_sync_delay());
+    room_config.group_id[sizeof(room_config.group_id) - 1] = '\0';
+    used = append_json_string(buffer, size, used, room_config.group_id);
+    used += (size_t)snprintf(buffer + (used < size ? used : size), used < size ? size - used : 0, ",\"rooms\":[");
+    for (int i = 0; i < room_count; i++) {
+        if (i > 0) {
+            used += (size_t)snprintf(buffer + (used < size ? used : size), used < size ? size - used : 0, ",");
+        }
+        rooms[i][MAX_ROOM_NAME_LEN - 1] = '\0';
+        used = append_json_string(buffer, size, used, rooms[i]);
+    }
+    used += (size_t)snprintf(buffer + (used < size ? used : size), used < size ? size - used : 0,
+                             "]},\"subscribers\":%d}", subscriber_count);
+    
+    return used < size ? (int)used : -1;
+}
+
+static void close_client(int index) {
+    api_client_t *client = clients[index];
+    if (client->state == CLIENT_SUBSCRIBED) {
+        subscriber_count--;
+    }
+    epoll_ctl(api_epoll, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    free(client);
+    clients[index] = NULL;
+}
+
+// Whole responses or nothing: a subscriber whose socket buffer is full is
+// dropped rather than queued for, it gets a fresh snapshot on reconnect
+static bool send_all(int fd, const char *data, size_t length) {
+    ssize_t sent = send(fd, data, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+    return sent == (ssize_t)length;
+}
+
+static void respond(int index, const char *status, const char *content_type, const char *body) {
+    char header[256];
+    size_t body_length = body ? strlen(body) : 0;
+    int length = snprintf(header, sizeof(header),
+                          "HTTP/1.1 %s\r\n"
+                          "Content-Type: %s\r\n"
+                          "Content-Length: %zu\r\n"
+                          "Connection: close\r\n"
+                          "\r\n", status, content_type, body_length);
+    if (send_all(clients[index]->fd, header, (size_t)length) && body_length > 0) {
+        send_all(clients[index]->fd, body, body_length);
+    }
+    close_client(index);
+}
+
+static int format_event(void) {
+    int length = control_api_format_state(snapshot, sizeof(snapshot));
+    if (length < 0) {
+        return -1;
+    }
+    return snprintf(event, sizeof(event), "event: state\ndata: %s\n\n", snapshot);
+}
+
+static void subscribe(int index) {
+    static const char header[] =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/event-stream\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n";
+    api_client_t *client = clients[index];
+    
+    client->state = CLIENT_SUBSCRIBED;
+    subscriber_count++;
+    int length = format_event();
+    if (!send_all(client->fd, header, sizeof(header) - 1) ||
+        length < 0 || !send_all(client->fd, event, (size_t)length)) {
+        close_client(index);
+    }
+}
+
+static bool parse_level(const char *query, const char *name, float *value) {
+    size_t name_length = strlen(name);
+    if (!query || strncmp(query, name, name_length) != 0 || query[name_length] != '=') {
+        return false;
+    }
+    char *end;
+    *value = strtof(query + name_length + 1, &end);
+    return end != query + name_length + 1;
+}
+
+static void handle_request(int index) {
+    char method[8];
+    char target[CONTROL_API_LINE_SIZE];
+    if (sscanf(clients[index]->line, "%7s %95s", method, target) != 2) {
+        respond(index, "400 Bad Request", "text/plain", "bad request\n");
+        return;
+    }
+    
+    char *query = strchr(target, '?');
+    if (query) {
+        *query++ = '\0';
+    }
+    
+    if (strcmp(method, "GET") == 0) {
+        if (strcmp(target, "/state") == 0) {
+            if (control_api_format_state(snapshot, sizeof(snapshot)) < 0) {
+                respond(index, "500 Internal Server Error", "text/plain", "state too large\n");
+            } else {
+                respond(index, "200 OK", "application/json", snapshot);
+            }
+        } else if (strcmp(target, "/events") == 0) {
+            subscribe(index);
+        } else {
+            respond(index, "404 Not Found", "text/plain", "not found\n");
+        }
+        return;
+    }
+    if (strcmp(method, "POST") != 0) {
+        respond(index, "405 Method Not Allowed", "text/plain", "use GET or POST\n");
+        return;
+    }
+    
+    // Playback commands are queued for the sender, the answer does not wait
+    // for it. Their outcome shows up on /events.
+    int result;
+    float value;
+    bool queued = true;
+    if (strcmp(target, "/play") == 0) {
+        result = playback_control_play(playback);
+    } else if (strcmp(target, "/pause") == 0) {
+        result = playback_control_pause(playback);
+    } else if (strcmp(target, "/stop") == 0) {
+        result = playback_control_stop(playback);
+    } else if (strcmp(target, "/next") == 0) {
+        result = playback_control_next(playback);
+    } else if (strcmp(target, "/previous") == 0) {
+        result = playback_control_previous(playback);
+    } else if (strcmp(target, "/volume") == 0 && parse_level(query, "level", &value)) {
+        result = volume_control_set_volume(volume, value);
+        queued = false;
+    } else if (strcmp(target, "/mute") == 0 && parse_level(query, "on", &value)) {
+        result = volume_control_set_mute(volume, value != 0.0f);
+        queued = false;
+    } else {
+        respond(index, "404 Not Found", "text/plain", "not found\n");
+        return;
+    }
+    
+    if (result == 0) {
+        respond(index, queued ? "202 Accepted" : "204 No Content", "text/plain", NULL);
+    } else {
+        respond(index, "409 Conflict", "text/plain", "not possible now\n");
+    }
+}
+
+static void read_client(int index) {
+    char buffer[CONTROL_API_READ_SIZE];
+    static const char blank_line[] = "\r\n\r\n";
+    
+    while (true) {
+        ssize_t bytes = recv(clients[index]->fd, buffer, sizeof(buffer), 0);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (bytes <= 0) {
+            close_client(index);
+            return;
+        }
+        
+        api_client_t *client = clients[index];
+        if (client->state == CLIENT_SUBSCRIBED) {
+            continue;
+        }
+        
+        // Headers are scanned for their end, not stored
+        for (ssize_t i = 0; i < bytes; i++) {
+            char c = buffer[i];
+            if (!client->line_done) {
+                if (c == '\r' || c == '\n') {
+                    client->line_done = true;
+                } else if (client->line_length < CONTROL_API_LINE_SIZE - 1) {
+                    client->line[client->line_length++] = c;
+                } else {
+                    respond(index, "414 URI Too Long", "text/plain", "request line too long\n");
+                    return;
+                }
+            }
+            
+            client->header_match = c == blank_line[client->header_match] ? client->header_match + 1 :
+                                   c == '\r' ? 1 : 0;
+            if (client->header_match == 4) {
+                handle_request(index);
+                // Responses close the connection, subscribers only listen
+                if (!clients[index] || clients[index]->state == CLIENT_SUBSCRIBED) {
+                    return;
+                }
+            }
+        }
+    }
+}
+
+static void accept_clients(int listen_fd) {
+    while (true) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        
+        int index = -1;
+        for (int i = 0; i < CONTROL_API_MAX_CLIENTS && index < 0; i++) {
+            if (!clients[i]) {
+                index = i;
+            }
+        }
+        api_client_t *client = index >= 0 ? calloc(1, sizeof(api_client_t)) : NULL;
+        if (!client) {
+            logger_log(LOG_WARNING, "Control API full, connection refused");
+            close(fd);
+            continue;
+        }
+        
+        client->fd = fd;
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = client;
+        if (epoll_ctl(api_epoll, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            free(client);
+            continue;
+        }
+        clients[index] = client;
+    }
+}
+
+static void broadcast(void) {
+    __atomic_store_n(&pending, false, __ATOMIC_RELEASE);
+    if (subscriber_count == 0) {
+        return;
+    }
+    
+    int length = format_event();
+    for (int i = 0; i < CONTROL_API_MAX_CLIENTS && length > 0; i++) {
+        if (clients[i] && clients[i]->state == CLIENT_SUBSCRIBED &&
+            !send_all(clients[i]->fd, event, (size_t)length)) {
+            logger_log(LOG_INFO, "Control API subscriber fell behind, disconnected");
+            close_client(i);
+        }
+    }
+}
+
+static int find_client(const api_client_t *client) {
+    for (int i = 0; i < CONTROL_API_MAX_CLIENTS; i++) {
+        if (clients[i] == client) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// The API keeps its own epoll set, so hundreds of clients take one event loop slot
+static void api_callback(int fd, uint32_t events, void *userdata) {
+    struct epoll_event ready[CONTROL_API_BATCH];
+    (void)fd;
+    (void)events;
+    (void)userdata;
+    
+    int count = epoll_wait(api_epoll, ready, CONTROL_API_BATCH, 0);
+    for (int i = 0; i < count; i++) {
+        void *tag = ready[i].data.ptr;
+        if (tag == &unix_fd || tag == &tcp_fd) {
+            accept_clients(*(int *)tag);
+        } else if (tag == &notify_fd) {
+            uint64_t value;
+            ssize_t bytes = read(notify_fd, &value, sizeof(value));
+            (void)bytes;
+            broadcast();
+        } else {
+            // Earlier events in this batch may have closed it
+            int index = find_client(tag);
+            if (index >= 0) {
+                read_client(index);
+            }
+        }
+    }
+}
+
+static int watch(int fd, void *tag) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = tag;
+    return epoll_ctl(api_epoll, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int listen_unix(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    // A socket left behind by a crash would make bind fail
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, CONTROL_API_BACKLOG) < 0) {
+        close(fd);
+        return -1;
+    }
+    snprintf(socket_path, sizeof(socket_path), "%s", path);
+    return fd;
+}
+
+static int listen_tcp(uint16_t port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, CONTROL_API_BACKLOG) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int control_api_init(const control_api_config_t *config, playback_control_t *zone_playback,
+                     volume_control_t *zone_volume) {
+    control_api_config_t defaults;
+    if (!zone_playback || !zone_volume) {
+        return -1;
+    }
+    if (!config) {
+        control_api_get_defaults(&defaults);
+        config = &defaults;
+    }
+    if (!config->socket_path && config->port == 0) {
+        return 0;
+    }
+    playback = zone_playback;
+    volume = zone_volume;
+    
+    api_epoll = epoll_create1(EPOLL_CLOEXEC);
+    notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (api_epoll < 0 || notify_fd < 0 || watch(notify_fd, &notify_fd) < 0 ||
+        event_loop_add(api_epoll, api_callback, NULL) != 0) {
+        syslog(LOG_ERR, "Failed to set up the control API");
+        control_api_cleanup();
+        return -1;
+    }
+    
+    if (config->socket_path) {
+        unix_fd = listen_unix(config->socket_path);
+        if (unix_fd < 0 || watch(unix_fd, &unix_fd) < 0) {
+            syslog(LOG_WARNING, "Cannot listen on %s: %s", config->socket_path, strerror(errno));
+        }
+    }
+    if (config->port != 0) {
+        tcp_fd = listen_tcp(config->port);
+        if (tcp_fd < 0 || watch(tcp_fd, &tcp_fd) < 0) {
+            syslog(LOG_WARNING, "Cannot listen on 127.0.0.1:%u: %s", config->port, strerror(errno));
+        }
+    }
+    
+    playback_control_set_state_callback(playback, on_state, NULL);
+    playback_control_set_info_callback(playback, on_info, NULL);
+    volume_control_set_callback(volume, on_volume, NULL);
+    multiroom_set_room_added_callback(on_room);
+    multiroom_set_room_removed_callback(on_room);
+    
+    syslog(LOG_INFO, "Control API on %s%s%s", unix_fd >= 0 ? config->socket_path : "",
+           unix_fd >= 0 && tcp_fd >= 0 ? " and " : "", tcp_fd >= 0 ? "127.0.0.1" : "");
+    return 0;
+}
+
+void control_api_cleanup(void) {
+    if (api_epoll < 0 && notify_fd < 0) {
+        return;
+    }
+    
+    if (playback) {
+        playback_control_set_state_callback(playback, NULL, NULL);
+        playback_control_set_info_callback(playback, NULL, NULL);
+    }
+    if (volume) {
+        volume_control_set_callback(volume, NULL, NULL);
+    }
+    multiroom_set_room_added_callback(NULL);
+    multiroom_set_room_removed_callback(NULL);
+    
+    for (int i = 0; i < CONTROL_API_MAX_CLIENTS; i++) {
+        if (clients[i]) {
+            close_client(i);
+        }
+    }
+    if (unix_fd >= 0) {
+        close(unix_fd);
+        unix_fd = -1;
+        unlink(socket_path);
+    }
+    if (tcp_fd >= 0) {
+        close(tcp_fd);
+        tcp_fd = -1;
+    }
+    if (api_epoll >= 0) {
+        event_loop_remove(api_epoll);
+        close(api_epoll);
+        api_epoll = -1;
+    }
+    if (notify_fd >= 0) {
+        close(notify_fd);
+        notify_fd = -1;
+    }
+    subscriber_count = 0;
+    playback = NULL;
+    volume = NULL;
+}
+
+int control_api_get_subscriber_count(void) {
+    return subscriber_count;
+}
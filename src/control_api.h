@@ -0,0 +1,35 @@
+#ifndef CONTROL_API_H
+#define CONTROL_API_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "playback_control.h"
+#include "volume_control.h"
+
+#define CONTROL_API_DEFAULT_SOCKET "/var/run/airplay2-lite.sock"
+#define CONTROL_API_MAX_CLIENTS 256
+#define CONTROL_API_SNAPSHOT_SIZE 8192
+
+typedef struct {
+    const char *socket_path;    // Unix socket, NULL for none
+    uint16_t port;              // HTTP on 127.0.0.1, 0 for none
+} control_api_config_t;
+
+void control_api_get_defaults(control_api_config_t *config);
+
+// HTTP on both listeners, served from the event loop:
+//   GET /state      JSON snapshot of playback, volume, metadata and multiroom
+//   GET /events     server-sent events, one snapshot per change
+//   POST /play, /pause, /stop, /next, /previous   202, sent to the sender later
+//   POST /volume?level=0.0-1.0, /mute?on=0|1       204
+// The API controls one zone, through its playback and volume handles.
+int control_api_init(const control_api_config_t *config, playback_control_t *playback,
+                     volume_control_t *volume);
+void control_api_cleanup(void);
+
+// Snapshot as served by GET /state, returns its length or -1
+int control_api_format_state(char *buffer, size_t size);
+int control_api_get_subscriber_count(void);
+
+#endif // CONTROL_API_H
@@ -0,0 +1,1215 @@
+#include "crypto_engine.h"
+#include "crypto_utils.h"
+#include "pairing_store.h"
+#include "thread_policy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <openssl/bn.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <openssl/crypto.h>
+
+#define CRYPTO_ENGINE_WORKERS 1
+#define JOB_QUEUE_SIZE 8
+#define MAX_ID_LENGTH PAIRING_STORE_MAX_ID
+
+#define SRP_USERNAME "Pair-Setup"
+#define SRP_PIN "3939"
+#define SRP_SALT_SIZE 16
+#define SRP_PRIVATE_SIZE 32
+#define SRP_MODULUS_SIZE 384
+
+#define AES_KEY_SIZE 16
+#define RSA_MAX_SIZE 512
+
+// TLV8 types used by pair-setup / pair-verify
+#define TLV_METHOD 0x00
+#define TLV_IDENTIFIER 0x01
+#define TLV_SALT 0x02
+#define TLV_PUBLIC_KEY 0x03
+#define TLV_PROOF 0x04
+#define TLV_ENCRYPTED_DATA 0x05
+#define TLV_STATE 0x06
+#define TLV_ERROR 0x07
+#define TLV_SIGNATURE 0x0A
+#define TLV_FLAGS 0x13
+
+#define TLV_ERROR_UNKNOWN 0x01
+#define TLV_ERROR_AUTHENTICATION 0x02
+
+#define PAIR_FLAG_TRANSIENT 0x10
+
+// Handshake state, worked on by the crypto worker outside the engine lock
+typedef struct {
+    // pair-setup
+    int setup_step;
+    bool transient;
+    uint8_t srp_b[SRP_PRIVATE_SIZE];
+    uint8_t srp_B[SRP_MODULUS_SIZE];
+    uint8_t srp_K[SHA512_DIGEST_SIZE];
+    
+    // pair-verify
+    int verify_step;
+    uint8_t verify_public[CURVE25519_KEY_SIZE];
+    uint8_t controller_public[CURVE25519_KEY_SIZE];
+    uint8_t verify_shared[CURVE25519_KEY_SIZE];
+    uint8_t verify_key[CHACHA20_POLY1305_KEY_SIZE];
+    
+    // Result
+    bool verified;
+    uint8_t control_read_key[CHACHA20_POLY1305_KEY_SIZE];
+    uint8_t control_write_key[CHACHA20_POLY1305_KEY_SIZE];
+} pairing_state_t;
+
+typedef struct {
+    uint32_t generation;
+    pairing_state_t pairing;
+    
+    // AirPlay 1 audio key (rsaaeskey / aesiv)
+    bool has_audio_key;
+    uint8_t audio_iv[AES_KEY_SIZE];
+    EVP_CIPHER_CTX *audio_ctx;
+} crypto_session_t;
+
+typedef struct {
+    int session;
+    uint32_t generation;
+    crypto_job_type_t type;
+    crypto_job_callback_t callback;
+    void *userdata;
+    int status;
+    uint8_t request[CRYPTO_ENGINE_MAX_MESSAGE];
+    size_t request_length;
+    uint8_t response[CRYPTO_ENGINE_MAX_MESSAGE];
+    size_t response_length;
+} crypto_job_t;
+
+typedef struct {
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+} tlv_writer_t;
+
+static pthread_mutex_t engine_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool is_initialized = false;
+
+// Long-term keys, parsed once at startup
+static EVP_PKEY *accessory_key = NULL;
+static uint8_t accessory_public[ED25519_KEY_SIZE];
+static EVP_PKEY *rsa_key = NULL;
+static char accessory_id[MAX_ID_LENGTH] = "OpenWRT-AirPlay-001";
+
+// Precomputed SRP-6a parameters (3072-bit group, SHA-512)
+static BIGNUM *srp_N = NULL;
+static BIGNUM *srp_g = NULL;
+static BIGNUM *srp_k = NULL;
+static BIGNUM *srp_v = NULL;
+static BN_MONT_CTX *srp_mont = NULL;
+static uint8_t srp_salt[SRP_SALT_SIZE];
+static uint8_t srp_hn_xor_hg[SHA512_DIGEST_SIZE];
+static uint8_t srp_h_user[SHA512_DIGEST_SIZE];
+
+// Per client sessions
+static crypto_session_t sessions[CRYPTO_ENGINE_MAX_SESSIONS];
+static crypto_engine_stats_t engine_stats;
+
+// Job queues
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t workers[CRYPTO_ENGINE_WORKERS];
+static int worker_count = 0;
+static bool shutting_down = false;
+static crypto_job_t job_pool[JOB_QUEUE_SIZE];
+static int free_jobs[JOB_QUEUE_SIZE];
+static int free_count = 0;
+static int pending_jobs[JOB_QUEUE_SIZE];
+static int pending_head = 0;
+static int pending_count = 0;
+static int done_jobs[JOB_QUEUE_SIZE];
+static int done_head = 0;
+static int done_count = 0;
+static int notify_pipe[2] = {-1, -1};
+
+static void* worker_thread(void *arg);
+
+// TLV8 helpers
+static int tlv_add(tlv_writer_t *writer, uint8_t type, const uint8_t *value, size_t length) {
+    do {
+        size_t chunk = length > 255 ? 255 : length;
+        if (writer->length + 2 + chunk > writer->capacity) {
+            return -1;
+        }
+        writer->data[writer->length++] = type;
+        writer->data[writer->length++] = (uint8_t)chunk;
+        if (chunk > 0) {
+            memcpy(writer->data + writer->length, value, chunk);
+        }
+        writer->length += chunk;
+        value += chunk;
+        length -= chunk;
+    } while (length > 0);
+    
+    return 0;
+}
+
+static int tlv_add_byte(tlv_writer_t *writer, uint8_t type, uint8_t value) {
+    return tlv_add(writer, type, &value, 1);
+}
+
+// Finds an item and merges fragments; *length holds the capacity on input
+static int tlv_find(const uint8_t *data, size_t data_length, uint8_t type,
+                    uint8_t *value, size_t *length) {
+    size_t capacity = *length;
+    size_t pos = 0;
+    bool found = false;
+    
+    *length = 0;
+    while (pos + 2 <= data_length) {
+        uint8_t item_type = data[pos];
+        size_t item_length = data[pos + 1];
+        if (pos + 2 + item_length > data_length) {
+            return -1;
+        }
+        
+        if (item_type == type) {
+            if (*length + item_length > capacity) {
+                return -1;
+            }
+            memcpy(value + *length, data + pos + 2, item_length);
+            *length += item_length;
+            found = true;
+        } else if (found) {
+            break;
+        }
+        pos += 2 + item_length;
+    }
+    
+    return found ? 0 : -1;
+}
+
+static int tlv_find_byte(const uint8_t *data, size_t data_length, uint8_t type, uint8_t *value) {
+    size_t length = 1;
+    if (tlv_find(data, data_length, type, value, &length) != 0 || length != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+static int tlv_error(tlv_writer_t *writer, uint8_t state, uint8_t error) {
+    writer->length = 0;
+    tlv_add_byte(writer, TLV_STATE, state);
+    tlv_add_byte(writer, TLV_ERROR, error);
+    return -1;
+}
+
+static void make_nonce(uint8_t *nonce, const char *label) {
+    memset(nonce, 0, CHACHA20_POLY1305_NONCE_SIZE);
+    memcpy(nonce + 4, label, 8);
+}
+
+static uint32_t elapsed_us(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t)((now.tv_sec - start->tv_sec) * 1000000L +
+                      (now.tv_nsec - start->tv_nsec) / 1000L);
+}
+
+// Key loading
+static int load_accessory_key(const char *key_dir) {
+    char path[256];
+    uint8_t seed[ED25519_KEY_SIZE];
+    
+    snprintf(path, sizeof(path), "%s/accessory.key", key_dir);
+    
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        ssize_t bytes_read = read(fd, seed, sizeof(seed));
+        close(fd);
+        if (bytes_read != (ssize_t)sizeof(seed)) {
+            syslog(LOG_ERR, "Accessory key %s is corrupt", path);
+            return -1;
+        }
+    } else {
+        // First start: create a new long-term identity
+        if (generate_random_bytes(seed, sizeof(seed)) != 0) {
+            return -1;
+        }
+        mkdir(key_dir, 0700);
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0 || write(fd, seed, sizeof(seed)) != (ssize_t)sizeof(seed)) {
+            syslog(LOG_WARNING, "Failed to store accessory key in %s, pairings will not survive restart", path);
+        }
+        if (fd >= 0) {
+            fsync(fd);
+            close(fd);
+        }
+        syslog(LOG_INFO, "Generated new accessory key");
+    }
+    
+    accessory_key = EVP_PKEY_new_raw_private_key(EVP_PKEY_ED25519, NULL, seed, sizeof(seed));
+    OPENSSL_cleanse(seed, sizeof(seed));
+    if (!accessory_key) {
+        return -1;
+    }
+    
+    size_t length = sizeof(accessory_public);
+    if (EVP_PKEY_get_raw_public_key(accessory_key, accessory_public, &length) != 1) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+static int load_rsa_key(const char *key_dir) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/airport.pem", key_dir);
+    
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        syslog(LOG_INFO, "No RSA key at %s, AirPlay 1 encrypted audio disabled", path);
+        return 0;
+    }
+    
+    rsa_key = PEM_read_PrivateKey(file, NULL, NULL, NULL);
+    fclose(file);
+    
+    if (!rsa_key) {
+        syslog(LOG_ERR, "Failed to parse RSA key %s", path);
+        return -1;
+    }
+    
+    return 0;
+}
+
+static int bn_to_padded(const BIGNUM *bn, uint8_t *output, size_t length) {
+    return BN_bn2binpad(bn, output, length) == (int)length ? 0 : -1;
+}
+
+static int srp_precompute(void) {
+    uint8_t buffer[SRP_SALT_SIZE + SHA512_DIGEST_SIZE];
+    uint8_t modulus[SRP_MODULUS_SIZE * 2];
+    uint8_t hash[SHA512_DIGEST_SIZE];
+    uint8_t hash_g[SHA512_DIGEST_SIZE];
+    uint8_t generator = 5;
+    int result = -1;
+    
+    BN_CTX *ctx = BN_CTX_new();
+    BIGNUM *x = BN_new();
+    srp_N = BN_get_rfc3526_prime_3072(NULL);
+    srp_g = BN_new();
+    srp_k = BN_new();
+    srp_v = BN_new();
+    srp_mont = BN_MONT_CTX_new();
+    
+    if (!ctx || !x || !srp_N || !srp_g || !srp_k || !srp_v || !srp_mont ||
+        !BN_set_word(srp_g, generator) ||
+        !BN_MONT_CTX_set(srp_mont, srp_N, ctx)) {
+        goto out;
+    }
+    
+    // x = H(s | H(I ":" P)), v = g^x
+    if (generate_random_bytes(srp_salt, sizeof(srp_salt)) != 0) {
+        goto out;
+    }
+    sha512_hash((const uint8_t *)SRP_USERNAME ":" SRP_PIN,
+                strlen(SRP_USERNAME ":" SRP_PIN), hash);
+    memcpy(buffer, srp_salt, SRP_SALT_SIZE);
+    memcpy(buffer + SRP_SALT_SIZE, hash, SHA512_DIGEST_SIZE);
+    sha512_hash(buffer, sizeof(buffer), hash);
+    if (!BN_bin2bn(hash, sizeof(hash), x) ||
+        !BN_mod_exp_mont(srp_v, srp_g, x, srp_N, ctx, srp_mont)) {
+        goto out;
+    }
+    
+    // k = H(N | PAD(g))
+    if (bn_to_padded(srp_N, modulus, SRP_MODULUS_SIZE) != 0 ||
+        bn_to_padded(srp_g, modulus + SRP_MODULUS_SIZE, SRP_MODULUS_SIZE) != 0) {
+        goto out;
+    }
+    sha512_hash(modulus, sizeof(modulus), hash);
+    if (!BN_bin2bn(hash, sizeof(hash), srp_k)) {
+        goto out;
+    }
+    
+    // H(N) xor H(g) and H(I) are constant for every proof
+    sha512_hash(modulus, SRP_MODULUS_SIZE, hash);
+    sha512_hash(&generator, 1, hash_g);
+    for (int i = 0; i < SHA512_DIGEST_SIZE; i++) {
+        srp_hn_xor_hg[i] = hash[i] ^ hash_g[i];
+    }
+    sha512_hash((const uint8_t *)SRP_USERNAME, strlen(SRP_USERNAME), srp_h_user);
+    
+    result = 0;
+
+out:
+    BN_clear_free(x);
+    BN_CTX_free(ctx);
+    return result;
+}
+
+static void srp_free(void) {
+    BN_free(srp_N);
+    BN_free(srp_g);
+    BN_free(srp_k);
+    BN_clear_free(srp_v);
+    BN_MONT_CTX_free(srp_mont);
+    srp_N = srp_g = srp_k = srp_v = NULL;
+    srp_mont = NULL;
+}
+
+static int sign_with_accessory_key(const uint8_t *message, size_t length, uint8_t *signature) {
+    EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+    size_t signature_length = ED25519_SIGNATURE_SIZE;
+    int result = -1;
+    
+    if (mdctx &&
+        EVP_DigestSignInit(mdctx, NULL, NULL, NULL, accessory_key) == 1 &&
+        EVP_DigestSign(mdctx, signature, &signature_length, message, length) == 1) {
+        result = 0;
+    }
+    
+    EVP_MD_CTX_free(mdctx);
+    return result;
+}
+
+static int derive_control_keys(pairing_state_t *state, const uint8_t *secret, size_t length) {
+    if (hkdf_sha512(secret, length, "Control-Salt", "Control-Read-Encryption-Key",
+                    state->control_read_key, sizeof(state->control_read_key)) != 0 ||
+        hkdf_sha512(secret, length, "Control-Salt", "Control-Write-Encryption-Key",
+                    state->control_write_key, sizeof(state->control_write_key)) != 0) {
+        return -1;
+    }
+    
+    state->verified = true;
+    return 0;
+}
+
+// pair-setup M1 -> M2: send salt and server public key B = k*v + g^b
+static int pair_setup_m1(pairing_state_t *state, const uint8_t *request, size_t request_length,
+                         tlv_writer_t *response) {
+    uint8_t flags[4] = {0};
+    size_t flags_length = sizeof(flags);
+    int result = -1;
+    
+    state->transient = false;
+    state->verified = false;
+    if (tlv_find(request, request_length, TLV_FLAGS, flags, &flags_length) == 0) {
+        state->transient = (flags[0] & PAIR_FLAG_TRANSIENT) != 0;
+    }
+    
+    BN_CTX *ctx = BN_CTX_new();
+    BIGNUM *b = BN_new();
+    BIGNUM *B = BN_new();
+    BIGNUM *gb = BN_new();
+    
+    if (!ctx || !b || !B || !gb ||
+        generate_random_bytes(state->srp_b, sizeof(state->srp_b)) != 0 ||
+        !BN_bin2bn(state->srp_b, sizeof(state->srp_b), b) ||
+        !BN_mod_mul(B, srp_k, srp_v, srp_N, ctx) ||
+        !BN_mod_exp_mont(gb, srp_g, b, srp_N, ctx, srp_mont) ||
+        !BN_mod_add(B, B, gb, srp_N, ctx) ||
+        bn_to_padded(B, state->srp_B, sizeof(state->srp_B)) != 0) {
+        tlv_error(response, 2, TLV_ERROR_UNKNOWN);
+        goto out;
+    }
+    
+    tlv_add_byte(response, TLV_STATE, 2);
+    tlv_add(response, TLV_SALT, srp_salt, sizeof(srp_salt));
+    if (tlv_add(response, TLV_PUBLIC_KEY, state->srp_B, sizeof(state->srp_B)) != 0) {
+        goto out;
+    }
+    
+    state->setup_step = 2;
+    result = 0;
+
+out:
+    BN_clear_free(b);
+    BN_free(B);
+    BN_clear_free(gb);
+    BN_CTX_free(ctx);
+    return result;
+}
+
+// pair-setup M3 -> M4: verify client proof, answer with server proof
+static int pair_setup_m3(pairing_state_t *state, const uint8_t *request, size_t request_length,
+                         tlv_writer_t *response) {
+    uint8_t a_bytes[SRP_MODULUS_SIZE];
+    uint8_t proof[SHA512_DIGEST_SIZE];
+    uint8_t buffer[SRP_MODULUS_SIZE * 2];
+    uint8_t expected[SHA512_DIGEST_SIZE];
+    size_t a_length = sizeof(a_bytes);
+    size_t proof_length = sizeof(proof);
+    int result = -1;
+    
+    if (state->setup_step != 2 ||
+        tlv_find(request, request_length, TLV_PUBLIC_KEY, a_bytes, &a_length) != 0 ||
+        tlv_find(request, request_length, TLV_PROOF, proof, &proof_length) != 0 ||
+        proof_length != sizeof(proof)) {
+        return tlv_error(response, 4, TLV_ERROR_AUTHENTICATION);
+    }
+    
+    BN_CTX *ctx = BN_CTX_new();
+    BIGNUM *A = BN_bin2bn(a_bytes, a_length, NULL);
+    BIGNUM *B = BN_bin2bn(state->srp_B, sizeof(state->srp_B), NULL);
+    BIGNUM *b = BN_bin2bn(state->srp_b, sizeof(state->srp_b), NULL);
+    BIGNUM *u = BN_new();
+    BIGNUM *S = BN_new();
+    BIGNUM *tmp = BN_new();
+    
+    if (!ctx || !A || !B || !b || !u || !S || !tmp) {
+        tlv_error(response, 4, TLV_ERROR_UNKNOWN);
+        goto out;
+    }
+    
+    // Reject A % N == 0
+    if (!BN_mod(tmp, A, srp_N, ctx) || BN_is_zero(tmp)) {
+        tlv_error(response, 4, TLV_ERROR_AUTHENTICATION);
+        goto out;
+    }
+    
+    // u = H(PAD(A) | PAD(B)), S = (A * v^u)^b, K = H(S)
+    uint8_t hash[SHA512_DIGEST_SIZE];
+    if (bn_to_padded(A, buffer, SRP_MODULUS_SIZE) != 0) {
+        tlv_error(response, 4, TLV_ERROR_AUTHENTICATION);
+        goto out;
+    }
+    memcpy(buffer + SRP_MODULUS_SIZE, state->srp_B, SRP_MODULUS_SIZE);
+    sha512_hash(buffer, sizeof(buffer), hash);
+    
+    if (!BN_bin2bn(hash, sizeof(hash), u) ||
+        !BN_mod_exp_mont(tmp, srp_v, u, srp_N, ctx, srp_mont) ||
+        !BN_mod_mul(tmp, A, tmp, srp_N, ctx) ||
+        !BN_mod_exp_mont(S, tmp, b, srp_N, ctx, srp_mont)) {
+        tlv_error(response, 4, TLV_ERROR_UNKNOWN);
+        goto out;
+    }
+    
+    int s_length = BN_bn2bin(S, buffer);
+    sha512_hash(buffer, s_length, state->srp_K);
+    
+    // M1 = H(H(N) xor H(g) | H(I) | s | A | B | K)
+    EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+    unsigned int digest_length = 0;
+    int ok = mdctx && EVP_DigestInit_ex(mdctx, EVP_sha512(), NULL) == 1;
+    ok = ok && EVP_DigestUpdate(mdctx, srp_hn_xor_hg, sizeof(srp_hn_xor_hg)) == 1;
+    ok = ok && EVP_DigestUpdate(mdctx, srp_h_user, sizeof(srp_h_user)) == 1;
+    ok = ok && EVP_DigestUpdate(mdctx, srp_salt, sizeof(srp_salt)) == 1;
+    int length = BN_bn2bin(A, buffer);
+    ok = ok && EVP_DigestUpdate(mdctx, buffer, length) == 1;
+    length = BN_bn2bin(B, buffer);
+    ok = ok && EVP_DigestUpdate(mdctx, buffer, length) == 1;
+    ok = ok && EVP_DigestUpdate(mdctx, state->srp_K, sizeof(state->srp_K)) == 1;
+    ok = ok && EVP_DigestFinal_ex(mdctx, expected, &digest_length) == 1;
+    EVP_MD_CTX_free(mdctx);
+    
+    if (!ok || CRYPTO_memcmp(expected, proof, sizeof(proof)) != 0) {
+        syslog(LOG_WARNING, "pair-setup: client proof mismatch");
+        tlv_error(response, 4, TLV_ERROR_AUTHENTICATION);
+        goto out;
+    }
+    
+    // M2 = H(A | M1 | K)
+    length = BN_bn2bin(A, buffer);
+    memcpy(buffer + length, proof, sizeof(proof));
+    length += sizeof(proof);
+    memcpy(buffer + length, state->srp_K, sizeof(state->srp_K));
+    length += sizeof(state->srp_K);
+    sha512_hash(buffer, length, expected);
+    
+    tlv_add_byte(response, TLV_STATE, 4);
+    tlv_add(response, TLV_PROOF, expected, sizeof(expected));
+    
+    // Transient pairing ends here and keys come straight from the SRP secret
+    if (state->transient &&
+        derive_control_keys(state, state->srp_K, sizeof(state->srp_K)) != 0) {
+        tlv_error(response, 4, TLV_ERROR_UNKNOWN);
+        goto out;
+    }
+    
+    state->setup_step = 4;
+    result = 0;
+
+out:
+    BN_free(A);
+    BN_free(B);
+    BN_clear_free(b);
+    BN_free(u);
+    BN_clear_free(S);
+    BN_clear_free(tmp);
+    BN_CTX_free(ctx);
+    return result;
+}
+
+// pair-setup M5 -> M6: exchange long-term public keys
+static int pair_setup_m5(pairing_state_t *state, const uint8_t *request, size_t request_length,
+                         tlv_writer_t *response) {
+    uint8_t encrypted[CRYPTO_ENGINE_MAX_MESSAGE];
+    uint8_t decrypted[CRYPTO_ENGINE_MAX_MESSAGE];
+    uint8_t key[CHACHA20_POLY1305_KEY_SIZE];
+    uint8_t nonce[CHACHA20_POLY1305_NONCE_SIZE];
+    uint8_t device_x[32];
+    uint8_t info[32 + MAX_ID_LENGTH + ED25519_KEY_SIZE];
+    uint8_t id[MAX_ID_LENGTH];
+    uint8_t ltpk[ED25519_KEY_SIZE];
+    uint8_t signature[ED25519_SIGNATURE_SIZE];
+    size_t encrypted_length = sizeof(encrypted);
+    size_t id_length = sizeof(id);
+    size_t ltpk_length = sizeof(ltpk);
+    size_t signature_length = sizeof(signature);
+    
+    if (state->setup_step != 4 || state->transient ||
+        tlv_find(request, request_length, TLV_ENCRYPTED_DATA, encrypted, &encrypted_length) != 0 ||
+        encrypted_length <= CHACHA20_POLY1305_TAG_SIZE) {
+        return tlv_error(response, 6, TLV_ERROR_AUTHENTICATION);
+    }
+    
+    size_t data_length = encrypted_length - CHACHA20_POLY1305_TAG_SIZE;
+    make_nonce(nonce, "PS-Msg05");
+    if (hkdf_sha512(state->srp_K, sizeof(state->srp_K), "Pair-Setup-Encrypt-Salt",
+                    "Pair-Setup-Encrypt-Info", key, sizeof(key)) != 0 ||
+        chacha20_poly1305_decrypt(key, nonce, NULL, 0, encrypted, data_length,
+                                  encrypted + data_length, decrypted) != 0) {
+        return tlv_error(response, 6, TLV_ERROR_AUTHENTICATION);
+    }
+    
+    if (tlv_find(decrypted, data_length, TLV_IDENTIFIER, id, &id_length) != 0 ||
+        tlv_find(decrypted, data_length, TLV_PUBLIC_KEY, ltpk, &ltpk_length) != 0 ||
+        tlv_find(decrypted, data_length, TLV_SIGNATURE, signature, &signature_length) != 0 ||
+        ltpk_length != sizeof(ltpk) || signature_length != sizeof(signature)) {
+        return tlv_error(response, 6, TLV_ERROR_AUTHENTICATION);
+    }
+    
+    // Verify iOSDeviceX | pairing id | LTPK
+    if (hkdf_sha512(state->srp_K, sizeof(state->srp_K), "Pair-Setup-Controller-Sign-Salt",
+                    "Pair-Setup-Controller-Sign-Info", device_x, sizeof(device_x)) != 0) {
+        return tlv_error(response, 6, TLV_ERROR_UNKNOWN);
+    }
+    memcpy(info, device_x, sizeof(device_x));
+    memcpy(info + sizeof(device_x), id, id_length);
+    memcpy(info + sizeof(device_x) + id_length, ltpk, sizeof(ltpk));
+    if (ed25519_verify(ltpk, info, sizeof(device_x) + id_length + sizeof(ltpk), signature) != 0) {
+        syslog(LOG_WARNING, "pair-setup: controller signature invalid");
+        return tlv_error(response, 6, TLV_ERROR_AUTHENTICATION);
+    }
+    
+    // The first controller to pair becomes the admin
+    uint8_t permissions = pairing_store_get_count() == 0 ? PAIRING_PERMISSION_ADMIN : PAIRING_PERMISSION_USER;
+    if (pairing_store_add(id, id_length, ltpk, permissions) != 0) {
+        syslog(LOG_WARNING, "pair-setup: failed to persist controller %.*s", (int)id_length, (const char *)id);
+    }
+    
+    // Sign AccessoryX | accessory id | accessory LTPK
+    size_t accessory_id_length = strlen(accessory_id);
+    if (hkdf_sha512(state->srp_K, sizeof(state->srp_K), "Pair-Setup-Accessory-Sign-Salt",
+                    "Pair-Setup-Accessory-Sign-Info", device_x, sizeof(device_x)) != 0) {
+        return tlv_error(response, 6, TLV_ERROR_UNKNOWN);
+    }
+    memcpy(info, device_x, sizeof(device_x));
+    memcpy(info + sizeof(device_x), accessory_id, accessory_id_length);
+    memcpy(info + sizeof(device_x) + accessory_id_length, accessory_public, sizeof(accessory_public));
+    if (sign_with_accessory_key(info, sizeof(device_x) + accessory_id_length + sizeof(accessory_public),
+                                signature) != 0) {
+        return tlv_error(response, 6, TLV_ERROR_UNKNOWN);
+    }
+    
+    tlv_writer_t inner = {decrypted, 0, sizeof(decrypted) - CHACHA20_POLY1305_TAG_SIZE};
+    tlv_add(&inner, TLV_IDENTIFIER, (const uint8_t *)accessory_id, accessory_id_length);
+    tlv_add(&inner, TLV_PUBLIC_KEY, accessory_public, sizeof(accessory_public));
+    tlv_add(&inner, TLV_SIGNATURE, signature, sizeof(signature));
+    
+    make_nonce(nonce, "PS-Msg06");
+    if (chacha20_poly1305_encrypt(key, nonce, NULL, 0, inner.data, inner.length,
+                                  encrypted, encrypted + inner.length) != 0) {
+        return tlv_error(response, 6, TLV_ERROR_UNKNOWN);
+    }
+    
+    tlv_add_byte(response, TLV_STATE, 6);
+    tlv_add(response, TLV_ENCRYPTED_DATA, encrypted, inner.length + CHACHA20_POLY1305_TAG_SIZE);
+    
+    state->setup_step = 6;
+    OPENSSL_cleanse(key, sizeof(key));
+    return 0;
+}
+
+static int handle_pair_setup(pairing_state_t *state, const uint8_t *request, size_t request_length,
+                             tlv_writer_t *response) {
+    uint8_t step;
+    if (tlv_find_byte(request, request_length, TLV_STATE, &step) != 0) {
+        return tlv_error(response, 2, TLV_ERROR_UNKNOWN);
+    }
+    
+    switch (step) {
+        case 1:
+            state->setup_step = 0;
+            return pair_setup_m1(state, request, request_length, response);
+        case 3:
+            return pair_setup_m3(state, request, request_length, response);
+        case 5:
+            return pair_setup_m5(state, request, request_length, response);
+        default:
+            return tlv_error(response, step + 1, TLV_ERROR_UNKNOWN);
+    }
+}
+
+// pair-verify M1 -> M2: ephemeral Curve25519 exchange signed with the accessory LTSK
+static int pair_verify_m1(pairing_state_t *state, const uint8_t *request, size_t request_length,
+                          tlv_writer_t *response) {
+    uint8_t private_key[CURVE25519_KEY_SIZE];
+    uint8_t info[CURVE25519_KEY_SIZE * 2 + MAX_ID_LENGTH];
+    uint8_t signature[ED25519_SIGNATURE_SIZE];
+    uint8_t inner_buffer[256];
+    uint8_t encrypted[256];
+    uint8_t nonce[CHACHA20_POLY1305_NONCE_SIZE];
+    size_t public_length = sizeof(state->controller_public);
+    size_t accessory_id_length = strlen(accessory_id);
+    
+    state->verify_step = 0;
+    state->verified = false;
+    if (tlv_find(request, request_length, TLV_PUBLIC_KEY, state->controller_public, &public_length) != 0 ||
+        public_length != CURVE25519_KEY_SIZE) {
+        return tlv_error(response, 2, TLV_ERROR_AUTHENTICATION);
+    }
+    
+    if (x25519_generate_keypair(state->verify_public, private_key) != 0 ||
+        x25519_shared_secret(private_key, state->controller_public, state->verify_shared) != 0) {
+        OPENSSL_cleanse(private_key, sizeof(private_key));
+        return tlv_error(response, 2, TLV_ERROR_UNKNOWN);
+    }
+    OPENSSL_cleanse(private_key, sizeof(private_key));
+    
+    memcpy(info, state->verify_public, CURVE25519_KEY_SIZE);
+    memcpy(info + CURVE25519_KEY_SIZE, accessory_id, accessory_id_length);
+    memcpy(info + CURVE25519_KEY_SIZE + accessory_id_length, state->controller_public, CURVE25519_KEY_SIZE);
+    if (sign_with_accessory_key(info, CURVE25519_KEY_SIZE * 2 + accessory_id_length, signature) != 0 ||
+        hkdf_sha512(state->verify_shared, sizeof(state->verify_shared), "Pair-Verify-Encrypt-Salt",
+                    "Pair-Verify-Encrypt-Info", state->verify_key, sizeof(state->verify_key)) != 0) {
+        return tlv_error(response, 2, TLV_ERROR_UNKNOWN);
+    }
+    
+    tlv_writer_t inner = {inner_buffer, 0, sizeof(inner_buffer)};
+    tlv_add(&inner, TLV_IDENTIFIER, (const uint8_t *)accessory_id, accessory_id_length);
+    tlv_add(&inner, TLV_SIGNATURE, signature, sizeof(signature));
+    
+    make_nonce(nonce, "PV-Msg02");
+    if (inner.length + CHACHA20_POLY1305_TAG_SIZE > sizeof(encrypted) ||
+        chacha20_poly1305_encrypt(state->verify_key, nonce, NULL, 0, inner.data, inner.length,
+                                  encrypted, encrypted + inner.length) != 0) {
+        return tlv_error(response, 2, TLV_ERROR_UNKNOWN);
+    }
+    
+    tlv_add_byte(response, TLV_STATE, 2);
+    tlv_add(response, TLV_PUBLIC_KEY, state->verify_public, sizeof(state->verify_public));
+    tlv_add(response, TLV_ENCRYPTED_DATA, encrypted, inner.length + CHACHA20_POLY1305_TAG_SIZE);
+    
+    state->verify_step = 2;
+    return 0;
+}
+
+// pair-verify M3 -> M4: check the controller signature and derive control channel keys
+static int pair_verify_m3(pairing_state_t *state, const uint8_t *request, size_t request_length,
+                          tlv_writer_t *response) {
+    uint8_t encrypted[256];
+    uint8_t decrypted[256];
+    uint8_t nonce[CHACHA20_POLY1305_NONCE_SIZE];
+    uint8_t id[MAX_ID_LENGTH];
+    uint8_t signature[ED25519_SIGNATURE_SIZE];
+    uint8_t ltpk[ED25519_KEY_SIZE];
+    uint8_t info[CURVE25519_KEY_SIZE * 2 + MAX_ID_LENGTH];
+    size_t encrypted_length = sizeof(encrypted);
+    size_t id_length = sizeof(id);
+    size_t signature_length = sizeof(signature);
+    
+    if (state->verify_step != 2 ||
+        tlv_find(request, request_length, TLV_ENCRYPTED_DATA, encrypted, &encrypted_length) != 0 ||
+        encrypted_length <= CHACHA20_POLY1305_TAG_SIZE) {
+        return tlv_error(response, 4, TLV_ERROR_AUTHENTICATION);
+    }
+    
+    size_t data_length = encrypted_length - CHACHA20_POLY1305_TAG_SIZE;
+    make_nonce(nonce, "PV-Msg03");
+    if (chacha20_poly1305_decrypt(state->verify_key, nonce, NULL, 0, encrypted, data_length,
+                                  encrypted + data_length, decrypted) != 0 ||
+        tlv_find(decrypted, data_length, TLV_IDENTIFIER, id, &id_length) != 0 ||
+        tlv_find(decrypted, data_length, TLV_SIGNATURE, signature, &signature_length) != 0 ||
+        signature_length != sizeof(signature)) {
+        return tlv_error(response, 4, TLV_ERROR_AUTHENTICATION);
+    }
+    
+    if (pairing_store_lookup(id, id_length, ltpk, NULL) != 0) {
+        syslog(LOG_INFO, "pair-verify: unknown controller %.*s", (int)id_length, (const char *)id);
+        return tlv_error(response, 4, TLV_ERROR_AUTHENTICATION);
+    }
+    
+    memcpy(info, state->controller_public, CURVE25519_KEY_SIZE);
+    memcpy(info + CURVE25519_KEY_SIZE, id, id_length);
+    memcpy(info + CURVE25519_KEY_SIZE + id_length, state->verify_public, CURVE25519_KEY_SIZE);
+    if (ed25519_verify(ltpk, info, CURVE25519_KEY_SIZE * 2 + id_length, signature) != 0) {
+        syslog(LOG_WARNING, "pair-verify: controller signature invalid");
+        return tlv_error(response, 4, TLV_ERROR_AUTHENTICATION);
+    }
+    
+    if (derive_control_keys(state, state->verify_shared, sizeof(state->verify_shared)) != 0) {
+        return tlv_error(response, 4, TLV_ERROR_UNKNOWN);
+    }
+    
+    tlv_add_byte(response, TLV_STATE, 4);
+    state->verify_step = 4;
+    return 0;
+}
+
+static int handle_pair_verify(pairing_state_t *state, const uint8_t *request, size_t request_length,
+                              tlv_writer_t *response) {
+    uint8_t step;
+    if (tlv_find_byte(request, request_length, TLV_STATE, &step) != 0) {
+        return tlv_error(response, 2, TLV_ERROR_UNKNOWN);
+    }
+    
+    switch (step) {
+        case 1:
+            return pair_verify_m1(state, request, request_length, response);
+        case 3:
+            return pair_verify_m3(state, request, request_length, response);
+        default:
+            return tlv_error(response, step + 1, TLV_ERROR_UNKNOWN);
+    }
+}
+
+// rsaaeskey: request is aesiv (16 bytes) followed by the RSA-OAEP encrypted AES key
+static int handle_rsa_aes_key(crypto_job_t *job) {
+    uint8_t key[RSA_MAX_SIZE];
+    size_t key_length = sizeof(key);
+    
+    if (!rsa_key || job->request_length <= AES_KEY_SIZE) {
+        return -1;
+    }
+    
+    EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new(rsa_key, NULL);
+    if (!pctx ||
+        EVP_PKEY_decrypt_init(pctx) != 1 ||
+        EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_OAEP_PADDING) != 1 ||
+        EVP_PKEY_decrypt(pctx, key, &key_length, job->request + AES_KEY_SIZE,
+                         job->request_length - AES_KEY_SIZE) != 1 ||
+        key_length != AES_KEY_SIZE) {
+        EVP_PKEY_CTX_free(pctx);
+        return -1;
+    }
+    EVP_PKEY_CTX_free(pctx);
+    
+    int result = -1;
+    pthread_mutex_lock(&engine_mutex);
+    crypto_session_t *session = &sessions[job->session];
+    if (session->generation == job->generation) {
+        if (!session->audio_ctx) {
+            session->audio_ctx = EVP_CIPHER_CTX_new();
+        }
+        if (session->audio_ctx &&
+            EVP_DecryptInit_ex(session->audio_ctx, EVP_aes_128_cbc(), NULL, key, job->request) == 1) {
+            EVP_CIPHER_CTX_set_padding(session->audio_ctx, 0);
+            memcpy(session->audio_iv, job->request, AES_KEY_SIZE);
+            session->has_audio_key = true;
+            result = 0;
+        }
+    }
+    pthread_mutex_unlock(&engine_mutex);
+    
+    OPENSSL_cleanse(key, sizeof(key));
+    return result;
+}
+
+static void run_job(crypto_job_t *job) {
+    pairing_state_t state;
+    struct timespec start;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    job->response_length = 0;
+    
+    if (job->type == CRYPTO_JOB_RSA_AES_KEY) {
+        job->status = handle_rsa_aes_key(job);
+    } else {
+        // Work on a private copy so the lock is not held during the big number math
+        pthread_mutex_lock(&engine_mutex);
+        state = sessions[job->session].pairing;
+        pthread_mutex_unlock(&engine_mutex);
+        
+        tlv_writer_t response = {job->response, 0, sizeof(job->response)};
+        if (job->type == CRYPTO_JOB_PAIR_SETUP) {
+            job->status = handle_pair_setup(&state, job->request, job->request_length, &response);
+        } else {
+            job->status = handle_pair_verify(&state, job->request, job->request_length, &response);
+        }
+        job->response_length = response.length;
+        
+        pthread_mutex_lock(&engine_mutex);
+        if (sessions[job->session].generation == job->generation) {
+            sessions[job->session].pairing = state;
+        }
+        pthread_mutex_unlock(&engine_mutex);
+        OPENSSL_cleanse(&state, sizeof(state));
+    }
+    
+    uint32_t us = elapsed_us(&start);
+    
+    pthread_mutex_lock(&engine_mutex);
+    crypto_job_stats_t *stats = &engine_stats.jobs[job->type];
+    stats->count++;
+    if (job->status != 0) {
+        stats->failures++;
+    }
+    stats->last_us = us;
+    stats->total_us += us;
+    if (us > stats->max_us) {
+        stats->max_us = us;
+    }
+    pthread_mutex_unlock(&engine_mutex);
+    
+    syslog(LOG_DEBUG, "Crypto job %d for session %d finished in %u us (status %d)",
+           job->type, job->session, us, job->status);
+}
+
+static void* worker_thread(void *arg) {
+    (void)arg;
+    
+    pthread_mutex_lock(&queue_mutex);
+    while (true) {
+        while (pending_count == 0 && !shutting_down) {
+            pthread_cond_wait(&queue_cond, &queue_mutex);
+        }
+        if (shutting_down) {
+            break;
+        }
+        
+        int index = pending_jobs[pending_head];
+        pending_head = (pending_head + 1) % JOB_QUEUE_SIZE;
+        pending_count--;
+        pthread_mutex_unlock(&queue_mutex);
+        
+        run_job(&job_pool[index]);
+        
+        pthread_mutex_lock(&queue_mutex);
+        done_jobs[(done_head + done_count) % JOB_QUEUE_SIZE] = index;
+        done_count++;
+        
+        // Wake the event loop
+        uint8_t token = 1;
+        if (write(notify_pipe[1], &token, 1) < 0 && errno != EAGAIN) {
+            syslog(LOG_WARNING, "Crypto engine notify failed: %s", strerror(errno));
+        }
+    }
+    pthread_mutex_unlock(&queue_mutex);
+    
+    return NULL;
+}
+
+int crypto_engine_init(const char *key_dir) {
+    if (!key_dir) {
+        key_dir = CRYPTO_ENGINE_DEFAULT_KEY_DIR;
+    }
+    
+    if (is_initialized) {
+        return 0;
+    }
+    
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    if (load_accessory_key(key_dir) != 0) {
+        syslog(LOG_ERR, "Failed to load accessory key");
+        crypto_engine_cleanup();
+        return -1;
+    }
+    
+    // Known controllers only need pair-verify after a restart
+    char path[256];
+    snprintf(path, sizeof(path), "%s/pairings.db", key_dir);
+    if (pairing_store_open(path) != 0) {
+        syslog(LOG_WARNING, "Pairing store unavailable, controllers must pair again");
+    }
+    
+    if (load_rsa_key(key_dir) != 0 || srp_precompute() != 0) {
+        syslog(LOG_ERR, "Failed to prepare key exchange contexts");
+        crypto_engine_cleanup();
+        return -1;
+    }
+    
+    memset(sessions, 0, sizeof(sessions));
+    memset(&engine_stats, 0, sizeof(engine_stats));
+    
+    // Job queues and completion notification
+    if (pipe(notify_pipe) != 0) {
+        syslog(LOG_ERR, "Failed to create crypto notify pipe");
+        crypto_engine_cleanup();
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(notify_pipe[i], F_SETFL, fcntl(notify_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(notify_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    
+    free_count = 0;
+    for (int i = 0; i < JOB_QUEUE_SIZE; i++) {
+        free_jobs[free_count++] = i;
+    }
+    pending_head = pending_count = 0;
+    done_head = done_count = 0;
+    shutting_down = false;
+    
+    for (worker_count = 0; worker_count < CRYPTO_ENGINE_WORKERS; worker_count++) {
+        if (pthread_create(&workers[worker_count], thread_policy_attr(), worker_thread, NULL) != 0) {
+            syslog(LOG_ERR, "Failed to start crypto worker");
+            crypto_engine_cleanup();
+            return -1;
+        }
+    }
+    
+    // Published last, the server may be polling from another thread
+    __atomic_store_n(&is_initialized, true, __ATOMIC_RELEASE);
+    syslog(LOG_INFO, "Crypto engine initialized in %u us", elapsed_us(&start));
+    return 0;
+}
+
+int crypto_engine_cleanup(void) {
+    pthread_mutex_lock(&queue_mutex);
+    shutting_down = true;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+    
+    for (int i = 0; i < worker_count; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    worker_count = 0;
+    
+    for (int i = 0; i < 2; i++) {
+        if (notify_pipe[i] >= 0) {
+            close(notify_pipe[i]);
+            notify_pipe[i] = -1;
+        }
+    }
+    
+    pthread_mutex_lock(&engine_mutex);
+    for (int i = 0; i < CRYPTO_ENGINE_MAX_SESSIONS; i++) {
+        if (sessions[i].audio_ctx) {
+            EVP_CIPHER_CTX_free(sessions[i].audio_ctx);
+        }
+    }
+    OPENSSL_cleanse(sessions, sizeof(sessions));
+    
+    pairing_store_close();
+    EVP_PKEY_free(accessory_key);
+    accessory_key = NULL;
+    EVP_PKEY_free(rsa_key);
+    rsa_key = NULL;
+    srp_free();
+    
+    __atomic_store_n(&is_initialized, false, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&engine_mutex);
+    
+    syslog(LOG_INFO, "Crypto engine cleaned up");
+    return 0;
+}
+
+int crypto_engine_set_accessory_id(const char *id) {
+    if (!id || strlen(id) == 0 || strlen(id) >= sizeof(accessory_id)) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&engine_mutex);
+    strncpy(accessory_id, id, sizeof(accessory_id) - 1);
+    accessory_id[sizeof(accessory_id) - 1] = '\0';
+    pthread_mutex_unlock(&engine_mutex);
+    return 0;
+}
+
+int crypto_engine_get_public_key(uint8_t *public_key) {
+    if (!public_key || !crypto_engine_is_ready()) {
+        return -1;
+    }
+    
+    memcpy(public_key, accessory_public, sizeof(accessory_public));
+    return 0;
+}
+
+int crypto_engine_submit(int session, crypto_job_type_t type,
+                         const uint8_t *data, size_t length,
+                         crypto_job_callback_t callback, void *userdata) {
+    if (!crypto_engine_is_ready() || session < 0 || session >= CRYPTO_ENGINE_MAX_SESSIONS ||
+        type >= CRYPTO_JOB_TYPE_COUNT || !data || length > CRYPTO_ENGINE_MAX_MESSAGE) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&engine_mutex);
+    uint32_t generation = sessions[session].generation;
+    pthread_mutex_unlock(&engine_mutex);
+    
+    pthread_mutex_lock(&queue_mutex);
+    
+    if (free_count == 0) {
+        pthread_mutex_unlock(&queue_mutex);
+        pthread_mutex_lock(&engine_mutex);
+        engine_stats.queue_full++;
+        pthread_mutex_unlock(&engine_mutex);
+        syslog(LOG_WARNING, "Crypto job queue full");
+        return -1;
+    }
+    
+    int index = free_jobs[--free_count];
+    crypto_job_t *job = &job_pool[index];
+    job->session = session;
+    job->generation = generation;
+    job->type = type;
+    job->callback = callback;
+    job->userdata = userdata;
+    job->status = -1;
+    memcpy(job->request, data, length);
+    job->request_length = length;
+    job->response_length = 0;
+    
+    pending_jobs[(pending_head + pending_count) % JOB_QUEUE_SIZE] = index;
+    pending_count++;
+    pthread_cond_signal(&queue_cond);
+    
+    pthread_mutex_unlock(&queue_mutex);
+    return 0;
+}
+
+bool crypto_engine_is_ready(void) {
+    return __atomic_load_n(&is_initialized, __ATOMIC_ACQUIRE);
+}
+
+int crypto_engine_get_notify_fd(void) {
+    return crypto_engine_is_ready() ? notify_pipe[0] : -1;
+}
+
+int crypto_engine_process_completions(void) {
+    uint8_t drain[16];
+    int processed = 0;
+    
+    while (read(notify_pipe[0], drain, sizeof(drain)) > 0) {
+        // Drain wakeup tokens
+    }
+    
+    while (true) {
+        pthread_mutex_lock(&queue_mutex);
+        if (done_count == 0) {
+            pthread_mutex_unlock(&queue_mutex);
+            break;
+        }
+        int index = done_jobs[done_head];
+        done_head = (done_head + 1) % JOB_QUEUE_SIZE;
+        done_count--;
+        pthread_mutex_unlock(&queue_mutex);
+        
+        crypto_job_t *job = &job_pool[index];
+        
+        // Drop results for clients that went away in the meantime
+        pthread_mutex_lock(&engine_mutex);
+        bool current = sessions[job->session].generation == job->generation;
+        pthread_mutex_unlock(&engine_mutex);
+        
+        if (current && job->callback) {
+            job->callback(job->session, job->type, job->status,
+                          job->response, job->response_length, job->userdata);
+        }
+        
+        pthread_mutex_lock(&queue_mutex);
+        free_jobs[free_count++] = index;
+        pthread_mutex_unlock(&queue_mutex);
+        processed++;
+    }
+    
+    return processed;
+}
+
+int crypto_engine_session_reset(int session) {
+    if (session < 0 || session >= CRYPTO_ENGINE_MAX_SESSIONS) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&engine_mutex);
+    crypto_session_t *s = &sessions[session];
+    s->generation++;
+    OPENSSL_cleanse(&s->pairing, sizeof(s->pairing));
+    OPENSSL_cleanse(s->audio_iv, sizeof(s->audio_iv));
+    s->has_audio_key = false;
+    if (s->audio_ctx) {
+        EVP_CIPHER_CTX_reset(s->audio_ctx);
+    }
+    pthread_mutex_unlock(&engine_mutex);
+    return 0;
+}
+
+bool crypto_engine_session_is_verified(int session) {
+    if (session < 0 || session >= CRYPTO_ENGINE_MAX_SESSIONS) {
+        return false;
+    }
+    
+    pthread_mutex_lock(&engine_mutex);
+    bool verified = sessions[session].pairing.verified;
+    pthread_mutex_unlock(&engine_mutex);
+    return verified;
+}
+
+int crypto_engine_session_get_control_keys(int session, uint8_t *read_key, uint8_t *write_key) {
+    if (session < 0 || session >= CRYPTO_ENGINE_MAX_SESSIONS || !read_key || !write_key) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&engine_mutex);
+    pairing_state_t *state = &sessions[session].pairing;
+    if (!state->verified) {
+        pthread_mutex_unlock(&engine_mutex);
+        return -1;
+    }
+    memcpy(read_key, state->control_read_key, sizeof(state->control_read_key));
+    memcpy(write_key, state->control_write_key, sizeof(state->control_write_key));
+    pthread_mutex_unlock(&engine_mutex);
+    return 0;
+}
+
+int crypto_engine_decrypt_audio(int session, const uint8_t *data, size_t length, uint8_t *output) {
+    if (session < 0 || session >= CRYPTO_ENGINE_MAX_SESSIONS || !data || !output) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&engine_mutex);
+    crypto_session_t *s = &sessions[session];
+    if (!s->has_audio_key) {
+        pthread_mutex_unlock(&engine_mutex);
+        return -1;
+    }
+    
+    // Every packet restarts CBC from aesiv; the trailing partial block is sent in the clear
+    size_t aligned = length & ~(size_t)(AES_KEY_SIZE - 1);
+    int out_length = 0;
+    int result = 0;
+    if (aligned > 0 &&
+        (EVP_DecryptInit_ex(s->audio_ctx, NULL, NULL, NULL, s->audio_iv) != 1 ||
+         EVP_DecryptUpdate(s->audio_ctx, output, &out_length, data, aligned) != 1)) {
+        result = -1;
+    }
+    pthread_mutex_unlock(&engine_mutex);
+    
+    if (result == 0 && length > aligned) {
+        memmove(output + aligned, data + aligned, length - aligned);
+    }
+    return result;
+}
+
+int crypto_engine_get_stats(crypto_engine_stats_t *stats) {
+    if (!stats) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&engine_mutex);
+    *stats = engine_stats;
+    pthread_mutex_unlock(&engine_mutex);
+    return 0;
+}
@@ -0,0 +1,62 @@
+#ifndef CRYPTO_ENGINE_H
+#define CRYPTO_ENGINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define CRYPTO_ENGINE_DEFAULT_KEY_DIR "/etc/airplay2-lite"
+#define CRYPTO_ENGINE_MAX_SESSIONS 16    // clients of every AirPlay server together
+#define CRYPTO_ENGINE_MAX_MESSAGE 1024
+
+// Asynchronous key exchange jobs
+typedef enum {
+    CRYPTO_JOB_PAIR_SETUP,
+    CRYPTO_JOB_PAIR_VERIFY,
+    CRYPTO_JOB_RSA_AES_KEY,
+    CRYPTO_JOB_TYPE_COUNT
+} crypto_job_type_t;
+
+// Completion callback, always invoked from crypto_engine_process_completions()
+typedef void (*crypto_job_callback_t)(int session, crypto_job_type_t type, int status,
+                                      const uint8_t *response, size_t response_length,
+                                      void *userdata);
+
+// Per job type latency statistics
+typedef struct {
+    uint32_t count;
+    uint32_t failures;
+    uint32_t last_us;
+    uint32_t max_us;
+    uint64_t total_us;
+} crypto_job_stats_t;
+
+typedef struct {
+    crypto_job_stats_t jobs[CRYPTO_JOB_TYPE_COUNT];
+    uint32_t queue_full;
+} crypto_engine_stats_t;
+
+// Engine lifecycle
+int crypto_engine_init(const char *key_dir);
+int crypto_engine_cleanup(void);
+bool crypto_engine_is_ready(void);          // keys loaded, init may run on another thread
+int crypto_engine_set_accessory_id(const char *accessory_id);
+int crypto_engine_get_public_key(uint8_t *public_key);
+
+// Job submission and completion (notify fd becomes readable when jobs finish)
+int crypto_engine_submit(int session, crypto_job_type_t type,
+                         const uint8_t *data, size_t length,
+                         crypto_job_callback_t callback, void *userdata);
+int crypto_engine_get_notify_fd(void);
+int crypto_engine_process_completions(void);
+
+// Per client session state
+int crypto_engine_session_reset(int session);
+bool crypto_engine_session_is_verified(int session);   // after pair-verify or transient pair-setup
+int crypto_engine_session_get_control_keys(int session, uint8_t *read_key, uint8_t *write_key);
+int crypto_engine_decrypt_audio(int session, const uint8_t *data, size_t length, uint8_t *output);
+
+// Statistics
+int crypto_engine_get_stats(crypto_engine_stats_t *stats);
+
+#endif // CRYPTO_ENGINE_H
@@ -7,6 +7,7 @@
 #include <openssl/evp.h>
 #include <openssl/aes.h>
 #include <openssl/rand.h>
+#include <openssl/kdf.h>
 
 // SHA-1 functions
 int sha1_hash(const uint8_t *data, size_t length, uint8_t *hash) {
@@ -29,6 +30,44 @@ int sha1_hmac(const uint8_t *key, size_t key_length,
     return 0;
 }
 
+// SHA-512 / HKDF functions
+int sha512_hash(const uint8_t *data, size_t length, uint8_t *hash) {
+    if (!data || !hash) {
+        return -1;
+    }
+    
+    SHA512(data, length, hash);
+    return 0;
+}
+
+int hkdf_sha512(const uint8_t *key, size_t key_length,
+                const char *salt, const char *info,
+                uint8_t *output, size_t output_length) {
+    if (!key || !salt || !info || !output) {
+        return -1;
+    }
+    
+    EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    if (!pctx) {
+        return -1;
+    }
+    
+    size_t length = output_length;
+    if (EVP_PKEY_derive_init(pctx) != 1 ||
+        EVP_PKEY_CTX_set_hkdf_md(pctx, EVP_sha512()) != 1 ||
+        EVP_PKEY_CTX_set1_hkdf_salt(pctx, (const unsigned char *)salt, strlen(salt)) != 1 ||
+        EVP_PKEY_CTX_set1_hkdf_key(pctx, key, key_length) != 1 ||
+        EVP_PKEY_CTX_add1_hkdf_info(pctx, (const unsigned char *)info, strlen(info)) != 1 ||
+        EVP_PKEY_derive(pctx, output, &length) != 1 ||
+        length != output_length) {
+        EVP_PKEY_CTX_free(pctx);
+        return -1;
+    }
+    
+    EVP_PKEY_CTX_free(pctx);
+    return 0;
+}
+
 // AES functions
 int aes_encrypt(const uint8_t *key, const uint8_t *iv, 
                 const uint8_t *plaintext, size_t plaintext_length,
@@ -100,6 +139,289 @@ int aes_decrypt(const uint8_t *key, const uint8_t *iv,
     return 0;
 }
 
+// ChaCha20-Poly1305 functions
+int chacha20_poly1305_encrypt(const uint8_t *key, const uint8_t *nonce,
+                              const uint8_t *aad, size_t aad_length,
+                              const uint8_t *plaintext, size_t length,
+                              uint8_t *ciphertext, uint8_t *tag) {
+    if (!key || !nonce || (!plaintext && length > 0) || (!ciphertext && length > 0) || !tag) {
+        return -1;
+    }
+    
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) {
+        return -1;
+    }
+    
+    int len;
+    if (EVP_EncryptInit_ex(ctx, EVP_chacha20_poly1305(), NULL, key, nonce) != 1 ||
+        (aad && aad_length > 0 && EVP_EncryptUpdate(ctx, NULL, &len, aad, aad_length) != 1) ||
+        (length > 0 && EVP_EncryptUpdate(ctx, ciphertext, &len, plaintext, length) != 1) ||
+        EVP_EncryptFinal_ex(ctx, ciphertext + length, &len) != 1 ||
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, CHACHA20_POLY1305_TAG_SIZE, tag) != 1) {
+        EVP_CIPHER_CTX_free(ctx);
+        return -1;
+    }
+    
+    EVP_CIPHER_CTX_free(ctx);
+    return 0;
+}
+
+int chacha20_poly1305_decrypt(const uint8_t *key, const uint8_t *nonce,
+                              const uint8_t *aad, size_t aad_length,
+                              const uint8_t *ciphertext, size_t length,
+                              const uint8_t *tag, uint8_t *plaintext) {
+    if (!key || !nonce || (!ciphertext && length > 0) || !tag || (!plaintext && length > 0)) {
+        return -1;
+    }
+    
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) {
+        return -1;
+    }
+    
+    int len;
+    if (EVP_DecryptInit_ex(ctx, EVP_chacha20_poly1305(), NULL, key, nonce) != 1 ||
+        (aad && aad_length > 0 && EVP_DecryptUpdate(ctx, NULL, &len, aad, aad_length) != 1) ||
+        (length > 0 && EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, length) != 1) ||
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, CHACHA20_POLY1305_TAG_SIZE, (void *)tag) != 1 ||
+        EVP_DecryptFinal_ex(ctx, plaintext + length, &len) != 1) {
+        // Authentication failure
+        EVP_CIPHER_CTX_free(ctx);
+        return -1;
+    }
+    
+    EVP_CIPHER_CTX_free(ctx);
+    return 0;
+}
+
+// ChaCha20-Poly1305 session
+struct aead_session {
+    EVP_CIPHER_CTX *ctx;
+    uint64_t counter;
+};
+
+static void aead_build_nonce(aead_session_t *session, const uint8_t *nonce, uint8_t *iv) {
+    memset(iv, 0, 4);
+    if (nonce) {
+        memcpy(iv + 4, nonce, 8);
+    } else {
+        uint64_t counter = session->counter++;
+        for (int i = 0; i < 8; i++) {
+            iv[4 + i] = (uint8_t)(counter >> (8 * i));
+        }
+    }
+}
+
+static int aead_session_crypt(aead_session_t *session, int encrypt, const uint8_t *nonce,
+                              const uint8_t *aad, size_t aad_length,
+                              uint8_t *data, size_t length, uint8_t *tag) {
+    uint8_t iv[CHACHA20_POLY1305_NONCE_SIZE];
+    int len;
+    
+    aead_build_nonce(session, nonce, iv);
+    
+    // Key schedule stays in the context, only the nonce changes per message
+    if (EVP_CipherInit_ex(session->ctx, NULL, NULL, NULL, iv, encrypt) != 1) {
+        return -1;
+    }
+    if (aad && aad_length > 0 &&
+        EVP_CipherUpdate(session->ctx, NULL, &len, aad, aad_length) != 1) {
+        return -1;
+    }
+    if (!encrypt &&
+        EVP_CIPHER_CTX_ctrl(session->ctx, EVP_CTRL_AEAD_SET_TAG, CHACHA20_POLY1305_TAG_SIZE, tag) != 1) {
+        return -1;
+    }
+    if (length > 0 && EVP_CipherUpdate(session->ctx, data, &len, data, length) != 1) {
+        return -1;
+    }
+    if (EVP_CipherFinal_ex(session->ctx, data + length, &len) != 1) {
+        return -1;
+    }
+    if (encrypt &&
+        EVP_CIPHER_CTX_ctrl(session->ctx, EVP_CTRL_AEAD_GET_TAG, CHACHA20_POLY1305_TAG_SIZE, tag) != 1) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+aead_session_t* aead_session_create(const uint8_t *key) {
+    if (!key) {
+        return NULL;
+    }
+    
+    aead_session_t *session = calloc(1, sizeof(aead_session_t));
+    if (!session) {
+        return NULL;
+    }
+    
+    session->ctx = EVP_CIPHER_CTX_new();
+    if (!session->ctx || aead_session_set_key(session, key) != 0) {
+        aead_session_destroy(session);
+        return NULL;
+    }
+    
+    return session;
+}
+
+void aead_session_destroy(aead_session_t *session) {
+    if (session) {
+        EVP_CIPHER_CTX_free(session->ctx);
+        free(session);
+    }
+}
+
+int aead_session_set_key(aead_session_t *session, const uint8_t *key) {
+    if (!session || !key) {
+        return -1;
+    }
+    
+    if (EVP_CipherInit_ex(session->ctx, EVP_chacha20_poly1305(), NULL, key, NULL, 0) != 1) {
+        return -1;
+    }
+    
+    session->counter = 0;
+    return 0;
+}
+
+void aead_session_set_counter(aead_session_t *session, uint64_t counter) {
+    if (session) {
+        session->counter = counter;
+    }
+}
+
+uint64_t aead_session_get_counter(const aead_session_t *session) {
+    return session ? session->counter : 0;
+}
+
+int aead_session_encrypt(aead_session_t *session, const uint8_t *nonce,
+                         const uint8_t *aad, size_t aad_length,
+                         uint8_t *data, size_t length, uint8_t *tag) {
+    if (!session || (!data && length > 0) || !tag) {
+        return -1;
+    }
+    
+    return aead_session_crypt(session, 1, nonce, aad, aad_length, data, length, tag);
+}
+
+int aead_session_decrypt(aead_session_t *session, const uint8_t *nonce,
+                         const uint8_t *aad, size_t aad_length,
+                         uint8_t *data, size_t length, const uint8_t *tag) {
+    if (!session || (!data && length > 0) || !tag) {
+        return -1;
+    }
+    
+    return aead_session_crypt(session, 0, nonce, aad, aad_length, data, length, (uint8_t *)tag);
+}
+
+size_t aead_session_decrypt_batch(aead_session_t *session, aead_packet_t *packets, size_t count) {
+    if (!session || !packets) {
+        return 0;
+    }
+    
+    size_t decrypted = 0;
+    for (size_t i = 0; i < count; i++) {
+        aead_packet_t *packet = &packets[i];
+        packet->status = -1;
+        if ((!packet->data && packet->length > 0) || !packet->tag) {
+            continue;
+        }
+        
+        packet->status = aead_session_crypt(session, 0, packet->nonce, packet->aad, packet->aad_length,
+                                            packet->data, packet->length, (uint8_t *)packet->tag);
+        if (packet->status == 0) {
+            decrypted++;
+        }
+    }
+    
+    return decrypted;
+}
+
+// Curve25519 / Ed25519 functions
+int x25519_generate_keypair(uint8_t *public_key, uint8_t *private_key) {
+    if (!public_key || !private_key) {
+        return -1;
+    }
+    
+    EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, NULL);
+    if (!pctx) {
+        return -1;
+    }
+    
+    EVP_PKEY *pkey = NULL;
+    if (EVP_PKEY_keygen_init(pctx) != 1 || EVP_PKEY_keygen(pctx, &pkey) != 1) {
+        EVP_PKEY_CTX_free(pctx);
+        return -1;
+    }
+    EVP_PKEY_CTX_free(pctx);
+    
+    size_t public_length = CURVE25519_KEY_SIZE;
+    size_t private_length = CURVE25519_KEY_SIZE;
+    int result = 0;
+    if (EVP_PKEY_get_raw_public_key(pkey, public_key, &public_length) != 1 ||
+        EVP_PKEY_get_raw_private_key(pkey, private_key, &private_length) != 1) {
+        result = -1;
+    }
+    
+    EVP_PKEY_free(pkey);
+    return result;
+}
+
+int x25519_shared_secret(const uint8_t *private_key, const uint8_t *peer_public_key,
+                         uint8_t *secret) {
+    if (!private_key || !peer_public_key || !secret) {
+        return -1;
+    }
+    
+    EVP_PKEY *pkey = EVP_PKEY_new_raw_private_key(EVP_PKEY_X25519, NULL,
+                                                  private_key, CURVE25519_KEY_SIZE);
+    EVP_PKEY *peer = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL,
+                                                 peer_public_key, CURVE25519_KEY_SIZE);
+    EVP_PKEY_CTX *pctx = pkey ? EVP_PKEY_CTX_new(pkey, NULL) : NULL;
+    
+    size_t secret_length = CURVE25519_KEY_SIZE;
+    int result = 0;
+    if (!pctx || !peer ||
+        EVP_PKEY_derive_init(pctx) != 1 ||
+        EVP_PKEY_derive_set_peer(pctx, peer) != 1 ||
+        EVP_PKEY_derive(pctx, secret, &secret_length) != 1) {
+        result = -1;
+    }
+    
+    EVP_PKEY_CTX_free(pctx);
+    EVP_PKEY_free(peer);
+    EVP_PKEY_free(pkey);
+    return result;
+}
+
+int ed25519_verify(const uint8_t *public_key,
+                   const uint8_t *message, size_t message_length,
+                   const uint8_t *signature) {
+    if (!public_key || !message || !signature) {
+        return -1;
+    }
+    
+    EVP_PKEY *pkey = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, NULL,
+                                                 public_key, ED25519_KEY_SIZE);
+    if (!pkey) {
+        return -1;
+    }
+    
+    EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+    int result = -1;
+    if (mdctx &&
+        EVP_DigestVerifyInit(mdctx, NULL, NULL, NULL, pkey) == 1 &&
+        EVP_DigestVerify(mdctx, signature, ED25519_SIGNATURE_SIZE, message, message_length) == 1) {
+        result = 0;
+    }
+    
+    EVP_MD_CTX_free(mdctx);
+    EVP_PKEY_free(pkey);
+    return result;
+}
+
 // Base64 encoding table
 static const char base64_chars[] = 
     "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
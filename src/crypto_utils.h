@@ -4,11 +4,25 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#define SHA512_DIGEST_SIZE 64
+#define CURVE25519_KEY_SIZE 32
+#define ED25519_KEY_SIZE 32
+#define ED25519_SIGNATURE_SIZE 64
+#define CHACHA20_POLY1305_KEY_SIZE 32
+#define CHACHA20_POLY1305_NONCE_SIZE 12
+#define CHACHA20_POLY1305_TAG_SIZE 16
+
 // SHA-1 functions
 int sha1_hash(const uint8_t *data, size_t length, uint8_t *hash);
 int sha1_hmac(const uint8_t *key, size_t key_length, 
               const uint8_t *data, size_t data_length, uint8_t *hmac);
 
+// SHA-512 / HKDF functions
+int sha512_hash(const uint8_t *data, size_t length, uint8_t *hash);
+int hkdf_sha512(const uint8_t *key, size_t key_length,
+                const char *salt, const char *info,
+                uint8_t *output, size_t output_length);
+
 // AES functions
 int aes_encrypt(const uint8_t *key, const uint8_t *iv, 
                 const uint8_t *plaintext, size_t plaintext_length,
@@ -17,6 +31,52 @@ int aes_decrypt(const uint8_t *key, const uint8_t *iv,
                 const uint8_t *ciphertext, size_t ciphertext_length,
                 uint8_t *plaintext, size_t *plaintext_length);
 
+// ChaCha20-Poly1305 one-shot functions (12 byte nonce, detached tag)
+int chacha20_poly1305_encrypt(const uint8_t *key, const uint8_t *nonce,
+                              const uint8_t *aad, size_t aad_length,
+                              const uint8_t *plaintext, size_t length,
+                              uint8_t *ciphertext, uint8_t *tag);
+int chacha20_poly1305_decrypt(const uint8_t *key, const uint8_t *nonce,
+                              const uint8_t *aad, size_t aad_length,
+                              const uint8_t *ciphertext, size_t length,
+                              const uint8_t *tag, uint8_t *plaintext);
+
+// ChaCha20-Poly1305 session with a persistent cipher context. Nonces are
+// 4 zero bytes followed by either the session counter (little endian,
+// incremented per message) or an explicit 8 byte nonce.
+typedef struct aead_session aead_session_t;
+
+typedef struct {
+    uint8_t *data;              // ciphertext in, plaintext out (in place)
+    size_t length;
+    const uint8_t *aad;
+    size_t aad_length;
+    const uint8_t *tag;
+    const uint8_t *nonce;       // 8 bytes, NULL to use the session counter
+    int status;                 // 0 on success, -1 on authentication failure
+} aead_packet_t;
+
+aead_session_t* aead_session_create(const uint8_t *key);
+void aead_session_destroy(aead_session_t *session);
+int aead_session_set_key(aead_session_t *session, const uint8_t *key);
+void aead_session_set_counter(aead_session_t *session, uint64_t counter);
+uint64_t aead_session_get_counter(const aead_session_t *session);
+int aead_session_encrypt(aead_session_t *session, const uint8_t *nonce,
+                         const uint8_t *aad, size_t aad_length,
+                         uint8_t *data, size_t length, uint8_t *tag);
+int aead_session_decrypt(aead_session_t *session, const uint8_t *nonce,
+                         const uint8_t *aad, size_t aad_length,
+                         uint8_t *data, size_t length, const uint8_t *tag);
+size_t aead_session_decrypt_batch(aead_session_t *session, aead_packet_t *packets, size_t count);
+
+// Curve25519 / Ed25519 functions
+int x25519_generate_keypair(uint8_t *public_key, uint8_t *private_key);
+int x25519_shared_secret(const uint8_t *private_key, const uint8_t *peer_public_key,
+                         uint8_t *secret);
+int ed25519_verify(const uint8_t *public_key,
+                   const uint8_t *message, size_t message_length,
+                   const uint8_t *signature);
+
 // Base64 functions
 int base64_encode(const uint8_t *data, size_t length, char *encoded);
 int base64_decode(const char *encoded, uint8_t *data, size_t *length);
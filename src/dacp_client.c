@@ -0,0 +1,492 @@
+#include "dacp_client.h"
+#include "mdns.h"
+#include "thread_policy.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <avahi-client/lookup.h>
+#include <avahi-common/address.h>
+#include <avahi-common/error.h>
+
+#define DACP_ID_SIZE 32
+#define DACP_REMOTE_SIZE 32
+#define DACP_RESPONSE_SIZE 1024
+
+static const char *command_paths[DACP_COMMAND_COUNT] = {
+    "play", "pause", "playpause", "stop", "nextitem", "previtem", "volumeup", "volumedown"
+};
+
+typedef struct {
+    dacp_command_t command;
+    dacp_result_callback_t callback;
+    void *userdata;
+} dacp_request_t;
+
+struct dacp_client {
+    // Who to talk to, set from the RTSP thread and the Avahi resolver. The
+    // resolver is created and freed under the mDNS lock, taken before this one.
+    pthread_mutex_t state_mutex;
+    char dacp_id[DACP_ID_SIZE];
+    char active_remote[DACP_REMOTE_SIZE];
+    struct sockaddr_in endpoint;
+    bool resolved;
+    uint32_t endpoint_generation;
+    AvahiServiceResolver *resolver;
+    uint32_t resolver_generation;       // mdns_generation() it was created in
+    
+    // The connection, kept open between commands
+    pthread_mutex_t io_mutex;
+    int sock_fd;
+    uint32_t sock_generation;
+    
+    // Commands waiting for the worker, started with the first one so an
+    // idle zone has no thread for it
+    pthread_mutex_t queue_mutex;
+    pthread_cond_t queue_cond;
+    dacp_request_t queue[DACP_CLIENT_QUEUE_SIZE];
+    unsigned queue_head;
+    unsigned queue_count;
+    pthread_t worker_thread;
+    bool worker_started;
+    bool worker_running;
+};
+
+static void close_socket_locked(dacp_client_t *client) {
+    if (client->sock_fd >= 0) {
+        close(client->sock_fd);
+        client->sock_fd = -1;
+    }
+}
+
+// Non-blocking connect bounded by the timeout, blocking I/O with timeouts after
+static int connect_locked(dacp_client_t *client, const struct sockaddr_in *addr) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0) {
+        struct pollfd pfd = { fd, POLLOUT, 0 };
+        int error = 0;
+        socklen_t error_length = sizeof(error);
+        if (errno != EINPROGRESS || poll(&pfd, 1, DACP_CLIENT_TIMEOUT_MS) != 1 ||
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_length) < 0 || error != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    fcntl(fd, F_SETFL, flags);
+    
+    struct timeval timeout = { DACP_CLIENT_TIMEOUT_MS / 1000, (DACP_CLIENT_TIMEOUT_MS % 1000) * 1000 };
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    
+    client->sock_fd = fd;
+    return 0;
+}
+
+static int find_header(const char *response, const char *name, char *value, size_t value_size) {
+    size_t name_length = strlen(name);
+    const char *line = strstr(response, "\r\n");
+    
+    while (line && strncmp(line, "\r\n\r\n", 4) != 0) {
+        line += 2;
+        if (strncasecmp(line, name, name_length) == 0 && line[name_length] == ':') {
+            const char *start = line + name_length + 1;
+            while (*start == ' ') {
+                start++;
+            }
+            size_t length = strcspn(start, "\r\n");
+            if (length >= value_size) {
+                length = value_size - 1;
+            }
+            memcpy(value, start, length);
+            value[length] = '\0';
+            return 0;
+        }
+        line = strstr(line, "\r\n");
+    }
+    
+    return -1;
+}
+
+// Sends one request and reads its response, body included, so the next
+// request starts on a clean connection. Returns the status or -1.
+static int exchange_locked(dacp_client_t *client, const char *request, size_t request_length,
+                           bool *keep_alive) {
+    if (send(client->sock_fd, request, request_length, MSG_NOSIGNAL) != (ssize_t)request_length) {
+        return -1;
+    }
+    
+    char response[DACP_RESPONSE_SIZE];
+    size_t received = 0;
+    char *header_end = NULL;
+    while (!header_end) {
+        if (received == sizeof(response) - 1) {
+            return -1;
+        }
+        ssize_t bytes = recv(client->sock_fd, response + received, sizeof(response) - 1 - received, 0);
+        if (bytes <= 0) {
+            return -1;
+        }
+        received += (size_t)bytes;
+        response[received] = '\0';
+        header_end = strstr(response, "\r\n\r\n");
+    }
+    
+    int status;
+    if (sscanf(response, "HTTP/1.%*d %d", &status) != 1) {
+        return -1;
+    }
+    
+    char value[32];
+    size_t body_length = 0;
+    if (find_header(response, "Content-Length", value, sizeof(value)) == 0) {
+        body_length = strtoul(value, NULL, 10);
+    }
+    *keep_alive = !(find_header(response, "Connection", value, sizeof(value)) == 0 &&
+                    strcasecmp(value, "close") == 0);
+    
+    // Replies are normally 204 without a body, anything else is discarded
+    size_t have = received - (size_t)(header_end + 4 - response);
+    while (have < body_length) {
+        char discard[256];
+        size_t want = body_length - have < sizeof(discard) ? body_length - have : sizeof(discard);
+        ssize_t bytes = recv(client->sock_fd, discard, want, 0);
+        if (bytes <= 0) {
+            *keep_alive = false;
+            break;
+        }
+        have += (size_t)bytes;
+    }
+    
+    return status;
+}
+
+static void resolver_callback(AvahiServiceResolver *r, AvahiIfIndex interface, AvahiProtocol protocol,
+                              AvahiResolverEvent event, const char *name, const char *type,
+                              const char *domain, const char *host_name, const AvahiAddress *a,
+                              uint16_t port, AvahiStringList *txt, AvahiLookupResultFlags flags,
+                              void *userdata) {
+    (void)interface; (void)protocol; (void)type; (void)domain; (void)host_name;
+    (void)txt; (void)flags;
+    dacp_client_t *client = userdata;
+    
+    char address[AVAHI_ADDRESS_STR_MAX];
+    bool found = event == AVAHI_RESOLVER_FOUND && a &&
+                 avahi_address_snprint(address, sizeof(address), a) != NULL;
+    
+    pthread_mutex_lock(&client->state_mutex);
+    if (r == client->resolver) {
+        client->resolver = NULL;
+    }
+    pthread_mutex_unlock(&client->state_mutex);
+    avahi_service_resolver_free(r);
+    
+    if (!found) {
+        syslog(LOG_WARNING, "Cannot resolve remote control %s", name);
+        return;
+    }
+    if (dacp_client_set_endpoint(client, address, port) == 0) {
+        syslog(LOG_INFO, "Remote control %s at %s:%u", name, address, port);
+    }
+}
+
+// Both locks held. A reconnected Avahi client already freed the old resolver.
+static void free_resolver_locked(dacp_client_t *client) {
+    if (client->resolver && client->resolver_generation == mdns_generation()) {
+        avahi_service_resolver_free(client->resolver);
+    }
+    client->resolver = NULL;
+}
+
+// Takes commands off the queue one at a time, holding no lock while sending
+static void* worker_thread_func(void *arg) {
+    dacp_client_t *client = arg;
+    
+    thread_policy_apply(THREAD_ROLE_CONTROL);
+    
+    pthread_mutex_lock(&client->queue_mutex);
+    while (client->worker_running) {
+        if (client->queue_count == 0) {
+            pthread_cond_wait(&client->queue_cond, &client->queue_mutex);
+            continue;
+        }
+        
+        dacp_request_t request = client->queue[client->queue_head];
+        client->queue_head = (client->queue_head + 1) % DACP_CLIENT_QUEUE_SIZE;
+        client->queue_count--;
+        pthread_mutex_unlock(&client->queue_mutex);
+        
+        int status = dacp_client_send(client, request.command);
+        if (request.callback) {
+            request.callback(request.command, status, request.userdata);
+        }
+        
+        pthread_mutex_lock(&client->queue_mutex);
+    }
+    pthread_mutex_unlock(&client->queue_mutex);
+    
+    return NULL;
+}
+
+dacp_client_t* dacp_client_create(void) {
+    dacp_client_t *client = calloc(1, sizeof(dacp_client_t));
+    if (!client) {
+        return NULL;
+    }
+    
+    pthread_mutex_init(&client->state_mutex, NULL);
+    pthread_mutex_init(&client->io_mutex, NULL);
+    pthread_mutex_init(&client->queue_mutex, NULL);
+    pthread_cond_init(&client->queue_cond, NULL);
+    client->sock_fd = -1;
+    return client;
+}
+
+void dacp_client_destroy(dacp_client_t *client) {
+    if (!client) {
+        return;
+    }
+    
+    // Waiting commands are dropped, one being sent finishes first
+    pthread_mutex_lock(&client->queue_mutex);
+    bool started = client->worker_started;
+    client->worker_running = false;
+    client->queue_count = 0;
+    pthread_cond_signal(&client->queue_cond);
+    pthread_mutex_unlock(&client->queue_mutex);
+    if (started) {
+        pthread_join(client->worker_thread, NULL);
+    }
+    
+    dacp_client_clear(client);
+    pthread_cond_destroy(&client->queue_cond);
+    pthread_mutex_destroy(&client->queue_mutex);
+    pthread_mutex_destroy(&client->state_mutex);
+    pthread_mutex_destroy(&client->io_mutex);
+    free(client);
+}
+
+int dacp_client_set_remote(dacp_client_t *client, const char *id, const char *remote) {
+    if (!id || !remote || strlen(id) >= DACP_ID_SIZE || strlen(remote) >= DACP_REMOTE_SIZE) {
+        return -1;
+    }
+    
+    AvahiClient *avahi = mdns_lock();
+    pthread_mutex_lock(&client->state_mutex);
+    
+    // Every request carries the headers, only a new sender costs a resolve
+    snprintf(client->active_remote, sizeof(client->active_remote), "%s", remote);
+    if (strcmp(client->dacp_id, id) == 0) {
+        pthread_mutex_unlock(&client->state_mutex);
+        mdns_unlock();
+        return 0;
+    }
+    snprintf(client->dacp_id, sizeof(client->dacp_id), "%s", id);
+    client->resolved = false;
+    client->endpoint_generation++;
+    free_resolver_locked(client);
+    
+    int result = -1;
+    if (avahi) {
+        char name[DACP_ID_SIZE + 16];
+        snprintf(name, sizeof(name), "iTunes_Ctrl_%s", id);
+        client->resolver = avahi_service_resolver_new(avahi, AVAHI_IF_UNSPEC, AVAHI_PROTO_INET, name,
+                                                      "_dacp._tcp", NULL, AVAHI_PROTO_INET, 0,
+                                                      resolver_callback, client);
+        client->resolver_generation = mdns_generation();
+        result = client->resolver ? 0 : -1;
+    }
+    
+    pthread_mutex_unlock(&client->state_mutex);
+    mdns_unlock();
+    
+    if (result != 0) {
+        syslog(LOG_WARNING, "Cannot look up remote control %s", id);
+    }
+    return result;
+}
+
+int dacp_client_set_endpoint(dacp_client_t *client, const char *address, uint16_t port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (!address || inet_pton(AF_INET, address, &addr.sin_addr) != 1) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&client->state_mutex);
+    client->endpoint = addr;
+    client->resolved = true;
+    client->endpoint_generation++;
+    pthread_mutex_unlock(&client->state_mutex);
+    return 0;
+}
+
+void dacp_client_clear(dacp_client_t *client) {
+    mdns_lock();
+    pthread_mutex_lock(&client->state_mutex);
+    free_resolver_locked(client);
+    client->dacp_id[0] = '\0';
+    client->active_remote[0] = '\0';
+    client->resolved = false;
+    client->endpoint_generation++;
+    pthread_mutex_unlock(&client->state_mutex);
+    mdns_unlock();
+    
+    pthread_mutex_lock(&client->io_mutex);
+    close_socket_locked(client);
+    pthread_mutex_unlock(&client->io_mutex);
+}
+
+bool dacp_client_available(dacp_client_t *client) {
+    pthread_mutex_lock(&client->state_mutex);
+    bool available = client->resolved;
+    pthread_mutex_unlock(&client->state_mutex);
+    return available;
+}
+
+// Play, pause and stop name the state the user wants, playpause and the
+// others count every press
+static bool replaces_waiting(dacp_command_t command) {
+    return command == DACP_COMMAND_PLAY || command == DACP_COMMAND_PAUSE || command == DACP_COMMAND_STOP;
+}
+
+int dacp_client_queue(dacp_client_t *client, dacp_command_t command,
+                      dacp_result_callback_t callback, void *userdata) {
+    if (command >= DACP_COMMAND_COUNT) {
+        return -1;
+    }
+    if (!dacp_client_available(client)) {
+        logger_log(LOG_WARNING, "No remote control for %s", command_paths[command]);
+        return -1;
+    }
+    
+    pthread_mutex_lock(&client->queue_mutex);
+    
+    if (client->queue_count > 0) {
+        dacp_request_t *last = &client->queue[(client->queue_head + client->queue_count - 1) %
+                                              DACP_CLIENT_QUEUE_SIZE];
+        if (replaces_waiting(last->command) && replaces_waiting(command) &&
+            last->callback == callback && last->userdata == userdata) {
+            last->command = command;
+            pthread_mutex_unlock(&client->queue_mutex);
+            return 0;
+        }
+    }
+    if (client->queue_count == DACP_CLIENT_QUEUE_SIZE) {
+        pthread_mutex_unlock(&client->queue_mutex);
+        logger_log(LOG_WARNING, "Remote control busy, %s dropped", command_paths[command]);
+        return -1;
+    }
+    
+    if (!client->worker_started) {
+        client->worker_running = true;
+        if (pthread_create(&client->worker_thread, thread_policy_attr(), worker_thread_func, client) != 0) {
+            client->worker_running = false;
+            pthread_mutex_unlock(&client->queue_mutex);
+            syslog(LOG_ERR, "Failed to create remote control thread");
+            return -1;
+        }
+        client->worker_started = true;
+    }
+    
+    dacp_request_t *request = &client->queue[(client->queue_head + client->queue_count) % DACP_CLIENT_QUEUE_SIZE];
+    request->command = command;
+    request->callback = callback;
+    request->userdata = userdata;
+    client->queue_count++;
+    pthread_cond_signal(&client->queue_cond);
+    
+    pthread_mutex_unlock(&client->queue_mutex);
+    return 0;
+}
+
+int dacp_client_send(dacp_client_t *client, dacp_command_t command) {
+    if (command >= DACP_COMMAND_COUNT) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&client->io_mutex);
+    
+    pthread_mutex_lock(&client->state_mutex);
+    bool ready = client->resolved;
+    struct sockaddr_in addr = client->endpoint;
+    uint32_t generation = client->endpoint_generation;
+    char host[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client->endpoint.sin_addr, host, sizeof(host));
+    char request[256];
+    int request_length = snprintf(request, sizeof(request),
+                                  "GET /ctrl-int/1/%s HTTP/1.1\r\n"
+                                  "Host: %s:%u\r\n"
+                                  "Active-Remote: %s\r\n"
+                                  "Connection: keep-alive\r\n"
+                                  "\r\n",
+                                  command_paths[command], host,
+                                  ntohs(client->endpoint.sin_port), client->active_remote);
+    pthread_mutex_unlock(&client->state_mutex);
+    
+    if (!ready) {
+        pthread_mutex_unlock(&client->io_mutex);
+        logger_log(LOG_WARNING, "No remote control for %s", command_paths[command]);
+        return -1;
+    }
+    
+    if (client->sock_generation != generation) {
+        close_socket_locked(client);
+    }
+    
+    // A kept connection may have been closed by the sender while idle, that
+    // costs one reconnect; a fresh connection failing is a real error
+    int status = -1;
+    for (int attempt = 0; attempt < 2 && status < 0; attempt++) {
+        bool fresh = client->sock_fd < 0;
+        if (fresh) {
+            if (connect_locked(client, &addr) != 0) {
+                break;
+            }
+            client->sock_generation = generation;
+        }
+        
+        bool keep_alive = false;
+        status = exchange_locked(client, request, (size_t)request_length, &keep_alive);
+        if (status < 0 || !keep_alive) {
+            close_socket_locked(client);
+        }
+        if (status < 0 && fresh) {
+            break;
+        }
+    }
+    
+    pthread_mutex_unlock(&client->io_mutex);
+    
+    if (status < 0) {
+        logger_log(LOG_WARNING, "Remote control %s failed", command_paths[command]);
+    } else {
+        logger_log(LOG_DEBUG, "Remote control %s: %d", command_paths[command], status);
+    }
+    return status;
+}
+
+const char* dacp_client_command_name(dacp_command_t command) {
+    return command < DACP_COMMAND_COUNT ? command_paths[command] : "unknown";
+}
@@ -0,0 +1,57 @@
+#ifndef DACP_CLIENT_H
+#define DACP_CLIENT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DACP_CLIENT_TIMEOUT_MS 1000
+#define DACP_CLIENT_QUEUE_SIZE 8
+
+// Remote control commands the sender accepts on /ctrl-int/1/
+typedef enum {
+    DACP_COMMAND_PLAY = 0,
+    DACP_COMMAND_PAUSE,
+    DACP_COMMAND_PLAYPAUSE,
+    DACP_COMMAND_STOP,
+    DACP_COMMAND_NEXT,
+    DACP_COMMAND_PREVIOUS,
+    DACP_COMMAND_VOLUME_UP,
+    DACP_COMMAND_VOLUME_DOWN,
+    DACP_COMMAND_COUNT
+} dacp_command_t;
+
+// The remote control of the sender playing to one zone
+typedef struct dacp_client dacp_client_t;
+
+// Runs on the client's worker thread with the HTTP status, or -1
+typedef void (*dacp_result_callback_t)(dacp_command_t command, int status, void *userdata);
+
+// Lifecycle
+dacp_client_t* dacp_client_create(void);
+void dacp_client_destroy(dacp_client_t *client);
+
+// From the DACP-ID and Active-Remote headers of the sender's requests. A new
+// DACP-ID starts an mDNS resolve of iTunes_Ctrl_<id> through the shared mdns
+// client, a known one is a no-op.
+int dacp_client_set_remote(dacp_client_t *client, const char *dacp_id, const char *active_remote);
+
+// Endpoint known without mDNS, replaces a resolved one
+int dacp_client_set_endpoint(dacp_client_t *client, const char *address, uint16_t port);
+
+// Forgets the sender, e.g. when its session ends
+void dacp_client_clear(dacp_client_t *client);
+bool dacp_client_available(dacp_client_t *client);
+
+// Hands the command to the client's worker thread and returns at once, so
+// the event loop never waits on the sender. -1 without a remote control or
+// with a full queue. A play, pause or stop replaces one still waiting with
+// the same callback, whose callback then runs once.
+int dacp_client_queue(dacp_client_t *client, dacp_command_t command,
+                      dacp_result_callback_t callback, void *userdata);
+
+// One request on the kept-alive connection, returns the HTTP status or -1.
+// Blocks for up to a connect and two exchanges, the worker's path.
+int dacp_client_send(dacp_client_t *client, dacp_command_t command);
+const char* dacp_client_command_name(dacp_command_t command);
+
+#endif // DACP_CLIENT_H
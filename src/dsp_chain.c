@@ -0,0 +1,452 @@
+#include "dsp_chain.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <syslog.h>
+#include <pthread.h>
+
+// Fixed point throughout the audio path, MIPS routers rarely have an FPU.
+// Coefficients are Q4.28, samples Q8.23 inside the chain for headroom.
+#define COEFF_BITS 28
+#define SAMPLE_SHIFT 8
+#define GAIN_BITS 16
+#define GAIN_UNITY (1 << GAIN_BITS)
+#define BLOCK_FRAMES 256
+#define CROSSFADE_FRAMES 256
+#define MAX_CHANNELS 2
+
+typedef struct {
+    int32_t b0, b1, b2, a1, a2;
+} biquad_t;
+
+// Direct form I: the history is plain input and output, valid for any
+// coefficients, so a new chain can start from the old one's state
+typedef struct {
+    int32_t x1, x2, y1, y2;
+} biquad_state_t;
+
+typedef struct {
+    int stages;
+    biquad_t biquads[DSP_MAX_FILTERS];
+    int32_t preamp;             // Q16
+    bool limiter;
+    int32_t threshold;          // Q23 peak
+    int32_t release;            // Q16 gain recovered per frame
+} chain_t;
+
+struct dsp_chain {
+    pthread_mutex_t mutex;
+    dsp_config_t current_config;
+    uint32_t current_rate;
+    uint8_t current_channels;
+    
+    // Two slots so the outgoing chain can be faded against the new one
+    chain_t chains[2];
+    biquad_state_t states[2][DSP_MAX_FILTERS][MAX_CHANNELS];
+    int32_t limiter_gain[2];
+    int active;
+    chain_t next_chain;
+    bool pending;
+    uint32_t fade_left;
+    int32_t work[2][BLOCK_FRAMES * MAX_CHANNELS];
+};
+
+static const char *filter_names[] = {
+    "peaking", "lowshelf", "highshelf", "lowpass", "highpass"
+};
+#define FILTER_TYPE_COUNT (sizeof(filter_names) / sizeof(filter_names[0]))
+
+void dsp_chain_get_defaults(dsp_config_t *config) {
+    if (!config) {
+        return;
+    }
+    
+    memset(config, 0, sizeof(*config));
+    config->preamp_db = 0.0f;
+    config->limiter = false;
+    config->limiter_db = DSP_DEFAULT_LIMITER_DB;
+    config->release_ms = DSP_DEFAULT_RELEASE_MS;
+}
+
+int dsp_chain_parse_filter(const char *spec, dsp_filter_t *filter) {
+    if (!spec || !filter) {
+        return -1;
+    }
+    
+    char name[16];
+    size_t length = strcspn(spec, ":");
+    if (length == 0 || length >= sizeof(name) || spec[length] != ':') {
+        return -1;
+    }
+    memcpy(name, spec, length);
+    name[length] = '\0';
+    
+    size_t type = 0;
+    while (type < FILTER_TYPE_COUNT && strcmp(filter_names[type], name) != 0) {
+        type++;
+    }
+    if (type == FILTER_TYPE_COUNT) {
+        return -1;
+    }
+    
+    // Missing gain and Q fall back to 0 dB and a Butterworth Q
+    char *end;
+    filter->type = (dsp_filter_type_t)type;
+    filter->frequency = strtof(spec + length + 1, &end);
+    filter->gain_db = 0.0f;
+    filter->q = DSP_DEFAULT_Q;
+    if (*end == ':') {
+        filter->gain_db = strtof(end + 1, &end);
+    }
+    if (*end == ':') {
+        filter->q = strtof(end + 1, &end);
+    }
+    if (*end != '\0' || filter->frequency <= 0.0f || filter->q <= 0.0f) {
+        return -1;
+    }
+    return 0;
+}
+
+// RBJ audio EQ cookbook, normalized by a0 and rounded to Q28
+static void design_biquad(const dsp_filter_t *filter, uint32_t rate, biquad_t *biquad) {
+    double frequency = filter->frequency < rate * 0.45 ? filter->frequency : rate * 0.45;
+    double gain_db = filter->gain_db;
+    if (gain_db > DSP_MAX_GAIN_DB) {
+        gain_db = DSP_MAX_GAIN_DB;
+    } else if (gain_db < -DSP_MAX_GAIN_DB) {
+        gain_db = -DSP_MAX_GAIN_DB;
+    }
+    
+    double a = pow(10.0, gain_db / 40.0);
+    double w0 = 2.0 * M_PI * frequency / rate;
+    double cosw = cos(w0);
+    double alpha = sin(w0) / (2.0 * filter->q);
+    double root = 2.0 * sqrt(a) * alpha;
+    double b0, b1, b2, a0, a1, a2;
+    
+    switch (filter->type) {
+        case DSP_FILTER_LOW_SHELF:
+            b0 = a * ((a + 1) - (a - 1) * cosw + root);
+            b1 = 2 * a * ((a - 1) - (a + 1) * cosw);
+            b2 = a * ((a + 1) - (a - 1) * cosw - root);
+            a0 = (a + 1) + (a - 1) * cosw + root;
+            a1 = -2 * ((a - 1) + (a + 1) * cosw);
+            a2 = (a + 1) + (a - 1) * cosw - root;
+            break;
+        case DSP_FILTER_HIGH_SHELF:
+            b0 = a * ((a + 1) + (a - 1) * cosw + root);
+            b1 = -2 * a * ((a - 1) + (a + 1) * cosw);
+            b2 = a * ((a + 1) + (a - 1) * cosw - root);
+            a0 = (a + 1) - (a - 1) * cosw + root;
+            a1 = 2 * ((a - 1) - (a + 1) * cosw);
+            a2 = (a + 1) - (a - 1) * cosw - root;
+            break;
+        case DSP_FILTER_LOW_PASS:
+            b0 = (1 - cosw) / 2;
+            b1 = 1 - cosw;
+            b2 = (1 - cosw) / 2;
+            a0 = 1 + alpha;
+            a1 = -2 * cosw;
+            a2 = 1 - alpha;
+            break;
+        case DSP_FILTER_HIGH_PASS:
+            b0 = (1 + cosw) / 2;
+            b1 = -(1 + cosw);
+            b2 = (1 + cosw) / 2;
+            a0 = 1 + alpha;
+            a1 = -2 * cosw;
+            a2 = 1 - alpha;
+            break;
+        case DSP_FILTER_PEAKING:
+        default:
+            b0 = 1 + alpha * a;
+            b1 = -2 * cosw;
+            b2 = 1 - alpha * a;
+            a0 = 1 + alpha / a;
+            a1 = -2 * cosw;
+            a2 = 1 - alpha / a;
+            break;
+    }
+    
+    double scale = (double)(1 << COEFF_BITS) / a0;
+    biquad->b0 = (int32_t)lrint(b0 * scale);
+    biquad->b1 = (int32_t)lrint(b1 * scale);
+    biquad->b2 = (int32_t)lrint(b2 * scale);
+    biquad->a1 = (int32_t)lrint(a1 * scale);
+    biquad->a2 = (int32_t)lrint(a2 * scale);
+}
+
+static void build_chain(const dsp_config_t *config, uint32_t rate, chain_t *chain) {
+    memset(chain, 0, sizeof(*chain));
+    chain->stages = config->filter_count;
+    for (int i = 0; i < chain->stages; i++) {
+        design_biquad(&config->filters[i], rate, &chain->biquads[i]);
+    }
+    
+    chain->preamp = (int32_t)lrint(pow(10.0, config->preamp_db / 20.0) * GAIN_UNITY);
+    chain->limiter = config->limiter;
+    chain->threshold = (int32_t)lrint(pow(10.0, config->limiter_db / 20.0) * (INT16_MAX << SAMPLE_SHIFT));
+    double release_frames = config->release_ms * rate / 1000.0;
+    chain->release = release_frames >= 1.0 ? (int32_t)(GAIN_UNITY / release_frames) + 1 : GAIN_UNITY;
+}
+
+static bool chain_is_bypass(const chain_t *chain) {
+    return chain->stages == 0 && !chain->limiter && chain->preamp == GAIN_UNITY;
+}
+
+dsp_chain_t* dsp_chain_create(void) {
+    dsp_chain_t *dsp = calloc(1, sizeof(dsp_chain_t));
+    if (!dsp) {
+        syslog(LOG_ERR, "Failed to allocate DSP chain");
+        return NULL;
+    }
+    
+    pthread_mutex_init(&dsp->mutex, NULL);
+    dsp->current_rate = 44100;
+    dsp->current_channels = 2;
+    dsp_chain_get_defaults(&dsp->current_config);
+    build_chain(&dsp->current_config, dsp->current_rate, &dsp->chains[0]);
+    build_chain(&dsp->current_config, dsp->current_rate, &dsp->chains[1]);
+    dsp->limiter_gain[0] = GAIN_UNITY;
+    dsp->limiter_gain[1] = GAIN_UNITY;
+    return dsp;
+}
+
+void dsp_chain_destroy(dsp_chain_t *dsp) {
+    if (!dsp) {
+        return;
+    }
+    
+    pthread_mutex_destroy(&dsp->mutex);
+    free(dsp);
+}
+
+int dsp_chain_configure(dsp_chain_t *dsp, const dsp_config_t *config) {
+    if (!config || config->filter_count < 0 || config->filter_count > DSP_MAX_FILTERS) {
+        return -1;
+    }
+    
+    // The design math is slow in soft float, keep it out of the audio lock
+    pthread_mutex_lock(&dsp->mutex);
+    uint32_t rate = dsp->current_rate;
+    pthread_mutex_unlock(&dsp->mutex);
+    
+    chain_t chain;
+    build_chain(config, rate, &chain);
+    
+    pthread_mutex_lock(&dsp->mutex);
+    dsp->current_config = *config;
+    dsp->next_chain = chain;
+    dsp->pending = true;
+    pthread_mutex_unlock(&dsp->mutex);
+    
+    syslog(LOG_INFO, "DSP chain: %d filters, preamp %.1f dB, limiter %s", config->filter_count,
+           config->preamp_db, config->limiter ? "on" : "off");
+    return 0;
+}
+
+int dsp_chain_get_config(dsp_chain_t *dsp, dsp_config_t *config) {
+    if (!config) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&dsp->mutex);
+    *config = dsp->current_config;
+    pthread_mutex_unlock(&dsp->mutex);
+    return 0;
+}
+
+int dsp_chain_set_format(dsp_chain_t *dsp, uint32_t sample_rate, uint8_t channels) {
+    if (sample_rate == 0 || channels == 0) {
+        return -1;
+    }
+    
+    // A new stream starts from silence, no crossfade needed
+    pthread_mutex_lock(&dsp->mutex);
+    dsp->current_rate = sample_rate;
+    dsp->current_channels = channels;
+    build_chain(&dsp->current_config, dsp->current_rate, &dsp->chains[dsp->active]);
+    memset(dsp->states, 0, sizeof(dsp->states));
+    dsp->limiter_gain[dsp->active] = GAIN_UNITY;
+    dsp->pending = false;
+    dsp->fade_left = 0;
+    pthread_mutex_unlock(&dsp->mutex);
+    return 0;
+}
+
+// Stereo kernel: both channels of one stage per step, so the coefficients
+// stay in registers and the two multiply chains interleave
+static void run_stage_stereo(const biquad_t *c, biquad_state_t *state, int32_t *samples, size_t frames) {
+    const int32_t b0 = c->b0, b1 = c->b1, b2 = c->b2, a1 = c->a1, a2 = c->a2;
+    biquad_state_t l = state[0];
+    biquad_state_t r = state[1];
+    
+    for (size_t i = 0; i < frames; i++) {
+        int32_t xl = samples[2 * i];
+        int32_t xr = samples[2 * i + 1];
+        int64_t accl = (int64_t)b0 * xl + (int64_t)b1 * l.x1 + (int64_t)b2 * l.x2 -
+                       (int64_t)a1 * l.y1 - (int64_t)a2 * l.y2;
+        int64_t accr = (int64_t)b0 * xr + (int64_t)b1 * r.x1 + (int64_t)b2 * r.x2 -
+                       (int64_t)a1 * r.y1 - (int64_t)a2 * r.y2;
+        int32_t yl = (int32_t)(accl >> COEFF_BITS);
+        int32_t yr = (int32_t)(accr >> COEFF_BITS);
+        
+        l.x2 = l.x1;
+        l.x1 = xl;
+        l.y2 = l.y1;
+        l.y1 = yl;
+        r.x2 = r.x1;
+        r.x1 = xr;
+        r.y2 = r.y1;
+        r.y1 = yr;
+        samples[2 * i] = yl;
+        samples[2 * i + 1] = yr;
+    }
+    
+    state[0] = l;
+    state[1] = r;
+}
+
+static void run_stage_mono(const biquad_t *c, biquad_state_t *state, int32_t *samples, size_t frames) {
+    biquad_state_t s = *state;
+    
+    for (size_t i = 0; i < frames; i++) {
+        int32_t x = samples[i];
+        int64_t acc = (int64_t)c->b0 * x + (int64_t)c->b1 * s.x1 + (int64_t)c->b2 * s.x2 -
+                      (int64_t)c->a1 * s.y1 - (int64_t)c->a2 * s.y2;
+        int32_t y = (int32_t)(acc >> COEFF_BITS);
+        s.x2 = s.x1;
+        s.x1 = x;
+        s.y2 = s.y1;
+        s.y1 = y;
+        samples[i] = y;
+    }
+    
+    *state = s;
+}
+
+// Instant attack, linear release, both channels share one gain
+static void run_limiter(const chain_t *chain, int32_t *gain_state, int32_t *samples, size_t frames,
+                        size_t channels) {
+    int32_t gain = *gain_state;
+    
+    for (size_t i = 0; i < frames; i++) {
+        int32_t *frame = samples + i * channels;
+        int32_t peak = 0;
+        for (size_t channel = 0; channel < channels; channel++) {
+            int32_t level = frame[channel] < 0 ? -frame[channel] : frame[channel];
+            peak = level > peak ? level : peak;
+        }
+        
+        gain = gain + chain->release < GAIN_UNITY ? gain + chain->release : GAIN_UNITY;
+        if ((int64_t)peak * gain > ((int64_t)chain->threshold << GAIN_BITS)) {
+            gain = (int32_t)(((int64_t)chain->threshold << GAIN_BITS) / peak);
+        }
+        if (gain != GAIN_UNITY) {
+            for (size_t channel = 0; channel < channels; channel++) {
+                frame[channel] = (int32_t)(((int64_t)frame[channel] * gain) >> GAIN_BITS);
+            }
+        }
+    }
+    
+    *gain_state = gain;
+}
+
+static void run_chain(dsp_chain_t *dsp, int slot, const int16_t *input, int32_t *samples, size_t frames,
+                      size_t channels) {
+    const chain_t *chain = &dsp->chains[slot];
+    size_t count = frames * channels;
+    
+    for (size_t i = 0; i < count; i++) {
+        samples[i] = (int32_t)input[i] << SAMPLE_SHIFT;
+    }
+    if (chain->preamp != GAIN_UNITY) {
+        for (size_t i = 0; i < count; i++) {
+            samples[i] = (int32_t)(((int64_t)samples[i] * chain->preamp) >> GAIN_BITS);
+        }
+    }
+    
+    for (int stage = 0; stage < chain->stages; stage++) {
+        if (channels == 2) {
+            run_stage_stereo(&chain->biquads[stage], dsp->states[slot][stage], samples, frames);
+        } else {
+            run_stage_mono(&chain->biquads[stage], &dsp->states[slot][stage][0], samples, frames);
+        }
+    }
+    
+    if (chain->limiter) {
+        run_limiter(chain, &dsp->limiter_gain[slot], samples, frames, channels);
+    }
+}
+
+// The new chain picks up the old history, stages it did not have start empty
+static void take_over_locked(dsp_chain_t *dsp) {
+    int old = dsp->active;
+    int new = !dsp->active;
+    
+    dsp->chains[new] = dsp->next_chain;
+    for (int stage = 0; stage < DSP_MAX_FILTERS; stage++) {
+        if (stage < dsp->chains[old].stages) {
+            memcpy(dsp->states[new][stage], dsp->states[old][stage], sizeof(dsp->states[new][stage]));
+        } else {
+            memset(dsp->states[new][stage], 0, sizeof(dsp->states[new][stage]));
+        }
+    }
+    dsp->limiter_gain[new] = dsp->limiter_gain[old];
+    
+    dsp->active = new;
+    dsp->pending = false;
+    bool bypass = chain_is_bypass(&dsp->chains[old]) && chain_is_bypass(&dsp->chains[new]);
+    dsp->fade_left = bypass ? 0 : CROSSFADE_FRAMES;
+}
+
+void dsp_chain_process(dsp_chain_t *dsp, int16_t *samples, size_t frames) {
+    if (!samples || frames == 0) {
+        return;
+    }
+    
+    uint64_t start_ns = stats_now();
+    pthread_mutex_lock(&dsp->mutex);
+    
+    if (dsp->pending && dsp->fade_left == 0) {
+        take_over_locked(dsp);
+    }
+    if ((dsp->fade_left == 0 && chain_is_bypass(&dsp->chains[dsp->active])) ||
+        dsp->current_channels > MAX_CHANNELS) {
+        pthread_mutex_unlock(&dsp->mutex);
+        return;
+    }
+    
+    size_t channels = dsp->current_channels;
+    for (size_t done = 0; done < frames; ) {
+        size_t block = frames - done < BLOCK_FRAMES ? frames - done : BLOCK_FRAMES;
+        int16_t *block_samples = samples + done * channels;
+        size_t count = block * channels;
+        
+        run_chain(dsp, dsp->active, block_samples, dsp->work[0], block, channels);
+        
+        // Linear crossfade from the outgoing chain to the new one
+        if (dsp->fade_left > 0) {
+            run_chain(dsp, !dsp->active, block_samples, dsp->work[1], block, channels);
+            for (size_t i = 0; i < block && dsp->fade_left > 0; i++, dsp->fade_left--) {
+                int64_t weight = dsp->fade_left;
+                for (size_t channel = 0; channel < channels; channel++) {
+                    int32_t *out = &dsp->work[0][i * channels + channel];
+                    int32_t old = dsp->work[1][i * channels + channel];
+                    *out += (int32_t)(((int64_t)(old - *out) * weight) / CROSSFADE_FRAMES);
+                }
+            }
+        }
+        
+        for (size_t i = 0; i < count; i++) {
+            int32_t sample = (dsp->work[0][i] + (1 << (SAMPLE_SHIFT - 1))) >> SAMPLE_SHIFT;
+            block_samples[i] = (int16_t)(sample > INT16_MAX ? INT16_MAX : sample < INT16_MIN ? INT16_MIN : sample);
+        }
+        done += block;
+    }
+    
+    pthread_mutex_unlock(&dsp->mutex);
+    stats_record(STATS_STAGE_DSP, start_ns);
+}
@@ -0,0 +1,60 @@
+#ifndef DSP_CHAIN_H
+#define DSP_CHAIN_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define DSP_MAX_FILTERS 8
+#define DSP_MAX_GAIN_DB 15.0f
+#define DSP_DEFAULT_Q 0.707f
+#define DSP_DEFAULT_LIMITER_DB -1.0f
+#define DSP_DEFAULT_RELEASE_MS 200.0f
+
+typedef enum {
+    DSP_FILTER_PEAKING = 0,
+    DSP_FILTER_LOW_SHELF,
+    DSP_FILTER_HIGH_SHELF,
+    DSP_FILTER_LOW_PASS,
+    DSP_FILTER_HIGH_PASS
+} dsp_filter_type_t;
+
+typedef struct {
+    dsp_filter_type_t type;
+    float frequency;            // Hz, centre or corner
+    float gain_db;              // peaking and shelves only
+    float q;
+} dsp_filter_t;
+
+typedef struct {
+    dsp_filter_t filters[DSP_MAX_FILTERS];
+    int filter_count;
+    float preamp_db;            // headroom for boosts, applied before the filters
+    bool limiter;
+    float limiter_db;           // peak ceiling in dBFS
+    float release_ms;           // time the limiter takes to recover
+} dsp_config_t;
+
+void dsp_chain_get_defaults(dsp_config_t *config);
+
+// "type:frequency[:gain_db[:q]]", type one of peaking, lowshelf, highshelf,
+// lowpass, highpass
+int dsp_chain_parse_filter(const char *spec, dsp_filter_t *filter);
+
+// One chain per output, with its own filter state and work buffers
+typedef struct dsp_chain dsp_chain_t;
+
+// Lifecycle, an empty chain passes audio through untouched
+dsp_chain_t* dsp_chain_create(void);
+void dsp_chain_destroy(dsp_chain_t *dsp);
+
+// Control side: the new chain crossfades in over a few ms, so it can be
+// changed while audio plays. set_format resets the filters for a new stream.
+int dsp_chain_configure(dsp_chain_t *dsp, const dsp_config_t *config);
+int dsp_chain_get_config(dsp_chain_t *dsp, dsp_config_t *config);
+int dsp_chain_set_format(dsp_chain_t *dsp, uint32_t sample_rate, uint8_t channels);
+
+// Playout side: filters interleaved 16 bit audio in place
+void dsp_chain_process(dsp_chain_t *dsp, int16_t *samples, size_t frames);
+
+#endif // DSP_CHAIN_H
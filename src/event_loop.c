@@ -0,0 +1,125 @@
+#include "event_loop.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/epoll.h>
+
+#define EVENT_LOOP_BATCH 16
+
+// Only touched from the main thread, so no locking. The generation in the
+// epoll data tells a handler removed during a dispatch from its slot's new owner.
+typedef struct {
+    int fd;
+    event_callback_t callback;
+    void *userdata;
+    uint32_t generation;
+    bool used;
+} handler_t;
+
+static handler_t handlers[EVENT_LOOP_MAX_HANDLERS];
+static int epoll_fd = -1;
+
+int event_loop_init(void) {
+    if (epoll_fd >= 0) {
+        return 0;
+    }
+    
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        syslog(LOG_ERR, "Failed to create event loop: %s", strerror(errno));
+        return -1;
+    }
+    memset(handlers, 0, sizeof(handlers));
+    
+    syslog(LOG_INFO, "Event loop initialized");
+    return 0;
+}
+
+void event_loop_cleanup(void) {
+    if (epoll_fd < 0) {
+        return;
+    }
+    
+    close(epoll_fd);
+    epoll_fd = -1;
+    memset(handlers, 0, sizeof(handlers));
+}
+
+int event_loop_add(int fd, event_callback_t callback, void *userdata) {
+    if (epoll_fd < 0 || fd < 0 || !callback) {
+        return -1;
+    }
+    
+    for (int i = 0; i < EVENT_LOOP_MAX_HANDLERS; i++) {
+        handler_t *handler = &handlers[i];
+        if (handler->used) {
+            continue;
+        }
+        
+        handler->generation++;
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.u64 = ((uint64_t)handler->generation << 32) | (uint32_t)i;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            syslog(LOG_WARNING, "Cannot watch fd %d: %s", fd, strerror(errno));
+            return -1;
+        }
+        
+        handler->fd = fd;
+        handler->callback = callback;
+        handler->userdata = userdata;
+        handler->used = true;
+        return 0;
+    }
+    
+    syslog(LOG_WARNING, "No free event loop slot for fd %d", fd);
+    return -1;
+}
+
+int event_loop_remove(int fd) {
+    for (int i = 0; i < EVENT_LOOP_MAX_HANDLERS; i++) {
+        if (handlers[i].used && handlers[i].fd == fd) {
+            handlers[i].used = false;
+            // Fails harmlessly when the fd was closed first
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int event_loop_get_fd(void) {
+    return epoll_fd;
+}
+
+int event_loop_dispatch(int timeout_ms) {
+    if (epoll_fd < 0) {
+        return -1;
+    }
+    
+    struct epoll_event events[EVENT_LOOP_BATCH];
+    int count = epoll_wait(epoll_fd, events, EVENT_LOOP_BATCH, timeout_ms);
+    if (count < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    
+    int handled = 0;
+    for (int i = 0; i < count; i++) {
+        uint32_t index = (uint32_t)events[i].data.u64;
+        uint32_t generation = (uint32_t)(events[i].data.u64 >> 32);
+        if (index >= EVENT_LOOP_MAX_HANDLERS) {
+            continue;
+        }
+        handler_t *handler = &handlers[index];
+        if (!handler->used || handler->generation != generation) {
+            continue;
+        }
+        handler->callback(handler->fd, events[i].events, handler->userdata);
+        handled++;
+    }
+    return handled;
+}
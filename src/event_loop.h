@@ -0,0 +1,26 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define EVENT_LOOP_MAX_HANDLERS 64
+
+// Called on the main thread when fd is readable, events as from epoll
+typedef void (*event_callback_t)(int fd, uint32_t events, void *userdata);
+
+// Lifecycle
+int event_loop_init(void);
+void event_loop_cleanup(void);
+
+// Handlers may add and remove handlers, themselves included, while called
+int event_loop_add(int fd, event_callback_t callback, void *userdata);
+int event_loop_remove(int fd);
+
+// Readable whenever a handler is due, for the server's select()
+int event_loop_get_fd(void);
+
+// Runs due handlers, waiting up to timeout_ms for one (0 never waits)
+int event_loop_dispatch(int timeout_ms);
+
+#endif // EVENT_LOOP_H
@@ -0,0 +1,397 @@
+#include "input_control.h"
+#include "event_loop.h"
+#include "volume_control.h"
+#include "playback_control.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <linux/input.h>
+
+#define INPUT_EVENT_BATCH 16
+#define ENCODER_FAST_MS 25          // detents this close move 4 steps
+#define ENCODER_BRISK_MS 60         // and these 2
+#define NOTIFY_BUFFER_SIZE 1024
+
+#define BITS_PER_LONG (sizeof(long) * 8)
+#define BIT_LONGS(bits) (((bits) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define TEST_BIT(bit, array) (((array)[(bit) / BITS_PER_LONG] >> ((bit) % BITS_PER_LONG)) & 1)
+
+typedef enum {
+    ACTION_VOLUME_UP = 0,
+    ACTION_VOLUME_DOWN,
+    ACTION_MUTE,
+    ACTION_PLAYPAUSE,
+    ACTION_PLAY,
+    ACTION_PAUSE,
+    ACTION_STOP,
+    ACTION_NEXT,
+    ACTION_PREVIOUS,
+    ACTION_COUNT
+} input_action_t;
+
+typedef struct {
+    int fd;
+    char path[64];
+    int encoder_axis;           // REL_* code counted as detents, -1 none
+    uint64_t pressed_ms[ACTION_COUNT];
+    uint64_t detent_ms;
+    int detent_direction;
+    bool used;
+} input_device_t;
+
+// Only touched from the event loop on the main thread
+static input_control_config_t current_config = {
+    INPUT_CONTROL_AUTO, INPUT_CONTROL_DEFAULT_DEBOUNCE_MS, true
+};
+static input_device_t devices[INPUT_CONTROL_MAX_DEVICES];
+static int notify_fd = -1;
+static playback_control_t *playback = NULL;
+static volume_control_t *volume = NULL;
+
+void input_control_get_defaults(input_control_config_t *config) {
+    if (!config) {
+        return;
+    }
+    
+    config->device = INPUT_CONTROL_AUTO;
+    config->debounce_ms = INPUT_CONTROL_DEFAULT_DEBOUNCE_MS;
+    config->accelerate = true;
+}
+
+static int key_action(uint16_t code) {
+    switch (code) {
+        case KEY_VOLUMEUP:
+            return ACTION_VOLUME_UP;
+        case KEY_VOLUMEDOWN:
+            return ACTION_VOLUME_DOWN;
+        case KEY_MUTE:
+            return ACTION_MUTE;
+        case KEY_PLAYPAUSE:
+            return ACTION_PLAYPAUSE;
+        case KEY_PLAY:
+        case KEY_PLAYCD:
+            return ACTION_PLAY;
+        case KEY_PAUSE:
+        case KEY_PAUSECD:
+            return ACTION_PAUSE;
+        case KEY_STOP:
+        case KEY_STOPCD:
+            return ACTION_STOP;
+        case KEY_NEXTSONG:
+            return ACTION_NEXT;
+        case KEY_PREVIOUSSONG:
+            return ACTION_PREVIOUS;
+        default:
+            return -1;
+    }
+}
+
+static void run_action(input_action_t action) {
+    switch (action) {
+        case ACTION_VOLUME_UP:
+            volume_control_step_up(volume);
+            break;
+        case ACTION_VOLUME_DOWN:
+            volume_control_step_down(volume);
+            break;
+        case ACTION_MUTE:
+            volume_control_set_mute(volume, !volume_control_is_muted(volume));
+            break;
+        case ACTION_PLAYPAUSE:
+            if (playback_control_get_state(playback) == PLAYBACK_PLAYING) {
+                playback_control_pause(playback);
+            } else {
+                playback_control_play(playback);
+            }
+            break;
+        case ACTION_PLAY:
+            playback_control_play(playback);
+            break;
+        case ACTION_PAUSE:
+            playback_control_pause(playback);
+            break;
+        case ACTION_STOP:
+            playback_control_stop(playback);
+            break;
+        case ACTION_NEXT:
+            playback_control_next(playback);
+            break;
+        case ACTION_PREVIOUS:
+            playback_control_previous(playback);
+            break;
+        default:
+            break;
+    }
+}
+
+// Kernel timestamps, so a burst read late is still debounced by when it happened
+static uint64_t event_ms(const struct input_event *event) {
+    return (uint64_t)event->input_event_sec * 1000 + (uint64_t)event->input_event_usec / 1000;
+}
+
+static void handle_key(input_device_t *device, const struct input_event *event) {
+    int action = key_action(event->code);
+    if (action < 0 || event->value == 0) {
+        return;
+    }
+    
+    // Held volume keys repeat, other keys act once per press
+    uint64_t now = event_ms(event);
+    if (event->value == 2) {
+        if (action == ACTION_VOLUME_UP || action == ACTION_VOLUME_DOWN) {
+            run_action((input_action_t)action);
+        }
+        return;
+    }
+    if (device->pressed_ms[action] != 0 && now - device->pressed_ms[action] < current_config.debounce_ms) {
+        return;
+    }
+    device->pressed_ms[action] = now;
+    run_action((input_action_t)action);
+}
+
+static void handle_detents(input_device_t *device, const struct input_event *event) {
+    if (event->value == 0) {
+        return;
+    }
+    
+    uint64_t now = event_ms(event);
+    int direction = event->value > 0 ? 1 : -1;
+    uint64_t since = now - device->detent_ms;
+    
+    // A contact bouncing between two detents reads as a quick reversal
+    if (device->detent_ms != 0 && direction != device->detent_direction && since < current_config.debounce_ms) {
+        return;
+    }
+    
+    int steps = abs(event->value);
+    if (current_config.accelerate && device->detent_ms != 0 && direction == device->detent_direction) {
+        steps *= since < ENCODER_FAST_MS ? 4 : since < ENCODER_BRISK_MS ? 2 : 1;
+    }
+    device->detent_ms = now;
+    device->detent_direction = direction;
+    volume_control_step(volume, direction * steps);
+}
+
+static void close_device(input_device_t *device) {
+    event_loop_remove(device->fd);
+    close(device->fd);
+    device->used = false;
+    syslog(LOG_INFO, "Input %s removed", device->path);
+}
+
+static void device_callback(int fd, uint32_t events, void *userdata) {
+    input_device_t *device = userdata;
+    struct input_event batch[INPUT_EVENT_BATCH];
+    (void)events;
+    
+    while (true) {
+        ssize_t bytes = read(fd, batch, sizeof(batch));
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes < 0 && errno == EAGAIN) {
+            return;
+        }
+        if (bytes <= 0) {
+            // ENODEV once the device is unplugged
+            close_device(device);
+            return;
+        }
+        
+        size_t count = (size_t)bytes / sizeof(struct input_event);
+        for (size_t i = 0; i < count; i++) {
+            if (batch[i].type == EV_KEY) {
+                handle_key(device, &batch[i]);
+            } else if (batch[i].type == EV_REL && batch[i].code == device->encoder_axis) {
+                handle_detents(device, &batch[i]);
+            }
+        }
+    }
+}
+
+// Media keys or a rotary encoder; mice and keyboards without media keys are left alone
+static bool probe_device(int fd, int *encoder_axis) {
+    unsigned long keys[BIT_LONGS(KEY_CNT)];
+    unsigned long axes[BIT_LONGS(REL_CNT)];
+    memset(keys, 0, sizeof(keys));
+    memset(axes, 0, sizeof(axes));
+    if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keys)), keys) < 0) {
+        memset(keys, 0, sizeof(keys));
+    }
+    if (ioctl(fd, EVIOCGBIT(EV_REL, sizeof(axes)), axes) < 0) {
+        memset(axes, 0, sizeof(axes));
+    }
+    
+    *encoder_axis = -1;
+    if (TEST_BIT(REL_DIAL, axes)) {
+        *encoder_axis = REL_DIAL;
+    } else if (!TEST_BIT(BTN_LEFT, keys)) {
+        if (TEST_BIT(REL_WHEEL, axes)) {
+            *encoder_axis = REL_WHEEL;
+        } else if (TEST_BIT(REL_X, axes)) {
+            *encoder_axis = REL_X;
+        }
+    }
+    if (*encoder_axis >= 0) {
+        return true;
+    }
+    
+    for (uint16_t code = 0; code < KEY_CNT; code++) {
+        if (TEST_BIT(code, keys) && key_action(code) >= 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int open_device(const char *path, bool quiet) {
+    for (int i = 0; i < INPUT_CONTROL_MAX_DEVICES; i++) {
+        if (devices[i].used && strcmp(devices[i].path, path) == 0) {
+            return 0;
+        }
+    }
+    
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        if (!quiet) {
+            syslog(LOG_WARNING, "Cannot open input %s: %s", path, strerror(errno));
+        }
+        return -1;
+    }
+    
+    int encoder_axis;
+    if (!probe_device(fd, &encoder_axis)) {
+        close(fd);
+        return -1;
+    }
+    
+    input_device_t *device = NULL;
+    for (int i = 0; i < INPUT_CONTROL_MAX_DEVICES && !device; i++) {
+        if (!devices[i].used) {
+            device = &devices[i];
+        }
+    }
+    if (!device) {
+        close(fd);
+        syslog(LOG_WARNING, "Too many input devices, ignoring %s", path);
+        return -1;
+    }
+    
+    memset(device, 0, sizeof(*device));
+    device->fd = fd;
+    device->encoder_axis = encoder_axis;
+    snprintf(device->path, sizeof(device->path), "%s", path);
+    if (event_loop_add(fd, device_callback, device) != 0) {
+        close(fd);
+        return -1;
+    }
+    device->used = true;
+    
+    char name[64] = "unknown";
+    ioctl(fd, EVIOCGNAME(sizeof(name) - 1), name);
+    syslog(LOG_INFO, "Input %s (%s)%s", path, name, encoder_axis >= 0 ? " as volume encoder" : "");
+    return 0;
+}
+
+// New event nodes appear on hotplug, and again once udev has set permissions
+static void notify_callback(int fd, uint32_t events, void *userdata) {
+    char buffer[NOTIFY_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    (void)events;
+    (void)userdata;
+    
+    ssize_t bytes;
+    while ((bytes = read(fd, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; p < buffer + bytes; ) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            if (event->len > 0 && strncmp(event->name, "event", 5) == 0) {
+                char path[64];
+                snprintf(path, sizeof(path), INPUT_CONTROL_DIR "/%.16s", event->name);
+                open_device(path, true);
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+static void scan_devices(void) {
+    DIR *dir = opendir(INPUT_CONTROL_DIR);
+    if (!dir) {
+        return;
+    }
+    
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "event", 5) == 0) {
+            char path[64];
+            snprintf(path, sizeof(path), INPUT_CONTROL_DIR "/%.16s", entry->d_name);
+            open_device(path, false);
+        }
+    }
+    closedir(dir);
+}
+
+int input_control_init(const input_control_config_t *config, playback_control_t *zone_playback,
+                       volume_control_t *zone_volume) {
+    if (!zone_playback || !zone_volume) {
+        return -1;
+    }
+    if (config) {
+        current_config = *config;
+    }
+    memset(devices, 0, sizeof(devices));
+    playback = zone_playback;
+    volume = zone_volume;
+    
+    if (!current_config.device || strcmp(current_config.device, INPUT_CONTROL_NONE) == 0) {
+        return 0;
+    }
+    
+    if (strcmp(current_config.device, INPUT_CONTROL_AUTO) != 0) {
+        return open_device(current_config.device, false);
+    }
+    
+    notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (notify_fd >= 0 &&
+        (inotify_add_watch(notify_fd, INPUT_CONTROL_DIR, IN_CREATE | IN_ATTRIB) < 0 ||
+         event_loop_add(notify_fd, notify_callback, NULL) != 0)) {
+        close(notify_fd);
+        notify_fd = -1;
+    }
+    scan_devices();
+    
+    syslog(LOG_INFO, "Input control initialized, %d devices", input_control_get_device_count());
+    return 0;
+}
+
+void input_control_cleanup(void) {
+    if (notify_fd >= 0) {
+        event_loop_remove(notify_fd);
+        close(notify_fd);
+        notify_fd = -1;
+    }
+    
+    for (int i = 0; i < INPUT_CONTROL_MAX_DEVICES; i++) {
+        if (devices[i].used) {
+            event_loop_remove(devices[i].fd);
+            close(devices[i].fd);
+            devices[i].used = false;
+        }
+    }
+}
+
+int input_control_get_device_count(void) {
+    int count = 0;
+    for (int i = 0; i < INPUT_CONTROL_MAX_DEVICES; i++) {
+        count += devices[i].used;
+    }
+    return count;
+}
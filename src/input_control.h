@@ -0,0 +1,32 @@
+#ifndef INPUT_CONTROL_H
+#define INPUT_CONTROL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "playback_control.h"
+#include "volume_control.h"
+
+#define INPUT_CONTROL_AUTO "auto"           // every suitable /dev/input/event*, hotplug included
+#define INPUT_CONTROL_NONE "none"
+#define INPUT_CONTROL_DIR "/dev/input"
+#define INPUT_CONTROL_MAX_DEVICES 8
+#define INPUT_CONTROL_DEFAULT_DEBOUNCE_MS 30
+
+typedef struct {
+    const char *device;         // event device path, INPUT_CONTROL_AUTO or INPUT_CONTROL_NONE
+    uint32_t debounce_ms;       // presses and encoder reversals closer than this are bounce
+    bool accelerate;            // fast encoder turns move the volume further per detent
+} input_control_config_t;
+
+void input_control_get_defaults(input_control_config_t *config);
+
+// Buttons and encoders are read by the event loop, which must exist first.
+// Media keys map to playback and volume, an encoder's REL_DIAL, REL_WHEEL
+// or REL_X axis (not on pointers) steps the volume of the zone whose
+// handles are given.
+int input_control_init(const input_control_config_t *config, playback_control_t *playback,
+                       volume_control_t *volume);
+void input_control_cleanup(void);
+int input_control_get_device_count(void);
+
+#endif // INPUT_CONTROL_H
@@ -0,0 +1,263 @@
+#include "logger.h"
+#include "thread_policy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#define LOGGER_MAX_THREADS 16
+#define LOGGER_RING_ENTRIES 32
+#define LOGGER_MESSAGE_SIZE 120
+#define LOGGER_BURST 10
+#define LOGGER_RATE_PER_SEC 5
+#define LOGGER_DEDUP_WINDOW_MS 10000
+#define LOGGER_DRAIN_INTERVAL_US 100000
+
+enum {
+    RING_FREE = 0,
+    RING_CLAIMED,
+    RING_OWNED,
+    RING_ORPHANED
+};
+
+typedef struct {
+    int priority;
+    char text[LOGGER_MESSAGE_SIZE];
+} log_entry_t;
+
+// Single producer (the owning thread), single consumer (the drain thread)
+typedef struct {
+    int state;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t suppressed;
+    
+    // Only touched by the owning thread
+    uint32_t tokens;
+    uint64_t refill_ms;
+    uint32_t repeats;
+    int last_priority;
+    uint64_t last_ms;
+    char last_text[LOGGER_MESSAGE_SIZE];
+    
+    log_entry_t entries[LOGGER_RING_ENTRIES];
+} log_ring_t;
+
+static log_ring_t rings[LOGGER_MAX_THREADS];
+static uint32_t unowned_dropped = 0;
+static uint32_t generation = 0;
+static bool drain_running = false;
+static pthread_t drain_thread;
+static pthread_key_t ring_key;
+
+static __thread log_ring_t *thread_ring = NULL;
+static __thread uint32_t thread_generation = 0;
+
+static uint64_t now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// The drain thread frees the ring once it has emptied it
+static void release_ring(void *value) {
+    log_ring_t *ring = (log_ring_t *)value;
+    __atomic_store_n(&ring->state, RING_ORPHANED, __ATOMIC_RELEASE);
+}
+
+static log_ring_t* acquire_ring(void) {
+    uint32_t current = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+    if (thread_ring && thread_generation == current) {
+        return thread_ring;
+    }
+    
+    for (int i = 0; i < LOGGER_MAX_THREADS; i++) {
+        log_ring_t *ring = &rings[i];
+        int expected = RING_FREE;
+        if (!__atomic_compare_exchange_n(&ring->state, &expected, RING_CLAIMED, false,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        
+        ring->tokens = LOGGER_BURST;
+        ring->refill_ms = now_ms();
+        ring->repeats = 0;
+        ring->last_priority = -1;
+        ring->last_text[0] = '\0';
+        pthread_setspecific(ring_key, ring);
+        thread_ring = ring;
+        thread_generation = current;
+        __atomic_store_n(&ring->state, RING_OWNED, __ATOMIC_RELEASE);
+        return ring;
+    }
+    
+    thread_ring = NULL;
+    return NULL;
+}
+
+static void enqueue(log_ring_t *ring, int priority, const char *text) {
+    uint32_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOGGER_RING_ENTRIES) {
+        __atomic_fetch_add(&ring->suppressed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    
+    log_entry_t *entry = &ring->entries[head % LOGGER_RING_ENTRIES];
+    entry->priority = priority;
+    snprintf(entry->text, sizeof(entry->text), "%s", text);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Token bucket, refilled at LOGGER_RATE_PER_SEC up to LOGGER_BURST
+static bool take_token(log_ring_t *ring, uint64_t now) {
+    uint64_t refill = (now - ring->refill_ms) * LOGGER_RATE_PER_SEC / 1000;
+    if (refill > 0) {
+        ring->refill_ms += refill * 1000 / LOGGER_RATE_PER_SEC;
+        ring->tokens = ring->tokens + refill > LOGGER_BURST ? LOGGER_BURST : ring->tokens + (uint32_t)refill;
+    }
+    
+    if (ring->tokens == 0) {
+        return false;
+    }
+    ring->tokens--;
+    return true;
+}
+
+void logger_write(int priority, const char *format, ...) {
+    va_list args;
+    
+    if (!__atomic_load_n(&drain_running, __ATOMIC_ACQUIRE)) {
+        va_start(args, format);
+        vsyslog(priority, format, args);
+        va_end(args);
+        return;
+    }
+    
+    log_ring_t *ring = acquire_ring();
+    if (!ring) {
+        __atomic_fetch_add(&unowned_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    
+    char text[LOGGER_MESSAGE_SIZE];
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    
+    // Identical messages inside the window only bump a counter
+    uint64_t now = now_ms();
+    if (priority == ring->last_priority && now - ring->last_ms < LOGGER_DEDUP_WINDOW_MS &&
+        strcmp(text, ring->last_text) == 0) {
+        ring->repeats++;
+        return;
+    }
+    
+    if (ring->repeats > 0) {
+        char summary[LOGGER_MESSAGE_SIZE];
+        snprintf(summary, sizeof(summary), "Last message repeated %u times", ring->repeats);
+        enqueue(ring, ring->last_priority, summary);
+        ring->repeats = 0;
+    }
+    
+    if (!take_token(ring, now)) {
+        __atomic_fetch_add(&ring->suppressed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    
+    enqueue(ring, priority, text);
+    ring->last_priority = priority;
+    ring->last_ms = now;
+    memcpy(ring->last_text, text, sizeof(text));
+}
+
+static void drain_rings(void) {
+    for (int i = 0; i < LOGGER_MAX_THREADS; i++) {
+        log_ring_t *ring = &rings[i];
+        int state = __atomic_load_n(&ring->state, __ATOMIC_ACQUIRE);
+        if (state != RING_OWNED && state != RING_ORPHANED) {
+            continue;
+        }
+        
+        uint32_t tail = ring->tail;
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        while (tail != head) {
+            const log_entry_t *entry = &ring->entries[tail % LOGGER_RING_ENTRIES];
+            syslog(entry->priority, "%s", entry->text);
+            tail++;
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        }
+        
+        uint32_t suppressed = __atomic_exchange_n(&ring->suppressed, 0, __ATOMIC_RELAXED);
+        if (suppressed > 0) {
+            syslog(LOG_WARNING, "%u log messages suppressed", suppressed);
+        }
+        
+        // An orphaned ring has no producer left, so empty means done
+        if (state == RING_ORPHANED) {
+            __atomic_store_n(&ring->state, RING_FREE, __ATOMIC_RELEASE);
+        }
+    }
+    
+    uint32_t dropped = __atomic_exchange_n(&unowned_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0) {
+        syslog(LOG_WARNING, "%u log messages dropped, no free log ring", dropped);
+    }
+}
+
+static void* drain_thread_func(void *arg) {
+    (void)arg;
+    
+    thread_policy_apply(THREAD_ROLE_BACKGROUND);
+    
+    while (__atomic_load_n(&drain_running, __ATOMIC_ACQUIRE)) {
+        drain_rings();
+        usleep(LOGGER_DRAIN_INTERVAL_US);
+    }
+    
+    return NULL;
+}
+
+int logger_init(void) {
+    if (drain_running) {
+        return 0;
+    }
+    
+    if (pthread_key_create(&ring_key, release_ring) != 0) {
+        syslog(LOG_ERR, "Failed to create log ring key");
+        return -1;
+    }
+    
+    // Rings held by threads from an earlier run are invalidated here
+    memset(rings, 0, sizeof(rings));
+    __atomic_store_n(&unowned_dropped, 0, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&generation, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&drain_running, true, __ATOMIC_RELEASE);
+    
+    if (pthread_create(&drain_thread, thread_policy_attr(), drain_thread_func, NULL) != 0) {
+        __atomic_store_n(&drain_running, false, __ATOMIC_RELEASE);
+        pthread_key_delete(ring_key);
+        syslog(LOG_ERR, "Failed to create log drain thread");
+        return -1;
+    }
+    
+    syslog(LOG_INFO, "Logger initialized");
+    return 0;
+}
+
+void logger_cleanup(void) {
+    if (!drain_running) {
+        return;
+    }
+    
+    __atomic_store_n(&drain_running, false, __ATOMIC_RELEASE);
+    pthread_join(drain_thread, NULL);
+    
+    // Whatever was queued before the flag flipped still reaches syslog
+    drain_rings();
+    pthread_key_delete(ring_key);
+}
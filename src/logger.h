@@ -0,0 +1,26 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <syslog.h>
+
+// Messages above this syslog priority are compiled out, arguments included
+#ifndef LOGGER_LEVEL
+#define LOGGER_LEVEL LOG_DEBUG
+#endif
+
+// Never blocks and never enters the kernel, safe with audio locks held
+#define logger_log(priority, ...) \
+    do { \
+        if ((priority) <= LOGGER_LEVEL) { \
+            logger_write((priority), __VA_ARGS__); \
+        } \
+    } while (0)
+
+// Lifecycle, messages logged before init go straight to syslog
+int logger_init(void);
+void logger_cleanup(void);
+
+void logger_write(int priority, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#endif // LOGGER_H
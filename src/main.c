@@ -4,15 +4,38 @@
 #include <signal.h>
 #include <unistd.h>
 #include <syslog.h>
+#include <sys/signalfd.h>
 #include <daemon.h>
 #include "airplay_server.h"
+#include "config.h"
 #include "audio_output.h"
+#include "alsa_probe.h"
+#include "power_gate.h"
+#include "dsp_chain.h"
+#include "volume_map.h"
 #include "volume_control.h"
-#include "playback_control.h"
+#include "input_control.h"
+#include "control_api.h"
+#include "event_loop.h"
+#include "mdns.h"
+#include "zone.h"
 #include "multiroom.h"
+#include "crypto_engine.h"
+#include "buffered_audio.h"
+#include "session_arena.h"
+#include "stats.h"
+#include "logger.h"
+#include "thread_policy.h"
+#include "startup.h"
+
+#define OPTIONS "dfs:p:n:a:r:c:Mo:D:i:S:g:Le:P:l:C:R:HV:I:b:NU:W:F:"
 
 static volatile int running = 1;
-static airplay_server_t *server = NULL;
+static zone_t *zones[CONFIG_MAX_ZONES];  // zones[0] is the main section's
+static int zone_count = 0;
+static const char *config_path = CONFIG_DEFAULT_PATH;
+static config_t running_config;         // what a reload is compared against
+static int reload_fd = -1;
 
 void signal_handler(int sig) {
     switch (sig) {
@@ -34,15 +57,169 @@ void setup_signal_handlers() {
     
     sigaction(SIGTERM, &sa, NULL);
     sigaction(SIGINT, &sa, NULL);
-    sigaction(SIGHUP, &sa, NULL);
+    
+    // SIGHUP is read from a signalfd on the event loop, so it has to stay
+    // blocked in every thread, which inherit the mask from here
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hup, NULL);
+    
+    // A pipe output whose reader went away reports EPIPE instead
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+}
+
+// Re-reads the configuration and redoes only what changed, a stream in
+// progress keeps playing
+static void reload_config(int fd, uint32_t events, void *userdata) {
+    struct signalfd_siginfo info;
+    (void)events;
+    (void)userdata;
+    
+    // Several queued SIGHUPs make one reload
+    while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+    }
+    
+    config_t loaded;
+    if (config_load(config_path, &loaded) != 0) {
+        syslog(LOG_WARNING, "Cannot read %s, configuration unchanged", config_path);
+        return;
+    }
+    
+    // The name is the main zone's, the volume and buffer settings every zone's
+    uint32_t changed = config_diff(&running_config, &loaded);
+    if (changed & CONFIG_CHANGED_NAME) {
+        airplay_server_set_name(zones[0]->server, loaded.airplay.device_name);
+    }
+    if (changed & CONFIG_CHANGED_VOLUME) {
+        volume_map_init(&loaded.volume);
+        audio_output_set_hw_volume(zones[0]->output, loaded.use_hw_volume);
+        for (int i = 0; i < zone_count; i++) {
+            volume_control_set_rate(zones[i]->volume, loaded.volume_rate);
+            volume_control_reapply(zones[i]->volume);
+        }
+    }
+    if (changed & CONFIG_CHANGED_BUFFER) {
+        for (int i = 0; i < zone_count; i++) {
+            if (audio_output_set_buffer_size(zones[i]->output, loaded.buffer_size) != 0) {
+                syslog(LOG_WARNING, "Invalid buffer size %zu", loaded.buffer_size);
+                loaded.buffer_size = running_config.buffer_size;
+                break;
+            }
+        }
+    }
+    if (changed & CONFIG_CHANGED_RESTART) {
+        syslog(LOG_WARNING, "Some changes to %s need a restart", config_path);
+    }
+    
+    // The rest stays as running until a restart, so it is reported again
+    snprintf(running_config.airplay.device_name, sizeof(running_config.airplay.device_name), "%s",
+             loaded.airplay.device_name);
+    running_config.use_hw_volume = loaded.use_hw_volume;
+    running_config.volume = loaded.volume;
+    running_config.volume_rate = loaded.volume_rate;
+    running_config.buffer_size = loaded.buffer_size;
+    syslog(LOG_INFO, "Configuration reloaded");
+}
+
+// Deferred until the daemon listens, pairing is refused until the keys are in
+static int load_keys(void) {
+    return crypto_engine_init(CRYPTO_ENGINE_DEFAULT_KEY_DIR);
+}
+
+// Warms the ALSA probe cache so the first RECORD does not wait for it
+static int probe_outputs(void) {
+    bool alsa = strcmp(running_config.output, "alsa") == 0;
+    for (int i = 0; i < running_config.zone_count; i++) {
+        alsa = alsa || strcmp(running_config.zones[i].output, "alsa") == 0;
+    }
+    if (alsa) {
+        alsa_probe_device_t devices[ALSA_PROBE_MAX_DEVICES];
+        alsa_probe_get_devices(devices, ALSA_PROBE_MAX_DEVICES);
+    }
+    return 0;
+}
+
+// Zone settings from the main section, and for index > 0 the zone section.
+// Only the main zone may use the mixer, there is one Master control.
+static void get_zone_config(int index, const dsp_config_t *dsp, zone_config_t *zone) {
+    memset(zone, 0, sizeof(*zone));
+    zone->airplay = running_config.airplay;
+    snprintf(zone->output, sizeof(zone->output), "%s", running_config.output);
+    snprintf(zone->audio_device, sizeof(zone->audio_device), "%s", running_config.audio_device);
+    zone->sample_rate = running_config.sample_rate;
+    zone->channels = running_config.channels;
+    zone->bits_per_sample = running_config.bits_per_sample;
+    zone->buffer_size = running_config.buffer_size;
+    zone->use_hw_volume = running_config.use_hw_volume;
+    zone->volume_rate = running_config.volume_rate;
+    zone->dsp = *dsp;
+    if (index == 0) {
+        return;
+    }
+    
+    const config_zone_t *extra = &running_config.zones[index - 1];
+    snprintf(zone->airplay.device_name, sizeof(zone->airplay.device_name), "%s", extra->device_name);
+    snprintf(zone->airplay.device_id, sizeof(zone->airplay.device_id), "%s", extra->device_id);
+    zone->airplay.port = extra->port;
+    snprintf(zone->output, sizeof(zone->output), "%s", extra->output);
+    snprintf(zone->audio_device, sizeof(zone->audio_device), "%s", extra->audio_device);
+    zone->use_hw_volume = false;
+}
+
+static void destroy_zones(void) {
+    while (zone_count > 0) {
+        zone_destroy(zones[--zone_count]);
+        zones[zone_count] = NULL;
+    }
 }
 
 int main(int argc, char *argv[]) {
     int daemonize = 1;
     int opt;
+    thread_policy_config_t policy;
+    power_gate_config_t gate;
+    dsp_config_t dsp;
+    volume_map_config_t volume;
+    int hw_volume;
+    uint32_t volume_rate;
+    input_control_config_t input;
+    control_api_config_t api;
+    const char *output_backend = NULL;
+    const char *output_device = NULL;
+    int status = EXIT_SUCCESS;
+    
+    // Time origin of the startup trace
+    startup_begin();
+    
+    // The UCI file is read first, command line options override it
+    opterr = 0;
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        if (opt == 'F') {
+            config_path = optarg;
+        }
+    }
+    optind = 1;
+    opterr = 1;
+    bool config_read = config_load(config_path, &running_config) == 0;
+    if (!config_read) {
+        config_get_defaults(&running_config);
+    }
+    policy = running_config.policy;
+    gate = running_config.gate;
+    dsp = running_config.dsp;
+    volume = running_config.volume;
+    hw_volume = running_config.use_hw_volume;
+    volume_rate = running_config.volume_rate;
+    input.device = running_config.input;
+    input.debounce_ms = running_config.input_debounce_ms;
+    input.accelerate = running_config.input_accelerate;
+    api.socket_path = running_config.control_socket[0] ? running_config.control_socket : NULL;
+    api.port = running_config.control_port;
     
     // Parse command line arguments
-    while ((opt = getopt(argc, argv, "df")) != -1) {
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
         switch (opt) {
             case 'd':
                 daemonize = 0;
@@ -50,98 +227,388 @@ int main(int argc, char *argv[]) {
             case 'f':
                 daemonize = 1;
                 break;
+            case 's':
+                if (thread_policy_parse_scheduler(optarg, &policy.playout_scheduler) != 0) {
+                    fprintf(stderr, "Unknown scheduler: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'p':
+                policy.playout_priority = atoi(optarg);
+                break;
+            case 'n':
+                policy.receive_nice = atoi(optarg);
+                break;
+            case 'a':
+                policy.cpu[THREAD_ROLE_PLAYOUT] = atoi(optarg);
+                break;
+            case 'r':
+                policy.cpu[THREAD_ROLE_RECEIVE] = atoi(optarg);
+                break;
+            case 'c':
+                policy.cpu[THREAD_ROLE_CONTROL] = atoi(optarg);
+                policy.cpu[THREAD_ROLE_BACKGROUND] = atoi(optarg);
+                break;
+            case 'M':
+                policy.lock_memory = false;
+                break;
+            case 'o':
+                output_backend = optarg;
+                break;
+            case 'D':
+                output_device = optarg;
+                break;
+            case 'i':
+                gate.idle_ms = (uint32_t)atoi(optarg);
+                break;
+            case 'S':
+                gate.suspend_ms = (uint32_t)atoi(optarg);
+                break;
+            case 'g':
+                gate.amp_gpio = atoi(optarg);
+                break;
+            case 'L':
+                gate.amp_active_low = true;
+                break;
+            case 'e':
+                if (dsp.filter_count == DSP_MAX_FILTERS ||
+                    dsp_chain_parse_filter(optarg, &dsp.filters[dsp.filter_count]) != 0) {
+                    fprintf(stderr, "Invalid or too many filters: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                dsp.filter_count++;
+                break;
+            case 'P':
+                dsp.preamp_db = strtof(optarg, NULL);
+                break;
+            case 'l':
+                dsp.limiter = true;
+                dsp.limiter_db = strtof(optarg, NULL);
+                break;
+            case 'C':
+                if (volume_map_parse_curve(optarg, &volume.curve) != 0) {
+                    fprintf(stderr, "Unknown volume curve: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'R':
+                volume.range_db = strtof(optarg, NULL);
+                break;
+            case 'H':
+                hw_volume = 1;
+                break;
+            case 'V':
+                volume_rate = (uint32_t)atoi(optarg);
+                break;
+            case 'I':
+                input.device = optarg;
+                break;
+            case 'b':
+                input.debounce_ms = (uint32_t)atoi(optarg);
+                break;
+            case 'N':
+                input.accelerate = false;
+                break;
+            case 'U':
+                api.socket_path = strcmp(optarg, "none") == 0 ? NULL : optarg;
+                break;
+            case 'W':
+                api.port = (uint16_t)atoi(optarg);
+                break;
+            case 'F':
+                config_path = optarg;
+                break;
             default:
-                fprintf(stderr, "Usage: %s [-d] [-f]\n", argv[0]);
+                fprintf(stderr, "Usage: %s [-d] [-f] [-s fifo|rr|other] [-p priority] [-n nice]\n"
+                                "          [-a cpu] [-r cpu] [-c cpu] [-M] [-o alsa|pipe|shm] [-D device]\n"
+                                "          [-i idle_ms] [-S suspend_ms] [-g gpio] [-L]\n"
+                                "          [-e type:freq[:gain[:q]]]... [-P preamp_db] [-l limit_db]\n"
+                                "          [-C db|cubic] [-R range_db] [-H] [-V rate]\n"
+                                "          [-I auto|none|device] [-b debounce_ms] [-N]\n"
+                                "          [-U socket|none] [-W port] [-F config]\n", argv[0]);
                 fprintf(stderr, "  -d: run in foreground\n");
                 fprintf(stderr, "  -f: run as daemon\n");
+                fprintf(stderr, "  -s: audio thread scheduler (default fifo)\n");
+                fprintf(stderr, "  -p: audio thread realtime priority (default %d)\n",
+                        THREAD_POLICY_DEFAULT_PRIORITY);
+                fprintf(stderr, "  -n: network receive thread nice value (default %d)\n",
+                        THREAD_POLICY_DEFAULT_RECEIVE_NICE);
+                fprintf(stderr, "  -a: pin the audio thread to a CPU\n");
+                fprintf(stderr, "  -r: pin the network receive thread to a CPU\n");
+                fprintf(stderr, "  -c: pin control and discovery threads to a CPU\n");
+                fprintf(stderr, "  -M: do not lock memory\n");
+                fprintf(stderr, "  -o: audio output backend (default alsa)\n");
+                fprintf(stderr, "  -D: ALSA device, pipe path (- for stdout) or shared memory name\n");
+                fprintf(stderr, "  -i: silence before the output counts as idle (default %d ms)\n",
+                        POWER_GATE_DEFAULT_IDLE_MS);
+                fprintf(stderr, "  -S: idle time before the device is suspended, 0 never (default %d ms)\n",
+                        POWER_GATE_DEFAULT_SUSPEND_MS);
+                fprintf(stderr, "  -g: sysfs GPIO switching the amplifier\n");
+                fprintf(stderr, "  -L: amplifier GPIO is active low\n");
+                fprintf(stderr, "  -e: add a peaking, lowshelf, highshelf, lowpass or highpass filter (up to %d)\n",
+                        DSP_MAX_FILTERS);
+                fprintf(stderr, "  -P: gain before the filters in dB\n");
+                fprintf(stderr, "  -l: enable the limiter with this ceiling in dBFS\n");
+                fprintf(stderr, "  -C: volume curve (default db)\n");
+                fprintf(stderr, "  -R: attenuation at the lowest volume step (default %.0f dB)\n",
+                        VOLUME_MAP_DEFAULT_RANGE_DB);
+                fprintf(stderr, "  -H: use the Master mixer control for volume\n");
+                fprintf(stderr, "  -V: volume changes applied per second, 0 no limit (default %d)\n",
+                        VOLUME_CONTROL_DEFAULT_RATE_HZ);
+                fprintf(stderr, "  -I: buttons and encoders, an event device or auto (default auto)\n");
+                fprintf(stderr, "  -b: button and encoder debounce time (default %d ms)\n",
+                        INPUT_CONTROL_DEFAULT_DEBOUNCE_MS);
+                fprintf(stderr, "  -N: no encoder acceleration\n");
+                fprintf(stderr, "  -U: control API socket (default %s)\n", CONTROL_API_DEFAULT_SOCKET);
+                fprintf(stderr, "  -W: also serve the control API on this localhost port\n");
+                fprintf(stderr, "  -F: UCI configuration, read before these options and again on SIGHUP (default %s)\n",
+                        CONFIG_DEFAULT_PATH);
                 exit(EXIT_FAILURE);
         }
     }
     
-    // Initialize logging
+    // Initialize logging, in the foreground (as procd runs it) to stderr too
     if (daemonize) {
         openlog("airplay2-lite", LOG_PID | LOG_CONS, LOG_DAEMON);
         daemon(0, 0);
     } else {
-        openlog("airplay2-lite", LOG_PID | LOG_CONS, LOG_PERROR);
+        openlog("airplay2-lite", LOG_PID | LOG_CONS | LOG_PERROR, LOG_DAEMON);
     }
     
     syslog(LOG_INFO, "Starting AirPlay 2 Lite server...");
     
+    if (!config_read) {
+        syslog(LOG_INFO, "Cannot read %s, using defaults", config_path);
+    }
+    startup_mark("config");
+    running_config.use_hw_volume = hw_volume;
+    running_config.volume = volume;
+    running_config.volume_rate = volume_rate;
+    if (output_backend) {
+        snprintf(running_config.output, sizeof(running_config.output), "%s", output_backend);
+    }
+    if (output_device) {
+        snprintf(running_config.audio_device, sizeof(running_config.audio_device), "%s", output_device);
+    }
+    
     // Setup signal handlers
     setup_signal_handlers();
     
-    // Initialize audio output
-    if (audio_output_init() != 0) {
-        syslog(LOG_ERR, "Failed to initialize audio output");
+    // Scheduling and memory locking, before any worker thread exists
+    thread_policy_init(&policy);
+    
+    // Hot paths log through per-thread rings drained into syslog
+    if (logger_init() != 0) {
+        syslog(LOG_WARNING, "Logging directly to syslog");
+    }
+    
+    // Counters fall back to process memory if the shared file cannot be mapped
+    stats_init(STATS_DEFAULT_PATH);
+    
+    // Listening sockets, input and other fd handlers of every zone run from
+    // the one event loop
+    if (event_loop_init() != 0) {
+        syslog(LOG_ERR, "Failed to initialize the event loop");
+        stats_cleanup();
+        logger_cleanup();
+        thread_policy_cleanup();
         exit(EXIT_FAILURE);
     }
     
-    // Initialize volume control
-    if (volume_control_init() != 0) {
-        syslog(LOG_ERR, "Failed to initialize volume control");
-        audio_output_cleanup();
+    // One Avahi client announces every zone and resolves their remotes
+    if (running_config.airplay.enable_discovery && mdns_init() != 0) {
+        syslog(LOG_ERR, "Failed to initialize mDNS");
+        event_loop_cleanup();
+        stats_cleanup();
+        logger_cleanup();
+        thread_policy_cleanup();
         exit(EXIT_FAILURE);
     }
     
-    // Initialize playback control
-    if (playback_control_init() != 0) {
-        syslog(LOG_ERR, "Failed to initialize playback control");
-        volume_control_cleanup();
-        audio_output_cleanup();
+    // Direct hw: device choice, cached across restarts while the cards stay the same
+    alsa_probe_init(ALSA_PROBE_DEFAULT_CACHE);
+    
+    // Silence gating of the outputs and the amplifier GPIO
+    power_gate_init(&gate);
+    
+    // Volume tables, built once so volume changes need no math
+    volume_map_init(&volume);
+    
+    // Page pool for AirPlay 2 buffered audio streams, shared by the zones
+    if (buffered_audio_init(BUFFERED_AUDIO_DEFAULT_POOL_SIZE) != 0) {
+        syslog(LOG_ERR, "Failed to initialize buffered audio");
+        volume_map_cleanup();
+        power_gate_cleanup();
+        alsa_probe_cleanup();
+        mdns_cleanup();
+        event_loop_cleanup();
+        stats_cleanup();
+        logger_cleanup();
+        thread_policy_cleanup();
+        exit(EXIT_FAILURE);
+    }
+    
+    // Per-session memory, capped so a new session is refused instead of risking OOM
+    if (session_arena_init(SESSION_ARENA_DEFAULT_LIMIT) != 0) {
+        syslog(LOG_ERR, "Failed to initialize session arena");
+        buffered_audio_cleanup();
+        volume_map_cleanup();
+        power_gate_cleanup();
+        alsa_probe_cleanup();
+        mdns_cleanup();
+        event_loop_cleanup();
+        stats_cleanup();
+        logger_cleanup();
+        thread_policy_cleanup();
         exit(EXIT_FAILURE);
     }
     
+    // A receiver per zone, each with its own output, DSP, volume and
+    // remote control. The devices open at the first RECORD.
+    for (int i = 0; i <= running_config.zone_count; i++) {
+        zone_config_t zone_config;
+        get_zone_config(i, &dsp, &zone_config);
+        zones[zone_count] = zone_create(&zone_config);
+        if (!zones[zone_count]) {
+            syslog(LOG_ERR, "Failed to create zone %s", zone_config.airplay.device_name);
+            destroy_zones();
+            session_arena_cleanup();
+            buffered_audio_cleanup();
+            volume_map_cleanup();
+            power_gate_cleanup();
+            alsa_probe_cleanup();
+            mdns_cleanup();
+            event_loop_cleanup();
+            stats_cleanup();
+            logger_cleanup();
+            thread_policy_cleanup();
+            exit(EXIT_FAILURE);
+        }
+        zone_count++;
+    }
+    running_config.buffer_size = zones[0]->config.buffer_size;
+    startup_mark("output");
+    
+    // Volume knobs and media buttons, for the main zone
+    input_control_init(&input, zones[0]->playback, zones[0]->volume);
+    
     // Initialize multiroom support
     if (multiroom_init() != 0) {
         syslog(LOG_ERR, "Failed to initialize multiroom support");
-        playback_control_cleanup();
-        volume_control_cleanup();
-        audio_output_cleanup();
+        input_control_cleanup();
+        destroy_zones();
+        session_arena_cleanup();
+        buffered_audio_cleanup();
+        volume_map_cleanup();
+        power_gate_cleanup();
+        alsa_probe_cleanup();
+        mdns_cleanup();
+        event_loop_cleanup();
+        stats_cleanup();
+        logger_cleanup();
+        thread_policy_cleanup();
         exit(EXIT_FAILURE);
     }
     
-    // Create and start AirPlay server
-    server = airplay_server_create();
-    if (!server) {
-        syslog(LOG_ERR, "Failed to create AirPlay server");
-        multiroom_cleanup();
-        playback_control_cleanup();
-        volume_control_cleanup();
-        audio_output_cleanup();
-        exit(EXIT_FAILURE);
+    // Announced to other rooms only when enabled in the configuration
+    multiroom_set_config(&running_config.multiroom);
+    if (multiroom_start() != 0) {
+        syslog(LOG_WARNING, "Multiroom is disabled");
     }
     
-    if (airplay_server_start(server) != 0) {
+    // State, metadata and push notifications of the main zone for local clients
+    control_api_init(&api, zones[0]->playback, zones[0]->volume);
+    
+    // Listen and announce. Without the main zone there is nothing to serve,
+    // a further zone that cannot start is dropped.
+    if (zone_start(zones[0]) != 0) {
         syslog(LOG_ERR, "Failed to start AirPlay server");
-        airplay_server_destroy(server);
+        control_api_cleanup();
         multiroom_cleanup();
-        playback_control_cleanup();
-        volume_control_cleanup();
-        audio_output_cleanup();
+        input_control_cleanup();
+        destroy_zones();
+        session_arena_cleanup();
+        buffered_audio_cleanup();
+        volume_map_cleanup();
+        power_gate_cleanup();
+        alsa_probe_cleanup();
+        mdns_cleanup();
+        event_loop_cleanup();
+        stats_cleanup();
+        logger_cleanup();
+        thread_policy_cleanup();
         exit(EXIT_FAILURE);
     }
+    for (int i = 1; i < zone_count; i++) {
+        if (zone_start(zones[i]) != 0) {
+            syslog(LOG_WARNING, "Zone %s is disabled", zones[i]->config.airplay.device_name);
+            zone_destroy(zones[i]);
+            zones[i] = zones[--zone_count];
+            zones[zone_count] = NULL;
+            i--;
+        }
+    }
     
     syslog(LOG_INFO, "AirPlay 2 Lite server started successfully");
+    startup_mark("listening");
     
-    // Main loop
+    // Listening and announced already, the keys and the sound card probe
+    // follow in the background. The device itself opens at the first RECORD.
+    startup_defer("keys", load_keys);
+    startup_defer("outputs", probe_outputs);
+    if (startup_run(STARTUP_READY_FILE) != 0) {
+        running = 0;
+        status = EXIT_FAILURE;
+    }
+    
+    // Configuration changes are picked up on SIGHUP, which stays blocked,
+    // and so ignored, without the event loop
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    reload_fd = signalfd(-1, &hup, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (reload_fd < 0 || event_loop_add(reload_fd, reload_config, NULL) != 0) {
+        syslog(LOG_WARNING, "Configuration reload on SIGHUP is disabled");
+    }
+    
+    // Main loop, every zone is served from here
     while (running) {
-        airplay_server_process(server);
-        usleep(10000); // 10ms sleep to prevent excessive CPU usage
+        airplay_server_dispatch(10);
+        
+        // Without keys no sender can pair, exit so procd restarts us
+        if (startup_failed()) {
+            running = 0;
+            status = EXIT_FAILURE;
+        }
     }
     
     // Cleanup
     syslog(LOG_INFO, "Shutting down AirPlay 2 Lite server...");
     
-    airplay_server_stop(server);
-    airplay_server_destroy(server);
+    if (reload_fd >= 0) {
+        event_loop_remove(reload_fd);
+        close(reload_fd);
+    }
+    
+    startup_cleanup();
+    control_api_cleanup();
     multiroom_cleanup();
-    playback_control_cleanup();
-    volume_control_cleanup();
-    audio_output_cleanup();
+    input_control_cleanup();
+    destroy_zones();
+    session_arena_cleanup();
+    buffered_audio_cleanup();
+    crypto_engine_cleanup();
+    volume_map_cleanup();
+    power_gate_cleanup();
+    alsa_probe_cleanup();
+    mdns_cleanup();
+    event_loop_cleanup();
+    stats_cleanup();
+    logger_cleanup();
+    thread_policy_cleanup();
     
     syslog(LOG_INFO, "AirPlay 2 Lite server stopped");
     closelog();
     
-    return EXIT_SUCCESS;
+    return status;
 }
@@ -0,0 +1,244 @@
+#include "mdns.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <syslog.h>
+#include <avahi-client/publish.h>
+#include <avahi-common/error.h>
+#include <avahi-common/thread-watch.h>
+
+typedef struct {
+    bool used;
+    char name[64];
+    char type[32];
+    uint16_t port;
+    AvahiEntryGroup *group;
+} mdns_service_t;
+
+// Everything below is touched with the poll lock held, by the public
+// functions explicitly and by the callbacks because Avahi holds it for them
+static AvahiThreadedPoll *threaded_poll = NULL;
+static AvahiClient *client = NULL;
+static uint32_t client_generation = 0;
+static mdns_service_t services[MDNS_MAX_SERVICES];
+
+static void client_callback(AvahiClient *c, AvahiClientState state, void *userdata);
+
+static void group_callback(AvahiEntryGroup *g, AvahiEntryGroupState state, void *userdata) {
+    mdns_service_t *service = userdata;
+    (void)g;
+    
+    switch (state) {
+        case AVAHI_ENTRY_GROUP_ESTABLISHED:
+            syslog(LOG_INFO, "%s registered with mDNS as %s", service->type, service->name);
+            break;
+        case AVAHI_ENTRY_GROUP_COLLISION:
+            syslog(LOG_WARNING, "mDNS name collision for %s", service->name);
+            break;
+        case AVAHI_ENTRY_GROUP_FAILURE:
+            syslog(LOG_ERR, "Failed to register %s with mDNS", service->name);
+            break;
+        default:
+            break;
+    }
+}
+
+// Adds the service to an empty entry group, also after a rename
+static void register_locked(AvahiClient *c, mdns_service_t *service) {
+    if (!service->group) {
+        service->group = avahi_entry_group_new(c, group_callback, service);
+        if (!service->group) {
+            syslog(LOG_ERR, "Cannot create mDNS entry group: %s", avahi_strerror(avahi_client_errno(c)));
+            return;
+        }
+    }
+    
+    avahi_entry_group_add_service(service->group, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, 0,
+                                  service->name, service->type, NULL, NULL, service->port, NULL);
+    avahi_entry_group_commit(service->group);
+}
+
+// Groups belong to the client and are freed with it
+static void forget_groups_locked(void) {
+    for (int i = 0; i < MDNS_MAX_SERVICES; i++) {
+        services[i].group = NULL;
+    }
+}
+
+static void reconnect_locked(AvahiClient *c) {
+    forget_groups_locked();
+    avahi_client_free(c);
+    client_generation++;
+    
+    int error;
+    client = avahi_client_new(avahi_threaded_poll_get(threaded_poll), AVAHI_CLIENT_NO_FAIL,
+                              client_callback, NULL, &error);
+    if (!client) {
+        syslog(LOG_ERR, "Failed to recreate Avahi client: %s", avahi_strerror(error));
+    }
+}
+
+// The client may call this before avahi_client_new has returned it
+static void client_callback(AvahiClient *c, AvahiClientState state, void *userdata) {
+    (void)userdata;
+    
+    switch (state) {
+        case AVAHI_CLIENT_S_RUNNING:
+            for (int i = 0; i < MDNS_MAX_SERVICES; i++) {
+                mdns_service_t *service = &services[i];
+                if (service->used && (!service->group || avahi_entry_group_is_empty(service->group))) {
+                    register_locked(c, service);
+                }
+            }
+            break;
+        case AVAHI_CLIENT_S_COLLISION:
+        case AVAHI_CLIENT_S_REGISTERING:
+            // The host name changed, announce again once it settles
+            for (int i = 0; i < MDNS_MAX_SERVICES; i++) {
+                if (services[i].group) {
+                    avahi_entry_group_reset(services[i].group);
+                }
+            }
+            break;
+        case AVAHI_CLIENT_FAILURE:
+            if (avahi_client_errno(c) == AVAHI_ERR_DISCONNECTED) {
+                syslog(LOG_WARNING, "Avahi daemon went away, reconnecting");
+                reconnect_locked(c);
+            } else {
+                syslog(LOG_ERR, "Avahi client failure: %s", avahi_strerror(avahi_client_errno(c)));
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+int mdns_init(void) {
+    if (threaded_poll) {
+        return 0;
+    }
+    
+    memset(services, 0, sizeof(services));
+    threaded_poll = avahi_threaded_poll_new();
+    if (!threaded_poll) {
+        syslog(LOG_ERR, "Failed to create Avahi poll");
+        return -1;
+    }
+    
+    int error;
+    client = avahi_client_new(avahi_threaded_poll_get(threaded_poll), AVAHI_CLIENT_NO_FAIL,
+                              client_callback, NULL, &error);
+    if (!client) {
+        syslog(LOG_ERR, "Failed to create Avahi client: %s", avahi_strerror(error));
+        avahi_threaded_poll_free(threaded_poll);
+        threaded_poll = NULL;
+        return -1;
+    }
+    
+    if (avahi_threaded_poll_start(threaded_poll) < 0) {
+        syslog(LOG_ERR, "Failed to start Avahi poll thread");
+        avahi_client_free(client);
+        client = NULL;
+        avahi_threaded_poll_free(threaded_poll);
+        threaded_poll = NULL;
+        return -1;
+    }
+    
+    return 0;
+}
+
+void mdns_cleanup(void) {
+    if (!threaded_poll) {
+        return;
+    }
+    
+    avahi_threaded_poll_stop(threaded_poll);
+    if (client) {
+        avahi_client_free(client);
+        client = NULL;
+    }
+    forget_groups_locked();
+    memset(services, 0, sizeof(services));
+    avahi_threaded_poll_free(threaded_poll);
+    threaded_poll = NULL;
+}
+
+int mdns_add_service(const char *name, const char *type, uint16_t port) {
+    if (!threaded_poll || !name || !type) {
+        return -1;
+    }
+    
+    avahi_threaded_poll_lock(threaded_poll);
+    int id = -1;
+    for (int i = 0; i < MDNS_MAX_SERVICES; i++) {
+        if (!services[i].used) {
+            id = i;
+            break;
+        }
+    }
+    if (id >= 0) {
+        mdns_service_t *service = &services[id];
+        service->used = true;
+        snprintf(service->name, sizeof(service->name), "%s", name);
+        snprintf(service->type, sizeof(service->type), "%s", type);
+        service->port = port;
+        service->group = NULL;
+        if (client && avahi_client_get_state(client) == AVAHI_CLIENT_S_RUNNING) {
+            register_locked(client, service);
+        }
+    }
+    avahi_threaded_poll_unlock(threaded_poll);
+    
+    if (id < 0) {
+        syslog(LOG_ERR, "No room for mDNS service %s", name);
+    }
+    return id;
+}
+
+int mdns_rename_service(int id, const char *name) {
+    if (!threaded_poll || id < 0 || id >= MDNS_MAX_SERVICES || !name) {
+        return -1;
+    }
+    
+    avahi_threaded_poll_lock(threaded_poll);
+    mdns_service_t *service = &services[id];
+    snprintf(service->name, sizeof(service->name), "%s", name);
+    if (service->group) {
+        avahi_entry_group_reset(service->group);
+        register_locked(client, service);
+    }
+    avahi_threaded_poll_unlock(threaded_poll);
+    return 0;
+}
+
+void mdns_remove_service(int id) {
+    if (!threaded_poll || id < 0 || id >= MDNS_MAX_SERVICES) {
+        return;
+    }
+    
+    avahi_threaded_poll_lock(threaded_poll);
+    if (services[id].group) {
+        avahi_entry_group_free(services[id].group);
+    }
+    memset(&services[id], 0, sizeof(services[id]));
+    avahi_threaded_poll_unlock(threaded_poll);
+}
+
+AvahiClient* mdns_lock(void) {
+    if (!threaded_poll) {
+        return NULL;
+    }
+    avahi_threaded_poll_lock(threaded_poll);
+    return client;
+}
+
+uint32_t mdns_generation(void) {
+    return client_generation;
+}
+
+void mdns_unlock(void) {
+    if (threaded_poll) {
+        avahi_threaded_poll_unlock(threaded_poll);
+    }
+}
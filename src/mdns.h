@@ -0,0 +1,30 @@
+#ifndef MDNS_H
+#define MDNS_H
+
+#include <stdint.h>
+#include <avahi-client/client.h>
+
+#define MDNS_MAX_SERVICES 8
+
+// One Avahi client on its own poll thread for the whole process, every
+// zone's announcement and every remote control lookup goes through it
+int mdns_init(void);
+void mdns_cleanup(void);
+
+// Services are announced once the daemon is reachable and again after it
+// restarts. add returns an id for rename and remove, or -1.
+int mdns_add_service(const char *name, const char *type, uint16_t port);
+int mdns_rename_service(int id, const char *name);
+void mdns_remove_service(int id);
+
+// Holds the poll thread off while Avahi objects are created or freed from
+// another thread. The client is NULL without mdns_init, never call these
+// from an Avahi callback.
+AvahiClient* mdns_lock(void);
+void mdns_unlock(void);
+
+// Bumped when the client is recreated, which frees every resolver it owned.
+// Read with the lock held.
+uint32_t mdns_generation(void);
+
+#endif // MDNS_H
@@ -0,0 +1,388 @@
+#include "output_sink.h"
+#include "stats.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define PIPE_RECONNECT_NS 1000000000ULL
+#define MAX_FRAME_BYTES 32
+
+// Format and drop state every sink starts with
+typedef struct {
+    size_t frame_bytes;
+    bool dropping;
+} sink_format_t;
+
+// Frames the reader could not take are counted, the first of a run is logged
+static void count_drops(sink_format_t *format, size_t frames, const char *reason) {
+    if (frames == 0) {
+        format->dropping = false;
+        return;
+    }
+    
+    stats_add(STATS_COUNTER_SINK_DROPS, (uint32_t)frames);
+    if (!format->dropping) {
+        logger_log(LOG_WARNING, "Output sink dropping audio: %s", reason);
+        format->dropping = true;
+    }
+}
+
+static int set_frame_bytes(sink_format_t *format, const audio_config_t *config) {
+    format->frame_bytes = config->channels * config->bits_per_sample / 8;
+    if (format->frame_bytes == 0 || format->frame_bytes > MAX_FRAME_BYTES) {
+        syslog(LOG_ERR, "Unsupported output frame size: %zu bytes", format->frame_bytes);
+        return -1;
+    }
+    format->dropping = false;
+    return 0;
+}
+
+// The ALSA device names default and auto stand for the sink's own default
+static const char* sink_target(const audio_config_t *config, const char *fallback) {
+    const char *name = config->device_name;
+    if (!name || strcmp(name, "default") == 0 || strcmp(name, AUDIO_OUTPUT_DEVICE_AUTO) == 0) {
+        return fallback;
+    }
+    return name;
+}
+
+// Pipe sink
+typedef struct {
+    sink_format_t format;
+    int fd;
+    bool is_stdout;
+    char path[256];
+    uint64_t retry_ns;
+    
+    // A partial write can end mid-frame, the rest of that frame goes out first next time
+    uint8_t carry[MAX_FRAME_BYTES];
+    size_t carry_length;
+} pipe_sink_t;
+
+static int pipe_connect(pipe_sink_t *pipe_sink) {
+    int fd;
+    if (pipe_sink->is_stdout) {
+        fd = STDOUT_FILENO;
+        int flags = fcntl(fd, F_GETFL);
+        if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            return -1;
+        }
+    } else {
+        // A FIFO without a reader fails with ENXIO rather than blocking. A
+        // regular file starts over, O_TRUNC is ignored for FIFOs and devices.
+        fd = open(pipe_sink->path, O_WRONLY | O_TRUNC | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) {
+            return -1;
+        }
+    }
+    
+    pipe_sink->fd = fd;
+    pipe_sink->carry_length = 0;
+    logger_log(LOG_INFO, "Output pipe %s connected", pipe_sink->path);
+    return 0;
+}
+
+static void pipe_disconnect(pipe_sink_t *pipe_sink) {
+    if (pipe_sink->fd >= 0 && !pipe_sink->is_stdout) {
+        close(pipe_sink->fd);
+    }
+    pipe_sink->fd = -1;
+    pipe_sink->carry_length = 0;
+}
+
+static int pipe_open(void **sink, const audio_config_t *config, size_t buffer_bytes) {
+    (void)buffer_bytes;
+    
+    pipe_sink_t *pipe_sink = calloc(1, sizeof(pipe_sink_t));
+    if (!pipe_sink) {
+        return -1;
+    }
+    if (set_frame_bytes(&pipe_sink->format, config) != 0) {
+        free(pipe_sink);
+        return -1;
+    }
+    
+    const char *target = sink_target(config, OUTPUT_SINK_DEFAULT_PIPE);
+    snprintf(pipe_sink->path, sizeof(pipe_sink->path), "%s", target);
+    pipe_sink->is_stdout = strcmp(pipe_sink->path, "-") == 0;
+    
+    struct stat st;
+    if (!pipe_sink->is_stdout && stat(pipe_sink->path, &st) != 0 && mkfifo(pipe_sink->path, 0644) != 0) {
+        syslog(LOG_ERR, "Cannot create output pipe %s: %s", pipe_sink->path, strerror(errno));
+        free(pipe_sink);
+        return -1;
+    }
+    
+    pipe_sink->fd = -1;
+    pipe_sink->retry_ns = 0;
+    if (pipe_connect(pipe_sink) != 0) {
+        syslog(LOG_INFO, "Output pipe %s has no reader yet", pipe_sink->path);
+    }
+    *sink = pipe_sink;
+    return 0;
+}
+
+static long pipe_write(void *sink, const uint8_t *data, size_t frames) {
+    pipe_sink_t *pipe_sink = sink;
+    sink_format_t *format = &pipe_sink->format;
+    
+    if (pipe_sink->fd < 0) {
+        uint64_t now = stats_now();
+        if (now >= pipe_sink->retry_ns && pipe_connect(pipe_sink) != 0) {
+            pipe_sink->retry_ns = now + PIPE_RECONNECT_NS;
+        }
+        if (pipe_sink->fd < 0) {
+            count_drops(format, frames, "no reader");
+            return (long)frames;
+        }
+    }
+    
+    size_t length = frames * format->frame_bytes;
+    struct iovec iov[2] = {
+        { pipe_sink->carry, pipe_sink->carry_length },
+        { (void *)data, length }
+    };
+    int first = pipe_sink->carry_length > 0 ? 0 : 1;
+    ssize_t written = writev(pipe_sink->fd, iov + first, 2 - first);
+    if (written < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            logger_log(LOG_WARNING, "Output pipe %s closed: %s", pipe_sink->path, strerror(errno));
+            pipe_disconnect(pipe_sink);
+            count_drops(format, frames, "reader closed");
+            return (long)frames;
+        }
+        written = 0;
+    }
+    
+    size_t carry_length = pipe_sink->carry_length;
+    size_t from_carry = (size_t)written < carry_length ? (size_t)written : carry_length;
+    memmove(pipe_sink->carry, pipe_sink->carry + from_carry, carry_length - from_carry);
+    pipe_sink->carry_length -= from_carry;
+    written -= from_carry;
+    if (pipe_sink->carry_length > 0) {
+        count_drops(format, frames, "pipe full");
+        return (long)frames;
+    }
+    
+    // Finish a frame that was cut short, drop the frames after it
+    size_t frames_written = (size_t)written / format->frame_bytes;
+    size_t partial = (size_t)written % format->frame_bytes;
+    if (partial > 0) {
+        pipe_sink->carry_length = format->frame_bytes - partial;
+        memcpy(pipe_sink->carry, data + written, pipe_sink->carry_length);
+        frames_written++;
+    }
+    count_drops(format, frames - frames_written, "pipe full");
+    return (long)frames;
+}
+
+static void pipe_drop(void *sink) {
+    // A carried partial frame stays, the reader would lose alignment without it
+    (void)sink;
+}
+
+static void pipe_drain(void *sink) {
+    (void)sink;
+}
+
+static void pipe_close(void *sink) {
+    pipe_sink_t *pipe_sink = sink;
+    if (pipe_sink->fd >= 0 && pipe_sink->is_stdout) {
+        int flags = fcntl(pipe_sink->fd, F_GETFL);
+        if (flags >= 0) {
+            fcntl(pipe_sink->fd, F_SETFL, flags & ~O_NONBLOCK);
+        }
+    }
+    pipe_disconnect(pipe_sink);
+    free(pipe_sink);
+}
+
+const audio_backend_ops_t pipe_sink_backend = {
+    "pipe", false, pipe_open, pipe_write, pipe_drop, pipe_drain, pipe_close, NULL, NULL
+};
+
+// Shared memory ring sink. Segments stay mapped from the first open until
+// release, a close only ends the writer.
+typedef struct {
+    char name[64];
+    output_shm_header_t *header;
+    size_t map_size;
+} shm_segment_t;
+
+typedef struct {
+    sink_format_t format;
+    output_shm_header_t *header;
+    uint8_t *ring;
+} shm_sink_t;
+
+static pthread_mutex_t segments_mutex = PTHREAD_MUTEX_INITIALIZER;
+static shm_segment_t segments[OUTPUT_SHM_MAX_SEGMENTS];
+
+static shm_segment_t* find_segment_locked(const char *name) {
+    for (int i = 0; i < OUTPUT_SHM_MAX_SEGMENTS; i++) {
+        if (segments[i].header && strcmp(segments[i].name, name) == 0) {
+            return &segments[i];
+        }
+    }
+    return NULL;
+}
+
+// Creates and maps a segment with a zeroed header, magic still unset
+static shm_segment_t* create_segment_locked(const char *name) {
+    shm_segment_t *segment = NULL;
+    for (int i = 0; i < OUTPUT_SHM_MAX_SEGMENTS && !segment; i++) {
+        if (!segments[i].header) {
+            segment = &segments[i];
+        }
+    }
+    if (!segment) {
+        syslog(LOG_ERR, "No more than %d shared memory outputs", OUTPUT_SHM_MAX_SEGMENTS);
+        return NULL;
+    }
+    
+    int fd = shm_open(name, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Cannot open shared memory %s: %s", name, strerror(errno));
+        return NULL;
+    }
+    
+    size_t map_size = sizeof(output_shm_header_t) + OUTPUT_SHM_RING_SIZE;
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, map_size) == 0) {
+        map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        syslog(LOG_ERR, "Cannot map shared memory %s: %s", name, strerror(errno));
+        shm_unlink(name);
+        return NULL;
+    }
+    
+    snprintf(segment->name, sizeof(segment->name), "%s", name);
+    segment->header = (output_shm_header_t *)map;
+    segment->map_size = map_size;
+    memset(segment->header, 0, sizeof(output_shm_header_t));
+    segment->header->version = OUTPUT_SHM_VERSION;
+    segment->header->size = OUTPUT_SHM_RING_SIZE;
+    return segment;
+}
+
+static int shm_open_sink(void **sink, const audio_config_t *config, size_t buffer_bytes) {
+    (void)buffer_bytes;
+    
+    shm_sink_t *shm_sink = calloc(1, sizeof(shm_sink_t));
+    if (!shm_sink) {
+        return -1;
+    }
+    if (set_frame_bytes(&shm_sink->format, config) != 0) {
+        free(shm_sink);
+        return -1;
+    }
+    
+    const char *target = sink_target(config, OUTPUT_SINK_DEFAULT_SHM);
+    if (target[0] != '/' || strlen(target) >= sizeof(segments[0].name)) {
+        syslog(LOG_ERR, "Shared memory output name must start with '/' and fit %zu bytes: %s",
+               sizeof(segments[0].name) - 1, target);
+        free(shm_sink);
+        return -1;
+    }
+    
+    pthread_mutex_lock(&segments_mutex);
+    shm_segment_t *segment = find_segment_locked(target);
+    bool created = !segment;
+    if (created) {
+        segment = create_segment_locked(target);
+    }
+    if (!segment) {
+        pthread_mutex_unlock(&segments_mutex);
+        free(shm_sink);
+        return -1;
+    }
+    
+    // Positions carry on, an attached reader only sees the generation move
+    output_shm_header_t *header = segment->header;
+    shm_sink->header = header;
+    shm_sink->ring = (uint8_t *)header + sizeof(output_shm_header_t);
+    header->sample_rate = config->sample_rate;
+    header->channels = config->channels;
+    header->bits_per_sample = config->bits_per_sample;
+    __atomic_fetch_add(&header->generation, 1, __ATOMIC_RELEASE);
+    
+    // Readers check the magic last, after the format is in place
+    if (created) {
+        __atomic_store_n(&header->magic, OUTPUT_SHM_MAGIC, __ATOMIC_RELEASE);
+        syslog(LOG_INFO, "Shared memory output %s ready (%d KiB ring)", target, OUTPUT_SHM_RING_SIZE / 1024);
+    }
+    pthread_mutex_unlock(&segments_mutex);
+    
+    *sink = shm_sink;
+    return 0;
+}
+
+static long shm_write(void *sink, const uint8_t *data, size_t frames) {
+    shm_sink_t *shm_sink = sink;
+    output_shm_header_t *header = shm_sink->header;
+    size_t frame_bytes = shm_sink->format.frame_bytes;
+    
+    uint32_t write_pos = header->write_pos;
+    uint32_t read_pos = __atomic_load_n(&header->read_pos, __ATOMIC_ACQUIRE);
+    uint32_t used = write_pos - read_pos;
+    size_t space = used < OUTPUT_SHM_RING_SIZE ? OUTPUT_SHM_RING_SIZE - used : 0;
+    
+    size_t fit = space / frame_bytes;
+    if (fit > frames) {
+        fit = frames;
+    }
+    
+    size_t length = fit * frame_bytes;
+    size_t offset = write_pos % OUTPUT_SHM_RING_SIZE;
+    size_t first = length < OUTPUT_SHM_RING_SIZE - offset ? length : OUTPUT_SHM_RING_SIZE - offset;
+    memcpy(shm_sink->ring + offset, data, first);
+    memcpy(shm_sink->ring, data + first, length - first);
+    __atomic_store_n(&header->write_pos, write_pos + (uint32_t)length, __ATOMIC_RELEASE);
+    
+    if (fit < frames) {
+        __atomic_fetch_add(&header->dropped_frames, (uint32_t)(frames - fit), __ATOMIC_RELAXED);
+    }
+    count_drops(&shm_sink->format, frames - fit, "shared memory ring full");
+    return (long)frames;
+}
+
+static void shm_drop(void *sink) {
+    // The reader owns read_pos, a flush only stops new audio
+    (void)sink;
+}
+
+static void shm_drain(void *sink) {
+    (void)sink;
+}
+
+static void shm_close(void *sink) {
+    free(sink);
+}
+
+// The output is going away, so is its segment
+static void shm_release(const audio_config_t *config) {
+    pthread_mutex_lock(&segments_mutex);
+    shm_segment_t *segment = find_segment_locked(sink_target(config, OUTPUT_SINK_DEFAULT_SHM));
+    if (segment) {
+        munmap(segment->header, segment->map_size);
+        shm_unlink(segment->name);
+        memset(segment, 0, sizeof(*segment));
+    }
+    pthread_mutex_unlock(&segments_mutex);
+}
+
+const audio_backend_ops_t shm_sink_backend = {
+    "shm", false, shm_open_sink, shm_write, shm_drop, shm_drain, shm_close, NULL, shm_release
+};
@@ -0,0 +1,40 @@
+#ifndef OUTPUT_SINK_H
+#define OUTPUT_SINK_H
+
+#include <stdint.h>
+#include "audio_output.h"
+
+#define OUTPUT_SINK_DEFAULT_PIPE "/tmp/snapfifo"
+#define OUTPUT_SINK_DEFAULT_SHM "/airplay2-lite.pcm"
+#define OUTPUT_SHM_MAGIC 0x41503250  // "AP2P"
+#define OUTPUT_SHM_VERSION 2
+#define OUTPUT_SHM_RING_SIZE (128 * 1024)
+#define OUTPUT_SHM_MAX_SEGMENTS 4
+
+// Interleaved little endian PCM written to a FIFO, a file or stdout ("-").
+// Audio the reader is not ready for is dropped, never waited for.
+extern const audio_backend_ops_t pipe_sink_backend;
+
+// Single-reader ring in POSIX shared memory. Positions are byte counts that
+// wrap at 2^32, so offsets are position % size. The reader waits for
+// write_pos to move, consumes up to it and then publishes read_pos.
+// The segment is created at the first open and kept, positions included,
+// until the output is destroyed, so a reader can stay attached across
+// tracks. Each open bumps generation after updating the format fields.
+extern const audio_backend_ops_t shm_sink_backend;
+
+// Layout at the start of the shared memory object, the ring follows it
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sample_rate;
+    uint16_t channels;
+    uint16_t bits_per_sample;
+    uint32_t size;                  // ring bytes, a power of two
+    uint32_t write_pos;             // advanced by the daemon
+    uint32_t read_pos;              // advanced by the reader
+    uint32_t dropped_frames;        // frames lost to a full ring
+    uint32_t generation;            // opens so far, re-read the format when it changes
+} output_shm_header_t;
+
+#endif // OUTPUT_SINK_H
@@ -0,0 +1,496 @@
+#include "pairing_store.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define STORE_MAGIC 0x50325041 // "AP2P"
+#define STORE_VERSION 1
+#define RECORD_SIZE 128
+#define HEADER_SIZE RECORD_SIZE
+#define INDEX_SIZE (PAIRING_STORE_MAX_ENTRIES * 2)
+#define INDEX_EMPTY 0
+#define INDEX_TOMBSTONE UINT32_MAX
+#define COMPACT_MIN_DEAD 16
+
+#define RECORD_ADD 1
+#define RECORD_REMOVE 2
+
+// On-flash layout, one fixed-size record per change
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint8_t reserved[RECORD_SIZE - 12];
+    uint32_t crc;
+} store_header_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t id_length;
+    uint8_t permissions;
+    uint8_t reserved;
+    uint8_t id[PAIRING_STORE_MAX_ID];
+    uint8_t public_key[PAIRING_STORE_KEY_SIZE];
+    uint8_t padding[RECORD_SIZE - 4 - PAIRING_STORE_MAX_ID - PAIRING_STORE_KEY_SIZE - 4];
+    uint32_t crc;
+} store_record_t;
+
+static pthread_mutex_t store_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char store_path[256];
+static int store_fd = -1;
+static uint8_t *store_map = NULL;
+static size_t store_map_size = 0;
+static uint32_t record_count = 0;
+static uint32_t live_count = 0;
+
+// Open addressing index: record number + 1, so 0 means empty
+static uint32_t store_index[INDEX_SIZE];
+
+static uint32_t crc32_update(const uint8_t *data, size_t length) {
+    uint32_t crc = 0xFFFFFFFFu;
+    
+    for (size_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1u)));
+        }
+    }
+    
+    return ~crc;
+}
+
+static uint32_t hash_id(const uint8_t *id, size_t id_length) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < id_length; i++) {
+        hash ^= id[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static const store_record_t* record_at(uint32_t number) {
+    return (const store_record_t *)(store_map + HEADER_SIZE + (size_t)number * RECORD_SIZE);
+}
+
+static bool record_matches(const store_record_t *record, const uint8_t *id, size_t id_length) {
+    return record->id_length == id_length && memcmp(record->id, id, id_length) == 0;
+}
+
+// Returns the index slot holding id, or -1
+static int index_find(const uint8_t *id, size_t id_length) {
+    uint32_t slot = hash_id(id, id_length) & (INDEX_SIZE - 1);
+    
+    for (int probe = 0; probe < INDEX_SIZE; probe++) {
+        uint32_t entry = store_index[slot];
+        if (entry == INDEX_EMPTY) {
+            return -1;
+        }
+        if (entry != INDEX_TOMBSTONE && record_matches(record_at(entry - 1), id, id_length)) {
+            return (int)slot;
+        }
+        slot = (slot + 1) & (INDEX_SIZE - 1);
+    }
+    
+    return -1;
+}
+
+static int index_insert(const uint8_t *id, size_t id_length, uint32_t number) {
+    int existing = index_find(id, id_length);
+    if (existing >= 0) {
+        store_index[existing] = number + 1;
+        return 0;
+    }
+    
+    if (live_count >= PAIRING_STORE_MAX_ENTRIES) {
+        return -1;
+    }
+    
+    uint32_t slot = hash_id(id, id_length) & (INDEX_SIZE - 1);
+    while (store_index[slot] != INDEX_EMPTY && store_index[slot] != INDEX_TOMBSTONE) {
+        slot = (slot + 1) & (INDEX_SIZE - 1);
+    }
+    store_index[slot] = number + 1;
+    live_count++;
+    return 0;
+}
+
+static void index_remove(const uint8_t *id, size_t id_length) {
+    int slot = index_find(id, id_length);
+    if (slot >= 0) {
+        store_index[slot] = INDEX_TOMBSTONE;
+        live_count--;
+    }
+}
+
+static int remap(void) {
+    if (store_map) {
+        munmap(store_map, store_map_size);
+        store_map = NULL;
+    }
+    
+    store_map_size = HEADER_SIZE + (size_t)record_count * RECORD_SIZE;
+    store_map = mmap(NULL, store_map_size, PROT_READ, MAP_SHARED, store_fd, 0);
+    if (store_map == MAP_FAILED) {
+        store_map = NULL;
+        syslog(LOG_ERR, "Failed to map pairing store: %s", strerror(errno));
+        return -1;
+    }
+    
+    return 0;
+}
+
+static int write_header(int fd) {
+    store_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = STORE_MAGIC;
+    header.version = STORE_VERSION;
+    header.record_size = RECORD_SIZE;
+    header.crc = crc32_update((const uint8_t *)&header, offsetof(store_header_t, crc));
+    
+    return pwrite(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) ? 0 : -1;
+}
+
+static int sync_directory(const char *path) {
+    char directory[256];
+    strncpy(directory, path, sizeof(directory) - 1);
+    directory[sizeof(directory) - 1] = '\0';
+    
+    int fd = open(dirname(directory), O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    fsync(fd);
+    close(fd);
+    return 0;
+}
+
+// Replays the log into the index and cuts off a torn tail
+static int load_records(void) {
+    struct stat st;
+    if (fstat(store_fd, &st) != 0) {
+        return -1;
+    }
+    
+    if (st.st_size < HEADER_SIZE) {
+        if (write_header(store_fd) != 0 || ftruncate(store_fd, HEADER_SIZE) != 0) {
+            return -1;
+        }
+        fdatasync(store_fd);
+        st.st_size = HEADER_SIZE;
+    }
+    
+    record_count = (uint32_t)((st.st_size - HEADER_SIZE) / RECORD_SIZE);
+    if (remap() != 0) {
+        return -1;
+    }
+    
+    const store_header_t *header = (const store_header_t *)store_map;
+    if (header->magic != STORE_MAGIC || header->version != STORE_VERSION ||
+        header->record_size != RECORD_SIZE ||
+        header->crc != crc32_update(store_map, offsetof(store_header_t, crc))) {
+        syslog(LOG_ERR, "Pairing store %s has an invalid header", store_path);
+        return -1;
+    }
+    
+    memset(store_index, 0, sizeof(store_index));
+    live_count = 0;
+    
+    uint32_t valid = 0;
+    for (; valid < record_count; valid++) {
+        const store_record_t *record = record_at(valid);
+        if (record->crc != crc32_update((const uint8_t *)record, offsetof(store_record_t, crc)) ||
+            record->id_length == 0 || record->id_length > PAIRING_STORE_MAX_ID) {
+            break;
+        }
+        
+        if (record->type == RECORD_ADD) {
+            index_insert(record->id, record->id_length, valid);
+        } else if (record->type == RECORD_REMOVE) {
+            index_remove(record->id, record->id_length);
+        } else {
+            break;
+        }
+    }
+    
+    // A power cut during append leaves a partial record; drop it
+    if (valid != record_count || st.st_size != (off_t)(HEADER_SIZE + (size_t)record_count * RECORD_SIZE)) {
+        syslog(LOG_WARNING, "Pairing store truncated after %u valid records", valid);
+        record_count = valid;
+        if (ftruncate(store_fd, HEADER_SIZE + (off_t)valid * RECORD_SIZE) != 0) {
+            return -1;
+        }
+        fdatasync(store_fd);
+        if (remap() != 0) {
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+static int append_record(uint8_t type, const uint8_t *id, size_t id_length,
+                         const uint8_t *public_key, uint8_t permissions) {
+    store_record_t record;
+    memset(&record, 0, sizeof(record));
+    record.type = type;
+    record.id_length = (uint8_t)id_length;
+    record.permissions = permissions;
+    memcpy(record.id, id, id_length);
+    if (public_key) {
+        memcpy(record.public_key, public_key, PAIRING_STORE_KEY_SIZE);
+    }
+    record.crc = crc32_update((const uint8_t *)&record, offsetof(store_record_t, crc));
+    
+    off_t offset = HEADER_SIZE + (off_t)record_count * RECORD_SIZE;
+    if (pwrite(store_fd, &record, sizeof(record), offset) != (ssize_t)sizeof(record) ||
+        fdatasync(store_fd) != 0) {
+        syslog(LOG_ERR, "Failed to append to pairing store: %s", strerror(errno));
+        // Leave the tail for load_records to discard
+        return -1;
+    }
+    
+    record_count++;
+    return remap();
+}
+
+static bool needs_compaction(void) {
+    uint32_t dead = record_count - live_count;
+    return dead >= COMPACT_MIN_DEAD && dead >= live_count;
+}
+
+static int compact_locked(void) {
+    char temp_path[sizeof(store_path) + 8];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", store_path);
+    
+    int fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    if (write_header(fd) != 0) {
+        close(fd);
+        unlink(temp_path);
+        return -1;
+    }
+    
+    // Copy live records in log order
+    uint32_t written = 0;
+    for (uint32_t i = 0; i < record_count; i++) {
+        const store_record_t *record = record_at(i);
+        int slot = record->type == RECORD_ADD ? index_find(record->id, record->id_length) : -1;
+        if (slot < 0 || store_index[slot] != i + 1) {
+            continue;
+        }
+        if (pwrite(fd, record, RECORD_SIZE, HEADER_SIZE + (off_t)written * RECORD_SIZE) != RECORD_SIZE) {
+            close(fd);
+            unlink(temp_path);
+            return -1;
+        }
+        written++;
+    }
+    
+    // New file must be durable before it replaces the old one
+    if (fsync(fd) != 0 || rename(temp_path, store_path) != 0) {
+        close(fd);
+        unlink(temp_path);
+        return -1;
+    }
+    sync_directory(store_path);
+    
+    munmap(store_map, store_map_size);
+    store_map = NULL;
+    close(store_fd);
+    store_fd = fd;
+    
+    if (load_records() != 0) {
+        return -1;
+    }
+    
+    syslog(LOG_INFO, "Pairing store compacted to %u records", written);
+    return 0;
+}
+
+int pairing_store_open(const char *path) {
+    if (!path || strlen(path) >= sizeof(store_path)) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&store_mutex);
+    
+    if (store_fd >= 0) {
+        pthread_mutex_unlock(&store_mutex);
+        return 0;
+    }
+    
+    strncpy(store_path, path, sizeof(store_path) - 1);
+    store_path[sizeof(store_path) - 1] = '\0';
+    
+    store_fd = open(store_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (store_fd < 0) {
+        syslog(LOG_ERR, "Cannot open pairing store %s: %s", store_path, strerror(errno));
+        pthread_mutex_unlock(&store_mutex);
+        return -1;
+    }
+    
+    if (load_records() != 0) {
+        if (store_map) {
+            munmap(store_map, store_map_size);
+            store_map = NULL;
+        }
+        close(store_fd);
+        store_fd = -1;
+        pthread_mutex_unlock(&store_mutex);
+        return -1;
+    }
+    
+    if (needs_compaction()) {
+        compact_locked();
+    }
+    
+    uint32_t count = live_count;
+    pthread_mutex_unlock(&store_mutex);
+    
+    syslog(LOG_INFO, "Pairing store loaded with %u controllers", count);
+    return 0;
+}
+
+int pairing_store_close(void) {
+    pthread_mutex_lock(&store_mutex);
+    
+    if (store_map) {
+        munmap(store_map, store_map_size);
+        store_map = NULL;
+    }
+    if (store_fd >= 0) {
+        close(store_fd);
+        store_fd = -1;
+    }
+    memset(store_index, 0, sizeof(store_index));
+    record_count = 0;
+    live_count = 0;
+    
+    pthread_mutex_unlock(&store_mutex);
+    return 0;
+}
+
+int pairing_store_add(const uint8_t *id, size_t id_length,
+                      const uint8_t *public_key, uint8_t permissions) {
+    if (!id || id_length == 0 || id_length > PAIRING_STORE_MAX_ID || !public_key) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&store_mutex);
+    
+    if (store_fd < 0 || !store_map) {
+        pthread_mutex_unlock(&store_mutex);
+        return -1;
+    }
+    
+    // Re-pairing with the same key costs no flash write
+    int slot = index_find(id, id_length);
+    if (slot >= 0) {
+        const store_record_t *record = record_at(store_index[slot] - 1);
+        if (record->permissions == permissions &&
+            memcmp(record->public_key, public_key, PAIRING_STORE_KEY_SIZE) == 0) {
+            pthread_mutex_unlock(&store_mutex);
+            return 0;
+        }
+    } else if (live_count >= PAIRING_STORE_MAX_ENTRIES) {
+        syslog(LOG_WARNING, "Pairing store full");
+        pthread_mutex_unlock(&store_mutex);
+        return -1;
+    }
+    
+    if (append_record(RECORD_ADD, id, id_length, public_key, permissions) != 0) {
+        pthread_mutex_unlock(&store_mutex);
+        return -1;
+    }
+    index_insert(id, id_length, record_count - 1);
+    
+    if (needs_compaction()) {
+        compact_locked();
+    }
+    
+    pthread_mutex_unlock(&store_mutex);
+    return 0;
+}
+
+int pairing_store_remove(const uint8_t *id, size_t id_length) {
+    if (!id || id_length == 0 || id_length > PAIRING_STORE_MAX_ID) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&store_mutex);
+    
+    if (store_fd < 0 || !store_map || index_find(id, id_length) < 0) {
+        pthread_mutex_unlock(&store_mutex);
+        return -1;
+    }
+    
+    if (append_record(RECORD_REMOVE, id, id_length, NULL, 0) != 0) {
+        pthread_mutex_unlock(&store_mutex);
+        return -1;
+    }
+    index_remove(id, id_length);
+    
+    if (needs_compaction()) {
+        compact_locked();
+    }
+    
+    pthread_mutex_unlock(&store_mutex);
+    return 0;
+}
+
+int pairing_store_lookup(const uint8_t *id, size_t id_length,
+                         uint8_t *public_key, uint8_t *permissions) {
+    if (!id || id_length == 0 || id_length > PAIRING_STORE_MAX_ID) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&store_mutex);
+    
+    int slot = store_map ? index_find(id, id_length) : -1;
+    if (slot < 0) {
+        pthread_mutex_unlock(&store_mutex);
+        return -1;
+    }
+    
+    const store_record_t *record = record_at(store_index[slot] - 1);
+    if (public_key) {
+        memcpy(public_key, record->public_key, PAIRING_STORE_KEY_SIZE);
+    }
+    if (permissions) {
+        *permissions = record->permissions;
+    }
+    
+    pthread_mutex_unlock(&store_mutex);
+    return 0;
+}
+
+int pairing_store_get_count(void) {
+    pthread_mutex_lock(&store_mutex);
+    int count = (int)live_count;
+    pthread_mutex_unlock(&store_mutex);
+    return count;
+}
+
+int pairing_store_compact(void) {
+    pthread_mutex_lock(&store_mutex);
+    
+    int result = -1;
+    if (store_fd >= 0) {
+        result = compact_locked();
+    }
+    
+    pthread_mutex_unlock(&store_mutex);
+    return result;
+}
@@ -0,0 +1,31 @@
+#ifndef PAIRING_STORE_H
+#define PAIRING_STORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define PAIRING_STORE_MAX_ID 64
+#define PAIRING_STORE_KEY_SIZE 32
+#define PAIRING_STORE_MAX_ENTRIES 64
+
+// Controller permissions
+#define PAIRING_PERMISSION_USER 0x00
+#define PAIRING_PERMISSION_ADMIN 0x01
+
+// Store lifecycle
+int pairing_store_open(const char *path);
+int pairing_store_close(void);
+
+// Controller management (append-only on flash)
+int pairing_store_add(const uint8_t *id, size_t id_length,
+                      const uint8_t *public_key, uint8_t permissions);
+int pairing_store_remove(const uint8_t *id, size_t id_length);
+int pairing_store_lookup(const uint8_t *id, size_t id_length,
+                         uint8_t *public_key, uint8_t *permissions);
+int pairing_store_get_count(void);
+
+// Rewrites the log without superseded records
+int pairing_store_compact(void);
+
+#endif // PAIRING_STORE_H
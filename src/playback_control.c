@@ -1,200 +1,226 @@
 #include "playback_control.h"
+#include "dacp_client.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 #include <pthread.h>
 
-static pthread_mutex_t playback_mutex = PTHREAD_MUTEX_INITIALIZER;
-static playback_state_t current_state = PLAYBACK_STOPPED;
-static playback_info_t current_info;
-static playback_state_callback_t state_callback = NULL;
-static playback_info_callback_t info_callback = NULL;
+struct playback_control {
+    pthread_mutex_t mutex;
+    dacp_client_t *remote;
+    playback_state_t current_state;
+    playback_info_t current_info;
+    playback_state_callback_t state_callback;
+    void *state_userdata;
+    playback_info_callback_t info_callback;
+    void *info_userdata;
+};
 
-int playback_control_init(void) {
-    pthread_mutex_lock(&playback_mutex);
-    
-    current_state = PLAYBACK_STOPPED;
-    memset(&current_info, 0, sizeof(current_info));
+playback_control_t* playback_control_create(dacp_client_t *remote) {
+    playback_control_t *playback = calloc(1, sizeof(playback_control_t));
+    if (!playback) {
+        return NULL;
+    }
     
-    pthread_mutex_unlock(&playback_mutex);
+    pthread_mutex_init(&playback->mutex, NULL);
+    playback->remote = remote;
+    playback->current_state = PLAYBACK_STOPPED;
+    return playback;
+}
+
+void playback_control_destroy(playback_control_t *playback) {
+    if (!playback) {
+        return;
+    }
     
-    syslog(LOG_INFO, "Playback control initialized");
-    return 0;
+    pthread_mutex_destroy(&playback->mutex);
+    free(playback);
 }
 
-int playback_control_cleanup(void) {
-    pthread_mutex_lock(&playback_mutex);
+// The sender plays the stream, so commands go back to it when it has a
+// remote control; the local state follows either way. Queued, because
+// buttons and the control API call this from the event loop.
+static void send_remote(playback_control_t *playback, dacp_command_t command) {
+    if (playback->remote && dacp_client_available(playback->remote)) {
+        dacp_client_queue(playback->remote, command, NULL, NULL);
+    }
+}
+
+// On the DACP worker once the sender has answered a track change
+static void track_changed(dacp_command_t command, int status, void *userdata) {
+    playback_control_t *playback = userdata;
+    if (status < 0) {
+        return;
+    }
     
-    state_callback = NULL;
-    info_callback = NULL;
+    pthread_mutex_lock(&playback->mutex);
     
-    pthread_mutex_unlock(&playback_mutex);
+    syslog(LOG_INFO, command == DACP_COMMAND_NEXT ? "Next track requested" : "Previous track requested");
     
-    syslog(LOG_INFO, "Playback control cleaned up");
-    return 0;
+    // Reset position for the new track
+    playback->current_info.position_ms = 0;
+    
+    // Notify callback
+    if (playback->info_callback) {
+        playback->info_callback(&playback->current_info, playback->info_userdata);
+    }
+    
+    pthread_mutex_unlock(&playback->mutex);
 }
 
-int playback_control_play(void) {
-    pthread_mutex_lock(&playback_mutex);
+int playback_control_play(playback_control_t *playback) {
+    send_remote(playback, DACP_COMMAND_PLAY);
     
-    if (current_state == PLAYBACK_PAUSED) {
-        current_state = PLAYBACK_PLAYING;
+    pthread_mutex_lock(&playback->mutex);
+    
+    if (playback->current_state == PLAYBACK_PAUSED) {
+        playback->current_state = PLAYBACK_PLAYING;
         syslog(LOG_INFO, "Playback resumed");
-    } else if (current_state == PLAYBACK_STOPPED) {
-        current_state = PLAYBACK_PLAYING;
+    } else if (playback->current_state == PLAYBACK_STOPPED) {
+        playback->current_state = PLAYBACK_PLAYING;
         syslog(LOG_INFO, "Playback started");
     }
     
     // Notify callback
-    if (state_callback) {
-        state_callback(current_state);
+    if (playback->state_callback) {
+        playback->state_callback(playback->current_state, playback->state_userdata);
     }
     
-    pthread_mutex_unlock(&playback_mutex);
+    pthread_mutex_unlock(&playback->mutex);
     return 0;
 }
 
-int playback_control_pause(void) {
-    pthread_mutex_lock(&playback_mutex);
+int playback_control_pause(playback_control_t *playback) {
+    send_remote(playback, DACP_COMMAND_PAUSE);
+    
+    pthread_mutex_lock(&playback->mutex);
     
-    if (current_state == PLAYBACK_PLAYING) {
-        current_state = PLAYBACK_PAUSED;
+    if (playback->current_state == PLAYBACK_PLAYING) {
+        playback->current_state = PLAYBACK_PAUSED;
         syslog(LOG_INFO, "Playback paused");
         
         // Notify callback
-        if (state_callback) {
-            state_callback(current_state);
+        if (playback->state_callback) {
+            playback->state_callback(playback->current_state, playback->state_userdata);
         }
     }
     
-    pthread_mutex_unlock(&playback_mutex);
+    pthread_mutex_unlock(&playback->mutex);
     return 0;
 }
 
-int playback_control_stop(void) {
-    pthread_mutex_lock(&playback_mutex);
+int playback_control_stop(playback_control_t *playback) {
+    send_remote(playback, DACP_COMMAND_STOP);
     
-    current_state = PLAYBACK_STOPPED;
-    current_info.position_ms = 0;
+    pthread_mutex_lock(&playback->mutex);
+    
+    playback->current_state = PLAYBACK_STOPPED;
+    playback->current_info.position_ms = 0;
     
     syslog(LOG_INFO, "Playback stopped");
     
     // Notify callbacks
-    if (state_callback) {
-        state_callback(current_state);
+    if (playback->state_callback) {
+        playback->state_callback(playback->current_state, playback->state_userdata);
     }
-    if (info_callback) {
-        info_callback(&current_info);
+    if (playback->info_callback) {
+        playback->info_callback(&playback->current_info, playback->info_userdata);
     }
     
-    pthread_mutex_unlock(&playback_mutex);
+    pthread_mutex_unlock(&playback->mutex);
     return 0;
 }
 
-int playback_control_next(void) {
-    pthread_mutex_lock(&playback_mutex);
-    
-    syslog(LOG_INFO, "Next track requested");
-    
-    // Reset position for new track
-    current_info.position_ms = 0;
-    
-    // Notify callback
-    if (info_callback) {
-        info_callback(&current_info);
+int playback_control_next(playback_control_t *playback) {
+    // Only the sender can change tracks
+    if (!playback->remote || dacp_client_queue(playback->remote, DACP_COMMAND_NEXT, track_changed, playback) != 0) {
+        return -1;
     }
-    
-    pthread_mutex_unlock(&playback_mutex);
     return 0;
 }
 
-int playback_control_previous(void) {
-    pthread_mutex_lock(&playback_mutex);
-    
-    syslog(LOG_INFO, "Previous track requested");
-    
-    // Reset position for previous track
-    current_info.position_ms = 0;
-    
-    // Notify callback
-    if (info_callback) {
-        info_callback(&current_info);
+int playback_control_previous(playback_control_t *playback) {
+    if (!playback->remote ||
+        dacp_client_queue(playback->remote, DACP_COMMAND_PREVIOUS, track_changed, playback) != 0) {
+        return -1;
     }
-    
-    pthread_mutex_unlock(&playback_mutex);
     return 0;
 }
 
-playback_state_t playback_control_get_state(void) {
-    pthread_mutex_lock(&playback_mutex);
-    playback_state_t state = current_state;
-    pthread_mutex_unlock(&playback_mutex);
+playback_state_t playback_control_get_state(playback_control_t *playback) {
+    pthread_mutex_lock(&playback->mutex);
+    playback_state_t state = playback->current_state;
+    pthread_mutex_unlock(&playback->mutex);
     return state;
 }
 
-int playback_control_set_state(playback_state_t state) {
+int playback_control_set_state(playback_control_t *playback, playback_state_t state) {
     if (state < PLAYBACK_STOPPED || state > PLAYBACK_BUFFERING) {
         return -1;
     }
     
-    pthread_mutex_lock(&playback_mutex);
+    pthread_mutex_lock(&playback->mutex);
     
-    current_state = state;
+    playback->current_state = state;
     
     // Notify callback
-    if (state_callback) {
-        state_callback(current_state);
+    if (playback->state_callback) {
+        playback->state_callback(playback->current_state, playback->state_userdata);
     }
     
-    pthread_mutex_unlock(&playback_mutex);
+    pthread_mutex_unlock(&playback->mutex);
     
     syslog(LOG_DEBUG, "Playback state set to %d", state);
     return 0;
 }
 
-int playback_control_set_info(const playback_info_t *info) {
+int playback_control_set_info(playback_control_t *playback, const playback_info_t *info) {
     if (!info) {
         return -1;
     }
     
-    pthread_mutex_lock(&playback_mutex);
+    pthread_mutex_lock(&playback->mutex);
     
-    current_info = *info;
+    playback->current_info = *info;
     
     // Notify callback
-    if (info_callback) {
-        info_callback(&current_info);
+    if (playback->info_callback) {
+        playback->info_callback(&playback->current_info, playback->info_userdata);
     }
     
-    pthread_mutex_unlock(&playback_mutex);
+    pthread_mutex_unlock(&playback->mutex);
     
     syslog(LOG_DEBUG, "Playback info updated: %s - %s", 
            info->artist, info->title);
     return 0;
 }
 
-int playback_control_get_info(playback_info_t *info) {
+int playback_control_get_info(playback_control_t *playback, playback_info_t *info) {
     if (!info) {
         return -1;
     }
     
-    pthread_mutex_lock(&playback_mutex);
-    *info = current_info;
-    pthread_mutex_unlock(&playback_mutex);
+    pthread_mutex_lock(&playback->mutex);
+    *info = playback->current_info;
+    pthread_mutex_unlock(&playback->mutex);
     return 0;
 }
 
-int playback_control_set_state_callback(playback_state_callback_t callback) {
-    pthread_mutex_lock(&playback_mutex);
-    state_callback = callback;
-    pthread_mutex_unlock(&playback_mutex);
+int playback_control_set_state_callback(playback_control_t *playback, playback_state_callback_t callback,
+                                        void *userdata) {
+    pthread_mutex_lock(&playback->mutex);
+    playback->state_callback = callback;
+    playback->state_userdata = userdata;
+    pthread_mutex_unlock(&playback->mutex);
     return 0;
 }
 
-int playback_control_set_info_callback(playback_info_callback_t callback) {
-    pthread_mutex_lock(&playback_mutex);
-    info_callback = callback;
-    pthread_mutex_unlock(&playback_mutex);
+int playback_control_set_info_callback(playback_control_t *playback, playback_info_callback_t callback,
+                                       void *userdata) {
+    pthread_mutex_lock(&playback->mutex);
+    playback->info_callback = callback;
+    playback->info_userdata = userdata;
+    pthread_mutex_unlock(&playback->mutex);
     return 0;
 }
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "dacp_client.h"
 
 // Playback states
 typedef enum {
@@ -12,17 +13,6 @@ typedef enum {
     PLAYBACK_BUFFERING
 } playback_state_t;
 
-// Playback control functions
-int playback_control_init(void);
-int playback_control_cleanup(void);
-int playback_control_play(void);
-int playback_control_pause(void);
-int playback_control_stop(void);
-int playback_control_next(void);
-int playback_control_previous(void);
-playback_state_t playback_control_get_state(void);
-int playback_control_set_state(playback_state_t state);
-
 // Playback info
 typedef struct {
     char title[256];
@@ -32,14 +22,33 @@ typedef struct {
     uint32_t position_ms;
 } playback_info_t;
 
-int playback_control_set_info(const playback_info_t *info);
-int playback_control_get_info(playback_info_t *info);
+// State and track of one zone. Commands go back to the sender through the
+// zone's DACP client, NULL when it has none, without waiting for it: next
+// and previous fail only without a sender and reset the position once it
+// has answered. The client must be destroyed first.
+typedef struct playback_control playback_control_t;
+
+// Playback control functions
+playback_control_t* playback_control_create(dacp_client_t *remote);
+void playback_control_destroy(playback_control_t *playback);
+int playback_control_play(playback_control_t *playback);
+int playback_control_pause(playback_control_t *playback);
+int playback_control_stop(playback_control_t *playback);
+int playback_control_next(playback_control_t *playback);
+int playback_control_previous(playback_control_t *playback);
+playback_state_t playback_control_get_state(playback_control_t *playback);
+int playback_control_set_state(playback_control_t *playback, playback_state_t state);
+
+int playback_control_set_info(playback_control_t *playback, const playback_info_t *info);
+int playback_control_get_info(playback_control_t *playback, playback_info_t *info);
 
 // Playback callbacks
-typedef void (*playback_state_callback_t)(playback_state_t state);
-typedef void (*playback_info_callback_t)(const playback_info_t *info);
+typedef void (*playback_state_callback_t)(playback_state_t state, void *userdata);
+typedef void (*playback_info_callback_t)(const playback_info_t *info, void *userdata);
 
-int playback_control_set_state_callback(playback_state_callback_t callback);
-int playback_control_set_info_callback(playback_info_callback_t callback);
+int playback_control_set_state_callback(playback_control_t *playback, playback_state_callback_t callback,
+                                        void *userdata);
+int playback_control_set_info_callback(playback_control_t *playback, playback_info_callback_t callback,
+                                       void *userdata);
 
 #endif // PLAYBACK_CONTROL_H
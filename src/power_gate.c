@@ -0,0 +1,211 @@
+#include "power_gate.h"
+#include "stats.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#define GPIO_SYSFS "/sys/class/gpio"
+#define PEAK_LANES 8
+
+// Eight samples per step, NEON or SSE2 where the target has it and plain
+// word operations elsewhere
+typedef int16_t peak_vector_t __attribute__((vector_size(PEAK_LANES * sizeof(int16_t))));
+
+static pthread_mutex_t gate_mutex = PTHREAD_MUTEX_INITIALIZER;
+static power_gate_config_t current_config = {
+    POWER_GATE_DEFAULT_IDLE_MS, POWER_GATE_DEFAULT_SUSPEND_MS, POWER_GATE_DEFAULT_THRESHOLD,
+    POWER_GATE_NO_GPIO, false
+};
+static power_state_t current_state = POWER_STATE_CLOSED;
+static int amp_fd = -1;
+
+// Outputs in each state, closed ones are not counted. Every zone has its
+// own output but they share the amplifier.
+static int output_count[POWER_STATE_COUNT];
+
+static const char *state_names[POWER_STATE_COUNT] = {
+    "active", "idle", "suspended", "closed"
+};
+
+void power_gate_get_defaults(power_gate_config_t *config) {
+    if (!config) {
+        return;
+    }
+    
+    config->idle_ms = POWER_GATE_DEFAULT_IDLE_MS;
+    config->suspend_ms = POWER_GATE_DEFAULT_SUSPEND_MS;
+    config->threshold = POWER_GATE_DEFAULT_THRESHOLD;
+    config->amp_gpio = POWER_GATE_NO_GPIO;
+    config->amp_active_low = false;
+}
+
+static int write_sysfs(const char *path, const char *value) {
+    int fd = open(path, O_WRONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t written = write(fd, value, strlen(value));
+    close(fd);
+    return written == (ssize_t)strlen(value) ? 0 : -1;
+}
+
+static int open_amp_gpio(int gpio) {
+    char path[64];
+    char number[16];
+    
+    // Already exported by the board setup is fine, export only fails then
+    snprintf(path, sizeof(path), GPIO_SYSFS "/gpio%d/value", gpio);
+    if (access(path, F_OK) != 0) {
+        snprintf(number, sizeof(number), "%d", gpio);
+        write_sysfs(GPIO_SYSFS "/export", number);
+    }
+    
+    snprintf(path, sizeof(path), GPIO_SYSFS "/gpio%d/direction", gpio);
+    if (write_sysfs(path, "out") != 0) {
+        syslog(LOG_WARNING, "Cannot set amplifier GPIO %d as output", gpio);
+        return -1;
+    }
+    
+    snprintf(path, sizeof(path), GPIO_SYSFS "/gpio%d/value", gpio);
+    return open(path, O_WRONLY);
+}
+
+static void set_amp_locked(bool on) {
+    if (amp_fd < 0) {
+        return;
+    }
+    
+    char level = (on != current_config.amp_active_low) ? '1' : '0';
+    if (pwrite(amp_fd, &level, 1, 0) != 1) {
+        logger_log(LOG_WARNING, "Cannot switch amplifier GPIO %d", current_config.amp_gpio);
+    }
+}
+
+int power_gate_init(const power_gate_config_t *config) {
+    pthread_mutex_lock(&gate_mutex);
+    
+    if (config) {
+        current_config = *config;
+    } else {
+        power_gate_get_defaults(&current_config);
+    }
+    current_state = POWER_STATE_CLOSED;
+    memset(output_count, 0, sizeof(output_count));
+    
+    if (current_config.amp_gpio != POWER_GATE_NO_GPIO) {
+        amp_fd = open_amp_gpio(current_config.amp_gpio);
+        if (amp_fd < 0) {
+            syslog(LOG_WARNING, "Amplifier GPIO %d unavailable, not switching it", current_config.amp_gpio);
+        }
+        set_amp_locked(false);
+    }
+    stats_set_gauge(STATS_GAUGE_POWER_STATE, current_state);
+    
+    pthread_mutex_unlock(&gate_mutex);
+    
+    syslog(LOG_INFO, "Power gating: idle after %u ms, suspend after %u ms more, silence below %u",
+           current_config.idle_ms, current_config.suspend_ms, current_config.threshold);
+    return 0;
+}
+
+void power_gate_cleanup(void) {
+    pthread_mutex_lock(&gate_mutex);
+    set_amp_locked(false);
+    if (amp_fd >= 0) {
+        close(amp_fd);
+        amp_fd = -1;
+    }
+    current_state = POWER_STATE_CLOSED;
+    memset(output_count, 0, sizeof(output_count));
+    pthread_mutex_unlock(&gate_mutex);
+}
+
+int power_gate_get_config(power_gate_config_t *config) {
+    if (!config) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&gate_mutex);
+    *config = current_config;
+    pthread_mutex_unlock(&gate_mutex);
+    return 0;
+}
+
+uint16_t power_gate_peak(const int16_t *samples, size_t count) {
+    peak_vector_t high = { 0 };
+    peak_vector_t low = { 0 };
+    size_t i = 0;
+    
+    // Branch-free running max and min per lane
+    for (; i + PEAK_LANES <= count; i += PEAK_LANES) {
+        peak_vector_t x;
+        memcpy(&x, samples + i, sizeof(x));
+        peak_vector_t above = x > high;
+        peak_vector_t below = x < low;
+        high = (x & above) | (high & ~above);
+        low = (x & below) | (low & ~below);
+    }
+    
+    int32_t max = 0;
+    int32_t min = 0;
+    for (int lane = 0; lane < PEAK_LANES; lane++) {
+        max = high[lane] > max ? high[lane] : max;
+        min = low[lane] < min ? low[lane] : min;
+    }
+    for (; i < count; i++) {
+        max = samples[i] > max ? samples[i] : max;
+        min = samples[i] < min ? samples[i] : min;
+    }
+    
+    int32_t peak = max > -min ? max : -min;
+    return peak > INT16_MAX ? INT16_MAX : (uint16_t)peak;
+}
+
+void power_gate_set_state(power_state_t from, power_state_t to) {
+    if ((unsigned int)from >= POWER_STATE_COUNT || (unsigned int)to >= POWER_STATE_COUNT || from == to) {
+        return;
+    }
+    
+    pthread_mutex_lock(&gate_mutex);
+    if (from != POWER_STATE_CLOSED && output_count[from] > 0) {
+        output_count[from]--;
+    }
+    if (to != POWER_STATE_CLOSED) {
+        output_count[to]++;
+    }
+    
+    // The gate is as awake as the most awake output
+    power_state_t previous = current_state;
+    power_state_t state = POWER_STATE_ACTIVE;
+    while (state < POWER_STATE_CLOSED && output_count[state] == 0) {
+        state++;
+    }
+    current_state = state;
+    
+    // The amplifier follows the DAC: on while it plays, off once it stops
+    if (previous != state) {
+        set_amp_locked(state == POWER_STATE_ACTIVE || state == POWER_STATE_IDLE);
+        stats_set_gauge(STATS_GAUGE_POWER_STATE, state);
+    }
+    pthread_mutex_unlock(&gate_mutex);
+    
+    if (previous != state) {
+        logger_log(LOG_INFO, "Audio output %s -> %s", state_names[previous], state_names[state]);
+    }
+}
+
+power_state_t power_gate_get_state(void) {
+    pthread_mutex_lock(&gate_mutex);
+    power_state_t state = current_state;
+    pthread_mutex_unlock(&gate_mutex);
+    return state;
+}
+
+const char* power_gate_state_name(power_state_t state) {
+    return (unsigned int)state < POWER_STATE_COUNT ? state_names[state] : "unknown";
+}
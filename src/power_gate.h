@@ -0,0 +1,46 @@
+#ifndef POWER_GATE_H
+#define POWER_GATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define POWER_GATE_DEFAULT_IDLE_MS 2000
+#define POWER_GATE_DEFAULT_SUSPEND_MS 10000
+#define POWER_GATE_DEFAULT_THRESHOLD 16     // about -66 dBFS
+#define POWER_GATE_NO_GPIO -1
+
+// Output power states, in the order silence moves the device through them
+typedef enum {
+    POWER_STATE_ACTIVE = 0,     // audible audio written
+    POWER_STATE_IDLE,           // device open, fed silence
+    POWER_STATE_SUSPENDED,      // device paused, amplifier off
+    POWER_STATE_CLOSED,         // device closed
+    POWER_STATE_COUNT
+} power_state_t;
+
+typedef struct {
+    uint32_t idle_ms;           // silence before the output counts as idle
+    uint32_t suspend_ms;        // further silence before the device is paused, 0 never
+    uint16_t threshold;         // peak sample magnitude still treated as silence
+    int amp_gpio;               // sysfs GPIO that powers the amplifier
+    bool amp_active_low;
+} power_gate_config_t;
+
+void power_gate_get_defaults(power_gate_config_t *config);
+
+// Lifecycle, init exports the amplifier GPIO and switches it off
+int power_gate_init(const power_gate_config_t *config);
+void power_gate_cleanup(void);
+int power_gate_get_config(power_gate_config_t *config);
+
+// Largest sample magnitude in interleaved 16 bit audio, count in samples
+uint16_t power_gate_peak(const int16_t *samples, size_t count);
+
+// Called by each output on every state change. The amplifier is on while
+// any output is active or idle, get_state is the most awake output's state.
+void power_gate_set_state(power_state_t from, power_state_t to);
+power_state_t power_gate_get_state(void);
+const char* power_gate_state_name(power_state_t state);
+
+#endif // POWER_GATE_H
@@ -0,0 +1,308 @@
+#include "secure_channel.h"
+#include "stats.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define FRAME_HEADER_SIZE 2
+#define FRAMES_PER_WRITE 8
+#define FRAME_OVERHEAD (FRAME_HEADER_SIZE + CHACHA20_POLY1305_TAG_SIZE)
+
+int secure_channel_init(secure_channel_t *channel) {
+    if (!channel) {
+        return -1;
+    }
+    
+    memset(channel, 0, sizeof(*channel));
+    // One spare byte so callers can terminate a message that fills the buffer
+    channel->buffer = malloc(SECURE_CHANNEL_BUFFER_SIZE + 1);
+    if (!channel->buffer) {
+        return -1;
+    }
+    channel->capacity = SECURE_CHANNEL_BUFFER_SIZE;
+    
+    return 0;
+}
+
+void secure_channel_cleanup(secure_channel_t *channel) {
+    if (!channel) {
+        return;
+    }
+    
+    secure_channel_reset(channel);
+    free(channel->buffer);
+    channel->buffer = NULL;
+    channel->capacity = 0;
+}
+
+void secure_channel_reset(secure_channel_t *channel) {
+    if (!channel) {
+        return;
+    }
+    
+    aead_session_destroy(channel->decrypt_session);
+    aead_session_destroy(channel->encrypt_session);
+    channel->decrypt_session = NULL;
+    channel->encrypt_session = NULL;
+    channel->encrypted = false;
+    channel->start = 0;
+    channel->plain_end = 0;
+    channel->cipher = 0;
+    channel->end = 0;
+}
+
+int secure_channel_enable_encryption(secure_channel_t *channel,
+                                     const uint8_t *decrypt_key, const uint8_t *encrypt_key) {
+    if (!channel || !decrypt_key || !encrypt_key) {
+        return -1;
+    }
+    
+    aead_session_destroy(channel->decrypt_session);
+    aead_session_destroy(channel->encrypt_session);
+    channel->decrypt_session = aead_session_create(decrypt_key);
+    channel->encrypt_session = aead_session_create(encrypt_key);
+    if (!channel->decrypt_session || !channel->encrypt_session) {
+        secure_channel_reset(channel);
+        return -1;
+    }
+    
+    // Anything still buffered was sent before the switch
+    channel->cipher = channel->end;
+    channel->plain_end = channel->end;
+    channel->encrypted = true;
+    return 0;
+}
+
+bool secure_channel_is_encrypted(const secure_channel_t *channel) {
+    return channel && channel->encrypted;
+}
+
+// Moves unparsed plaintext and the incomplete frame tail to the front
+static void compact(secure_channel_t *channel) {
+    size_t plain_length = channel->plain_end - channel->start;
+    size_t tail_length = channel->end - channel->cipher;
+    
+    if (plain_length > 0 && channel->start > 0) {
+        memmove(channel->buffer, channel->buffer + channel->start, plain_length);
+    }
+    if (tail_length > 0 && channel->cipher != plain_length) {
+        memmove(channel->buffer + plain_length, channel->buffer + channel->cipher, tail_length);
+    }
+    
+    channel->start = 0;
+    channel->plain_end = plain_length;
+    channel->cipher = plain_length;
+    channel->end = plain_length + tail_length;
+}
+
+// Decrypts every complete frame in place and appends it to the plaintext run
+static int decrypt_frames(secure_channel_t *channel) {
+    while (channel->end - channel->cipher >= FRAME_HEADER_SIZE) {
+        uint8_t *frame = channel->buffer + channel->cipher;
+        size_t length = frame[0] | ((size_t)frame[1] << 8);
+        
+        if (length > SECURE_CHANNEL_MAX_FRAME) {
+            logger_log(LOG_WARNING, "Encrypted frame too large: %zu", length);
+            return -1;
+        }
+        if (channel->end - channel->cipher < FRAME_HEADER_SIZE + length + CHACHA20_POLY1305_TAG_SIZE) {
+            break;
+        }
+        
+        // The length prefix is the additional authenticated data
+        uint64_t start_ns = stats_now();
+        if (aead_session_decrypt(channel->decrypt_session, NULL, frame, FRAME_HEADER_SIZE,
+                                 frame + FRAME_HEADER_SIZE, length,
+                                 frame + FRAME_HEADER_SIZE + length) != 0) {
+            logger_log(LOG_WARNING, "Encrypted frame failed authentication");
+            stats_increment(STATS_COUNTER_DECRYPT_ERRORS);
+            return -1;
+        }
+        stats_record(STATS_STAGE_DECRYPT, start_ns);
+        
+        if (channel->plain_end != channel->cipher + FRAME_HEADER_SIZE) {
+            memmove(channel->buffer + channel->plain_end, frame + FRAME_HEADER_SIZE, length);
+        }
+        channel->plain_end += length;
+        channel->cipher += FRAME_HEADER_SIZE + length + CHACHA20_POLY1305_TAG_SIZE;
+    }
+    
+    return 0;
+}
+
+ssize_t secure_channel_receive(secure_channel_t *channel, int fd) {
+    if (!channel || !channel->buffer) {
+        return -1;
+    }
+    
+    if (channel->capacity - channel->end < SECURE_CHANNEL_MAX_FRAME + FRAME_OVERHEAD) {
+        compact(channel);
+    }
+    if (channel->end == channel->capacity) {
+        logger_log(LOG_WARNING, "Request exceeds %zu byte receive buffer", channel->capacity);
+        return -1;
+    }
+    
+    ssize_t received = recv(fd, channel->buffer + channel->end, channel->capacity - channel->end, MSG_DONTWAIT);
+    if (received <= 0) {
+        return received;
+    }
+    channel->end += received;
+    
+    if (!channel->encrypted) {
+        channel->plain_end = channel->end;
+        channel->cipher = channel->end;
+        return received;
+    }
+    
+    if (decrypt_frames(channel) != 0) {
+        errno = EPROTO;
+        return -1;
+    }
+    
+    return received;
+}
+
+size_t secure_channel_peek(secure_channel_t *channel, char **data) {
+    if (!channel || !data) {
+        return 0;
+    }
+    
+    *data = (char *)channel->buffer + channel->start;
+    return channel->plain_end - channel->start;
+}
+
+void secure_channel_consume(secure_channel_t *channel, size_t length) {
+    if (!channel) {
+        return;
+    }
+    
+    if (length > channel->plain_end - channel->start) {
+        length = channel->plain_end - channel->start;
+    }
+    channel->start += length;
+    
+    // Everything parsed: rewind instead of compacting later, and give back
+    // what a large message needed
+    if (channel->start == channel->plain_end && channel->cipher == channel->end) {
+        channel->start = 0;
+        channel->plain_end = 0;
+        channel->cipher = 0;
+        channel->end = 0;
+        
+        if (channel->capacity > SECURE_CHANNEL_BUFFER_SIZE) {
+            uint8_t *buffer = realloc(channel->buffer, SECURE_CHANNEL_BUFFER_SIZE + 1);
+            if (buffer) {
+                channel->buffer = buffer;
+                channel->capacity = SECURE_CHANNEL_BUFFER_SIZE;
+            }
+        }
+    }
+}
+
+int secure_channel_expect(secure_channel_t *channel, size_t message_length) {
+    if (!channel || !channel->buffer || message_length > SECURE_CHANNEL_MAX_MESSAGE) {
+        return -1;
+    }
+    
+    // Room for the message after compaction, and for the next whole frame
+    // while its last bytes arrive
+    size_t capacity = message_length + SECURE_CHANNEL_MAX_FRAME + FRAME_OVERHEAD;
+    if (capacity <= channel->capacity) {
+        return 0;
+    }
+    
+    uint8_t *buffer = realloc(channel->buffer, capacity + 1);
+    if (!buffer) {
+        return -1;
+    }
+    channel->buffer = buffer;
+    channel->capacity = capacity;
+    return 0;
+}
+
+static int send_iov(int fd, struct iovec *iov, int count) {
+    struct msghdr message;
+    
+    while (count > 0) {
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = iov;
+        message.msg_iovlen = count;
+        
+        ssize_t sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        
+        // Skip what went out and retry the rest
+        while (count > 0 && (size_t)sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    
+    return 0;
+}
+
+int secure_channel_send(secure_channel_t *channel, int fd, uint8_t *data, size_t length) {
+    struct iovec iov[FRAMES_PER_WRITE * 3];
+    uint8_t headers[FRAMES_PER_WRITE][FRAME_HEADER_SIZE];
+    uint8_t tags[FRAMES_PER_WRITE][CHACHA20_POLY1305_TAG_SIZE];
+    
+    if (!channel || (!data && length > 0)) {
+        return -1;
+    }
+    
+    if (!channel->encrypted) {
+        iov[0].iov_base = data;
+        iov[0].iov_len = length;
+        return send_iov(fd, iov, 1);
+    }
+    
+    while (length > 0) {
+        int frames = 0;
+        int count = 0;
+        
+        // Header, in-place ciphertext and tag go out in one scatter-gather call
+        while (length > 0 && frames < FRAMES_PER_WRITE) {
+            size_t chunk = length > SECURE_CHANNEL_MAX_FRAME ? SECURE_CHANNEL_MAX_FRAME : length;
+            headers[frames][0] = (uint8_t)(chunk & 0xFF);
+            headers[frames][1] = (uint8_t)(chunk >> 8);
+            
+            if (aead_session_encrypt(channel->encrypt_session, NULL, headers[frames], FRAME_HEADER_SIZE,
+                                     data, chunk, tags[frames]) != 0) {
+                return -1;
+            }
+            
+            iov[count].iov_base = headers[frames];
+            iov[count++].iov_len = FRAME_HEADER_SIZE;
+            iov[count].iov_base = data;
+            iov[count++].iov_len = chunk;
+            iov[count].iov_base = tags[frames];
+            iov[count++].iov_len = CHACHA20_POLY1305_TAG_SIZE;
+            
+            data += chunk;
+            length -= chunk;
+            frames++;
+        }
+        
+        if (send_iov(fd, iov, count) != 0) {
+            return -1;
+        }
+    }
+    
+    return 0;
+}
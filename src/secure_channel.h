@@ -0,0 +1,51 @@
+#ifndef SECURE_CHANNEL_H
+#define SECURE_CHANNEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "crypto_utils.h"
+
+#define SECURE_CHANNEL_BUFFER_SIZE 16384                 // what an idle connection keeps
+#define SECURE_CHANNEL_MAX_MESSAGE (4 * 1024 * 1024)    // artwork and bplist bodies fit well below
+#define SECURE_CHANNEL_MAX_FRAME 1024
+
+// Per connection framing state. Received bytes are laid out as
+//   [start, plain_end)   plaintext ready for the RTSP parser
+//   [plain_end, cipher)  consumed frame headers/tags (encrypted mode only)
+//   [cipher, end)        bytes of frames not yet complete
+typedef struct {
+    uint8_t *buffer;
+    size_t capacity;
+    size_t start;
+    size_t plain_end;
+    size_t cipher;
+    size_t end;
+    bool encrypted;
+    aead_session_t *decrypt_session;
+    aead_session_t *encrypt_session;
+} secure_channel_t;
+
+// Channel lifecycle
+int secure_channel_init(secure_channel_t *channel);
+void secure_channel_cleanup(secure_channel_t *channel);
+void secure_channel_reset(secure_channel_t *channel);
+int secure_channel_enable_encryption(secure_channel_t *channel,
+                                     const uint8_t *decrypt_key, const uint8_t *encrypt_key);
+bool secure_channel_is_encrypted(const secure_channel_t *channel);
+
+// Receive path: read what the socket has, then parse plaintext in place
+ssize_t secure_channel_receive(secure_channel_t *channel, int fd);
+size_t secure_channel_peek(secure_channel_t *channel, char **data);
+void secure_channel_consume(secure_channel_t *channel, size_t length);
+
+// Grows the buffer until a message of this many plaintext bytes fits, from
+// its Content-Length. -1 above SECURE_CHANNEL_MAX_MESSAGE. The buffer
+// shrinks back once everything received has been consumed.
+int secure_channel_expect(secure_channel_t *channel, size_t message_length);
+
+// Send path: data is encrypted in place and written with one scatter-gather call
+int secure_channel_send(secure_channel_t *channel, int fd, uint8_t *data, size_t length);
+
+#endif // SECURE_CHANNEL_H
@@ -0,0 +1,176 @@
+#include "session_arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <syslog.h>
+#include <pthread.h>
+
+// Scratch planned per decoded frame and channel, for decode and DSP stages
+#define SCRATCH_BYTES_PER_SAMPLE 16
+#define PACKET_BUFFER_SIZE 8192
+
+struct session_arena {
+    size_t size;
+    size_t used;
+    uint8_t *data;
+};
+
+static pthread_mutex_t arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+static session_arena_stats_t arena_stats;
+static bool is_initialized = false;
+
+static size_t align_up(size_t value) {
+    return (value + SESSION_ARENA_ALIGNMENT - 1) & ~(size_t)(SESSION_ARENA_ALIGNMENT - 1);
+}
+
+int session_arena_init(size_t limit) {
+    pthread_mutex_lock(&arena_mutex);
+    
+    if (arena_stats.sessions > 0) {
+        syslog(LOG_WARNING, "Session arena limit changed with %d sessions live", arena_stats.sessions);
+    }
+    memset(&arena_stats, 0, sizeof(arena_stats));
+    arena_stats.limit = limit ? limit : SESSION_ARENA_DEFAULT_LIMIT;
+    is_initialized = true;
+    
+    pthread_mutex_unlock(&arena_mutex);
+    
+    syslog(LOG_INFO, "Session arena initialized (%zu KiB limit)", arena_stats.limit / 1024);
+    return 0;
+}
+
+void session_arena_cleanup(void) {
+    pthread_mutex_lock(&arena_mutex);
+    
+    if (arena_stats.sessions > 0) {
+        syslog(LOG_WARNING, "%d session arenas still live at cleanup", arena_stats.sessions);
+    }
+    syslog(LOG_INFO, "Session arena high water: %zu KiB reserved, %zu KiB used, %d sessions",
+           arena_stats.reserved_high_water / 1024, arena_stats.used_high_water / 1024,
+           arena_stats.sessions_high_water);
+    is_initialized = false;
+    
+    pthread_mutex_unlock(&arena_mutex);
+}
+
+size_t session_arena_size_for_format(const audio_format_t *format) {
+    size_t size = SESSION_ARENA_BASE_SIZE + PACKET_BUFFER_SIZE;
+    if (format) {
+        size_t frames = format->frames_per_packet ? format->frames_per_packet : AUDIO_DECODER_MAX_FRAMES;
+        size += frames * format->channels * SCRATCH_BYTES_PER_SAMPLE;
+    }
+    return align_up(size);
+}
+
+session_arena_t* session_arena_create(size_t size) {
+    size = align_up(size);
+    
+    pthread_mutex_lock(&arena_mutex);
+    
+    if (!is_initialized || arena_stats.reserved + size > arena_stats.limit) {
+        arena_stats.rejected++;
+        pthread_mutex_unlock(&arena_mutex);
+        syslog(LOG_WARNING, "Session refused, %zu KiB arena would exceed the %zu KiB limit",
+               size / 1024, arena_stats.limit / 1024);
+        return NULL;
+    }
+    
+    // Header and slab come from one allocation, so a session costs one heap block
+    void *block = NULL;
+    if (posix_memalign(&block, SESSION_ARENA_ALIGNMENT, align_up(sizeof(session_arena_t)) + size) != 0) {
+        block = NULL;
+    }
+    session_arena_t *arena = (session_arena_t *)block;
+    if (!arena) {
+        pthread_mutex_unlock(&arena_mutex);
+        syslog(LOG_ERR, "Failed to allocate %zu KiB session arena", size / 1024);
+        return NULL;
+    }
+    arena->size = size;
+    arena->used = 0;
+    arena->data = (uint8_t *)arena + align_up(sizeof(session_arena_t));
+    
+    arena_stats.reserved += size;
+    arena_stats.sessions++;
+    if (arena_stats.reserved > arena_stats.reserved_high_water) {
+        arena_stats.reserved_high_water = arena_stats.reserved;
+    }
+    if (arena_stats.sessions > arena_stats.sessions_high_water) {
+        arena_stats.sessions_high_water = arena_stats.sessions;
+    }
+    
+    pthread_mutex_unlock(&arena_mutex);
+    return arena;
+}
+
+void session_arena_destroy(session_arena_t *arena) {
+    if (!arena) {
+        return;
+    }
+    
+    pthread_mutex_lock(&arena_mutex);
+    arena_stats.reserved -= arena->size;
+    arena_stats.used -= arena->used;
+    arena_stats.sessions--;
+    pthread_mutex_unlock(&arena_mutex);
+    
+    syslog(LOG_DEBUG, "Session arena released, %zu of %zu bytes used", arena->used, arena->size);
+    free(arena);
+}
+
+void* session_arena_alloc(session_arena_t *arena, size_t size) {
+    if (!arena || size == 0) {
+        return NULL;
+    }
+    
+    size = align_up(size);
+    
+    pthread_mutex_lock(&arena_mutex);
+    
+    if (size > arena->size - arena->used) {
+        arena_stats.exhausted++;
+        pthread_mutex_unlock(&arena_mutex);
+        syslog(LOG_WARNING, "Session arena exhausted, %zu bytes requested with %zu free",
+               size, arena->size - arena->used);
+        return NULL;
+    }
+    
+    void *block = arena->data + arena->used;
+    arena->used += size;
+    arena_stats.used += size;
+    if (arena_stats.used > arena_stats.used_high_water) {
+        arena_stats.used_high_water = arena_stats.used;
+    }
+    
+    pthread_mutex_unlock(&arena_mutex);
+    
+    memset(block, 0, size);
+    return block;
+}
+
+size_t session_arena_used(const session_arena_t *arena) {
+    if (!arena) {
+        return 0;
+    }
+    
+    pthread_mutex_lock(&arena_mutex);
+    size_t used = arena->used;
+    pthread_mutex_unlock(&arena_mutex);
+    return used;
+}
+
+size_t session_arena_size(const session_arena_t *arena) {
+    return arena ? arena->size : 0;
+}
+
+int session_arena_get_stats(session_arena_stats_t *stats) {
+    if (!stats) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&arena_mutex);
+    *stats = arena_stats;
+    pthread_mutex_unlock(&arena_mutex);
+    return 0;
+}
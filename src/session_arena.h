@@ -0,0 +1,46 @@
+#ifndef SESSION_ARENA_H
+#define SESSION_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "audio_decoder.h"
+
+#define SESSION_ARENA_DEFAULT_LIMIT (512 * 1024)
+#define SESSION_ARENA_BASE_SIZE (16 * 1024)
+#define SESSION_ARENA_ALIGNMENT 16
+
+// One slab per streaming session, carved up by a bump allocator and
+// released in one piece at TEARDOWN
+typedef struct session_arena session_arena_t;
+
+typedef struct {
+    size_t limit;
+    size_t reserved;            // slab bytes held by live sessions
+    size_t reserved_high_water;
+    size_t used;                // bytes handed out from those slabs
+    size_t used_high_water;
+    int sessions;
+    int sessions_high_water;
+    uint32_t rejected;          // sessions refused by the limit
+    uint32_t exhausted;         // allocations that did not fit their slab
+} session_arena_stats_t;
+
+// Lifecycle, limit caps the slab bytes of all sessions together
+int session_arena_init(size_t limit);
+void session_arena_cleanup(void);
+
+// Slab size for a session playing format
+size_t session_arena_size_for_format(const audio_format_t *format);
+
+// NULL when the slab would take the total over the limit
+session_arena_t* session_arena_create(size_t size);
+void session_arena_destroy(session_arena_t *arena);
+
+// Zeroed, SESSION_ARENA_ALIGNMENT aligned, NULL once the slab is full
+void* session_arena_alloc(session_arena_t *arena, size_t size);
+size_t session_arena_used(const session_arena_t *arena);
+size_t session_arena_size(const session_arena_t *arena);
+
+int session_arena_get_stats(session_arena_stats_t *stats);
+
+#endif // SESSION_ARENA_H
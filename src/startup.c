@@ -0,0 +1,212 @@
+#include "startup.h"
+#include "thread_policy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define STARTUP_TRACE_SIZE 512
+
+typedef struct {
+    const char *stage;
+    uint32_t us;
+} startup_mark_t;
+
+typedef struct {
+    const char *stage;
+    startup_task_t task;
+} startup_job_t;
+
+static pthread_mutex_t startup_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec origin;
+static startup_mark_t marks[STARTUP_MAX_MARKS];
+static int mark_count = 0;
+static startup_job_t jobs[STARTUP_MAX_TASKS];
+static int job_count = 0;
+static char ready_path[128];
+static pthread_t background_thread;
+static bool background_joinable = false;
+static bool failed = false;
+static bool ready = false;
+
+void startup_begin(void) {
+    pthread_mutex_lock(&startup_mutex);
+    clock_gettime(CLOCK_MONOTONIC, &origin);
+    mark_count = 0;
+    job_count = 0;
+    failed = false;
+    ready = false;
+    pthread_mutex_unlock(&startup_mutex);
+}
+
+void startup_mark(const char *stage) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint32_t us = (uint32_t)((now.tv_sec - origin.tv_sec) * 1000000 + (now.tv_nsec - origin.tv_nsec) / 1000);
+    
+    pthread_mutex_lock(&startup_mutex);
+    if (mark_count < STARTUP_MAX_MARKS) {
+        marks[mark_count].stage = stage;
+        marks[mark_count].us = us;
+        mark_count++;
+    }
+    pthread_mutex_unlock(&startup_mutex);
+}
+
+int startup_defer(const char *stage, startup_task_t task) {
+    if (!stage || !task) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&startup_mutex);
+    if (job_count == STARTUP_MAX_TASKS || background_joinable) {
+        pthread_mutex_unlock(&startup_mutex);
+        return -1;
+    }
+    jobs[job_count].stage = stage;
+    jobs[job_count].task = task;
+    job_count++;
+    pthread_mutex_unlock(&startup_mutex);
+    return 0;
+}
+
+// One line with the time each stage finished, in ms since startup_begin
+static void log_trace(void) {
+    char trace[STARTUP_TRACE_SIZE];
+    size_t used = 0;
+    
+    pthread_mutex_lock(&startup_mutex);
+    trace[0] = '\0';
+    for (int i = 0; i < mark_count && used < sizeof(trace); i++) {
+        int written = snprintf(trace + used, sizeof(trace) - used, "%s%s %u.%u ms", i > 0 ? ", " : "",
+                               marks[i].stage, marks[i].us / 1000, marks[i].us % 1000 / 100);
+        if (written < 0) {
+            break;
+        }
+        used += (size_t)written;
+    }
+    pthread_mutex_unlock(&startup_mutex);
+    
+    syslog(LOG_INFO, "Startup: %s", trace);
+}
+
+// Written under a temporary name and renamed, so a reader never sees half a file
+static void write_ready_file(void) {
+    if (!ready_path[0]) {
+        return;
+    }
+    
+    char temp[sizeof(ready_path) + 8];
+    snprintf(temp, sizeof(temp), "%s.tmp", ready_path);
+    FILE *file = fopen(temp, "w");
+    if (!file) {
+        syslog(LOG_WARNING, "Cannot write %s", temp);
+        return;
+    }
+    fprintf(file, "%d\n", (int)getpid());
+    if (fclose(file) != 0 || rename(temp, ready_path) != 0) {
+        syslog(LOG_WARNING, "Cannot write %s", ready_path);
+        unlink(temp);
+    }
+}
+
+// The sd_notify datagram, without linking libsystemd
+static void notify_socket(void) {
+    const char *path = getenv("NOTIFY_SOCKET");
+    if (!path || !path[0]) {
+        return;
+    }
+    
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    size_t length = strlen(path);
+    if (length >= sizeof(addr.sun_path)) {
+        return;
+    }
+    memcpy(addr.sun_path, path, length);
+    if (addr.sun_path[0] == '@') {
+        addr.sun_path[0] = '\0';        // abstract namespace
+    }
+    
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return;
+    }
+    static const char message[] = "READY=1";
+    sendto(fd, message, sizeof(message) - 1, MSG_NOSIGNAL, (struct sockaddr *)&addr,
+           (socklen_t)(offsetof(struct sockaddr_un, sun_path) + length));
+    close(fd);
+}
+
+static void* background_func(void *arg) {
+    (void)arg;
+    thread_policy_apply(THREAD_ROLE_CONTROL);
+    
+    for (int i = 0; i < job_count; i++) {
+        if (jobs[i].task() != 0) {
+            syslog(LOG_ERR, "Startup stage %s failed", jobs[i].stage);
+            __atomic_store_n(&failed, true, __ATOMIC_RELEASE);
+            return NULL;
+        }
+        startup_mark(jobs[i].stage);
+    }
+    
+    startup_mark("ready");
+    write_ready_file();
+    notify_socket();
+    __atomic_store_n(&ready, true, __ATOMIC_RELEASE);
+    log_trace();
+    return NULL;
+}
+
+int startup_run(const char *ready_file) {
+    pthread_mutex_lock(&startup_mutex);
+    if (background_joinable) {
+        pthread_mutex_unlock(&startup_mutex);
+        return -1;
+    }
+    snprintf(ready_path, sizeof(ready_path), "%s", ready_file ? ready_file : "");
+    if (ready_path[0]) {
+        unlink(ready_path);
+    }
+    
+    // Jobs are fixed from here on, the thread reads them without the lock
+    if (pthread_create(&background_thread, thread_policy_attr(), background_func, NULL) != 0) {
+        pthread_mutex_unlock(&startup_mutex);
+        syslog(LOG_ERR, "Failed to create startup thread");
+        return -1;
+    }
+    background_joinable = true;
+    pthread_mutex_unlock(&startup_mutex);
+    return 0;
+}
+
+bool startup_failed(void) {
+    return __atomic_load_n(&failed, __ATOMIC_ACQUIRE);
+}
+
+bool startup_is_ready(void) {
+    return __atomic_load_n(&ready, __ATOMIC_ACQUIRE);
+}
+
+void startup_cleanup(void) {
+    pthread_mutex_lock(&startup_mutex);
+    bool join = background_joinable;
+    background_joinable = false;
+    pthread_mutex_unlock(&startup_mutex);
+    
+    if (join) {
+        pthread_join(background_thread, NULL);
+    }
+    if (ready_path[0]) {
+        unlink(ready_path);
+        ready_path[0] = '\0';
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef STARTUP_H
+#define STARTUP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define STARTUP_READY_FILE "/var/run/airplay2-lite.ready"
+#define STARTUP_MAX_MARKS 16
+#define STARTUP_MAX_TASKS 4
+
+// Work that can wait until the daemon listens, returns 0 or -1
+typedef int (*startup_task_t)(void);
+
+// Trace: begin takes the time origin, each mark the time a stage finished
+void startup_begin(void);
+void startup_mark(const char *stage);
+
+// Tasks run in order on one background thread started by startup_run.
+// When all succeed the trace is logged and readiness is announced: the
+// ready file is written, and READY=1 sent to $NOTIFY_SOCKET if set.
+int startup_defer(const char *stage, startup_task_t task);
+int startup_run(const char *ready_file);
+
+// True once a task has failed, the daemon cannot serve without it
+bool startup_failed(void);
+bool startup_is_ready(void);
+
+// Waits for the background thread and removes the ready file
+void startup_cleanup(void);
+
+#endif // STARTUP_H
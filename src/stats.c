@@ -0,0 +1,253 @@
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#define SUB_BUCKETS (1 << STATS_SUB_BUCKET_BITS)
+#define MAX_TRACKED_NS 0xFFFFFFFFU
+
+static const char *stage_names[STATS_STAGE_COUNT] = {
+    "receive", "decrypt", "decode", "dsp", "jitter_wait", "volume", "alsa_write", "gap",
+    "wake_idle", "wake_suspended", "wake_closed"
+};
+
+static const char *counter_names[STATS_COUNTER_COUNT] = {
+    "packets", "kilobytes", "underruns", "late_drops", "decrypt_errors", "decode_errors", "resends",
+    "sink_drops"
+};
+
+static const char *gauge_names[STATS_GAUGE_COUNT] = {
+    "ring_fill", "ring_size", "pool_pages", "power_state"
+};
+
+// Recording works before init, it just lands in process memory
+static stats_block_t private_block;
+static stats_block_t *block = &private_block;
+static char block_path[128];
+static bool block_mapped = false;
+
+int stats_init(const char *path) {
+    memset(&private_block, 0, sizeof(private_block));
+    block = &private_block;
+    block_mapped = false;
+    block_path[0] = '\0';
+    
+    if (path) {
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0 && ftruncate(fd, sizeof(stats_block_t)) == 0) {
+            void *map = mmap(NULL, sizeof(stats_block_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (map != MAP_FAILED) {
+                block = (stats_block_t *)map;
+                block_mapped = true;
+                snprintf(block_path, sizeof(block_path), "%s", path);
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (!block_mapped) {
+            syslog(LOG_WARNING, "Stats not shared, cannot map %s", path);
+        }
+    }
+    
+    memset(block, 0, sizeof(*block));
+    block->magic = STATS_MAGIC;
+    block->version = STATS_VERSION;
+    block->start_ns = stats_now();
+    
+    syslog(LOG_INFO, "Stats initialized");
+    return 0;
+}
+
+void stats_cleanup(void) {
+    if (block_mapped) {
+        stats_block_t *mapped = block;
+        block = &private_block;
+        munmap(mapped, sizeof(stats_block_t));
+        unlink(block_path);
+        block_mapped = false;
+    }
+}
+
+uint64_t stats_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int bucket_index(uint32_t ns) {
+    if (ns < SUB_BUCKETS) {
+        return (int)ns;
+    }
+    
+    int magnitude = 31 - __builtin_clz(ns);
+    int sub = (int)(ns >> (magnitude - STATS_SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+    return (magnitude - STATS_SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+// Lower bound of a bucket, inverse of bucket_index
+static uint64_t bucket_value(int index) {
+    if (index < SUB_BUCKETS) {
+        return (uint64_t)index;
+    }
+    
+    int magnitude = index / SUB_BUCKETS + STATS_SUB_BUCKET_BITS - 1;
+    uint64_t sub = index % SUB_BUCKETS;
+    return (SUB_BUCKETS + sub) << (magnitude - STATS_SUB_BUCKET_BITS);
+}
+
+void stats_record_value(stats_stage_t stage, uint64_t ns) {
+    if ((unsigned int)stage >= STATS_STAGE_COUNT) {
+        return;
+    }
+    if (ns > MAX_TRACKED_NS) {
+        ns = MAX_TRACKED_NS;
+    }
+    
+    stats_histogram_t *histogram = &block->stages[stage];
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->buckets[bucket_index((uint32_t)ns)], 1, __ATOMIC_RELAXED);
+    
+    uint32_t max = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+    while (ns > max &&
+           !__atomic_compare_exchange_n(&histogram->max_ns, &max, (uint32_t)ns, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void stats_record(stats_stage_t stage, uint64_t start_ns) {
+    uint64_t now = stats_now();
+    stats_record_value(stage, now > start_ns ? now - start_ns : 0);
+}
+
+void stats_add(stats_counter_t counter, uint32_t value) {
+    if ((unsigned int)counter < STATS_COUNTER_COUNT) {
+        __atomic_fetch_add(&block->counters[counter], value, __ATOMIC_RELAXED);
+    }
+}
+
+void stats_increment(stats_counter_t counter) {
+    stats_add(counter, 1);
+}
+
+void stats_set_gauge(stats_gauge_t gauge, uint32_t value) {
+    if ((unsigned int)gauge < STATS_GAUGE_COUNT) {
+        __atomic_store_n(&block->gauges[gauge], value, __ATOMIC_RELAXED);
+    }
+}
+
+uint32_t stats_get_count(stats_stage_t stage) {
+    if ((unsigned int)stage >= STATS_STAGE_COUNT) {
+        return 0;
+    }
+    return __atomic_load_n(&block->stages[stage].count, __ATOMIC_RELAXED);
+}
+
+uint32_t stats_get_counter(stats_counter_t counter) {
+    if ((unsigned int)counter >= STATS_COUNTER_COUNT) {
+        return 0;
+    }
+    return __atomic_load_n(&block->counters[counter], __ATOMIC_RELAXED);
+}
+
+uint64_t stats_get_percentile(stats_stage_t stage, double percentile) {
+    if ((unsigned int)stage >= STATS_STAGE_COUNT) {
+        return 0;
+    }
+    
+    const stats_histogram_t *histogram = &block->stages[stage];
+    uint64_t count = 0;
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        count += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+    }
+    if (count == 0) {
+        return 0;
+    }
+    
+    uint64_t target = (uint64_t)(count * percentile / 100.0);
+    if (target == 0) {
+        target = 1;
+    }
+    
+    uint64_t seen = 0;
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        seen += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+        if (seen >= target) {
+            return bucket_value(i);
+        }
+    }
+    return __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+}
+
+// Taken from the histogram, so there is no running total to overflow
+uint64_t stats_get_mean(stats_stage_t stage) {
+    if ((unsigned int)stage >= STATS_STAGE_COUNT) {
+        return 0;
+    }
+    
+    const stats_histogram_t *histogram = &block->stages[stage];
+    uint64_t count = 0;
+    uint64_t total = 0;
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        uint32_t bucket = __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+        count += bucket;
+        total += bucket * bucket_value(i);
+    }
+    return count ? total / count : 0;
+}
+
+int stats_format_json(char *buffer, size_t size) {
+    if (!buffer || size == 0) {
+        return -1;
+    }
+    
+    size_t length = 0;
+    int written;
+
+#define APPEND(...) \
+    do { \
+        written = snprintf(buffer + length, size - length, __VA_ARGS__); \
+        if (written < 0 || (size_t)written >= size - length) { \
+            return -1; \
+        } \
+        length += written; \
+    } while (0)
+    
+    APPEND("{\"uptime_ms\":%llu,\"stages\":{",
+           (unsigned long long)((stats_now() - block->start_ns) / 1000000ULL));
+    for (int i = 0; i < STATS_STAGE_COUNT; i++) {
+        const stats_histogram_t *histogram = &block->stages[i];
+        APPEND("%s\"%s\":{\"count\":%u,\"mean_us\":%llu,\"p50_us\":%llu,\"p99_us\":%llu,"
+               "\"p999_us\":%llu,\"max_us\":%u}",
+               i > 0 ? "," : "", stage_names[i],
+               __atomic_load_n(&histogram->count, __ATOMIC_RELAXED),
+               (unsigned long long)(stats_get_mean(i) / 1000),
+               (unsigned long long)(stats_get_percentile(i, 50.0) / 1000),
+               (unsigned long long)(stats_get_percentile(i, 99.0) / 1000),
+               (unsigned long long)(stats_get_percentile(i, 99.9) / 1000),
+               __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED) / 1000);
+    }
+    
+    APPEND("},\"counters\":{");
+    for (int i = 0; i < STATS_COUNTER_COUNT; i++) {
+        APPEND("%s\"%s\":%u", i > 0 ? "," : "", counter_names[i],
+               __atomic_load_n(&block->counters[i], __ATOMIC_RELAXED));
+    }
+    
+    APPEND("},\"gauges\":{");
+    for (int i = 0; i < STATS_GAUGE_COUNT; i++) {
+        APPEND("%s\"%s\":%u", i > 0 ? "," : "", gauge_names[i],
+               __atomic_load_n(&block->gauges[i], __ATOMIC_RELAXED));
+    }
+    APPEND("}}\n");
+
+#undef APPEND
+    
+    return (int)length;
+}
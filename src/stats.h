@@ -0,0 +1,90 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define STATS_DEFAULT_PATH "/dev/shm/airplay2-lite.stats"
+#define STATS_MAGIC 0x41503253  // "AP2S"
+#define STATS_VERSION 5
+
+// Log-linear latency histogram: 8 sub-buckets per power of two (12.5%
+// resolution) from 1ns up to ~4.3s. Every field is 32 bits wide so the
+// atomics stay lock-free on MIPS32 without libatomic.
+#define STATS_SUB_BUCKET_BITS 3
+#define STATS_HISTOGRAM_BUCKETS 256
+
+// Pipeline stages with latency histograms
+typedef enum {
+    STATS_STAGE_RECEIVE = 0,
+    STATS_STAGE_DECRYPT,
+    STATS_STAGE_DECODE,
+    STATS_STAGE_DSP,
+    STATS_STAGE_JITTER_WAIT,
+    STATS_STAGE_VOLUME,
+    STATS_STAGE_ALSA_WRITE,
+    STATS_STAGE_GAP,                // silence between audio while the output stays open
+    STATS_STAGE_WAKE_IDLE,          // time to first sound, by the output power state
+    STATS_STAGE_WAKE_SUSPENDED,
+    STATS_STAGE_WAKE_CLOSED,
+    STATS_STAGE_COUNT
+} stats_stage_t;
+
+// Event counters
+typedef enum {
+    STATS_COUNTER_PACKETS = 0,
+    STATS_COUNTER_KILOBYTES,
+    STATS_COUNTER_UNDERRUNS,
+    STATS_COUNTER_LATE_DROPS,
+    STATS_COUNTER_DECRYPT_ERRORS,
+    STATS_COUNTER_DECODE_ERRORS,
+    STATS_COUNTER_RESENDS,
+    STATS_COUNTER_SINK_DROPS,       // frames an output sink could not take
+    STATS_COUNTER_COUNT
+} stats_counter_t;
+
+// Last-value gauges
+typedef enum {
+    STATS_GAUGE_RING_FILL = 0,
+    STATS_GAUGE_RING_SIZE,
+    STATS_GAUGE_POOL_PAGES,
+    STATS_GAUGE_POWER_STATE,        // power_state_t of the output
+    STATS_GAUGE_COUNT
+} stats_gauge_t;
+
+typedef struct {
+    uint32_t count;
+    uint32_t max_ns;
+    uint32_t buckets[STATS_HISTOGRAM_BUCKETS];
+} stats_histogram_t;
+
+// Layout of the shared memory block, readers check magic and version
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t start_ns;
+    stats_histogram_t stages[STATS_STAGE_COUNT];
+    uint32_t counters[STATS_COUNTER_COUNT];
+    uint32_t gauges[STATS_GAUGE_COUNT];
+} stats_block_t;
+
+// Lifecycle, path NULL keeps the counters private to the process
+int stats_init(const char *path);
+void stats_cleanup(void);
+
+// Hot path: relaxed atomics only, safe from any thread
+uint64_t stats_now(void);
+void stats_record(stats_stage_t stage, uint64_t start_ns);
+void stats_record_value(stats_stage_t stage, uint64_t ns);
+void stats_add(stats_counter_t counter, uint32_t value);
+void stats_increment(stats_counter_t counter);
+void stats_set_gauge(stats_gauge_t gauge, uint32_t value);
+
+// Reporting
+uint32_t stats_get_count(stats_stage_t stage);
+uint32_t stats_get_counter(stats_counter_t counter);
+uint64_t stats_get_percentile(stats_stage_t stage, double percentile);
+uint64_t stats_get_mean(stats_stage_t stage);
+int stats_format_json(char *buffer, size_t size);
+
+#endif // STATS_H
@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+#include "thread_policy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#define PLAYOUT_FALLBACK_NICE -10
+#define BACKGROUND_NICE 10
+
+static pthread_mutex_t policy_mutex = PTHREAD_MUTEX_INITIALIZER;
+static thread_policy_config_t current_config;
+static bool is_initialized = false;
+static bool memory_locked = false;
+static bool any_pinned = false;
+static bool warned[THREAD_ROLE_COUNT];
+
+// Set up on first use, some threads start before thread_policy_init
+static pthread_once_t attr_once = PTHREAD_ONCE_INIT;
+static pthread_attr_t thread_attr;
+static bool attr_valid = false;
+
+static const char *role_names[THREAD_ROLE_COUNT] = {
+    "playout", "receive", "control", "background"
+};
+
+// Shown by top -H, the control role runs on the main thread and keeps its name
+static const char *thread_names[THREAD_ROLE_COUNT] = {
+    "ap2-playout", "ap2-receive", NULL, "ap2-background"
+};
+
+void thread_policy_get_defaults(thread_policy_config_t *config) {
+    if (!config) {
+        return;
+    }
+    
+    config->playout_scheduler = THREAD_SCHEDULER_FIFO;
+    config->playout_priority = THREAD_POLICY_DEFAULT_PRIORITY;
+    config->receive_nice = THREAD_POLICY_DEFAULT_RECEIVE_NICE;
+    config->lock_memory = true;
+    for (int i = 0; i < THREAD_ROLE_COUNT; i++) {
+        config->cpu[i] = THREAD_POLICY_NO_CPU;
+    }
+}
+
+int thread_policy_parse_scheduler(const char *name, thread_scheduler_t *scheduler) {
+    if (!name || !scheduler) {
+        return -1;
+    }
+    
+    if (strcmp(name, "fifo") == 0) {
+        *scheduler = THREAD_SCHEDULER_FIFO;
+    } else if (strcmp(name, "rr") == 0) {
+        *scheduler = THREAD_SCHEDULER_RR;
+    } else if (strcmp(name, "other") == 0 || strcmp(name, "off") == 0) {
+        *scheduler = THREAD_SCHEDULER_OTHER;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int thread_policy_init(const thread_policy_config_t *config) {
+    pthread_mutex_lock(&policy_mutex);
+    
+    if (config) {
+        current_config = *config;
+    } else {
+        thread_policy_get_defaults(&current_config);
+    }
+    
+    int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    any_pinned = false;
+    for (int i = 0; i < THREAD_ROLE_COUNT; i++) {
+        if (current_config.cpu[i] >= cpus) {
+            syslog(LOG_WARNING, "CPU %d not online, %s threads left unpinned",
+                   current_config.cpu[i], role_names[i]);
+            current_config.cpu[i] = THREAD_POLICY_NO_CPU;
+        }
+        if (current_config.cpu[i] != THREAD_POLICY_NO_CPU) {
+            any_pinned = true;
+        }
+        warned[i] = false;
+    }
+    
+    // Page faults in the playout path would undo the realtime priority
+    if (current_config.lock_memory && !memory_locked) {
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0) {
+            memory_locked = true;
+        } else {
+            syslog(LOG_WARNING, "Cannot lock memory: %s", strerror(errno));
+        }
+    }
+    
+    is_initialized = true;
+    pthread_mutex_unlock(&policy_mutex);
+    
+    syslog(LOG_INFO, "Thread policy initialized (%s priority %d, receive nice %d, memory %s)",
+           current_config.playout_scheduler == THREAD_SCHEDULER_FIFO ? "fifo" :
+           current_config.playout_scheduler == THREAD_SCHEDULER_RR ? "rr" : "other",
+           current_config.playout_priority, current_config.receive_nice,
+           memory_locked ? "locked" : "unlocked");
+    
+    // The main thread handles control traffic
+    thread_policy_apply(THREAD_ROLE_CONTROL);
+    return 0;
+}
+
+void thread_policy_cleanup(void) {
+    pthread_mutex_lock(&policy_mutex);
+    
+    if (memory_locked) {
+        munlockall();
+        memory_locked = false;
+    }
+    is_initialized = false;
+    
+    pthread_mutex_unlock(&policy_mutex);
+}
+
+static void init_thread_attr(void) {
+    if (pthread_attr_init(&thread_attr) != 0) {
+        return;
+    }
+    if (pthread_attr_setstacksize(&thread_attr, THREAD_POLICY_STACK_SIZE) != 0) {
+        pthread_attr_destroy(&thread_attr);
+        return;
+    }
+    attr_valid = true;
+}
+
+// NULL, and so the default stack, only if the attributes could not be set up
+const pthread_attr_t* thread_policy_attr(void) {
+    pthread_once(&attr_once, init_thread_attr);
+    return attr_valid ? &thread_attr : NULL;
+}
+
+static int set_thread_nice(int nice) {
+    // On Linux the nice value of a tid applies to that thread alone
+    pid_t tid = (pid_t)syscall(SYS_gettid);
+    return setpriority(PRIO_PROCESS, tid, nice);
+}
+
+static int set_thread_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    
+    // Unpinned threads may run anywhere, even when their creator was pinned
+    if (cpu == THREAD_POLICY_NO_CPU) {
+        int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        for (int i = 0; i < cpus && i < CPU_SETSIZE; i++) {
+            CPU_SET(i, &set);
+        }
+    } else {
+        CPU_SET(cpu, &set);
+    }
+    
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void warn_once(thread_role_t role, const char *what, int error) {
+    pthread_mutex_lock(&policy_mutex);
+    bool first = !warned[role];
+    warned[role] = true;
+    pthread_mutex_unlock(&policy_mutex);
+    
+    if (first) {
+        syslog(LOG_WARNING, "Cannot set %s for %s thread: %s", what, role_names[role], strerror(error));
+    }
+}
+
+int thread_policy_apply(thread_role_t role) {
+    if ((unsigned int)role >= THREAD_ROLE_COUNT) {
+        return -1;
+    }
+    
+    if (thread_names[role]) {
+        pthread_setname_np(pthread_self(), thread_names[role]);
+    }
+    
+    pthread_mutex_lock(&policy_mutex);
+    if (!is_initialized) {
+        pthread_mutex_unlock(&policy_mutex);
+        return 0;
+    }
+    thread_policy_config_t config = current_config;
+    bool pin = any_pinned;
+    pthread_mutex_unlock(&policy_mutex);
+    
+    int result = 0;
+    int error;
+    
+    switch (role) {
+        case THREAD_ROLE_PLAYOUT:
+            if (config.playout_scheduler != THREAD_SCHEDULER_OTHER) {
+                struct sched_param param;
+                memset(&param, 0, sizeof(param));
+                param.sched_priority = config.playout_priority;
+                int policy = config.playout_scheduler == THREAD_SCHEDULER_RR ? SCHED_RR : SCHED_FIFO;
+                
+                error = pthread_setschedparam(pthread_self(), policy, &param);
+                if (error == 0) {
+                    break;
+                }
+                warn_once(role, "realtime scheduling", error);
+            }
+            // Without CAP_SYS_NICE a lower nice value may still be allowed by RLIMIT_NICE
+            if (set_thread_nice(PLAYOUT_FALLBACK_NICE) != 0) {
+                error = errno;
+                warn_once(role, "nice value", error);
+                result = -1;
+            }
+            break;
+        
+        case THREAD_ROLE_RECEIVE:
+            if (set_thread_nice(config.receive_nice) != 0) {
+                error = errno;
+                warn_once(role, "nice value", error);
+                result = -1;
+            }
+            break;
+        
+        case THREAD_ROLE_BACKGROUND:
+            set_thread_nice(BACKGROUND_NICE);
+            break;
+        
+        default:
+            break;
+    }
+    
+    if (pin) {
+        error = set_thread_cpu(config.cpu[role]);
+        if (error != 0) {
+            warn_once(role, "CPU affinity", error);
+            result = -1;
+        }
+    }
+    
+    return result;
+}
@@ -0,0 +1,49 @@
+#ifndef THREAD_POLICY_H
+#define THREAD_POLICY_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#define THREAD_POLICY_DEFAULT_PRIORITY 50
+#define THREAD_POLICY_DEFAULT_RECEIVE_NICE -5
+#define THREAD_POLICY_NO_CPU -1
+#define THREAD_POLICY_STACK_SIZE (256 * 1024)
+
+// What a thread does decides how it is scheduled
+typedef enum {
+    THREAD_ROLE_PLAYOUT = 0,    // ALSA writes, SCHED_FIFO/RR when allowed
+    THREAD_ROLE_RECEIVE,        // network audio receive, raised nice
+    THREAD_ROLE_CONTROL,        // RTSP, discovery, pairing, normal priority
+    THREAD_ROLE_BACKGROUND,     // log draining and other housekeeping
+    THREAD_ROLE_COUNT
+} thread_role_t;
+
+typedef enum {
+    THREAD_SCHEDULER_OTHER = 0,
+    THREAD_SCHEDULER_FIFO,
+    THREAD_SCHEDULER_RR
+} thread_scheduler_t;
+
+typedef struct {
+    thread_scheduler_t playout_scheduler;
+    int playout_priority;
+    int receive_nice;
+    bool lock_memory;
+    int cpu[THREAD_ROLE_COUNT];     // THREAD_POLICY_NO_CPU leaves the thread unpinned
+} thread_policy_config_t;
+
+void thread_policy_get_defaults(thread_policy_config_t *config);
+int thread_policy_parse_scheduler(const char *name, thread_scheduler_t *scheduler);
+
+// Lifecycle, init locks memory when configured
+int thread_policy_init(const thread_policy_config_t *config);
+void thread_policy_cleanup(void);
+
+// Called by each thread on itself, falls back quietly without CAP_SYS_NICE
+int thread_policy_apply(thread_role_t role);
+
+// Passed to every pthread_create, so with memory locked each thread pins
+// THREAD_POLICY_STACK_SIZE of stack rather than the 8 MiB default
+const pthread_attr_t* thread_policy_attr(void);
+
+#endif // THREAD_POLICY_H
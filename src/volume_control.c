@@ -1,8 +1,12 @@
 #include "volume_control.h"
 #include "audio_output.h"
+#include "volume_map.h"
+#include "thread_policy.h"
+#include "logger.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <syslog.h>
 #include <pthread.h>
 
@@ -10,141 +14,197 @@
 #define MIN_VOLUME 0.0f
 #define MAX_VOLUME 1.0f
 
-static pthread_mutex_t volume_mutex = PTHREAD_MUTEX_INITIALIZER;
-static float current_volume = 0.5f;
-static bool is_muted = false;
-static volume_change_callback_t volume_callback = NULL;
+struct volume_control {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    audio_output_t *output;
+    float current_volume;
+    bool is_muted;
+    volume_change_callback_t callback;
+    void *callback_userdata;
+    
+    // Latest output level and its request number, both under the mutex.
+    // Requests overwrite it, the apply thread takes whatever is newest, so
+    // a burst of slider updates collapses into one.
+    float requested_level;
+    uint32_t request_generation;
+    pthread_t apply_thread;
+    bool apply_running;
+    uint32_t apply_interval_us;
+};
 
-int volume_control_init(void) {
-    pthread_mutex_lock(&volume_mutex);
-    
-    current_volume = 0.5f;
-    is_muted = false;
-    
-    pthread_mutex_unlock(&volume_mutex);
-    
-    syslog(LOG_INFO, "Volume control initialized");
-    return 0;
+static void publish_locked(volume_control_t *volume) {
+    volume->requested_level = volume->is_muted ? 0.0f : volume->current_volume;
+    volume->request_generation++;
+    pthread_cond_signal(&volume->cond);
 }
 
-int volume_control_cleanup(void) {
-    pthread_mutex_lock(&volume_mutex);
-    
-    volume_callback = NULL;
-    
-    pthread_mutex_unlock(&volume_mutex);
+// Output, callback and logging happen here, at most once per interval
+static void* apply_thread_func(void *arg) {
+    volume_control_t *volume = arg;
+    uint32_t applied = 0;
+    
+    thread_policy_apply(THREAD_ROLE_CONTROL);
+    
+    pthread_mutex_lock(&volume->mutex);
+    while (volume->apply_running) {
+        if (volume->request_generation == applied) {
+            pthread_cond_wait(&volume->cond, &volume->mutex);
+            continue;
+        }
+        
+        applied = volume->request_generation;
+        float level = volume->requested_level;
+        float position = volume->current_volume;
+        bool muted = volume->is_muted;
+        volume_change_callback_t callback = volume->callback;
+        void *userdata = volume->callback_userdata;
+        pthread_mutex_unlock(&volume->mutex);
+        
+        audio_output_set_volume(volume->output, level);
+        if (callback) {
+            callback(position, muted, userdata);
+        }
+        logger_log(LOG_DEBUG, "Volume %.2f%s applied", position, muted ? " (muted)" : "");
+        
+        // Requests arriving meanwhile only replace the slot
+        uint32_t interval_us = __atomic_load_n(&volume->apply_interval_us, __ATOMIC_RELAXED);
+        if (interval_us > 0) {
+            usleep(interval_us);
+        }
+        pthread_mutex_lock(&volume->mutex);
+    }
+    pthread_mutex_unlock(&volume->mutex);
     
-    syslog(LOG_INFO, "Volume control cleaned up");
-    return 0;
+    return NULL;
 }
 
-int volume_control_set_volume(float volume) {
-    if (volume < MIN_VOLUME || volume > MAX_VOLUME) {
-        return -1;
+volume_control_t* volume_control_create(audio_output_t *output, uint32_t rate_hz) {
+    volume_control_t *volume = calloc(1, sizeof(volume_control_t));
+    if (!volume) {
+        return NULL;
     }
     
-    pthread_mutex_lock(&volume_mutex);
-    
-    current_volume = volume;
-    
-    // Apply volume to audio output
-    audio_output_set_volume(is_muted ? 0.0f : current_volume);
+    pthread_mutex_init(&volume->mutex, NULL);
+    pthread_cond_init(&volume->cond, NULL);
+    volume->output = output;
+    volume->current_volume = 0.5f;
+    volume->apply_interval_us = rate_hz > 0 ? 1000000 / rate_hz : 0;
+    audio_output_set_volume_ramp(output, volume->apply_interval_us / 1000);
+    volume->apply_running = true;
+    
+    if (pthread_create(&volume->apply_thread, thread_policy_attr(), apply_thread_func, volume) != 0) {
+        syslog(LOG_ERR, "Failed to create volume thread");
+        pthread_cond_destroy(&volume->cond);
+        pthread_mutex_destroy(&volume->mutex);
+        free(volume);
+        return NULL;
+    }
     
-    // Notify callback
-    if (volume_callback) {
-        volume_callback(current_volume, is_muted);
+    syslog(LOG_INFO, "Volume control created, up to %u updates per second", rate_hz);
+    return volume;
+}
+
+void volume_control_destroy(volume_control_t *volume) {
+    if (!volume) {
+        return;
     }
     
-    pthread_mutex_unlock(&volume_mutex);
+    pthread_mutex_lock(&volume->mutex);
+    volume->apply_running = false;
+    volume->callback = NULL;
+    pthread_cond_signal(&volume->cond);
+    pthread_mutex_unlock(&volume->mutex);
     
-    syslog(LOG_DEBUG, "Volume set to %.2f", volume);
+    pthread_join(volume->apply_thread, NULL);
+    pthread_cond_destroy(&volume->cond);
+    pthread_mutex_destroy(&volume->mutex);
+    free(volume);
+}
+
+int volume_control_set_rate(volume_control_t *volume, uint32_t rate_hz) {
+    uint32_t interval_us = rate_hz > 0 ? 1000000 / rate_hz : 0;
+    __atomic_store_n(&volume->apply_interval_us, interval_us, __ATOMIC_RELAXED);
+    audio_output_set_volume_ramp(volume->output, interval_us / 1000);
     return 0;
 }
 
-float volume_control_get_volume(void) {
-    pthread_mutex_lock(&volume_mutex);
-    float volume = current_volume;
-    pthread_mutex_unlock(&volume_mutex);
-    return volume;
+// Same level again, for when the volume map or mixer behind it changed
+int volume_control_reapply(volume_control_t *volume) {
+    pthread_mutex_lock(&volume->mutex);
+    publish_locked(volume);
+    pthread_mutex_unlock(&volume->mutex);
+    return 0;
 }
 
-int volume_control_set_mute(bool mute) {
-    pthread_mutex_lock(&volume_mutex);
-    
-    is_muted = mute;
-    
-    // Apply mute to audio output
-    audio_output_set_volume(is_muted ? 0.0f : current_volume);
-    
-    // Notify callback
-    if (volume_callback) {
-        volume_callback(current_volume, is_muted);
+int volume_control_set_volume(volume_control_t *volume, float position) {
+    if (position < MIN_VOLUME || position > MAX_VOLUME) {
+        return -1;
     }
     
-    pthread_mutex_unlock(&volume_mutex);
-    
-    syslog(LOG_DEBUG, "Mute %s", mute ? "enabled" : "disabled");
+    pthread_mutex_lock(&volume->mutex);
+    volume->current_volume = position;
+    publish_locked(volume);
+    pthread_mutex_unlock(&volume->mutex);
     return 0;
 }
 
-bool volume_control_is_muted(void) {
-    pthread_mutex_lock(&volume_mutex);
-    bool muted = is_muted;
-    pthread_mutex_unlock(&volume_mutex);
+int volume_control_set_airplay_volume(volume_control_t *volume, float db) {
+    // -144 is AirPlay's mute, it stops at 0 rather than toggling mute
+    return volume_control_set_volume(volume, volume_map_from_airplay(db));
+}
+
+float volume_control_get_volume(volume_control_t *volume) {
+    pthread_mutex_lock(&volume->mutex);
+    float position = volume->current_volume;
+    pthread_mutex_unlock(&volume->mutex);
+    return position;
+}
+
+int volume_control_set_mute(volume_control_t *volume, bool mute) {
+    pthread_mutex_lock(&volume->mutex);
+    volume->is_muted = mute;
+    publish_locked(volume);
+    pthread_mutex_unlock(&volume->mutex);
+    return 0;
+}
+
+bool volume_control_is_muted(volume_control_t *volume) {
+    pthread_mutex_lock(&volume->mutex);
+    bool muted = volume->is_muted;
+    pthread_mutex_unlock(&volume->mutex);
     return muted;
 }
 
-int volume_control_step_up(void) {
-    pthread_mutex_lock(&volume_mutex);
+int volume_control_step(volume_control_t *volume, int steps) {
+    pthread_mutex_lock(&volume->mutex);
     
-    float new_volume = current_volume + VOLUME_STEP;
+    float new_volume = volume->current_volume + steps * VOLUME_STEP;
     if (new_volume > MAX_VOLUME) {
         new_volume = MAX_VOLUME;
+    } else if (new_volume < MIN_VOLUME) {
+        new_volume = MIN_VOLUME;
     }
     
-    current_volume = new_volume;
-    
-    // Apply volume to audio output
-    audio_output_set_volume(is_muted ? 0.0f : current_volume);
-    
-    // Notify callback
-    if (volume_callback) {
-        volume_callback(current_volume, is_muted);
-    }
-    
-    pthread_mutex_unlock(&volume_mutex);
+    volume->current_volume = new_volume;
+    publish_locked(volume);
     
-    syslog(LOG_DEBUG, "Volume stepped up to %.2f", current_volume);
+    pthread_mutex_unlock(&volume->mutex);
     return 0;
 }
 
-int volume_control_step_down(void) {
-    pthread_mutex_lock(&volume_mutex);
-    
-    float new_volume = current_volume - VOLUME_STEP;
-    if (new_volume < MIN_VOLUME) {
-        new_volume = MIN_VOLUME;
-    }
-    
-    current_volume = new_volume;
-    
-    // Apply volume to audio output
-    audio_output_set_volume(is_muted ? 0.0f : current_volume);
-    
-    // Notify callback
-    if (volume_callback) {
-        volume_callback(current_volume, is_muted);
-    }
-    
-    pthread_mutex_unlock(&volume_mutex);
-    
-    syslog(LOG_DEBUG, "Volume stepped down to %.2f", current_volume);
-    return 0;
+int volume_control_step_up(volume_control_t *volume) {
+    return volume_control_step(volume, 1);
+}
+
+int volume_control_step_down(volume_control_t *volume) {
+    return volume_control_step(volume, -1);
 }
 
-int volume_control_set_callback(volume_change_callback_t callback) {
-    pthread_mutex_lock(&volume_mutex);
-    volume_callback = callback;
-    pthread_mutex_unlock(&volume_mutex);
+int volume_control_set_callback(volume_control_t *volume, volume_change_callback_t callback, void *userdata) {
+    pthread_mutex_lock(&volume->mutex);
+    volume->callback = callback;
+    volume->callback_userdata = userdata;
+    pthread_mutex_unlock(&volume->mutex);
     return 0;
 }
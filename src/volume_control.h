@@ -3,19 +3,33 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "audio_output.h"
 
-// Volume control functions
-int volume_control_init(void);
-int volume_control_cleanup(void);
-int volume_control_set_volume(float volume);
-float volume_control_get_volume(void);
-int volume_control_set_mute(bool mute);
-bool volume_control_is_muted(void);
-int volume_control_step_up(void);
-int volume_control_step_down(void);
+#define VOLUME_CONTROL_DEFAULT_RATE_HZ 20
+
+// The volume of one zone's output. Changes return at once and are applied
+// to the output by the zone's worker thread, at most rate_hz times per
+// second (0 no limit).
+typedef struct volume_control volume_control_t;
 
 // Volume change callback
-typedef void (*volume_change_callback_t)(float volume, bool muted);
-int volume_control_set_callback(volume_change_callback_t callback);
+typedef void (*volume_change_callback_t)(float volume, bool muted, void *userdata);
+
+// Volume control functions
+volume_control_t* volume_control_create(audio_output_t *output, uint32_t rate_hz);
+void volume_control_destroy(volume_control_t *volume);
+int volume_control_set_rate(volume_control_t *volume, uint32_t rate_hz);
+int volume_control_reapply(volume_control_t *volume);
+int volume_control_set_volume(volume_control_t *volume, float position);
+float volume_control_get_volume(volume_control_t *volume);
+
+// AirPlay volume in dB, -30 to 0 or -144 for mute
+int volume_control_set_airplay_volume(volume_control_t *volume, float db);
+int volume_control_set_mute(volume_control_t *volume, bool mute);
+bool volume_control_is_muted(volume_control_t *volume);
+int volume_control_step_up(volume_control_t *volume);
+int volume_control_step_down(volume_control_t *volume);
+int volume_control_step(volume_control_t *volume, int steps);     // negative steps lower the volume
+int volume_control_set_callback(volume_control_t *volume, volume_change_callback_t callback, void *userdata);
 
 #endif // VOLUME_CONTROL_H
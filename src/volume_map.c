@@ -0,0 +1,166 @@
+#include "volume_map.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#define AIRPLAY_SPAN_DB (-VOLUME_MAP_AIRPLAY_MIN_DB)
+
+static pthread_mutex_t map_mutex = PTHREAD_MUTEX_INITIALIZER;
+static volume_map_config_t current_config = { VOLUME_CURVE_DB, VOLUME_MAP_DEFAULT_RANGE_DB };
+
+// Target level per position in dB * 100, then split between mixer and gain
+static long target_db100[VOLUME_MAP_STEPS];
+static volume_map_entry_t entries[VOLUME_MAP_STEPS];
+static long mixer_min = 0;
+static long mixer_max = 0;
+static volume_map_quantize_t mixer_quantize = NULL;
+static void *mixer_userdata = NULL;
+
+void volume_map_get_defaults(volume_map_config_t *config) {
+    if (!config) {
+        return;
+    }
+    
+    config->curve = VOLUME_CURVE_DB;
+    config->range_db = VOLUME_MAP_DEFAULT_RANGE_DB;
+}
+
+int volume_map_parse_curve(const char *name, volume_curve_t *curve) {
+    if (!name || !curve) {
+        return -1;
+    }
+    
+    if (strcmp(name, "db") == 0) {
+        *curve = VOLUME_CURVE_DB;
+    } else if (strcmp(name, "cubic") == 0) {
+        *curve = VOLUME_CURVE_CUBIC;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static uint32_t gain_from_db100(long db100) {
+    return (uint32_t)lrint(pow(10.0, db100 / 2000.0) * VOLUME_MAP_GAIN_UNITY);
+}
+
+// Position 0 is silence, every other step is audible and never below -range
+static void build_targets_locked(void) {
+    double range = current_config.range_db;
+    
+    target_db100[0] = LONG_MIN;
+    for (int i = 1; i < VOLUME_MAP_STEPS; i++) {
+        double position = (double)i / (VOLUME_MAP_STEPS - 1);
+        double db = current_config.curve == VOLUME_CURVE_CUBIC ?
+                    60.0 * log10(position) : -range * (1.0 - position);
+        if (db < -range) {
+            db = -range;
+        }
+        target_db100[i] = lround(db * 100.0);
+    }
+}
+
+// The mixer takes what it can, software gain makes up the difference to the
+// exact target including the size of the mixer's steps
+static void build_entries_locked(void) {
+    entries[0].use_mixer = mixer_quantize != NULL;
+    entries[0].mixer_raw = 0;
+    entries[0].gain = 0;
+    entries[0].full_gain = 0;
+    if (mixer_quantize) {
+        mixer_quantize(mixer_min, &entries[0].mixer_raw, mixer_userdata);
+    }
+    
+    long ceiling = mixer_max < 0 ? mixer_max : 0;
+    for (int i = 1; i < VOLUME_MAP_STEPS; i++) {
+        volume_map_entry_t *entry = &entries[i];
+        long target = target_db100[i];
+        entry->use_mixer = false;
+        entry->mixer_raw = 0;
+        entry->gain = gain_from_db100(target);
+        entry->full_gain = entry->gain;
+        
+        if (mixer_quantize) {
+            long request = target < mixer_min ? mixer_min : target > ceiling ? ceiling : target;
+            long played = mixer_quantize(request, &entry->mixer_raw, mixer_userdata);
+            long remainder = target - played;
+            entry->use_mixer = true;
+            entry->gain = remainder < 0 ? gain_from_db100(remainder) : VOLUME_MAP_GAIN_UNITY;
+        }
+    }
+}
+
+int volume_map_init(const volume_map_config_t *config) {
+    pthread_mutex_lock(&map_mutex);
+    
+    if (config) {
+        current_config = *config;
+    } else {
+        volume_map_get_defaults(&current_config);
+    }
+    if (current_config.range_db < 1.0f) {
+        current_config.range_db = VOLUME_MAP_DEFAULT_RANGE_DB;
+    }
+    build_targets_locked();
+    build_entries_locked();
+    
+    pthread_mutex_unlock(&map_mutex);
+    
+    syslog(LOG_INFO, "Volume curve %s over %.0f dB",
+           current_config.curve == VOLUME_CURVE_CUBIC ? "cubic" : "db", current_config.range_db);
+    return 0;
+}
+
+void volume_map_cleanup(void) {
+    pthread_mutex_lock(&map_mutex);
+    mixer_quantize = NULL;
+    mixer_userdata = NULL;
+    build_entries_locked();
+    pthread_mutex_unlock(&map_mutex);
+}
+
+int volume_map_set_mixer(long min_db100, long max_db100, volume_map_quantize_t quantize,
+                         void *userdata) {
+    if (quantize && min_db100 >= max_db100) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&map_mutex);
+    mixer_min = min_db100;
+    mixer_max = max_db100;
+    mixer_quantize = quantize;
+    mixer_userdata = userdata;
+    build_entries_locked();
+    pthread_mutex_unlock(&map_mutex);
+    
+    if (quantize) {
+        syslog(LOG_INFO, "Volume mixer range %.2f to %.2f dB", min_db100 / 100.0, max_db100 / 100.0);
+    }
+    return 0;
+}
+
+float volume_map_from_airplay(float db) {
+    if (db <= VOLUME_MAP_AIRPLAY_MUTE_DB) {
+        return 0.0f;
+    }
+    
+    float position = (db + AIRPLAY_SPAN_DB) / AIRPLAY_SPAN_DB;
+    float quietest = 1.0f / (VOLUME_MAP_STEPS - 1);
+    return position < quietest ? quietest : position > 1.0f ? 1.0f : position;
+}
+
+int volume_map_lookup(float position, volume_map_entry_t *entry) {
+    if (!entry || position < 0.0f || position > 1.0f) {
+        return -1;
+    }
+    
+    int index = (int)(position * (VOLUME_MAP_STEPS - 1) + 0.5f);
+    pthread_mutex_lock(&map_mutex);
+    *entry = entries[index];
+    pthread_mutex_unlock(&map_mutex);
+    return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef VOLUME_MAP_H
+#define VOLUME_MAP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define VOLUME_MAP_STEPS 256
+#define VOLUME_MAP_AIRPLAY_MIN_DB -30.0f
+#define VOLUME_MAP_AIRPLAY_MUTE_DB -144.0f
+#define VOLUME_MAP_DEFAULT_RANGE_DB 60.0f
+#define VOLUME_MAP_GAIN_UNITY 65536         // software gain is Q16
+
+// How the slider position maps onto attenuation
+typedef enum {
+    VOLUME_CURVE_DB = 0,        // attenuation linear in dB across the range
+    VOLUME_CURVE_CUBIC          // amplitude follows position^3, gentler at the top
+} volume_curve_t;
+
+typedef struct {
+    volume_curve_t curve;
+    float range_db;             // attenuation at the lowest audible position
+} volume_map_config_t;
+
+// Precomputed level for one slider position
+typedef struct {
+    bool use_mixer;
+    long mixer_raw;             // mixer step, valid with use_mixer
+    uint32_t gain;              // software gain after the mixer, Q16
+    uint32_t full_gain;         // software gain alone, for outputs without the mixer
+} volume_map_entry_t;
+
+// Picks the quietest mixer step at or above db100 (dB * 100) and returns its level
+typedef long (*volume_map_quantize_t)(long db100, long *raw, void *userdata);
+
+void volume_map_get_defaults(volume_map_config_t *config);
+int volume_map_parse_curve(const char *name, volume_curve_t *curve);
+
+// Lifecycle, the tables are built here and whenever a mixer is attached
+int volume_map_init(const volume_map_config_t *config);
+void volume_map_cleanup(void);
+
+// Moves as much attenuation as the mixer range allows into the mixer, the
+// rest stays in software gain. min and max in dB * 100, quantize NULL
+// detaches the mixer.
+int volume_map_set_mixer(long min_db100, long max_db100, volume_map_quantize_t quantize,
+                         void *userdata);
+
+// Slider position 0.0-1.0 from AirPlay dB: -144 mutes, -30 is the quietest step
+float volume_map_from_airplay(float db);
+
+// Table lookup only, no math library calls
+int volume_map_lookup(float position, volume_map_entry_t *entry);
+
+#endif // VOLUME_MAP_H
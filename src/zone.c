@@ -0,0 +1,118 @@
+#include "zone.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+zone_t* zone_create(const zone_config_t *config) {
+    if (!config) {
+        return NULL;
+    }
+    
+    zone_t *zone = calloc(1, sizeof(zone_t));
+    if (!zone) {
+        return NULL;
+    }
+    zone->config = *config;
+    
+    // Output device and its playout thread, opened at the first RECORD
+    zone->output = audio_output_create();
+    if (!zone->output) {
+        syslog(LOG_ERR, "Failed to create audio output for %s", config->airplay.device_name);
+        zone_destroy(zone);
+        return NULL;
+    }
+    if (audio_output_set_buffer_size(zone->output, config->buffer_size) != 0) {
+        syslog(LOG_WARNING, "Invalid buffer size %zu, using %zu", config->buffer_size,
+               audio_output_get_buffer_size(zone->output));
+        zone->config.buffer_size = audio_output_get_buffer_size(zone->output);
+    }
+    
+    // The strings stay in the zone's copy of the configuration
+    audio_config_t audio_config;
+    audio_config.sample_rate = zone->config.sample_rate;
+    audio_config.channels = zone->config.channels;
+    audio_config.bits_per_sample = zone->config.bits_per_sample;
+    audio_config.backend = zone->config.output;
+    audio_config.device_name = zone->config.audio_device;
+    audio_config.use_hw_volume = zone->config.use_hw_volume;
+    if (audio_output_configure(zone->output, &audio_config) != 0) {
+        syslog(LOG_ERR, "Invalid audio output configuration for %s", config->airplay.device_name);
+        zone_destroy(zone);
+        return NULL;
+    }
+    
+    // Stream -> decoder -> DSP -> output
+    zone->dsp = dsp_chain_create();
+    zone->stream = buffered_audio_create_stream();
+    if (!zone->dsp || !zone->stream || dsp_chain_configure(zone->dsp, &config->dsp) != 0) {
+        syslog(LOG_ERR, "Failed to create audio pipeline for %s", config->airplay.device_name);
+        zone_destroy(zone);
+        return NULL;
+    }
+    zone->pipeline = audio_pipeline_create(zone->output, zone->dsp, zone->stream);
+    if (!zone->pipeline) {
+        syslog(LOG_ERR, "Failed to create audio pipeline for %s", config->airplay.device_name);
+        zone_destroy(zone);
+        return NULL;
+    }
+    
+    // Control: volume worker, the sender's remote and playback state
+    zone->volume = volume_control_create(zone->output, config->volume_rate);
+    zone->remote = dacp_client_create();
+    zone->playback = zone->remote ? playback_control_create(zone->remote) : NULL;
+    if (!zone->volume || !zone->playback) {
+        syslog(LOG_ERR, "Failed to create controls for %s", config->airplay.device_name);
+        zone_destroy(zone);
+        return NULL;
+    }
+    
+    airplay_receiver_t receiver;
+    receiver.pipeline = zone->pipeline;
+    receiver.stream = zone->stream;
+    receiver.volume = zone->volume;
+    receiver.playback = zone->playback;
+    receiver.remote = zone->remote;
+    zone->server = airplay_server_create(&receiver);
+    if (!zone->server) {
+        syslog(LOG_ERR, "Failed to create AirPlay server for %s", config->airplay.device_name);
+        zone_destroy(zone);
+        return NULL;
+    }
+    airplay_server_set_config(zone->server, &config->airplay);
+    
+    return zone;
+}
+
+int zone_start(zone_t *zone) {
+    if (!zone) {
+        return -1;
+    }
+    
+    if (airplay_server_start(zone->server) != 0) {
+        syslog(LOG_ERR, "Failed to start AirPlay server for %s", zone->config.airplay.device_name);
+        return -1;
+    }
+    
+    // A port of 0 was bound to a free one
+    airplay_server_get_config(zone->server, &zone->config.airplay);
+    return 0;
+}
+
+// Sessions go first, they stop the pipeline that feeds the output. The
+// remote's worker reports to playback, so it stops before playback goes.
+void zone_destroy(zone_t *zone) {
+    if (!zone) {
+        return;
+    }
+    
+    airplay_server_destroy(zone->server);
+    audio_pipeline_destroy(zone->pipeline);
+    buffered_audio_destroy_stream(zone->stream);
+    volume_control_destroy(zone->volume);
+    dacp_client_destroy(zone->remote);
+    playback_control_destroy(zone->playback);
+    audio_output_destroy(zone->output);
+    dsp_chain_destroy(zone->dsp);
+    free(zone);
+}
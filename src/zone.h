@@ -0,0 +1,54 @@
+#ifndef ZONE_H
+#define ZONE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "airplay_server.h"
+#include "audio_output.h"
+#include "audio_pipeline.h"
+#include "buffered_audio.h"
+#include "dacp_client.h"
+#include "dsp_chain.h"
+#include "playback_control.h"
+#include "volume_control.h"
+
+#define ZONE_MAX_ZONES AIRPLAY_SERVER_MAX_INSTANCES
+
+// One AirPlay receiver and the DAC it plays to
+typedef struct {
+    airplay_config_t airplay;       // name, id and port it is announced with
+    char output[16];                // audio_config_t backend
+    char audio_device[64];          // audio_config_t device_name
+    uint32_t sample_rate;
+    uint8_t channels;
+    uint8_t bits_per_sample;
+    size_t buffer_size;
+    bool use_hw_volume;             // the mixer is shared, only one zone may use it
+    uint32_t volume_rate;
+    dsp_config_t dsp;
+} zone_config_t;
+
+// Everything a receiver has to itself: listening socket, sessions, stream
+// buffer index, decoder, DSP state, volume and playback state, remote
+// control and output device with its playout thread. The event loop, the
+// mDNS client, the crypto workers, the buffered audio page pool, the volume
+// tables and the power gate are shared by all zones.
+typedef struct {
+    zone_config_t config;
+    audio_output_t *output;
+    dsp_chain_t *dsp;
+    buffered_stream_t *stream;
+    audio_pipeline_t *pipeline;
+    dacp_client_t *remote;
+    playback_control_t *playback;
+    volume_control_t *volume;
+    airplay_server_t *server;
+} zone_t;
+
+// Builds the zone without listening yet, start makes it reachable
+zone_t* zone_create(const zone_config_t *config);
+int zone_start(zone_t *zone);
+void zone_destroy(zone_t *zone);
+
+#endif // ZONE_H